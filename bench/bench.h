@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/* timing and reporting shared by the drivers in bench/, which are built
+** with 'make bench' into bin/bench.  each one says at the top what it
+** measures and what it needs to be running.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/time.h>
+
+#define BENCH_CHUNK  (1024*1024)
+
+static inline long long bench_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return ((long long) tv.tv_usec) +
+        1000000LL * ((long long) tv.tv_sec);
+}
+
+static inline int bench_cmp(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* sorts t; p is in percent */
+static inline long long bench_percentile(long long *t, int n, int p)
+{
+    qsort(t, n, sizeof(*t), bench_cmp);
+    return t[(n - 1) * p / 100];
+}
+
+/* n timings in microseconds of moving size bytes each */
+static inline void bench_report_rate(const char *what, long long *t, int n,
+                                     long long size)
+{
+    long long us = bench_percentile(t, n, 50);
+
+    if(us <= 0) us = 1;
+    printf("  %-24s %8.1f MB/s  (%lld.%03llds)\n", what,
+           (double) size / us * 1000000.0 / (1024 * 1024),
+           us / 1000000LL, (us % 1000000LL) / 1000LL);
+}
+
+/* n latencies in microseconds */
+static inline void bench_report_latency(const char *what, long long *t, int n)
+{
+    long long p50 = bench_percentile(t, n, 50);
+    long long p99 = bench_percentile(t, n, 99);
+
+    printf("  %-24s median %8.1f us  p99 %8.1f us  max %8.1f us\n", what,
+           (double) p50, (double) p99, (double) t[n - 1]);
+}
+
+#endif
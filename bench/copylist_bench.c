@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* copylist_bench: time building, sorting and freeing the file list that
+** a directory push or sync starts with, and report the peak RSS.
+**
+**   copylist_bench [-n <entries>] [-f <files per dir>] [-r <runs>] [<local dir>]
+**
+** without a directory the list is made up in memory, 1000000 entries by
+** default in directories of 1000, which measures the list itself.  with
+** one, it is read with local_build_list() as a push would, which is
+** mostly the cost of lstat() on every entry.  nothing needs to be
+** running.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+#include "file_sync_copylist.h"
+
+static long peak_rss_kb(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static void make_list(copylist *l, unsigned entries, unsigned per_dir)
+{
+    char src[64], dst[64], name[32];
+    unsigned dir = 0, n;
+    unsigned x = 12345;
+    copyinfo *ci;
+
+    for(n = 0; n < entries; n++) {
+        if(n % per_dir == 0) {
+            snprintf(src, sizeof(src), "/home/user/project/dir%05u/", n / per_dir);
+            snprintf(dst, sizeof(dst), "/opt/usr/apps/project/dir%05u/", n / per_dir);
+            dir = copylist_add_dir(l, src, dst);
+        }
+        snprintf(name, sizeof(name), "file%07u.dat", n);
+        ci = copylist_add(l, dir, name);
+        x = x * 1103515245 + 12345;
+        ci->ino = x;
+        ci->size = 4096;
+        ci->mode = 0100644;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned entries = 1000000, per_dir = 1000;
+    long long *build, *sort, *release;
+    const char *lpath = 0;
+    char path[PATH_MAX];
+    long rss = 0, base;
+    int runs = 3, i, c;
+    unsigned count = 0;
+
+    while((c = getopt(argc, argv, "n:f:r:")) != -1) {
+        switch(c) {
+        case 'n': entries = strtoul(optarg, 0, 0); break;
+        case 'f': per_dir = strtoul(optarg, 0, 0); break;
+        case 'r': runs = atoi(optarg); break;
+        default: goto usage;
+        }
+    }
+    if(argc - optind > 1 || runs <= 0 || entries == 0 || per_dir == 0)
+        goto usage;
+    if(argc - optind == 1) {
+        snprintf(path, sizeof(path), "%s/", argv[optind]);
+        lpath = path;
+    }
+
+    build = calloc(runs, sizeof(*build));
+    sort = calloc(runs, sizeof(*sort));
+    release = calloc(runs, sizeof(*release));
+    base = peak_rss_kb();
+
+    for(i = 0; i < runs; i++) {
+        copylist list;
+        long long t;
+
+        copylist_init(&list);
+        t = bench_now();
+        if(lpath) {
+            if(local_build_list(&list, lpath, "/tmp/copylist_bench/"))
+                return 1;
+        } else {
+            make_list(&list, entries, per_dir);
+        }
+        build[i] = bench_now() - t;
+
+        t = bench_now();
+        copylist_sort(&list);
+        sort[i] = bench_now() - t;
+
+            /* the most the list ever holds is just before it goes */
+        if(i == 0)
+            rss = peak_rss_kb();
+        count = list.count;
+
+        t = bench_now();
+        copylist_free(&list);
+        release[i] = bench_now() - t;
+    }
+
+    printf("%u entries in %s, %d runs:\n", count,
+           lpath ? lpath : "memory", runs);
+    bench_report_latency("build", build, runs);
+    bench_report_latency("sort", sort, runs);
+    bench_report_latency("free", release, runs);
+    printf("  %-24s %8ld KB  (%ld KB for the list, %.1f bytes an entry)\n",
+           "peak RSS", rss, rss - base,
+           count ? (double) (rss - base) * 1024 / count : 0.0);
+    return 0;
+
+usage:
+    fprintf(stderr,"usage: copylist_bench [-n <entries>] [-f <files per dir>] [-r <runs>] [<local dir>]\n");
+    return 1;
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* push_bench: time 'sdb push' of one file from a cold and from a warm
+** page cache.
+**
+**   push_bench [-s <serial>] [-n <runs>] <megabytes> <remote dir>
+**
+** the file is made in $TMPDIR (or /tmp) and filled with data that
+** doesn't compress.  before each cold run it is dropped from the page
+** cache with POSIX_FADV_DONTNEED, which needs no root; a warm run goes
+** right after one that read it.  the sdb binary is $SDB, or sdb on the
+** PATH, and must find a server and device already running.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+static char *make_file(long long size)
+{
+    static char path[PATH_MAX];
+    const char *dir = getenv("TMPDIR");
+    char *buf;
+    unsigned x = 12345;
+    long long left;
+    int fd, i;
+
+    snprintf(path, sizeof(path), "%s/push_bench.XXXXXX", dir ? dir : "/tmp");
+    fd = mkstemp(path);
+    buf = malloc(BENCH_CHUNK);
+    if(fd < 0 || buf == 0) {
+        fprintf(stderr,"cannot create '%s': %s\n", path, strerror(errno));
+        exit(1);
+    }
+    for(left = size; left > 0; left -= BENCH_CHUNK) {
+        int n = left > BENCH_CHUNK ? BENCH_CHUNK : left;
+
+        for(i = 0; i < n; i++) {
+            x = x * 1103515245 + 12345;
+            buf[i] = x >> 16;
+        }
+        if(write(fd, buf, n) != n) {
+            fprintf(stderr,"cannot write '%s': %s\n", path, strerror(errno));
+            unlink(path);
+            exit(1);
+        }
+    }
+    fsync(fd);
+    close(fd);
+    free(buf);
+    return path;
+}
+
+static void drop_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if(fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/* run one push and return how long it took in microseconds */
+static long long push(const char *serial, const char *lpath, const char *rpath)
+{
+    const char *sdb = getenv("SDB");
+    long long start = bench_now();
+    int status;
+    pid_t pid;
+
+    if(sdb == 0)
+        sdb = "sdb";
+    pid = fork();
+    if(pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        dup2(null, 1);
+        dup2(null, 2);
+        if(serial)
+            execlp(sdb, sdb, "-s", serial, "push", lpath, rpath, (char *) 0);
+        else
+            execlp(sdb, sdb, "push", lpath, rpath, (char *) 0);
+        _exit(127);
+    }
+    if(pid < 0 || waitpid(pid, &status, 0) != pid ||
+       !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr,"'%s push %s %s' failed\n", sdb, lpath, rpath);
+        return -1;
+    }
+    return bench_now() - start;
+}
+
+int main(int argc, char **argv)
+{
+    const char *serial = 0;
+    long long size, *cold, *warm;
+    char rpath[PATH_MAX];
+    char *lpath;
+    int runs = 5, i, c;
+
+    while((c = getopt(argc, argv, "s:n:")) != -1) {
+        switch(c) {
+        case 's': serial = optarg; break;
+        case 'n': runs = atoi(optarg); break;
+        default: goto usage;
+        }
+    }
+    if(argc - optind != 2 || runs <= 0 || atoll(argv[optind]) <= 0)
+        goto usage;
+
+    size = atoll(argv[optind]) * 1024 * 1024;
+    snprintf(rpath, sizeof(rpath), "%s/push_bench.bin", argv[optind + 1]);
+    lpath = make_file(size);
+    cold = calloc(runs, sizeof(*cold));
+    warm = calloc(runs, sizeof(*warm));
+
+    for(i = 0; i < runs; i++) {
+        drop_cache(lpath);
+        cold[i] = push(serial, lpath, rpath);
+        warm[i] = push(serial, lpath, rpath);
+        if(cold[i] < 0 || warm[i] < 0) {
+            unlink(lpath);
+            return 1;
+        }
+    }
+    unlink(lpath);
+
+    printf("%lld MB, %d runs, median of each:\n", size >> 20, runs);
+    bench_report_rate("cold", cold, runs, size);
+    bench_report_rate("warm", warm, runs, size);
+    return 0;
+
+usage:
+    fprintf(stderr,"usage: push_bench [-s <serial>] [-n <runs>] <megabytes> <remote dir>\n");
+    return 1;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* shell_bench: time the round trip of a command that does nothing, run
+** as shell: (with a pty) and as exec: (without), from the connect to
+** the end of its output.  that is mostly what sdbd takes to start a
+** process, which is where fork() showed sdbd's size.
+**
+**   shell_bench [-s <serial>] [-n <runs>] [-p <server port>] [<command>]
+**
+** the command is 'true' unless given.  this goes through libsdb, so it
+** needs a server and a device already running.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "sdb_lib.h"
+
+/* one round trip, in microseconds */
+static long long round_trip(sdb_ctx *ctx, const char *serial, const char *service)
+{
+    char error[256], buf[4096];
+    long long start = bench_now();
+    int fd, r;
+
+    fd = sdb_ctx_connect(ctx, serial, service, error, sizeof(error));
+    if(fd < 0) {
+        fprintf(stderr,"cannot connect to '%s': %s\n", service, error);
+        return -1;
+    }
+    while((r = read(fd, buf, sizeof(buf))) > 0)
+        ;
+    close(fd);
+    return bench_now() - start;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *kinds[] = { "shell:", "exec:" };
+    const char *serial = 0, *command = "true";
+    char service[1024];
+    long long *t;
+    sdb_ctx *ctx;
+    int runs = 1000, port = 0, i, k, c;
+
+    while((c = getopt(argc, argv, "s:n:p:")) != -1) {
+        switch(c) {
+        case 's': serial = optarg; break;
+        case 'n': runs = atoi(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        default: goto usage;
+        }
+    }
+    if(argc - optind > 1 || runs <= 0)
+        goto usage;
+    if(argc - optind == 1)
+        command = argv[optind];
+
+    ctx = sdb_ctx_new(port);
+    t = calloc(runs, sizeof(*t));
+    if(ctx == 0 || t == 0) {
+        fprintf(stderr,"out of memory\n");
+        return 1;
+    }
+
+    printf("'%s', %d runs:\n", command, runs);
+    for(k = 0; k < 2; k++) {
+        snprintf(service, sizeof(service), "%s%s", kinds[k], command);
+
+            /* the first one pays for connecting the transport */
+        if(round_trip(ctx, serial, service) < 0)
+            return 1;
+        for(i = 0; i < runs; i++) {
+            t[i] = round_trip(ctx, serial, service);
+            if(t[i] < 0)
+                return 1;
+        }
+        bench_report_latency(kinds[k], t, runs);
+    }
+    sdb_ctx_free(ctx);
+    return 0;
+
+usage:
+    fprintf(stderr,"usage: shell_bench [-s <serial>] [-n <runs>] [-p <server port>] [<command>]\n");
+    return 1;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* socket_bench: time connect + "host:version" + close against the host
+** server, over its TCP port and over its Unix-domain socket, which is
+** what every sdb command pays before it gets to the device.
+**
+**   socket_bench [-n <runs>] [-p <server port>]
+**
+** the TCP side sets TCP_NODELAY, as sdb does.  it needs a server already
+** running, and one that listens on the Unix socket as well (not started
+** with SDB_NO_LOCAL_SOCKET) for the second half.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sysdeps.h"
+#include "sdb.h"
+#include "sockets.h"
+#include "bench.h"
+
+static int connect_tcp(int port)
+{
+    int fd = socket_loopback_client(port, SOCK_STREAM);
+
+    if(fd >= 0)
+        disable_tcp_nagle(fd);
+    return fd;
+}
+
+static int connect_unix(int port)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), SDB_SERVER_SOCKET_NAME, port);
+    return socket_local_client_same_user(name, ANDROID_SOCKET_NAMESPACE_ABSTRACT,
+                                         SOCK_STREAM);
+}
+
+static int read_all(int fd, char *buf, int len)
+{
+    int r;
+
+    while(len > 0) {
+        r = sdb_read(fd, buf, len);
+        if(r <= 0)
+            return -1;
+        buf += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* one round trip, in microseconds */
+static long long round_trip(int (*connect_to)(int), int port)
+{
+    static const char req[] = "000chost:version";
+    long long start = bench_now();
+    char buf[16];
+    int fd;
+
+    fd = connect_to(port);
+    if(fd < 0)
+        return -1;
+        /* OKAY, then the version as four hex digits of length and four more */
+    if(sdb_write(fd, req, sizeof(req) - 1) != sizeof(req) - 1 ||
+       read_all(fd, buf, 12) || memcmp(buf, "OKAY", 4)) {
+        sdb_close(fd);
+        return -1;
+    }
+    sdb_close(fd);
+    return bench_now() - start;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        int (*connect_to)(int);
+    } kinds[] = {
+        { "tcp", connect_tcp },
+        { "unix", connect_unix },
+    };
+    long long *t;
+    int runs = 3000, port = DEFAULT_SDB_PORT, ret = 0, i, k, c;
+
+    while((c = getopt(argc, argv, "n:p:")) != -1) {
+        switch(c) {
+        case 'n': runs = atoi(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        default: goto usage;
+        }
+    }
+    if(argc != optind || runs <= 0)
+        goto usage;
+
+    t = calloc(runs, sizeof(*t));
+    if(t == 0) {
+        fprintf(stderr,"out of memory\n");
+        return 1;
+    }
+
+    printf("connect + host:version + close, %d runs:\n", runs);
+    for(k = 0; k < 2; k++) {
+        for(i = 0; i < runs; i++) {
+            t[i] = round_trip(kinds[k].connect_to, port);
+            if(t[i] < 0) {
+                fprintf(stderr,"%s: no answer from the server on port %d\n",
+                        kinds[k].name, port);
+                ret = 1;
+                break;
+            }
+        }
+        if(i == runs)
+            bench_report_latency(kinds[k].name, t, runs);
+    }
+    return ret;
+
+usage:
+    fprintf(stderr,"usage: socket_bench [-n <runs>] [-p <server port>]\n");
+    return 1;
+}
@@ -60,6 +60,13 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_client.c \
+	file_sync_manifest.c \
+	file_sync_relay.c \
+	exec_session_client.c \
+	batch_client.c \
+	file_sync_archive.c \
+	file_sync_copylist.c \
+	sha256.c \
 	$(EXTRA_SRCS) \
 	$(USB_SRCS) \
 	utils.c \
@@ -92,6 +99,25 @@ $(LOCAL_INSTALLED_MODULE): \
 endif
 
 
+# libsdb host client library (not on windows)
+# =========================================================
+
+ifneq ($(HOST_OS),windows)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	sdb_lib.c \
+	socket_local_client.c \
+	socket_loopback_client.c
+
+LOCAL_CFLAGS += -O2 -g -DSDB_HOST=1  -Wall -Wno-unused-parameter
+LOCAL_CFLAGS += -D_XOPEN_SOURCE -D_GNU_SOURCE
+LOCAL_MODULE := libsdb
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+endif
+
+
 # adbd device daemon
 # =========================================================
 
@@ -120,6 +146,11 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_service.c \
+	file_sync_filter.c \
+	file_sync_cas.c \
+	exec_session_service.c \
+	file_sync_archive.c \
+	sha256.c \
 	jdwp_service.c \
 	framebuffer_service.c \
 	remount_service.c \
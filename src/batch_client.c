@@ -0,0 +1,506 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include "sysdeps.h"
+
+#define  TRACE_TAG  TRACE_SDB
+#include "sdb.h"
+#include "sdb_client.h"
+#include "exec_session.h"
+
+#ifndef _WIN32
+
+/* sdb batch runs a file of sdb commands, one per line, in one process:
+** the server's version is checked once, "shell <command>" lines all go
+** over a single session: connection, and every other line runs in a
+** forked copy of the client.  up to jobs lines run at a time; their
+** output is kept and printed in the order of the file, so at most jobs
+** lines are ever held.
+*/
+
+#define BATCH_MAX_ARGS  256
+
+enum { BATCH_FORK, BATCH_SESSION };
+
+typedef struct {
+    char *data;
+    size_t len, max;
+} batch_buf;
+
+typedef struct {
+    int lineno;
+    char *command;
+    int kind;
+    pid_t pid;          /* BATCH_FORK */
+    unsigned reqid;     /* BATCH_SESSION */
+    int fds[2];         /* the child's stdout and stderr; -1 at end of file */
+    batch_buf out;
+    batch_buf err;
+    int status;
+    int done;
+} batch_job;
+
+typedef struct {
+    batch_job *job;     /* a ring of jobs entries */
+    int jobs;
+    int started;
+    int printed;
+    int failed;
+
+    transport_type ttype;   /* the device picked for the batch, */
+    const char *serial;     /* passed on to every forked line */
+
+    int sfd;            /* the session's connection, or -1 */
+    exec_session *session;
+    int nosession;      /* session: couldn't be had; fork for shell too */
+} batch;
+
+static void batch_append(batch_buf *b, const char *data, size_t n)
+{
+    if(b->len + n > b->max) {
+        b->max = (b->len + n) * 2;
+        b->data = realloc(b->data, b->max);
+        if(b->data == 0) {
+            fprintf(stderr,"out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+/* split line in place the way a shell would split simple words:
+** blanks separate them, quotes and backslashes keep them together
+*/
+static int batch_split(char *line, char **argv, int max)
+{
+    char *in = line, *out;
+    int argc = 0;
+    char quote;
+
+    for(;;) {
+        while(isspace((unsigned char) *in)) in++;
+        if(*in == 0) break;
+        if(argc == max) return -1;
+
+        argv[argc++] = out = in;
+        quote = 0;
+        while(*in && (quote || !isspace((unsigned char) *in))) {
+            if(quote && *in == quote) {
+                quote = 0;
+                in++;
+            } else if(!quote && (*in == '\'' || *in == '"')) {
+                quote = *in++;
+            } else if(*in == '\\' && quote != '\'' && in[1]) {
+                *out++ = in[1];
+                in += 2;
+            } else {
+                *out++ = *in++;
+            }
+        }
+        if(quote) return -1;
+        if(*in) in++;
+        *out = 0;
+    }
+    argv[argc] = 0;
+    return argc;
+}
+
+/* "shell <command>", with nothing before it, goes over the session */
+static const char *batch_shell_command(const char *line)
+{
+    while(isspace((unsigned char) *line)) line++;
+    if(strncmp(line, "shell", 5) || !isspace((unsigned char) line[5]))
+        return 0;
+    line += 5;
+    while(isspace((unsigned char) *line)) line++;
+    return *line ? line : 0;
+}
+
+static int batch_session(batch *b)
+{
+    if(b->session == 0 && !b->nosession) {
+        b->sfd = sdb_connect("session:");
+        if(b->sfd < 0) {
+            D("batch: no session (%s), forking for shell\n", sdb_error());
+            b->nosession = 1;
+            return -1;
+        }
+        b->session = exec_session_open(b->sfd);
+        if(b->session == 0) {
+            b->nosession = 1;
+            return -1;
+        }
+    }
+    return b->session ? 0 : -1;
+}
+
+static void batch_child(batch *b, batch_job *j, int out[2], int err[2])
+{
+    char *argv[BATCH_MAX_ARGS + 1];
+    int argc, fd, i;
+
+        /* only the child's own pipes must stay open, or the
+        ** others wouldn't see end of file when theirs exit
+        */
+    if(b->session)
+        sdb_close(b->sfd);
+    for(i = b->printed; i < b->started; i++) {
+        batch_job *k = &b->job[i % b->jobs];
+        if(k->kind != BATCH_FORK) continue;
+        if(k->fds[0] >= 0) sdb_close(k->fds[0]);
+        if(k->fds[1] >= 0) sdb_close(k->fds[1]);
+    }
+
+    fd = unix_open("/dev/null", O_RDONLY);
+    if(fd >= 0) {
+        dup2(fd, 0);
+        sdb_close(fd);
+    }
+    dup2(out[1], 1);
+    dup2(err[1], 2);
+    sdb_close(out[0]);
+    sdb_close(out[1]);
+    sdb_close(err[0]);
+    sdb_close(err[1]);
+
+        /* sdb_commandline() picks the device afresh: the batch's
+        ** goes first, so that a -s on the line itself still wins */
+    argc = 0;
+    if(b->serial) {
+        argv[argc++] = "-s";
+        argv[argc++] = (char *) b->serial;
+    } else if(b->ttype == kTransportUsb) {
+        argv[argc++] = "-d";
+    } else if(b->ttype == kTransportLocal) {
+        argv[argc++] = "-e";
+    }
+    i = batch_split(j->command, argv + argc, BATCH_MAX_ARGS - argc);
+    if(i <= 0) {
+        fprintf(stderr,"cannot parse the command\n");
+        _exit(1);
+    }
+    i = sdb_commandline(argc + i, argv);
+    fflush(stdout);
+    fflush(stderr);
+    _exit(i ? 1 : 0);
+}
+
+/* returns 1 if the line has to wait for the session to run fewer */
+static int batch_start(batch *b, batch_job *j)
+{
+    const char *command = batch_shell_command(j->command);
+    int out[2], err[2], reqid;
+
+    if(command && batch_session(b) == 0) {
+            /* sdbd stops reading requests while it runs its maximum,
+            ** and one more written behind those could block us before
+            ** we read the output they are blocked on: wait for one */
+        if(exec_session_pending(b->session) >= EXEC_SESSION_MAX_RUNNING)
+            return 1;
+        j->kind = BATCH_SESSION;
+        reqid = exec_session_run(b->session, command);
+        if(reqid < 0) {
+            fprintf(stderr,"error: session lost\n");
+            return -1;
+        }
+        j->reqid = reqid;
+        return 0;
+    }
+
+    j->kind = BATCH_FORK;
+    if(pipe(out)) {
+        fprintf(stderr,"cannot create pipe: %s\n", strerror(errno));
+        return -1;
+    }
+    if(pipe(err)) {
+        fprintf(stderr,"cannot create pipe: %s\n", strerror(errno));
+        sdb_close(out[0]);
+        sdb_close(out[1]);
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    j->pid = fork();
+    if(j->pid < 0) {
+        fprintf(stderr,"cannot fork: %s\n", strerror(errno));
+        sdb_close(out[0]);
+        sdb_close(out[1]);
+        sdb_close(err[0]);
+        sdb_close(err[1]);
+        return -1;
+    }
+    if(j->pid == 0)
+        batch_child(b, j, out, err);
+
+    sdb_close(out[1]);
+    sdb_close(err[1]);
+    j->fds[0] = out[0];
+    j->fds[1] = err[0];
+    return 0;
+}
+
+static void batch_print(batch *b)
+{
+    batch_job *j;
+
+    while(b->printed < b->started) {
+        j = &b->job[b->printed % b->jobs];
+        if(!j->done) break;
+
+        fwrite(j->out.data, 1, j->out.len, stdout);
+        fflush(stdout);
+        fwrite(j->err.data, 1, j->err.len, stderr);
+        if(j->status) {
+            fprintf(stderr,"line %d: '%s' exited with %d\n", j->lineno, j->command, j->status);
+            b->failed++;
+        }
+        free(j->command);
+        free(j->out.data);
+        free(j->err.data);
+        b->printed++;
+    }
+}
+
+/* wait for output from any of the running lines */
+static int batch_wait(batch *b)
+{
+    struct pollfd pfd[1 + 2 * 64];
+    batch_job *owner[1 + 2 * 64];
+    int which[1 + 2 * 64];
+    struct pollfd *pf = pfd;
+    batch_job **ow = owner;
+    int *wh = which;
+    int n = 0, i, r, status;
+    char buf[4096];
+    exec_event ev;
+    batch_job *j;
+
+    if(b->jobs > 64) {
+        pf = malloc((1 + 2 * b->jobs) * (sizeof(*pf) + sizeof(*ow) + sizeof(*wh)));
+        if(pf == 0) {
+            fprintf(stderr,"out of memory\n");
+            return -1;
+        }
+        ow = (batch_job **) (pf + 1 + 2 * b->jobs);
+        wh = (int *) (ow + 1 + 2 * b->jobs);
+    }
+
+    if(b->session && exec_session_pending(b->session)) {
+        pf[n].fd = b->sfd;
+        pf[n].events = POLLIN;
+        ow[n++] = 0;
+    }
+    for(i = b->printed; i < b->started; i++) {
+        j = &b->job[i % b->jobs];
+        if(j->done || j->kind != BATCH_FORK) continue;
+        for(r = 0; r < 2; r++) {
+            if(j->fds[r] < 0) continue;
+            pf[n].fd = j->fds[r];
+            pf[n].events = POLLIN;
+            ow[n] = j;
+            wh[n++] = r;
+        }
+    }
+
+    r = 0;
+    if(n > 0 && poll(pf, n, -1) < 0) {
+        r = (errno == EINTR) ? 0 : -1;
+        n = 0;
+    }
+
+    for(i = 0; i < n && r == 0; i++) {
+        if(!(pf[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        if(ow[i] == 0) {
+            if(exec_session_next(b->session, &ev)) {
+                fprintf(stderr,"error: session lost\n");
+                r = -1;
+                break;
+            }
+            j = 0;
+            for(status = b->printed; status < b->started; status++) {
+                batch_job *k = &b->job[status % b->jobs];
+                if(k->kind == BATCH_SESSION && !k->done && k->reqid == ev.reqid) {
+                    j = k;
+                    break;
+                }
+            }
+            if(j == 0) {
+                fprintf(stderr,"error: session lost\n");
+                r = -1;
+                break;
+            }
+            if(ev.type == EXEC_STDOUT) {
+                batch_append(&j->out, ev.data, ev.len);
+            } else if(ev.type == EXEC_STDERR) {
+                batch_append(&j->err, ev.data, ev.len);
+            } else {
+                j->status = ev.status;
+                j->done = 1;
+            }
+            continue;
+        }
+
+        j = ow[i];
+        r = sdb_read(j->fds[wh[i]], buf, sizeof(buf));
+        if(r < 0 && errno == EINTR) {
+            r = 0;
+            continue;
+        }
+        if(r > 0) {
+            batch_append(wh[i] ? &j->err : &j->out, buf, r);
+            r = 0;
+            continue;
+        }
+        r = 0;
+        sdb_close(j->fds[wh[i]]);
+        j->fds[wh[i]] = -1;
+        if(j->fds[0] < 0 && j->fds[1] < 0) {
+            while(waitpid(j->pid, &status, 0) < 0 && errno == EINTR)
+                ;
+            j->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            j->done = 1;
+        }
+    }
+
+    if(pf != pfd)
+        free(pf);
+    return r;
+}
+
+int do_batch(const char *path, int jobs, transport_type ttype, const char *serial)
+{
+    static char line[EXEC_SESSION_MAX_COMMAND + 2];
+    batch b;
+    batch_job *j;
+    FILE *f;
+    int lineno = 0, barrier = 0, eof = 0, held = 0, len, r;
+    char *p;
+
+    f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if(f == 0) {
+        fprintf(stderr,"cannot open '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+        /* check the server once, for every line */
+    if(sdb_connect("host:start-server")) {
+        fprintf(stderr,"error: %s\n", sdb_error());
+        return 1;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.jobs = jobs;
+    b.ttype = ttype;
+    b.serial = serial;
+    b.sfd = -1;
+    b.job = calloc(jobs, sizeof(batch_job));
+    if(b.job == 0) {
+        fprintf(stderr,"out of memory\n");
+        return 1;
+    }
+
+    for(;;) {
+        while(!eof && b.started - b.printed < jobs &&
+              !(barrier && b.printed < b.started)) {
+            if(!held) {
+                barrier = 0;
+                if(!fgets(line, sizeof(line), f)) {
+                    eof = 1;
+                    break;
+                }
+                lineno++;
+                len = strlen(line);
+                while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+                    line[--len] = 0;
+                for(p = line; isspace((unsigned char) *p); p++)
+                    ;
+                if(*p == 0 || *p == '#')
+                    continue;
+                if(!strcmp(p, "wait")) {
+                    barrier = 1;
+                    continue;
+                }
+            }
+
+            j = &b.job[b.started % jobs];
+            memset(j, 0, sizeof(batch_job));
+            j->lineno = lineno;
+            j->command = strdup(line);
+            j->fds[0] = j->fds[1] = -1;
+            r = batch_start(&b, j);
+            held = r > 0;
+            if(r) {
+                free(j->command);
+                if(held) break;
+                goto done;
+            }
+            b.started++;
+        }
+
+        batch_print(&b);
+        if(b.printed == b.started) {
+            if(eof) break;
+            continue;
+        }
+        if(batch_wait(&b))
+            break;
+    }
+
+done:
+    if(b.session)
+        exec_session_close(b.session);
+    while(b.printed < b.started) {
+        j = &b.job[b.printed++ % jobs];
+        if(j->kind == BATCH_FORK && !j->done) {
+            if(j->fds[0] >= 0) sdb_close(j->fds[0]);
+            if(j->fds[1] >= 0) sdb_close(j->fds[1]);
+            waitpid(j->pid, 0, 0);
+        }
+        free(j->command);
+        free(j->out.data);
+        free(j->err.data);
+        b.failed++;
+    }
+    if(f != stdin)
+        fclose(f);
+    free(b.job);
+    return (b.failed || !eof) ? 1 : 0;
+}
+
+#else /* _WIN32 */
+
+int do_batch(const char *path, int jobs, transport_type ttype, const char *serial)
+{
+    fprintf(stderr,"error: batch mode is not supported on this platform\n");
+    return 1;
+}
+
+#endif /* _WIN32 */
@@ -23,6 +23,7 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <ctype.h>
 #include <assert.h>
 
@@ -36,6 +37,8 @@
 #include "sdb.h"
 #include "sdb_client.h"
 #include "file_sync_service.h"
+#include "file_sync_manifest.h"
+#include "exec_session.h"
 
 enum {
     IGNORE_DATA,
@@ -97,13 +100,55 @@ void help()
 	"                                 returns an error if more than one emulator is running.\n"
 	" -s <serial number>            - directs command to the USB device or emulator with\n"
 	"                                 the given serial number.\n"
+	" -m <serial>[,<serial>...]|all - runs push or shell on all of the given (or all\n"
+	"                                 connected) devices at once, reading files once.\n"
 	" devices                       - list all connected devices\n"
 	"\n"
 	" commands:\n"
-	"  sdb push <local> <remote>    - copy file/dir to device\n"
-	"  sdb pull <remote> [<local>]  - copy file/dir from device\n"
+	"  sdb push [-fsync|-atomic|-c|-dedup|-a] <local> <remote>\n"
+	"                               - copy file/dir to device\n"
+	"                                 ('-fsync' flushes each file to storage,\n"
+	"                                  '-atomic' also replaces it via rename,\n"
+	"                                  '-c' resumes an interrupted '-c' push,\n"
+	"                                  '-dedup' links files the device has kept\n"
+	"                                  from earlier '-dedup' pushes into place,\n"
+	"                                  read-only unless the filesystem clones,\n"
+	"                                  '-a' streams a directory as one archive)\n"
+	"  sdb pull [-a] [<filter>...] <remote> [<local>]\n"
+	"                               - copy file/dir from device\n"
+	"                                 ('-a' streams a directory as one archive)\n"
+	"                                 filters, applied on the device to directories:\n"
+	"                                   -include <glob>     -exclude <glob>\n"
+	"                                   -include-re <regex> -exclude-re <regex>\n"
+	"                                   -min-size <size>    -max-size <size>\n"
+	"                                   -newer <age>        -older <age>\n"
+	"                                 (ages take an s, m, h or d suffix)\n"
+	"  sdb pull [-o <offset>] [-l <length>] [-t <length>] [-c] <remote> [<local>]\n"
+	"                               - copy part of a file from device\n"
+	"                                 ('-o'/'-l' select a byte range, '-t' the last\n"
+	"                                  <length> bytes, '-c' resumes a partial copy;\n"
+	"                                  sizes take a k, m or g suffix)\n"
+	"  sdb sync [-l] [-fsync|-atomic] [-dedup] <local> <remote>\n"
+	"                               - push what changed in <local> since the last\n"
+	"                                 sync to this device ('-l' only lists it)\n"
+	"  sdb watch <local>            - journal changes under <local> so that syncs\n"
+	"                                 need not walk it (runs until interrupted)\n"
+	"  sdb relay <serial>:<path> <serial>:<path> ...\n"
+	"                               - copy a file or directory from the first device\n"
+	"                                 to the others, streamed through the server\n"
 	"  sdb shell                    - run remote shell interactively\n"
 	"  sdb shell <command>          - run remote shell command\n"
+	"  sdb exec <command>           - run remote command without a pty; its stdout\n"
+	"                                 is copied byte for byte (stderr is dropped)\n"
+	"  sdb session [-j <jobs>] [<file>]\n"
+	"                               - run each line of <file> (default: stdin) as a\n"
+	"                                 shell command, <jobs> at a time (default 8,\n"
+	"                                 at most 32), over one connection\n"
+	"  sdb batch [-j <jobs>] [<file>]\n"
+	"                               - run each line of <file> (default: stdin) as an\n"
+	"                                 sdb command, <jobs> at a time (default 1);\n"
+	"                                 'shell' lines share one connection, and a\n"
+	"                                 'wait' line waits for the lines before it\n"
 	"  sdb dlog [ <filter-spec> ]   - view device log\n"
 	"  sdb forward <local> <remote> - forward socket connections\n"
 	"                                 forward spec is : \n"
@@ -115,7 +160,13 @@ void help()
         "  sdb kill-server              - kill the server if it is running\n"
         "  sdb get-state                - prints: offline | bootloader | device\n"
         "  sdb get-serialno             - prints: <serial-number>\n"
+        "  sdb wait-for-device [<secs>] [<command>]\n"
+        "                               - block until the device is online, or for at\n"
+        "                                 most <secs> seconds, then run <command>\n"
         "  sdb status-window            - continuously print device status for a specified device\n"
+        "  sdb service-stats            - prints the device's service worker counters\n"
+        "  sdb transport-stats          - prints the per-class queue counters of the\n"
+        "                                 device's transport, both ways\n"
         "\n"
         );
 }
@@ -126,6 +177,96 @@ int usage()
     return 1;
 }
 
+/* parse a byte count such as "512", "64k" or "3M" */
+static int parse_size(const char *arg, long long *out)
+{
+    char *end;
+    long long n;
+    int shift = 0;
+
+    errno = 0;
+    n = strtoll(arg, &end, 0);
+    if(errno || end == arg || n < 0) return -1;
+
+    switch(*end) {
+    case 'g': case 'G': shift = 30; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'k': case 'K': shift = 10; end++; break;
+    }
+    if(*end || n > (LLONG_MAX >> shift)) return -1;
+
+    *out = n << shift;
+    return 0;
+}
+
+/* parse an age such as "90", "30m", "12h" or "7d" into seconds */
+static int parse_age(const char *arg, long long *out)
+{
+    char *end;
+    long long n;
+
+    errno = 0;
+    n = strtoll(arg, &end, 0);
+    if(errno || end == arg || n < 0) return -1;
+
+    switch(*end) {
+    case 'd': n *= 24;      /* fall through */
+    case 'h': n *= 60;      /* fall through */
+    case 'm': n *= 60;      /* fall through */
+    case 's':
+        end++;
+        break;
+    }
+    if(*end) return -1;
+
+    *out = n;
+    return 0;
+}
+
+/* turn a pull filter option into a line of the device filter spec;
+** returns 1 if opt isn't a filter option, -1 if it is malformed.
+*/
+static int add_pull_filter(char *spec, size_t size, const char *opt, const char *arg)
+{
+    static const struct {
+        const char *opt;
+        const char *rule;
+        int (*parse)(const char *arg, long long *out);
+    } filters[] = {
+        { "-include",    "include",    0 },
+        { "-exclude",    "exclude",    0 },
+        { "-include-re", "include-re", 0 },
+        { "-exclude-re", "exclude-re", 0 },
+        { "-min-size",   "min-size",   parse_size },
+        { "-max-size",   "max-size",   parse_size },
+        { "-newer",      "max-age",    parse_age },
+        { "-older",      "min-age",    parse_age },
+    };
+    size_t len = strlen(spec);
+    unsigned n;
+    int r;
+
+    for(n = 0; n < sizeof(filters) / sizeof(filters[0]); n++) {
+        if(strcmp(opt, filters[n].opt))
+            continue;
+
+        if(filters[n].parse) {
+            long long value;
+            if(filters[n].parse(arg, &value)) return -1;
+            r = snprintf(spec + len, size - len, "%s %lld\n", filters[n].rule, value);
+        } else {
+            if(strchr(arg, '\n')) return -1;
+            r = snprintf(spec + len, size - len, "%s %s\n", filters[n].rule, arg);
+        }
+        if(r < 0 || (size_t) r >= size - len) {
+            fprintf(stderr, "error: too many filter rules\n");
+            return -1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
 #ifdef HAVE_TERMIO_H
 static struct termios tio_save;
 
@@ -173,6 +314,94 @@ static void read_and_dump(int fd)
     }
 }
 
+static int write_stdout(const char *buf, int len)
+{
+    int w;
+
+    while(len > 0) {
+        w = unix_write(1, buf, len);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) return -1;
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* copy everything fd sends to stdout untouched, for exec: output.
+** on linux the data is spliced through the kernel when stdout is a pipe
+** or a file, and never crosses into our address space; anything splice
+** won't take (a tty, an O_APPEND file) is copied the ordinary way.
+*/
+static int copy_to_stdout(int fd)
+{
+    char buf[64 * 1024];
+    int r;
+#ifdef __linux__
+    struct stat st;
+    int p[2] = { -1, -1 };
+    int to = -1, n, w;
+
+    if(fstat(1, &st) == 0) {
+        if(S_ISFIFO(st.st_mode))
+            to = 1;
+        else if(S_ISREG(st.st_mode) && pipe(p) == 0)
+            to = p[1];
+    }
+
+    while(to >= 0) {
+        r = splice(fd, NULL, to, NULL, 1024 * 1024, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(r < 0 && errno == EINTR) continue;
+        if(r < 0 && errno == EINVAL)
+            break;
+        if(r <= 0)
+            goto done;
+
+        for(n = r; to != 1 && n > 0; n -= w) {
+            w = splice(p[0], NULL, 1, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(w < 0 && errno == EINTR) {
+                w = 0;
+            } else if(w < 0 && errno == EINVAL) {
+                    /* stdout won't take a splice: empty the pipe by hand */
+                while(n > 0) {
+                    w = unix_read(p[0], buf, n < (int) sizeof(buf) ? n : (int) sizeof(buf));
+                    if(w <= 0 || write_stdout(buf, w)) {
+                        r = -1;
+                        goto done;
+                    }
+                    n -= w;
+                }
+                to = -1;
+                break;
+            } else if(w <= 0) {
+                r = -1;
+                goto done;
+            }
+        }
+    }
+    if(p[0] >= 0) {
+        unix_close(p[0]);
+        unix_close(p[1]);
+    }
+#endif
+
+    for(;;) {
+        r = sdb_read(fd, buf, sizeof(buf));
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0 || write_stdout(buf, r))
+            return r < 0 ? r : (r ? -1 : 0);
+    }
+
+#ifdef __linux__
+done:
+    if(p[0] >= 0) {
+        unix_close(p[0]);
+        unix_close(p[1]);
+    }
+    return r;
+#endif
+}
+
 static void *stdin_read_thread(void *x)
 {
     int fd, fdi;
@@ -620,6 +849,284 @@ static const char *find_product_out_path(const char *hint)
     return path_buf;
 }
 #endif
+/* the serials a -m selector names: "all" for every device that is online,
+** or a comma separated list.  returns the count, or -1.
+*/
+static int fanout_devices(const char *selector, char ***serials)
+{
+    char *list, *p, *next, **out = 0;
+    int count = 0, max = 0;
+
+        /* this also starts the server, which sdb_connect_to() won't */
+    list = sdb_query("host:devices");
+    if(list == 0) {
+        fprintf(stderr,"error: %s\n", sdb_error());
+        return -1;
+    }
+    if(strcmp(selector, "all")) {
+        free(list);
+        list = strdup(selector);
+    }
+
+    for(p = list; p && *p; p = next) {
+        if(!strcmp(selector, "all")) {
+                /* <serial>\t<state>\t<name>\n */
+            char *state;
+
+            next = strchr(p, '\n');
+            if(next) *next++ = 0;
+            state = strchr(p, '\t');
+            if(state == 0) continue;
+            *state++ = 0;
+            if(strncmp(state, "device", 6) || (state[6] != 0 && state[6] != '\t'))
+                continue;
+        } else {
+            next = strchr(p, ',');
+            if(next) *next++ = 0;
+            if(*p == 0) continue;
+        }
+        if(count == max) {
+            max = max ? max * 2 : 16;
+            out = realloc(out, max * sizeof(char*));
+            if(out == 0) {
+                fprintf(stderr,"out of memory\n");
+                abort();
+            }
+        }
+        out[count++] = strdup(p);
+    }
+    free(list);
+
+    if(count == 0)
+        fprintf(stderr,"error: no devices\n");
+    *serials = out;
+    return count;
+}
+
+/* <service><argv[0]> <argv[1]> ..., quoting where the shell would split.
+** returns -1, having said so, if that doesn't fit in size bytes.
+*/
+static int format_shell_command(char *buf, size_t size, const char *service,
+                                int argc, char **argv)
+{
+    size_t len;
+    int quote;
+
+    len = snprintf(buf, size, "%s%s", service, argv[0]);
+    while(len < size && --argc > 0) {
+        argv++;
+
+        /* quote empty strings and strings with spaces */
+        quote = (**argv == 0 || strchr(*argv, ' '));
+        len += snprintf(buf + len, size - len, quote ? " \"%s\"" : " %s", *argv);
+    }
+    if(len >= size) {
+        fprintf(stderr,"error: command line too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+#ifndef _WIN32
+typedef struct fanout_shell fanout_shell;
+
+struct fanout_shell {
+    fanout_shell *head;
+    const char *serial;
+    const char *command;
+    int ok;
+    long long bytes;
+    long long elapsed;
+    char error[256];
+
+        /* shared, in the head */
+    sdb_mutex_t lock;
+    sdb_cond_t cond;
+    int running;
+};
+
+static long long fanout_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return ((long long) tv.tv_usec) + 1000000LL * ((long long) tv.tv_sec);
+}
+
+/* print what the device said a line at a time, each line tagged with
+** its serial, so that the output of several devices can't interleave
+*/
+static void fanout_shell_print(fanout_shell *f, const char *line, int len)
+{
+    sdb_mutex_lock(&f->head->lock);
+    printf("%s: %.*s\n", f->serial, len, line);
+    fflush(stdout);
+    sdb_mutex_unlock(&f->head->lock);
+}
+
+static void *fanout_shell_thread(void *x)
+{
+    fanout_shell *f = x;
+    fanout_shell *head = f->head;
+    long long start = fanout_now();
+    char buf[4096];
+    int fd, len, n = 0, r;
+
+    fd = sdb_connect_to(f->serial, f->command, f->error, sizeof(f->error));
+    if(fd >= 0) {
+        for(;;) {
+            r = sdb_read(fd, buf + n, sizeof(buf) - n);
+            if(r < 0 && errno == EINTR) continue;
+            if(r <= 0) break;
+            f->bytes += r;
+            n += r;
+
+            for(;;) {
+                char *nl = memchr(buf, '\n', n);
+                if(nl == 0) break;
+                len = nl - buf;
+                if(len > 0 && buf[len - 1] == '\r') len--;
+                fanout_shell_print(f, buf, len);
+                n -= nl + 1 - buf;
+                memmove(buf, nl + 1, n);
+            }
+            if(n == sizeof(buf)) {
+                fanout_shell_print(f, buf, n);
+                n = 0;
+            }
+        }
+        if(n > 0)
+            fanout_shell_print(f, buf, n);
+        if(r < 0)
+            snprintf(f->error, sizeof(f->error), "%s", strerror(errno));
+        else
+            f->ok = 1;
+        sdb_close(fd);
+    }
+    f->elapsed = fanout_now() - start;
+
+    sdb_mutex_lock(&head->lock);
+    head->running--;
+    sdb_cond_broadcast(&head->cond);
+    sdb_mutex_unlock(&head->lock);
+    return 0;
+}
+
+/* run one shell command on every device at once */
+static int fanout_shell_command(int nserials, char **serials, const char *command)
+{
+    fanout_shell *f;
+    sdb_thread_t t;
+    int i, failed = 0;
+
+    f = calloc(nserials, sizeof(fanout_shell));
+    if(f == 0) {
+        fprintf(stderr,"out of memory\n");
+        return 1;
+    }
+    sdb_mutex_init(&f->lock, NULL);
+    sdb_cond_init(&f->cond, NULL);
+
+    for(i = 0; i < nserials; i++) {
+        f[i].head = f;
+        f[i].serial = serials[i];
+        f[i].command = command;
+        sdb_mutex_lock(&f->lock);
+        f->running++;
+        sdb_mutex_unlock(&f->lock);
+        if(sdb_thread_create(&t, fanout_shell_thread, &f[i])) {
+            fprintf(stderr,"cannot create thread for %s\n", serials[i]);
+            abort();
+        }
+    }
+
+    sdb_mutex_lock(&f->lock);
+    while(f->running)
+        sdb_cond_wait(&f->cond, &f->lock);
+    sdb_mutex_unlock(&f->lock);
+
+    for(i = 0; i < nserials; i++) {
+        if(f[i].ok) {
+            fprintf(stderr,"%s: done, %lld bytes in %lld.%03llds\n", f[i].serial,
+                    f[i].bytes, f[i].elapsed / 1000000LL,
+                    (f[i].elapsed % 1000000LL) / 1000LL);
+        } else {
+            fprintf(stderr,"%s: error: %s\n", f[i].serial, f[i].error);
+            failed++;
+        }
+    }
+    if(nserials > 1)
+        fprintf(stderr,"%d of %d devices ok\n", nserials - failed, nserials);
+
+    sdb_cond_destroy(&f->cond);
+    sdb_mutex_destroy(&f->lock);
+    free(f);
+    return failed ? 1 : 0;
+}
+#else
+static int fanout_shell_command(int nserials, char **serials, const char *command)
+{
+    fprintf(stderr,"error: running a command on several devices at once is not supported on this platform\n");
+    return 1;
+}
+#endif /* !_WIN32 */
+
+/* 'sdb -m <selector> push|shell ...' */
+static int fanout_command(const char *selector, int argc, char **argv)
+{
+    char buf[4096];
+    char **serials;
+    int n, count, r;
+
+    if(strcmp(argv[0], "push") && strcmp(argv[0], "shell")) {
+        fprintf(stderr,"error: only push and shell can go to several devices\n");
+        return 1;
+    }
+    if(!strcmp(argv[0], "shell") && argc < 2) {
+        fprintf(stderr,"error: an interactive shell needs a single device\n");
+        return 1;
+    }
+
+    count = fanout_devices(selector, &serials);
+    if(count <= 0)
+        return 1;
+
+    if(!strcmp(argv[0], "shell")) {
+        if(format_shell_command(buf, sizeof(buf), "shell:", argc - 1, argv + 1))
+            r = 1;
+        else
+            r = fanout_shell_command(count, serials, buf);
+    } else {
+        unsigned flags = 0;
+
+        r = -1;
+        while(argc > 1 && argv[1][0] == '-') {
+            if(!strcmp(argv[1], "-fsync")) {
+                flags |= SYNC_FLAG_FDATASYNC;
+            } else if(!strcmp(argv[1], "-atomic")) {
+                flags |= SYNC_FLAG_FDATASYNC | SYNC_FLAG_ATOMIC;
+            } else {
+                fprintf(stderr,"error: '%s' needs a single device\n", argv[1]);
+                r = 1;
+                break;
+            }
+            argc--;
+            argv++;
+        }
+        if(r < 0) {
+            if(argc != 3)
+                r = usage();
+            else
+                r = do_sync_push_fanout(count, (const char **) serials,
+                                        argv[1], argv[2], flags);
+        }
+    }
+
+    for(n = 0; n < count; n++)
+        free(serials[n]);
+    free(serials);
+    return r;
+}
+
 int sdb_commandline(int argc, char **argv)
 {
     char buf[4096];
@@ -630,9 +1137,9 @@ int sdb_commandline(int argc, char **argv)
     char* server_port_str = NULL;
 #endif
     int r;
-    int quote;
     transport_type ttype = kTransportAny;
     char* serial = NULL;
+    char* fanout = NULL;
 
 #if 0 //eric
         /* If defined, this should be an absolute path to
@@ -702,6 +1209,11 @@ int sdb_commandline(int argc, char **argv)
                 argc--;
                 argv++;
             }
+        } else if (!strcmp(argv[0],"-m")) {
+            if(argc < 2) return usage();
+            fanout = argv[1];
+            argc--;
+            argv++;
         } else if (!strcmp(argv[0],"-d")) {
             ttype = kTransportUsb;
         } else if (!strcmp(argv[0],"-e")) {
@@ -730,11 +1242,19 @@ int sdb_commandline(int argc, char **argv)
         return r;
     }
 
-//top:
+top:
     if(argc == 0) {
         return usage();
     }
 
+    if(fanout) {
+        if(serial || ttype != kTransportAny) {
+            fprintf(stderr,"error: '-m' cannot be combined with '-s', '-d' or '-e'\n");
+            return 1;
+        }
+        return fanout_command(fanout, argc, argv);
+    }
+
     /* sdb_connect() commands */
 
     if(!strcmp(argv[0], "devices")) {
@@ -798,20 +1318,8 @@ int sdb_commandline(int argc, char **argv)
             return interactive_shell();
         }
 
-        snprintf(buf, sizeof buf, "shell:%s", argv[1]);
-        argc -= 2;
-        argv += 2;
-        while(argc-- > 0) {
-            strcat(buf, " ");
-
-            /* quote empty strings and strings with spaces */
-            quote = (**argv == 0 || strchr(*argv, ' '));
-            if (quote)
-                strcat(buf, "\"");
-            strcat(buf, *argv++);
-            if (quote)
-                strcat(buf, "\"");
-        }
+        if(format_shell_command(buf, sizeof buf, "shell:", argc - 1, argv + 1))
+            return 1;
 
         for(;;) {
             fd = sdb_connect(buf);
@@ -837,6 +1345,104 @@ int sdb_commandline(int argc, char **argv)
         }
     }
 
+    if(!strcmp(argv[0], "batch")) {
+        int jobs = 1;
+
+        while(argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+            if(!strcmp(argv[1], "-j") && argc > 2) {
+                jobs = atoi(argv[2]);
+                if(jobs < 1) return usage();
+                argc--;
+                argv++;
+            } else {
+                return usage();
+            }
+            argc--;
+            argv++;
+        }
+        if(argc > 2) return usage();
+        return do_batch(argc == 2 ? argv[1] : "-", jobs, ttype, serial);
+    }
+
+    if(!strcmp(argv[0], "transport-stats")) {
+        char *stats;
+        int fd;
+
+        if(argc != 1) return usage();
+        format_host_command(buf, sizeof buf, "get-transport-stats", ttype, serial);
+        stats = sdb_query(buf);
+        if(stats == 0) {
+            fprintf(stderr,"error: %s\n", sdb_error());
+            return 1;
+        }
+        printf("host to device:\n%s\n", stats);
+        free(stats);
+
+        fd = sdb_connect("transport-stats:");
+        if(fd < 0) {
+            fprintf(stderr,"error: %s\n", sdb_error());
+            return 1;
+        }
+        printf("device to host:\n");
+        fflush(stdout);
+        read_and_dump(fd);
+        sdb_close(fd);
+        return 0;
+    }
+
+    if(!strcmp(argv[0], "service-stats")) {
+        int fd;
+
+        if(argc != 1) return usage();
+        fd = sdb_connect("service-stats:");
+        if(fd < 0) {
+            fprintf(stderr,"error: %s\n", sdb_error());
+            return 1;
+        }
+        read_and_dump(fd);
+        sdb_close(fd);
+        return 0;
+    }
+
+    if(!strcmp(argv[0], "session")) {
+        int jobs = 8;
+
+        while(argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+            if(!strcmp(argv[1], "-j") && argc > 2) {
+                jobs = atoi(argv[2]);
+                if(jobs < 1) return usage();
+                argc--;
+                argv++;
+            } else {
+                return usage();
+            }
+            argc--;
+            argv++;
+        }
+        if(argc > 2) return usage();
+        return do_exec_session(argc == 2 ? argv[1] : "-", jobs);
+    }
+
+    if(!strcmp(argv[0], "exec")) {
+        int fd;
+
+        if(argc < 2) return usage();
+        if(format_shell_command(buf, sizeof buf, "exec:", argc - 1, argv + 1))
+            return 1;
+        fd = sdb_connect(buf);
+        if(fd < 0) {
+            fprintf(stderr,"error: %s\n", sdb_error());
+            return 1;
+        }
+        r = copy_to_stdout(fd);
+        sdb_close(fd);
+        if(r < 0) {
+            fprintf(stderr,"error: %s\n", strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
     if(!strcmp(argv[0], "kill-server")) {
         int fd;
         fd = _sdb_connect("host:kill");
@@ -876,36 +1482,53 @@ int sdb_commandline(int argc, char **argv)
 
     /* sdb_command() wrapper commands */
 
-//    if(!strncmp(argv[0], "wait-for-", strlen("wait-for-"))) {
-//        char* service = argv[0];
-//        if (!strncmp(service, "wait-for-device", strlen("wait-for-device"))) {
-//            if (ttype == kTransportUsb) {
-//                service = "wait-for-usb";
-//            } else if (ttype == kTransportLocal) {
-//                service = "wait-for-local";
-//            } else {
-//                service = "wait-for-any";
-//            }
-//        }
-//
-//        format_host_command(buf, sizeof buf, service, ttype, serial);
-//
-//        if (sdb_command(buf)) {
-//            D("failure: %s *\n",sdb_error());
-//            fprintf(stderr,"error: %s\n", sdb_error());
-//            return 1;
-//        }
-//
-//        /* Allow a command to be run after wait-for-device,
-//            * e.g. 'sdb wait-for-device shell'.
-//            */
-//        if(argc > 1) {
-//            argc--;
-//            argv++;
-//            goto top;
-//        }
-//        return 0;
-//    }
+    if(!strcmp(argv[0], "wait-for-device")) {
+        char service[64];
+        const char* kind = "any";
+        long secs = -1;
+
+        if (ttype == kTransportUsb) {
+            kind = "usb";
+        } else if (ttype == kTransportLocal) {
+            kind = "local";
+        }
+            /* what follows a number of seconds is the command to run */
+        if (argc > 1 && isdigit((unsigned char) argv[1][0])) {
+            char *end;
+
+            errno = 0;
+            secs = strtol(argv[1], &end, 10);
+            if (*end || errno || secs > INT_MAX / 1000) {
+                fprintf(stderr,"error: invalid number of seconds '%s'\n", argv[1]);
+                return 1;
+            }
+            argc--;
+            argv++;
+        }
+        if (secs >= 0) {
+            snprintf(service, sizeof service, "wait-for-%s:%ld", kind, secs * 1000);
+        } else {
+            snprintf(service, sizeof service, "wait-for-%s", kind);
+        }
+
+        format_host_command(buf, sizeof buf, service, ttype, serial);
+
+        if (sdb_command(buf)) {
+            D("failure: %s *\n",sdb_error());
+            fprintf(stderr,"error: %s\n", sdb_error());
+            return 1;
+        }
+
+        /* Allow a command to be run after wait-for-device,
+         * e.g. 'sdb wait-for-device shell'.
+         */
+        if(argc > 1) {
+            argc--;
+            argv++;
+            goto top;
+        }
+        return 0;
+    }
 
     if(!strcmp(argv[0], "forward")) {
         if(argc != 3) return usage();
@@ -933,18 +1556,159 @@ int sdb_commandline(int argc, char **argv)
     }
 #endif
     if(!strcmp(argv[0], "push")) {
+        unsigned flags = 0;
+        int archive = 0;
+
+        while(argc > 1 && argv[1][0] == '-') {
+            if(!strcmp(argv[1], "-fsync")) {
+                flags |= SYNC_FLAG_FDATASYNC;
+            } else if(!strcmp(argv[1], "-atomic")) {
+                flags |= SYNC_FLAG_FDATASYNC | SYNC_FLAG_ATOMIC;
+            } else if(!strcmp(argv[1], "-c")) {
+                flags |= SYNC_FLAG_RESUME;
+            } else if(!strcmp(argv[1], "-dedup")) {
+                flags |= SYNC_FLAG_CAS;
+            } else if(!strcmp(argv[1], "-a")) {
+                archive = 1;
+            } else {
+                return usage();
+            }
+            argc--;
+            argv++;
+        }
         if(argc != 3) return usage();
-        return do_sync_push(argv[1], argv[2], 0 /* no verify APK */);
+        if(archive) {
+            if(flags) {
+                fprintf(stderr, "error: '-a' cannot be combined with '-fsync', '-atomic', '-c' or '-dedup'\n");
+                return 1;
+            }
+            return do_sync_push_archive(argv[1], argv[2]);
+        }
+        return do_sync_push(argv[1], argv[2], 0 /* no verify APK */, flags);
     }
 
     if(!strcmp(argv[0], "pull")) {
-        if (argc == 2) {
-            return do_sync_pull(argv[1], ".");
-        } else if (argc == 3) {
-            return do_sync_pull(argv[1], argv[2]);
-        } else {
-            return usage();
+        long long offset = 0, length = -1;
+        unsigned flags = 0;
+        int archive = 0, ranged = 0, resume = 0;
+        char filter[1025];
+
+        filter[0] = 0;
+        while(argc > 1 && argv[1][0] == '-') {
+            if(argc > 2 && (r = add_pull_filter(filter, sizeof(filter), argv[1], argv[2])) <= 0) {
+                if(r < 0) return usage();
+                argc--;
+                argv++;
+            } else if(!strcmp(argv[1], "-a")) {
+                archive = 1;
+            } else if(!strcmp(argv[1], "-c")) {
+                resume = 1;
+            } else if(argc > 2 && !strcmp(argv[1], "-o")) {
+                if(parse_size(argv[2], &offset)) return usage();
+                ranged = 1;
+                argc--;
+                argv++;
+            } else if(argc > 2 && !strcmp(argv[1], "-l")) {
+                if(parse_size(argv[2], &length)) return usage();
+                ranged = 1;
+                argc--;
+                argv++;
+            } else if(argc > 2 && !strcmp(argv[1], "-t")) {
+                if(parse_size(argv[2], &offset)) return usage();
+                flags |= SYNC_RECV_TAIL;
+                argc--;
+                argv++;
+            } else {
+                return usage();
+            }
+            argc--;
+            argv++;
+        }
+        if(argc != 2 && argc != 3) return usage();
+        if(archive && (ranged || resume || flags)) {
+            fprintf(stderr, "error: '-a' cannot be combined with '-o', '-l', '-t' or '-c'\n");
+            return 1;
+        }
+        if(resume && (ranged || flags)) {
+            fprintf(stderr, "error: '-c' cannot be combined with '-o', '-l' or '-t'\n");
+            return 1;
+        }
+        if(ranged && flags) {
+            fprintf(stderr, "error: '-t' cannot be combined with '-o' or '-l'\n");
+            return 1;
+        }
+        if(filter[0] && (ranged || resume || flags)) {
+            fprintf(stderr, "error: filters cannot be combined with '-o', '-l', '-t' or '-c'\n");
+            return 1;
+        }
+
+        if(archive)
+            return do_sync_pull_archive(argv[1], argc == 3 ? argv[2] : ".",
+                                        filter[0] ? filter : 0);
+        if(ranged || resume || flags)
+            return do_sync_pull_range(argv[1], argc == 3 ? argv[2] : ".",
+                                      offset, length, flags, resume);
+        return do_sync_pull(argv[1], argc == 3 ? argv[2] : ".", filter[0] ? filter : 0);
+    }
+
+    if(!strcmp(argv[0], "sync")) {
+        unsigned flags = 0;
+        int listonly = 0;
+        char *devserial;
+        int ret;
+
+        while(argc > 1 && argv[1][0] == '-') {
+            if(!strcmp(argv[1], "-l")) {
+                listonly = 1;
+            } else if(!strcmp(argv[1], "-fsync")) {
+                flags |= SYNC_FLAG_FDATASYNC;
+            } else if(!strcmp(argv[1], "-atomic")) {
+                flags |= SYNC_FLAG_FDATASYNC | SYNC_FLAG_ATOMIC;
+            } else if(!strcmp(argv[1], "-dedup")) {
+                flags |= SYNC_FLAG_CAS;
+            } else {
+                return usage();
+            }
+            argc--;
+            argv++;
+        }
+        if(argc != 3) return usage();
+
+            /* the manifest belongs to the device, however it was picked */
+        format_host_command(buf, sizeof buf, "get-serialno", ttype, serial);
+        devserial = sdb_query(buf);
+        if(devserial == 0) {
+            fprintf(stderr,"error: %s\n", sdb_error());
+            return 1;
+        }
+        ret = do_sync_sync(argv[1], argv[2], devserial, listonly, flags);
+        free(devserial);
+        return ret;
+    }
+
+    if(!strcmp(argv[0], "watch")) {
+        if(argc != 2) return usage();
+        return do_sync_watch(argv[1]);
+    }
+
+    if(!strcmp(argv[0], "relay")) {
+        const char *tserials[16], *tpaths[16];
+        char *spath;
+        int n;
+
+        if(argc < 3 || argc > 2 + 16) return usage();
+            /* <serial>:<path>; serials may themselves hold a ':' */
+        for(n = 1; n < argc; n++) {
+            char *sep = strstr(argv[n], ":/");
+            if(sep == 0 || sep == argv[n]) return usage();
+            *sep = 0;
+            if(n > 1) {
+                tserials[n - 2] = argv[n];
+                tpaths[n - 2] = sep + 1;
+            }
         }
+        spath = argv[1] + strlen(argv[1]) + 1;
+        return do_sync_relay(argv[1], spath, argc - 2, tserials, tpaths);
     }
 
 //    if(!strcmp(argv[0], "install")) {
@@ -982,9 +1746,9 @@ int sdb_commandline(int argc, char **argv)
 //        if(ret != 0) return usage();
 //
 //        if(android_srcpath != NULL)
-//            ret = do_sync_sync(android_srcpath, "/system", listonly);
+//            ret = do_sync_sync(android_srcpath, "/system", listonly, 0);
 //        if(ret == 0 && data_srcpath != NULL)
-//            ret = do_sync_sync(data_srcpath, "/data", listonly);
+//            ret = do_sync_sync(data_srcpath, "/data", listonly, 0);
 //
 //        free(android_srcpath);
 //        free(data_srcpath);
@@ -1217,7 +1981,7 @@ int install_app(transport_type transport, char* serial, int argc, char** argv)
         return 1;
     }
 
-    if (!(err = do_sync_push(filename, to, 1 /* verify APK */))) {
+    if (!(err = do_sync_push(filename, to, 1 /* verify APK */, 0))) {
         /* file in place; tell the Package Manager to install it */
         argv[argc - 1] = to;       /* destination name, not source location */
         pm_command(transport, serial, argc, argv);
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EXEC_SESSION_H_
+#define _EXEC_SESSION_H_
+
+#include "file_sync_service.h"
+
+/* the session: service runs any number of shell commands over one
+** stream.  every message starts with an id, the request id the client
+** picked for the command, and a length or status; all of them little
+** endian, as in the sync protocol.
+**
+**   client:  RUN  <reqid> <len>  <len bytes of command>
+**            QUIT                 (no more commands; finish the rest)
+**   device:  OUT  <reqid> <len>  <len bytes of its stdout>
+**            ERR  <reqid> <len>  <len bytes of its stderr>
+**            EXIT <reqid> <status>
+**
+** commands run concurrently, each with /bin/sh -c, stdin on /dev/null
+** and no pty; their output is interleaved as it comes.  the status is
+** the exit code, 128 + the signal for a command that was killed, or -1
+** if it could not be run at all.  the device runs up to
+** EXEC_SESSION_MAX_RUNNING at a time and stops reading further requests
+** until one finishes.  closing the stream hangs up on whatever is
+** still running.
+*/
+
+#define ID_XRUN MKID('X','R','U','N')
+#define ID_XOUT MKID('X','O','U','T')
+#define ID_XERR MKID('X','E','R','R')
+#define ID_XEXT MKID('X','E','X','T')
+
+#define EXEC_SESSION_MAX_RUNNING  32
+#define EXEC_SESSION_MAX_COMMAND  (64*1024)
+
+typedef union {
+    unsigned id;
+    struct {
+        unsigned id;
+        unsigned reqid;
+        unsigned len;
+    } data;
+    struct {
+        unsigned id;
+        unsigned reqid;
+        int status;
+    } exit;
+} sessionmsg;
+
+#if SDB_HOST
+typedef struct exec_session exec_session;
+
+enum {
+    EXEC_STDOUT,
+    EXEC_STDERR,
+    EXEC_EXIT,
+};
+
+typedef struct {
+    int type;           /* EXEC_STDOUT, EXEC_STDERR or EXEC_EXIT */
+    unsigned reqid;
+    const char *data;   /* valid until the next exec_session_next() */
+    int len;
+    int status;
+} exec_event;
+
+/* take over fd, a connection to session:, and close it when done */
+exec_session *exec_session_open(int fd);
+
+/* start command; returns its request id, or -1 */
+int exec_session_run(exec_session *s, const char *command);
+
+/* the number of commands started that haven't exited yet */
+int exec_session_pending(exec_session *s);
+
+/* wait for the next piece of output or exit; 0, or -1 if the
+** connection failed
+*/
+int exec_session_next(exec_session *s, exec_event *ev);
+
+/* let the commands still running finish, then close */
+void exec_session_close(exec_session *s);
+
+int do_exec_session(const char *path, int jobs);
+#endif
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sysdeps.h"
+#include "sdb.h"
+#include "sdb_client.h"
+#include "exec_session.h"
+
+struct exec_session {
+    int fd;
+    unsigned next;
+    int pending;
+    char buf[SYNC_DATA_MAX];
+    char req[sizeof(sessionmsg) + EXEC_SESSION_MAX_COMMAND];
+};
+
+exec_session *exec_session_open(int fd)
+{
+    exec_session *s = malloc(sizeof(exec_session));
+
+    if(s == 0) {
+        sdb_close(fd);
+        return 0;
+    }
+    s->fd = fd;
+    s->next = 0;
+    s->pending = 0;
+    return s;
+}
+
+int exec_session_run(exec_session *s, const char *command)
+{
+    sessionmsg msg;
+    int len = strlen(command);
+
+    if(len > EXEC_SESSION_MAX_COMMAND)
+        return -1;
+    msg.data.id = ID_XRUN;
+    msg.data.reqid = htoll(s->next);
+    msg.data.len = htoll(len);
+
+        /* in one write, or Nagle holds the command back until the
+        ** header is acknowledged
+        */
+    memcpy(s->req, &msg.data, sizeof(msg.data));
+    memcpy(s->req + sizeof(msg.data), command, len);
+    if(writex(s->fd, s->req, sizeof(msg.data) + len))
+        return -1;
+    s->pending++;
+    return s->next++;
+}
+
+int exec_session_pending(exec_session *s)
+{
+    return s->pending;
+}
+
+int exec_session_next(exec_session *s, exec_event *ev)
+{
+    sessionmsg msg;
+    unsigned len;
+
+        /* every message the device sends is the same size */
+    if(readx(s->fd, &msg.data, sizeof(msg.data)))
+        return -1;
+
+    ev->reqid = ltohl(msg.data.reqid);
+    ev->data = s->buf;
+    ev->len = 0;
+    ev->status = 0;
+
+    switch(msg.id) {
+    case ID_XOUT:
+    case ID_XERR:
+        len = ltohl(msg.data.len);
+        if(len > sizeof(s->buf) || readx(s->fd, s->buf, len))
+            return -1;
+        ev->type = (msg.id == ID_XOUT) ? EXEC_STDOUT : EXEC_STDERR;
+        ev->len = len;
+        return 0;
+    case ID_XEXT:
+        ev->type = EXEC_EXIT;
+        ev->status = (int) ltohl(msg.exit.status);
+        s->pending--;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+void exec_session_close(exec_session *s)
+{
+    sessionmsg msg;
+
+    msg.id = ID_QUIT;
+    writex(s->fd, &msg.id, sizeof(msg.id));
+    sdb_close(s->fd);
+    free(s);
+}
+
+
+typedef struct {
+    char *command;
+    char *out;
+    size_t outlen, outmax;
+    char *err;
+    size_t errlen, errmax;
+    int status;
+    int done;
+} session_job;
+
+static void job_append(char **buf, size_t *len, size_t *max, const char *data, int n)
+{
+    if(*len + n > *max) {
+        *max = (*len + n) * 2;
+        *buf = realloc(*buf, *max);
+        if(*buf == 0) {
+            fprintf(stderr,"out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+/* run every line of path ("-" for stdin) as a shell command on the
+** device, up to jobs at a time, over one session.  each command's
+** output is printed once it has exited, in the order of the file.
+*/
+int do_exec_session(const char *path, int jobs)
+{
+    static char line[EXEC_SESSION_MAX_COMMAND + 2];
+    session_job *job = 0;
+    int count = 0, max = 0, started = 0, printed = 0, failed = 0;
+    exec_session *s;
+    exec_event ev;
+    FILE *f;
+    int fd, len;
+
+    f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if(f == 0) {
+        fprintf(stderr,"cannot open '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    while(fgets(line, sizeof(line), f)) {
+        len = strlen(line);
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = 0;
+        if(len == 0 || line[0] == '#')
+            continue;
+        if(count == max) {
+            max = max ? max * 2 : 64;
+            job = realloc(job, max * sizeof(session_job));
+            if(job == 0) {
+                fprintf(stderr,"out of memory\n");
+                return 1;
+            }
+        }
+        memset(&job[count], 0, sizeof(session_job));
+        job[count++].command = strdup(line);
+    }
+    if(f != stdin)
+        fclose(f);
+    if(count == 0)
+        return 0;
+
+    fd = sdb_connect("session:");
+    if(fd < 0) {
+        fprintf(stderr,"error: %s\n", sdb_error());
+        return 1;
+    }
+    s = exec_session_open(fd);
+    if(s == 0)
+        return 1;
+
+        /* sdbd stops reading requests while it runs its maximum; one
+        ** more written behind those could block us before we read the
+        ** output they are blocked on */
+    if(jobs > EXEC_SESSION_MAX_RUNNING)
+        jobs = EXEC_SESSION_MAX_RUNNING;
+
+    while(printed < count) {
+        while(started < count && exec_session_pending(s) < jobs) {
+            if(exec_session_run(s, job[started].command) != started) {
+                fprintf(stderr,"error: session lost\n");
+                return 1;
+            }
+            started++;
+        }
+
+        if(exec_session_next(s, &ev) || ev.reqid >= (unsigned) started) {
+            fprintf(stderr,"error: session lost\n");
+            return 1;
+        }
+        session_job *j = &job[ev.reqid];
+        if(ev.type == EXEC_STDOUT) {
+            job_append(&j->out, &j->outlen, &j->outmax, ev.data, ev.len);
+        } else if(ev.type == EXEC_STDERR) {
+            job_append(&j->err, &j->errlen, &j->errmax, ev.data, ev.len);
+        } else {
+            j->status = ev.status;
+            j->done = 1;
+        }
+
+        for(; printed < count && job[printed].done; printed++) {
+            j = &job[printed];
+            fwrite(j->out, 1, j->outlen, stdout);
+            fflush(stdout);
+            fwrite(j->err, 1, j->errlen, stderr);
+            if(j->status) {
+                fprintf(stderr,"'%s' exited with %d\n", j->command, j->status);
+                failed++;
+            }
+            free(j->command);
+            free(j->out);
+            free(j->err);
+        }
+    }
+
+    exec_session_close(s);
+    free(job);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sysdeps.h"
+
+#define TRACE_TAG  TRACE_SDB
+#include "sdb.h"
+#include "exec_session.h"
+
+/* sdbd's SIGCHLD handler reaps every child, so the exit status can't be
+** had from waitpid(): the shell that runs the command writes it to its
+** descriptor 3 instead, which the command itself doesn't get.
+*/
+#define SESSION_WRAPPER  "c=$1; shift; (eval \"$c\") 3>&-; echo $? >&3"
+
+enum { CMD_OUT, CMD_ERR, CMD_STATUS };
+
+typedef struct {
+    unsigned reqid;
+    pid_t pid;
+    int fds[3];         /* -1 once at end of file */
+    char status[16];
+    int statuslen;
+} session_cmd;
+
+/* send the len bytes at buf + SESSION_HDR; the header goes in front of
+** them, so that each message leaves in one write and Nagle never holds
+** back its second half
+*/
+#define SESSION_HDR  sizeof(((sessionmsg *) 0)->data)
+
+static int session_send(int fd, unsigned id, unsigned reqid, char *buf, unsigned len)
+{
+    sessionmsg msg;
+
+    msg.data.id = id;
+    msg.data.reqid = htoll(reqid);
+    msg.data.len = htoll(len);
+    memcpy(buf, &msg.data, SESSION_HDR);
+    return writex(fd, buf, SESSION_HDR + len);
+}
+
+static int session_exit(int fd, unsigned reqid, int status)
+{
+    sessionmsg msg;
+
+    msg.exit.id = ID_XEXT;
+    msg.exit.reqid = htoll(reqid);
+    msg.exit.status = htoll(status);
+    return writex(fd, &msg.exit, sizeof(msg.exit));
+}
+
+/* start command; if it can't be, say so and report it as exited */
+static int session_start(int fd, session_cmd *c, unsigned reqid, char *command)
+{
+    char *argv[] = { "/bin/sh", "-c", SESSION_WRAPPER, "sh", command, 0 };
+    int p[3][2], fds[4];
+    char msg[SESSION_HDR + 128];
+    int n, err;
+
+    c->reqid = reqid;
+    c->statuslen = 0;
+    for(n = 0; n < 3; n++) {
+        if(pipe2(p[n], O_CLOEXEC)) {
+            while(n-- > 0) {
+                sdb_close(p[n][0]);
+                sdb_close(p[n][1]);
+            }
+            goto fail;
+        }
+    }
+
+    fds[0] = -1;
+    fds[1] = p[CMD_OUT][1];
+    fds[2] = p[CMD_ERR][1];
+    fds[3] = p[CMD_STATUS][1];
+    c->pid = spawn_subprocess(argv, 0, fds, 4);
+    err = errno;
+    for(n = 0; n < 3; n++) {
+        sdb_close(p[n][1]);
+        c->fds[n] = p[n][0];
+    }
+    if(c->pid > 0)
+        return 0;
+
+    for(n = 0; n < 3; n++)
+        sdb_close(c->fds[n]);
+    errno = err;
+fail:
+    snprintf(msg + SESSION_HDR, sizeof(msg) - SESSION_HDR, "cannot run command: %s\n",
+             strerror(errno));
+    if(session_send(fd, ID_XERR, reqid, msg, strlen(msg + SESSION_HDR)) ||
+       session_exit(fd, reqid, -1))
+        return -2;
+    return -1;
+}
+
+/* read what one of c's descriptors has; 1 once c has finished */
+static int session_read(int fd, session_cmd *c, int which, char *buf, int *failed)
+{
+    int r;
+
+    if(which == CMD_STATUS) {
+        r = sdb_read(c->fds[which], c->status + c->statuslen,
+                     sizeof(c->status) - 1 - c->statuslen);
+        if(r > 0)
+            c->statuslen += r;
+    } else {
+        r = sdb_read(c->fds[which], buf + SESSION_HDR, SYNC_DATA_MAX);
+        if(r > 0 && session_send(fd, which == CMD_OUT ? ID_XOUT : ID_XERR, c->reqid, buf, r))
+            *failed = 1;
+    }
+    if(r < 0 && errno == EINTR)
+        return 0;
+    if(r <= 0 || (which == CMD_STATUS && c->statuslen == sizeof(c->status) - 1)) {
+        sdb_close(c->fds[which]);
+        c->fds[which] = -1;
+    }
+
+    if(c->fds[CMD_OUT] >= 0 || c->fds[CMD_ERR] >= 0 || c->fds[CMD_STATUS] >= 0)
+        return 0;
+
+    c->status[c->statuslen] = 0;
+    if(session_exit(fd, c->reqid, c->statuslen ? atoi(c->status) : -1))
+        *failed = 1;
+    return 1;
+}
+
+void exec_session_service(int fd, void *cookie)
+{
+    session_cmd cmds[EXEC_SESSION_MAX_RUNNING];
+    struct pollfd pfd[1 + 3 * EXEC_SESSION_MAX_RUNNING];
+    int owner[1 + 3 * EXEC_SESSION_MAX_RUNNING];
+    sessionmsg msg;
+    char *buf;
+    unsigned len;
+    int running = 0, quit = 0, failed = 0, reading;
+    int i, n, r;
+
+    buf = malloc(SESSION_HDR + EXEC_SESSION_MAX_COMMAND + 1);
+    if(buf == 0) {
+        sdb_close(fd);
+        return;
+    }
+
+    while(!failed && !(quit && running == 0)) {
+        n = 0;
+            /* stop taking requests while the table is full, or after
+            ** QUIT, but keep watching for the client hanging up
+            */
+        reading = !quit && running < EXEC_SESSION_MAX_RUNNING;
+        pfd[n].fd = fd;
+        pfd[n].events = reading ? POLLIN : 0;
+        owner[n++] = -1;
+        for(i = 0; i < running; i++) {
+            for(r = 0; r < 3; r++) {
+                if(cmds[i].fds[r] < 0) continue;
+                pfd[n].fd = cmds[i].fds[r];
+                pfd[n].events = POLLIN;
+                owner[n++] = i * 3 + r;
+            }
+        }
+
+        if(poll(pfd, n, -1) < 0) {
+            if(errno == EINTR) continue;
+            break;
+        }
+
+            /* the output first, so that finished commands free their slot */
+        for(i = n - 1; i >= 0 && !failed; i--) {
+            session_cmd *c;
+
+            if(owner[i] < 0 || !(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            c = &cmds[owner[i] / 3];
+            if(session_read(fd, c, owner[i] % 3, buf, &failed)) {
+                    /* the last entry moves into its place; it has been
+                    ** seen to already, as the entries go from the end
+                    */
+                *c = cmds[--running];
+            }
+        }
+
+        if(failed || !pfd[0].revents)
+            continue;
+        if(!reading) {
+            failed = 1;
+            break;
+        }
+
+        if(readx(fd, &msg.id, sizeof(msg.id))) {
+            failed = 1;
+            break;
+        }
+        if(msg.id == ID_QUIT) {
+            quit = 1;
+            continue;
+        }
+        if(msg.id != ID_XRUN ||
+           readx(fd, &msg.data.reqid, sizeof(msg.data) - sizeof(msg.id))) {
+            failed = 1;
+            break;
+        }
+        len = ltohl(msg.data.len);
+        if(len > EXEC_SESSION_MAX_COMMAND || readx(fd, buf, len)) {
+            failed = 1;
+            break;
+        }
+        buf[len] = 0;
+
+        D("session: run %u '%s'\n", ltohl(msg.data.reqid), buf);
+        r = session_start(fd, &cmds[running], ltohl(msg.data.reqid), buf);
+        if(r == 0)
+            running++;
+        else if(r < -1)
+            failed = 1;
+    }
+
+        /* the client went away: hang up on whatever it left running */
+    for(i = 0; i < running; i++) {
+        kill(-cmds[i].pid, SIGHUP);
+        for(r = 0; r < 3; r++) {
+            if(cmds[i].fds[r] >= 0)
+                sdb_close(cmds[i].fds[r]);
+        }
+    }
+    free(buf);
+    sdb_close(fd);
+}
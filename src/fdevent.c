@@ -25,6 +25,7 @@
 
 #include <stdarg.h>
 #include <stddef.h>
+#include <sys/time.h>
 
 #include "fdevent.h"
 
@@ -67,6 +68,8 @@ static void dump_fde(fdevent *fde, const char *info)
 static void fdevent_plist_enqueue(fdevent *node);
 static void fdevent_plist_remove(fdevent *node);
 static fdevent *fdevent_plist_dequeue(void);
+static int fdevent_timer_wait(void);
+static void fdevent_timer_expire(void);
 
 static fdevent list_pending = {
     .next = &list_pending,
@@ -210,106 +213,94 @@ static void fdevent_process()
     }
 }
 
-#else /* USE_SELECT */
+#else /* USE_POLL */
 
-#ifdef HAVE_WINSOCK
-#include <winsock2.h>
-#else
-#include <sys/select.h>
-#endif
-
-static fd_set read_fds;
-static fd_set write_fds;
-static fd_set error_fds;
+/* poll() rather than select(): a server with hundreds of devices has
+** descriptors past FD_SETSIZE, which an fd_set can't hold
+*/
+#include <poll.h>
 
-static int select_n = 0;
+static struct pollfd *poll_fds = 0;
+static int poll_fds_max = 0;
 
 static void fdevent_init(void)
 {
-    FD_ZERO(&read_fds);
-    FD_ZERO(&write_fds);
-    FD_ZERO(&error_fds);
 }
 
 static void fdevent_connect(fdevent *fde)
 {
-    if(fde->fd >= select_n) {
-        select_n = fde->fd + 1;
-    }
 }
 
 static void fdevent_disconnect(fdevent *fde)
 {
-    int i, n;
-
-    FD_CLR(fde->fd, &read_fds);
-    FD_CLR(fde->fd, &write_fds);
-    FD_CLR(fde->fd, &error_fds);
-
-    for(n = 0, i = 0; i < select_n; i++) {
-        if(fd_table[i] != 0) n = i;
-    }
-    select_n = n + 1;
 }
 
 static void fdevent_update(fdevent *fde, unsigned events)
 {
-    if(events & FDE_READ) {
-        FD_SET(fde->fd, &read_fds);
-    } else {
-        FD_CLR(fde->fd, &read_fds);
-    }
-    if(events & FDE_WRITE) {
-        FD_SET(fde->fd, &write_fds);
-    } else {
-        FD_CLR(fde->fd, &write_fds);
-    }
-    if(events & FDE_ERROR) {
-        FD_SET(fde->fd, &error_fds);
-    } else {
-        FD_CLR(fde->fd, &error_fds);
-    }
-
-    fde->state = (fde->state & FDE_STATEMASK) | events;    
+    fde->state = (fde->state & FDE_STATEMASK) | events;
 }
 
 static int fdevent_process()
 {
-    int i, n;
+    int i, n, count;
     fdevent *fde;
-    unsigned events;
-    fd_set rfd, wfd, efd;
+    unsigned events, wanted;
+    short revents;
+
+    if(poll_fds_max < fd_table_max) {
+        poll_fds = realloc(poll_fds, sizeof(struct pollfd) * fd_table_max);
+        if(poll_fds == 0) {
+            FATAL("could not expand poll_fds to %d entries\n", fd_table_max);
+        }
+        poll_fds_max = fd_table_max;
+    }
 
-    memcpy(&rfd, &read_fds, sizeof(fd_set));
-    memcpy(&wfd, &write_fds, sizeof(fd_set));
-    memcpy(&efd, &error_fds, sizeof(fd_set));
+    for(count = 0, i = 0; i < fd_table_max; i++) {
+        fde = fd_table[i];
+        if(fde == 0 || !(fde->state & (FDE_READ | FDE_WRITE | FDE_ERROR))) continue;
+        poll_fds[count].fd = i;
+        poll_fds[count].events = ((fde->state & FDE_READ) ? POLLIN : 0) |
+                                 ((fde->state & FDE_WRITE) ? POLLOUT : 0) |
+                                 ((fde->state & FDE_ERROR) ? POLLPRI : 0);
+        poll_fds[count].revents = 0;
+        count++;
+    }
 
-    n = select(select_n, &rfd, &wfd, &efd, 0);
+    n = poll(poll_fds, count, fdevent_timer_wait());
 
     if(n < 0) {
-        if(errno == EINTR) return -1;
-        perror("select");
+            /* a signal (SIGCHLD, say) is no reason to stop */
+        if(errno == EINTR) return 0;
+        perror("poll");
         return -1;
     }
 
-    for(i = 0; (i < select_n) && (n > 0); i++) {
-        events = 0;
-        if(FD_ISSET(i, &rfd)) events |= FDE_READ;
-        if(FD_ISSET(i, &wfd)) events |= FDE_WRITE;
-        if(FD_ISSET(i, &efd)) events |= FDE_ERROR;
+    fdevent_timer_expire();
 
-        if(events) {
-            n--;
+    for(i = 0; (i < count) && (n > 0); i++) {
+        revents = poll_fds[i].revents;
+        if(revents == 0) continue;
+        n--;
 
-            fde = fd_table[i];
-            if(fde == 0) FATAL("missing fde for fd %d\n", i);
+        fde = fd_table[poll_fds[i].fd];
+        if(fde == 0) FATAL("missing fde for fd %d\n", poll_fds[i].fd);
 
-            fde->events |= events;
+            /* as select() would: an fd that hung up or failed is
+            ** readable and writable, for the read or write to tell why
+            */
+        wanted = fde->state & (FDE_READ | FDE_WRITE | FDE_ERROR);
+        events = 0;
+        if(revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) events |= FDE_READ;
+        if(revents & (POLLOUT | POLLHUP | POLLERR | POLLNVAL)) events |= FDE_WRITE;
+        if(revents & POLLPRI) events |= FDE_ERROR;
+        events &= wanted;
+        if(events == 0) continue;
 
-            if(fde->state & FDE_PENDING) continue;
-            fde->state |= FDE_PENDING;
-            fdevent_plist_enqueue(fde);
-        }
+        fde->events |= events;
+
+        if(fde->state & FDE_PENDING) continue;
+        fde->state |= FDE_PENDING;
+        fdevent_plist_enqueue(fde);
     }
     return 0;
 }
@@ -338,7 +329,7 @@ static void fdevent_register(fdevent *fde)
         if(fd_table == 0) {
             FATAL("could not expand fd_table to %d entries\n", fd_table_max);
         }
-        memset(fd_table + oldmax, 0, sizeof(int) * (fd_table_max - oldmax));
+        memset(fd_table + oldmax, 0, sizeof(fdevent*) * (fd_table_max - oldmax));
     }
 
     fd_table[fde->fd] = fde;
@@ -395,6 +386,81 @@ static fdevent *fdevent_plist_dequeue(void)
     return node;
 }
 
+/* the fdes with a deadline, in no particular order: there are few */
+static fdevent *timer_list = 0;
+
+static int64_t fdevent_now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return ((int64_t) tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
+static void fdevent_timer_remove(fdevent *fde)
+{
+    fdevent **pnode;
+
+    if(fde->deadline == 0) return;
+    for(pnode = &timer_list; *pnode; pnode = &(*pnode)->timer_next) {
+        if(*pnode == fde) {
+            *pnode = fde->timer_next;
+            break;
+        }
+    }
+    fde->timer_next = 0;
+    fde->deadline = 0;
+}
+
+/* how long the wait for events may last: until the first deadline */
+static int fdevent_timer_wait(void)
+{
+    fdevent *fde;
+    int64_t first = 0, wait;
+
+    for(fde = timer_list; fde; fde = fde->timer_next) {
+        if(first == 0 || fde->deadline < first) first = fde->deadline;
+    }
+    if(first == 0) return -1;
+    wait = first - fdevent_now_ms();
+    if(wait < 0) return 0;
+    return wait > 0x7fffffff ? 0x7fffffff : (int) wait;
+}
+
+static void fdevent_timer_expire(void)
+{
+    fdevent **pnode = &timer_list;
+    fdevent *fde;
+    int64_t now;
+
+    if(timer_list == 0) return;
+    now = fdevent_now_ms();
+    while((fde = *pnode) != 0) {
+        if(fde->deadline > now) {
+            pnode = &fde->timer_next;
+            continue;
+        }
+        *pnode = fde->timer_next;
+        fde->timer_next = 0;
+        fde->deadline = 0;
+
+        fde->events |= FDE_TIMEOUT;
+        if(fde->state & FDE_PENDING) continue;
+        fde->state |= FDE_PENDING;
+        fdevent_plist_enqueue(fde);
+    }
+}
+
+void fdevent_set_timeout(fdevent *fde, int64_t timeout_ms)
+{
+    fdevent_timer_remove(fde);
+    if(timeout_ms < 0) return;
+
+    fde->deadline = fdevent_now_ms() + timeout_ms;
+    if(fde->deadline == 0) fde->deadline = 1;
+    fde->timer_next = timer_list;
+    timer_list = fde;
+}
+
 fdevent *fdevent_create(int fd, fd_func func, void *arg)
 {
     fdevent *fde = (fdevent*) malloc(sizeof(fdevent));
@@ -421,6 +487,12 @@ void fdevent_install(fdevent *fde, int fd, fd_func func, void *arg)
     fde->func = func;
     fde->arg = arg;
 
+        /* a timer has nothing to watch, and so is never active */
+    if(fd == FD_TIMER) {
+        fde->state = 0;
+        return;
+    }
+
 #ifndef HAVE_WINSOCK
     fcntl(fd, F_SETFL, O_NONBLOCK);
 #endif
@@ -432,6 +504,8 @@ void fdevent_install(fdevent *fde, int fd, fd_func func, void *arg)
 
 void fdevent_remove(fdevent *fde)
 {
+    fdevent_timer_remove(fde);
+
     if(fde->state & FDE_PENDING) {
         fdevent_plist_remove(fde);
     }
@@ -28,6 +28,9 @@
 /* features that may be set (via the events set/add/del interface) */
 #define FDE_DONT_CLOSE        0x0080
 
+/* the 'fd' of an fdevent that only ever times out */
+#define FD_TIMER              (-1)
+
 typedef struct fdevent fdevent;
 
 typedef void (*fd_func)(int fd, unsigned events, void *userdata);
@@ -58,6 +61,10 @@ void fdevent_set(fdevent *fde, unsigned events);
 void fdevent_add(fdevent *fde, unsigned events);
 void fdevent_del(fdevent *fde, unsigned events);
 
+/* Signal FDE_TIMEOUT once, timeout_ms from now, whatever else happens
+** meanwhile; setting it again moves the deadline, a negative timeout_ms
+** cancels it.  fdevent_remove() cancels it too.
+*/
 void fdevent_set_timeout(fdevent *fde, int64_t  timeout_ms);
 
 /* loop forever, handling events.
@@ -75,6 +82,9 @@ struct fdevent
 
     fd_func func;
     void *arg;
+
+    fdevent *timer_next;    /* on the timer list while deadline is set */
+    int64_t deadline;
 };
 
 
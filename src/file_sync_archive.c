@@ -0,0 +1,758 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <utime.h>
+
+#include <errno.h>
+
+#include "sysdeps.h"
+
+#define TRACE_TAG  TRACE_SYNC
+#include "sdb.h"
+#include "file_sync_service.h"
+#include "file_sync_archive.h"
+
+#define ARCHIVE_NAME_MAX 1024
+
+typedef struct archive archive;
+typedef struct archive_dir archive_dir;
+
+struct archive {
+    int s;
+    int ended;
+    archive_stats *stats;
+    char *error;
+    int errlen;
+    archive_accept_fn accept;
+    void *cookie;
+
+    char path[PATH_MAX];
+    int rootlen;
+
+        /* receive: the last directory checked by archive_parents() */
+    char safe[PATH_MAX];
+    int safelen;
+
+        /* the ID_DATA message being filled (send) or consumed (receive) */
+    unsigned pos;
+    unsigned len;
+    struct {
+        unsigned id;
+        unsigned size;
+        char data[SYNC_DATA_MAX];
+    } msg;
+};
+
+    /* directories get their real mode and mtime once their contents are in */
+struct archive_dir {
+    archive_dir *next;
+    unsigned mode;
+    unsigned time;
+    char path[1];
+};
+
+static archive *archive_create(int s, const char *root, archive_stats *stats,
+                               char *error, int errlen)
+{
+    archive *ar;
+    int len = strlen(root);
+
+    while(len > 0 && root[len - 1] == '/')
+        len--;
+    if(len >= PATH_MAX - 1) {
+        snprintf(error, errlen, "path too long: '%s'", root);
+        return 0;
+    }
+
+    ar = calloc(1, sizeof(archive));
+    if(ar == 0) {
+        snprintf(error, errlen, "out of memory");
+        return 0;
+    }
+    ar->s = s;
+    ar->stats = stats;
+    ar->error = error;
+    ar->errlen = errlen;
+    memcpy(ar->path, root, len);
+    ar->path[len] = 0;
+    ar->rootlen = len;
+
+    memset(stats, 0, sizeof(*stats));
+    error[0] = 0;
+    return ar;
+}
+
+static int archive_fail(archive *ar, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(ar->error, ar->errlen, fmt, ap);
+    va_end(ap);
+    D("archive: %s\n", ar->error);
+    return 1;
+}
+
+    /* the directory that ar->path names; "" stands for the root of the fs */
+static const char *archive_dirpath(archive *ar, int plen)
+{
+    return plen ? ar->path : "/";
+}
+
+
+/* --- sending side --- */
+
+static int archive_flush(archive *ar)
+{
+    if(ar->pos == 0)
+        return 0;
+
+    ar->msg.id = ID_DATA;
+    ar->msg.size = htoll(ar->pos);
+    if(writex(ar->s, &ar->msg, sizeof(unsigned) * 2 + ar->pos))
+        return -1;
+    ar->pos = 0;
+    return 0;
+}
+
+static int archive_put(archive *ar, const void *data, unsigned len)
+{
+    while(len > 0) {
+        unsigned n = SYNC_DATA_MAX - ar->pos;
+
+        if(n == 0) {
+            if(archive_flush(ar)) return -1;
+            continue;
+        }
+        if(n > len)
+            n = len;
+        memcpy(ar->msg.data + ar->pos, data, n);
+        ar->pos += n;
+        data = (const char*) data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int archive_put_entry(archive *ar, unsigned id, unsigned mode,
+                             unsigned time, long long size, int plen)
+{
+    archive_hdr hdr;
+    unsigned namelen = plen ? plen - ar->rootlen - 1 : 0;
+
+    hdr.id = id;
+    hdr.mode = htoll(mode);
+    hdr.time = htoll(time);
+    hdr.size_lo = htoll((unsigned) size);
+    hdr.size_hi = htoll((unsigned) (size >> 32));
+    hdr.namelen = htoll(namelen);
+
+    if(archive_put(ar, &hdr, sizeof(hdr)) ||
+       archive_put(ar, ar->path + ar->rootlen + 1, namelen))
+        return -1;
+    return 0;
+}
+
+static int archive_send_file(archive *ar, struct stat *st, int plen)
+{
+    long long left = st->st_size;
+    int fd, r;
+
+    fd = sdb_open(ar->path, O_RDONLY);
+    if(fd < 0)
+        return archive_fail(ar, "cannot open '%s': %s", ar->path, strerror(errno));
+
+    if(archive_put_entry(ar, ID_AENT, st->st_mode, st->st_mtime, left, plen)) {
+        sdb_close(fd);
+        return -1;
+    }
+
+    while(left > 0) {
+        unsigned n = SYNC_DATA_MAX - ar->pos;
+
+        if(n == 0) {
+            if(archive_flush(ar)) {
+                sdb_close(fd);
+                return -1;
+            }
+            continue;
+        }
+        if(n > left)
+            n = left;
+
+        r = sdb_read(fd, ar->msg.data + ar->pos, n);
+        if(r <= 0) {
+            if((r < 0) && (errno == EINTR)) continue;
+            sdb_close(fd);
+            if(r < 0)
+                return archive_fail(ar, "cannot read '%s': %s", ar->path, strerror(errno));
+            return archive_fail(ar, "'%s' shrank while being read", ar->path);
+        }
+        ar->pos += r;
+        left -= r;
+    }
+
+    sdb_close(fd);
+    ar->stats->files++;
+    ar->stats->bytes += st->st_size;
+    return 0;
+}
+
+#ifdef HAVE_SYMLINKS
+static int archive_send_link(archive *ar, struct stat *st, int plen)
+{
+    char target[PATH_MAX];
+    int len;
+
+    len = readlink(ar->path, target, sizeof(target) - 1);
+    if(len < 0)
+        return archive_fail(ar, "cannot read link '%s': %s", ar->path, strerror(errno));
+
+    if(archive_put_entry(ar, ID_AENT, st->st_mode, st->st_mtime, len, plen) ||
+       archive_put(ar, target, len))
+        return -1;
+
+    ar->stats->links++;
+    return 0;
+}
+#endif
+
+    /* ar->path holds a directory of plen chars; entries go out parents first */
+static int archive_send_dir(archive *ar, int plen)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    int r = 0;
+
+    d = opendir(archive_dirpath(ar, plen));
+    if(d == 0)
+        return archive_fail(ar, "cannot open '%s': %s", archive_dirpath(ar, plen), strerror(errno));
+
+    while((de = readdir(d))) {
+        const char *name = de->d_name;
+        int nlen = strlen(name);
+        int len = plen + 1 + nlen;
+
+        if(name[0] == '.') {
+            if(name[1] == 0) continue;
+            if((name[1] == '.') && (name[2] == 0)) continue;
+        }
+
+        if(len >= PATH_MAX || len - ar->rootlen - 1 > ARCHIVE_NAME_MAX) {
+            ar->path[plen] = 0;
+            r = archive_fail(ar, "path too long: '%s/%s'", ar->path, name);
+            break;
+        }
+        ar->path[plen] = '/';
+        memcpy(ar->path + plen + 1, name, nlen + 1);
+
+        if(lstat(ar->path, &st)) {
+            r = archive_fail(ar, "cannot stat '%s': %s", ar->path, strerror(errno));
+            break;
+        }
+        if(ar->accept && !ar->accept(ar->cookie, ar->path + ar->rootlen + 1,
+                                     st.st_mode, st.st_size, st.st_mtime))
+            continue;
+
+        if(S_ISDIR(st.st_mode)) {
+            r = archive_put_entry(ar, ID_AENT, st.st_mode, st.st_mtime, 0, len);
+            if(r == 0) {
+                ar->stats->dirs++;
+                r = archive_send_dir(ar, len);
+            }
+        } else if(S_ISREG(st.st_mode)) {
+            r = archive_send_file(ar, &st, len);
+#ifdef HAVE_SYMLINKS
+        } else if(S_ISLNK(st.st_mode)) {
+            r = archive_send_link(ar, &st, len);
+#endif
+        } else {
+            D("archive: skipping special file '%s'\n", ar->path);
+            ar->stats->skipped++;
+        }
+        if(r)
+            break;
+    }
+
+    closedir(d);
+    ar->path[plen] = 0;
+    return r;
+}
+
+int archive_send(int s, const char *root, archive_accept_fn accept,
+                 void *cookie, archive_stats *stats, char *error, int errlen)
+{
+    archive *ar;
+    struct stat st;
+    int r;
+
+    ar = archive_create(s, root, stats, error, errlen);
+    if(ar == 0) {
+        r = 1;
+        goto fail;
+    }
+    ar->accept = accept;
+    ar->cookie = cookie;
+
+    if(stat(archive_dirpath(ar, ar->rootlen), &st))
+        r = archive_fail(ar, "cannot stat '%s': %s", root, strerror(errno));
+    else if(!S_ISDIR(st.st_mode))
+        r = archive_fail(ar, "'%s' is not a directory", root);
+    else
+        r = archive_send_dir(ar, ar->rootlen);
+
+    if(r == 0) {
+        ar->path[ar->rootlen] = 0;
+        if(archive_put_entry(ar, ID_AEND, 0, 0, 0, 0) || archive_flush(ar)) {
+            r = -1;
+        } else {
+            ar->msg.id = ID_DONE;
+            ar->msg.size = 0;
+            if(writex(s, &ar->msg, sizeof(unsigned) * 2))
+                r = -1;
+        }
+    }
+    free(ar);
+
+fail:
+    if(r == 1) {
+        syncmsg msg;
+        int len = strlen(error);
+
+            /* whatever was buffered is dropped, the receiver stops at the FAIL */
+        msg.status.id = ID_FAIL;
+        msg.status.msglen = htoll(len);
+        if(writex(s, &msg.status, sizeof(msg.status)) ||
+           writex(s, error, len))
+            r = -1;
+    }
+    return r;
+}
+
+
+/* --- receiving side --- */
+
+    /* read the next message of the stream; returns its id, or -1 */
+static int archive_next(archive *ar)
+{
+    unsigned size;
+
+    if(readx(ar->s, &ar->msg, sizeof(unsigned) * 2))
+        return -1;
+    size = ltohl(ar->msg.size);
+    ar->pos = 0;
+    ar->len = 0;
+
+    if(ar->msg.id == ID_DATA) {
+        if(size > SYNC_DATA_MAX) {
+            archive_fail(ar, "oversize data message");
+            return -1;
+        }
+        if(readx(ar->s, ar->msg.data, size))
+            return -1;
+        ar->len = size;
+        return ID_DATA;
+    }
+
+    if(ar->msg.id == ID_FAIL) {
+        unsigned len = size;
+
+        if(len > SYNC_DATA_MAX)
+            return -1;
+        if(readx(ar->s, ar->msg.data, len))
+            return -1;
+        if(len > (unsigned) ar->errlen - 1)
+            len = ar->errlen - 1;
+        memcpy(ar->error, ar->msg.data, len);
+        ar->error[len] = 0;
+        ar->ended = 1;
+        return ID_FAIL;
+    }
+
+    if(ar->msg.id == ID_DONE) {
+        ar->ended = 1;
+        return ID_DONE;
+    }
+
+    archive_fail(ar, "invalid data message");
+    return -1;
+}
+
+    /* make sure some payload is buffered; 0, -1 or 1 like archive_receive */
+static int archive_fill(archive *ar)
+{
+    while(ar->pos == ar->len) {
+        if(ar->ended)
+            return archive_fail(ar, "truncated archive");
+
+        switch(archive_next(ar)) {
+        case ID_DATA:
+            break;
+        case ID_FAIL:
+            return 1;
+        case ID_DONE:
+            return archive_fail(ar, "truncated archive");
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int archive_get(archive *ar, void *data, unsigned len)
+{
+    while(len > 0) {
+        unsigned n;
+        int r = archive_fill(ar);
+
+        if(r) return r;
+        n = ar->len - ar->pos;
+        if(n > len)
+            n = len;
+        memcpy(data, ar->msg.data + ar->pos, n);
+        ar->pos += n;
+        data = (char*) data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int archive_skip(archive *ar, long long len)
+{
+    while(len > 0) {
+        unsigned n;
+        int r = archive_fill(ar);
+
+        if(r) return r;
+        n = ar->len - ar->pos;
+        if(n > len)
+            n = len;
+        ar->pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+    /* read up to the end of the stream after a local error */
+static int archive_drain(archive *ar)
+{
+    while(!ar->ended) {
+        if(archive_next(ar) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+    /* names must stay below the root: no absolute paths, no "." or ".." */
+static int archive_name_ok(const char *name)
+{
+    const char *p = name;
+
+    for(;;) {
+        const char *end = strchr(p, '/');
+        int n = end ? end - p : (int) strlen(p);
+
+        if(n == 0)
+            return 0;
+        if(p[0] == '.' && (n == 1 || (n == 2 && p[1] == '.')))
+            return 0;
+        if(end == 0)
+            return 1;
+        p = end + 1;
+    }
+}
+
+static int archive_mkdirs(char *path)
+{
+    char *x = path + 1;
+    int ret;
+
+    for(;;) {
+        x = sdb_dirstart(x);
+        if(x == 0) break;
+        *x = 0;
+        ret = sdb_mkdir(path, 0775);
+        *x = OS_PATH_SEPARATOR;
+        if((ret < 0) && (errno != EEXIST))
+            return ret;
+        x++;
+    }
+    return 0;
+}
+
+    /* make sure every directory between the root and ar->path is a real
+    ** one, creating those that are missing.  otherwise a symlink, from an
+    ** earlier entry ("x -> /etc" before "x/passwd") or already there,
+    ** would take the entries below it out of the root.  the directories
+    ** checked last are remembered, as entries come grouped by directory.
+    */
+static int archive_parents(archive *ar)
+{
+    char *path = ar->path;
+    char *end = strrchr(path + ar->rootlen + 1, '/');
+    struct stat st;
+    int len, i;
+
+    if(end == 0)
+        return 0;
+    len = end - path;
+
+        /* skip the directories this shares with the last one */
+    for(i = 0; i < len && i < ar->safelen && path[i] == ar->safe[i]; i++)
+        ;
+    while(i > ar->rootlen && !((i == len || path[i] == '/') &&
+                               (i == ar->safelen || ar->safe[i] == '/')))
+        i--;
+    if(i == len)
+        return 0;
+    if(i < ar->rootlen)
+        i = ar->rootlen;
+
+    for(i++; i <= len; i++) {
+        if(i < len && path[i] != '/')
+            continue;
+        path[i] = 0;
+        if(lstat(path, &st) < 0) {
+            if(errno != ENOENT || (sdb_mkdir(path, 0775) < 0 && errno != EEXIST)) {
+                archive_fail(ar, "cannot create directory '%s': %s", path, strerror(errno));
+                path[i] = '/';
+                return 1;
+            }
+        } else if(!S_ISDIR(st.st_mode)) {
+            archive_fail(ar, "'%s' is not a directory", path);
+            path[i] = '/';
+            return 1;
+        }
+        path[i] = '/';
+    }
+
+    memcpy(ar->safe, path, len);
+    ar->safe[len] = 0;
+    ar->safelen = len;
+    return 0;
+}
+
+static void archive_set_time(const char *path, unsigned time)
+{
+    struct utimbuf u;
+
+    u.actime = time;
+    u.modtime = time;
+    utime(path, &u);
+}
+
+static int archive_recv_dir(archive *ar, archive_dir **dirs, unsigned mode, unsigned time)
+{
+    archive_dir *dir;
+    struct stat st;
+    int len;
+
+        /* keep the directory writable until its contents are in */
+    if(sdb_mkdir(ar->path, 0700 | (mode & 0777)) < 0) {
+        if(errno != EEXIST || lstat(ar->path, &st) || !S_ISDIR(st.st_mode))
+            return archive_fail(ar, "cannot create directory '%s': %s", ar->path, strerror(errno));
+        chmod(ar->path, 0700 | (st.st_mode & 0777));
+    }
+
+    len = strlen(ar->path);
+    dir = malloc(sizeof(archive_dir) + len);
+    if(dir == 0)
+        return archive_fail(ar, "out of memory");
+    dir->mode = mode;
+    dir->time = time;
+    memcpy(dir->path, ar->path, len + 1);
+    dir->next = *dirs;
+    *dirs = dir;
+
+    ar->stats->dirs++;
+    return 0;
+}
+
+static int archive_recv_file(archive *ar, unsigned mode, unsigned time, long long size)
+{
+    long long left = size;
+    int fd, r = 0;
+
+    sdb_unlink(ar->path);
+    fd = sdb_open_mode(ar->path, O_WRONLY | O_CREAT | O_EXCL, mode & 0777);
+    if(fd < 0)
+        return archive_fail(ar, "cannot create '%s': %s", ar->path, strerror(errno));
+
+    while(left > 0) {
+        unsigned n;
+
+        r = archive_fill(ar);
+        if(r) break;
+        n = ar->len - ar->pos;
+        if(n > left)
+            n = left;
+        if(writex(fd, ar->msg.data + ar->pos, n)) {
+            r = archive_fail(ar, "cannot write '%s': %s", ar->path, strerror(errno));
+            break;
+        }
+        ar->pos += n;
+        left -= n;
+    }
+
+    sdb_close(fd);
+    if(r) {
+        sdb_unlink(ar->path);
+        return r;
+    }
+
+        /* the umask may have taken bits away at creation */
+    chmod(ar->path, mode & 0777);
+    archive_set_time(ar->path, time);
+
+    ar->stats->files++;
+    ar->stats->bytes += size;
+    return 0;
+}
+
+#ifdef HAVE_SYMLINKS
+static int archive_recv_link(archive *ar, unsigned time, long long size)
+{
+    char target[PATH_MAX];
+    struct timeval tv[2];
+    int r;
+
+    if(size >= (long long) sizeof(target))
+        return archive_fail(ar, "link target too long for '%s'", ar->path);
+    r = archive_get(ar, target, size);
+    if(r) return r;
+    target[size] = 0;
+
+    sdb_unlink(ar->path);
+    r = symlink(target, ar->path);
+    if(r)
+        return archive_fail(ar, "cannot create link '%s': %s", ar->path, strerror(errno));
+
+    tv[0].tv_sec = time;
+    tv[0].tv_usec = 0;
+    tv[1] = tv[0];
+    lutimes(ar->path, tv);
+
+    ar->stats->links++;
+    return 0;
+}
+#endif
+
+int archive_receive(int s, const char *root, archive_stats *stats,
+                    char *error, int errlen)
+{
+    archive *ar;
+    archive_dir *dirs = 0;
+    int r;
+
+    ar = archive_create(s, root, stats, error, errlen);
+    if(ar == 0)
+        return -1;
+
+    if(ar->rootlen > 0) {
+        ar->path[ar->rootlen] = '/';
+        ar->path[ar->rootlen + 1] = 0;
+        archive_mkdirs(ar->path);
+        ar->path[ar->rootlen] = 0;
+    }
+
+    for(;;) {
+        archive_hdr hdr;
+        unsigned namelen, mode, time;
+        long long size;
+
+        r = archive_get(ar, &hdr, sizeof(hdr));
+        if(r) break;
+
+        if(hdr.id == ID_AEND)
+            break;
+        if(hdr.id != ID_AENT) {
+            r = archive_fail(ar, "invalid archive entry");
+            break;
+        }
+
+        namelen = ltohl(hdr.namelen);
+        mode = ltohl(hdr.mode);
+        time = ltohl(hdr.time);
+        size = ((long long) ltohl(hdr.size_hi) << 32) | ltohl(hdr.size_lo);
+
+        if(namelen == 0 || namelen > ARCHIVE_NAME_MAX ||
+           ar->rootlen + 1 + namelen >= PATH_MAX) {
+            r = archive_fail(ar, "invalid name length in archive");
+            break;
+        }
+        ar->path[ar->rootlen] = '/';
+        r = archive_get(ar, ar->path + ar->rootlen + 1, namelen);
+        if(r) break;
+        ar->path[ar->rootlen + 1 + namelen] = 0;
+        if(!archive_name_ok(ar->path + ar->rootlen + 1)) {
+            r = archive_fail(ar, "invalid name in archive: '%s'", ar->path + ar->rootlen + 1);
+            break;
+        }
+        r = archive_parents(ar);
+        if(r) break;
+
+        if(S_ISDIR(mode)) {
+            r = archive_recv_dir(ar, &dirs, mode, time);
+        } else if(S_ISREG(mode)) {
+            r = archive_recv_file(ar, mode, time, size);
+#ifdef HAVE_SYMLINKS
+        } else if(S_ISLNK(mode)) {
+            r = archive_recv_link(ar, time, size);
+#endif
+        } else {
+            D("archive: skipping '%s' (mode %o)\n", ar->path, mode);
+            ar->stats->skipped++;
+            r = archive_skip(ar, size);
+        }
+        if(r) break;
+    }
+
+    if(r == 0) {
+        if(ar->pos != ar->len || archive_next(ar) != ID_DONE) {
+            if(!ar->ended)
+                r = archive_fail(ar, "missing end of archive");
+            else
+                r = 1;
+        }
+    }
+
+    while(dirs != 0) {
+        archive_dir *next = dirs->next;
+
+        if(r == 0) {
+            chmod(dirs->path, dirs->mode & 0777);
+            archive_set_time(dirs->path, dirs->time);
+        }
+        free(dirs);
+        dirs = next;
+    }
+
+    if(r == 1 && archive_drain(ar))
+        r = -1;
+    free(ar);
+    return r;
+}
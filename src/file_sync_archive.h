@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FILE_SYNC_ARCHIVE_H_
+#define _FILE_SYNC_ARCHIVE_H_
+
+/* a directory tree moved with ID_ASND / ID_ARCV travels as one archive
+** stream, cut into ordinary ID_DATA messages and closed by ID_DONE (or
+** by ID_FAIL + reason if the sender gives up half way).
+**
+** the stream is a sequence of entries, each a fixed header followed by
+** namelen bytes of path (relative to the root, '/' separated, no NUL)
+** and size bytes of payload: the file contents, or the target of a
+** symlink.  directories have no payload.  the AEND entry closes it.
+*/
+#define ID_AENT MKID('A','E','N','T')
+#define ID_AEND MKID('A','E','N','D')
+
+typedef struct {
+    unsigned id;
+    unsigned mode;
+    unsigned time;
+    unsigned size_lo;
+    unsigned size_hi;
+    unsigned namelen;
+} archive_hdr;
+
+typedef struct {
+    unsigned files;
+    unsigned dirs;
+    unsigned links;
+    unsigned skipped;
+    long long bytes;
+} archive_stats;
+
+/* decides whether an entry (name relative to the root) goes into the
+** archive; a directory that is left out is not walked either.
+*/
+typedef int (*archive_accept_fn)(void *cookie, const char *name, unsigned mode,
+                                 long long size, unsigned mtime);
+
+/* write the tree under root to s, keeping only what accept (if not
+** null) lets through.  returns 0 on success, -1 if the socket failed,
+** and 1 if a local error stopped the walk; in that case an ID_FAIL
+** carrying the reason (also left in error) closes the stream.
+*/
+int archive_send(int s, const char *root, archive_accept_fn accept,
+                 void *cookie, archive_stats *stats, char *error, int errlen);
+
+/* extract the stream read from s under root, creating it if needed.
+** returns 0 on success, -1 if the socket failed, and 1 for a bad
+** stream, a local error or an ID_FAIL from the sender, with the reason
+** in error.  on 1 the rest of the stream has been drained, so the
+** connection can still be used.
+*/
+int archive_receive(int s, const char *root, archive_stats *stats,
+                    char *error, int errlen);
+
+#endif
@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "sysdeps.h"
+
+#define TRACE_TAG  TRACE_SYNC
+#include "sdb.h"
+#include "sha256.h"
+#include "file_sync_service.h"
+#include "file_sync_cas.h"
+
+#define CAS_NAME_LEN  (SHA256_DIGEST_SIZE * 2)
+
+SDB_MUTEX_DEFINE( cas_lock );
+
+    /* bytes in the store, or -1 until it has been counted */
+static long long cas_bytes = -1;
+
+    /* for the names of temporary files, with the pid */
+static unsigned temp_count;
+
+static void cas_path(char *out, size_t len, const unsigned char *hash,
+                     const char *suffix)
+{
+    static const char hex[] = "0123456789abcdef";
+    char name[CAS_NAME_LEN + 1];
+    int n;
+
+    for(n = 0; n < SHA256_DIGEST_SIZE; n++) {
+        name[n * 2] = hex[hash[n] >> 4];
+        name[n * 2 + 1] = hex[hash[n] & 15];
+    }
+    name[CAS_NAME_LEN] = 0;
+    snprintf(out, len, SYNC_CAS_DIR "/%s%s", name, suffix);
+}
+
+/* a name that isn't a hash is a temporary one: left this long, nobody
+** is going to rename it into place any more */
+#define CAS_TEMP_AGE  (60 * 60)
+
+typedef struct {
+    char name[CAS_NAME_LEN + 1];
+    long long size;
+    time_t ctime;
+    int linked;
+} cas_object;
+
+static int cas_object_cmp(const void *a, const void *b)
+{
+    const cas_object *oa = a, *ob = b;
+
+        /* objects nothing else links to free space when they go */
+    if(oa->linked != ob->linked)
+        return oa->linked - ob->linked;
+    if(oa->ctime != ob->ctime)
+        return oa->ctime < ob->ctime ? -1 : 1;
+    return 0;
+}
+
+/* count the store and, if it has outgrown its budget, drop the oldest
+** objects until it is down to three quarters of it.  call with
+** cas_lock held.
+*/
+static void cas_evict(void)
+{
+    char path[PATH_MAX];
+    cas_object *objs = 0;
+    int count = 0, max = 0, n;
+    long long total = 0;
+    struct dirent *de;
+    struct stat st;
+    time_t now = time(0);
+    DIR *d;
+
+    d = opendir(SYNC_CAS_DIR);
+    if(d == 0) {
+        cas_bytes = 0;
+        return;
+    }
+
+    while((de = readdir(d))) {
+        if(de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), SYNC_CAS_DIR "/%s", de->d_name);
+        if(lstat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+        if(strlen(de->d_name) != CAS_NAME_LEN) {
+                /* an insert still under way, or one that never got
+                ** renamed into place; link() and mkstemp() both set
+                ** the ctime, whatever the mtime says */
+            if(now - st.st_ctime > CAS_TEMP_AGE)
+                sdb_unlink(path);
+            continue;
+        }
+
+        if(count == max) {
+            cas_object *tmp;
+            max = max ? max * 2 : 256;
+            tmp = realloc(objs, max * sizeof(cas_object));
+            if(tmp == 0)
+                break;
+            objs = tmp;
+        }
+        memcpy(objs[count].name, de->d_name, CAS_NAME_LEN + 1);
+        objs[count].size = st.st_size;
+        objs[count].ctime = st.st_ctime;
+        objs[count].linked = st.st_nlink > 1;
+        total += st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    if(total > SYNC_CAS_MAX_BYTES) {
+        qsort(objs, count, sizeof(cas_object), cas_object_cmp);
+        for(n = 0; n < count && total > SYNC_CAS_MAX_BYTES / 4 * 3; n++) {
+            snprintf(path, sizeof(path), SYNC_CAS_DIR "/%s", objs[n].name);
+            if(sdb_unlink(path) == 0) {
+                D("sync: cas evicted %s (%lld bytes)\n", objs[n].name, objs[n].size);
+                total -= objs[n].size;
+            }
+        }
+    }
+
+    free(objs);
+    cas_bytes = total;
+}
+
+/* drop a store object that no longer holds what its name says */
+static void cas_drop(const char *obj)
+{
+    D("sync: cas dropping %s\n", obj);
+    sdb_unlink(obj);
+    sdb_mutex_lock(&cas_lock);
+    cas_bytes = -1;
+    sdb_mutex_unlock(&cas_lock);
+}
+
+int sync_open_temp(char *tmppath, size_t len, const char *path, mode_t mode)
+{
+    unsigned count;
+    int n, fd = -1;
+
+        /* one left behind by an earlier sdbd with the same pid is
+        ** just skipped */
+    for(n = 0; n < 100; n++) {
+        sdb_mutex_lock(&cas_lock);
+        count = temp_count++;
+        sdb_mutex_unlock(&cas_lock);
+        snprintf(tmppath, len, "%s.sdbtmp.%d.%u", path, getpid(), count);
+        fd = sdb_open_mode(tmppath, O_WRONLY | O_CREAT | O_EXCL, mode);
+        if(fd >= 0 || errno != EEXIST)
+            break;
+    }
+    return fd;
+}
+
+/* clone sfd into fd where the filesystem can share the blocks */
+static int cas_clone(int fd, int sfd)
+{
+#ifdef FICLONE
+    return ioctl(fd, FICLONE, sfd);
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int cas_link(const char *path, mode_t mode, unsigned mtime, unsigned flags,
+             long long size, const unsigned char *hash)
+{
+    char obj[PATH_MAX];
+    char tmppath[PATH_MAX];
+    char lnkpath[PATH_MAX + 2];
+    struct stat st;
+    struct utimbuf u;
+    int sfd, fd, err;
+
+    cas_path(obj, sizeof(obj), hash, "");
+    sfd = sdb_open(obj, O_RDONLY);
+    if(sfd < 0)
+        return -1;
+        /* anything made writable since, or grown or cut, is suspect */
+    if(fstat(sfd, &st) || !S_ISREG(st.st_mode) || (st.st_mode & 0222) ||
+       st.st_size != size) {
+        sdb_close(sfd);
+        cas_drop(obj);
+        errno = ESTALE;
+        return -1;
+    }
+
+        /* a name of its own, so that pushes to the same path can't
+        ** remove each other's */
+    fd = sync_open_temp(tmppath, sizeof tmppath, path, mode);
+    if(fd < 0) {
+        err = errno;
+        sdb_close(sfd);
+        errno = err;
+        return -1;
+    }
+
+    if(cas_clone(fd, sfd) == 0) {
+            /* a clone shares the blocks, not the inode: it is the
+            ** requested file in every other respect */
+        if((flags & SYNC_FLAG_FDATASYNC) && fdatasync(fd))
+            goto fail;
+        sdb_close(fd);
+        fd = -1;
+            /* touch the store object, so that it counts as recently used */
+        fchmod(sfd, st.st_mode & 07777);
+    } else {
+            /* a link shares the read-only mode of the object, so it
+            ** has to be the one the file was asked for without the
+            ** write bits
+            */
+        sdb_close(fd);
+        fd = -1;
+        if((st.st_mode & 07777) != (mode & 0555)) {
+            errno = EPERM;
+            goto fail;
+        }
+        snprintf(lnkpath, sizeof lnkpath, "%s.l", tmppath);
+        if(link(obj, lnkpath))
+            goto fail;
+        sdb_unlink(tmppath);
+        memcpy(tmppath, lnkpath, strlen(lnkpath) + 1);
+        if((flags & SYNC_FLAG_FDATASYNC) && fdatasync(sfd))
+            goto fail;
+    }
+    sdb_close(sfd);
+    sfd = -1;
+
+    u.actime = mtime;
+    u.modtime = mtime;
+    utime(tmppath, &u);
+
+    if(rename(tmppath, path))
+        goto fail;
+        /* renaming onto another link to the same inode leaves both */
+    sdb_unlink(tmppath);
+    return 0;
+
+fail:
+    err = errno;
+    if(fd >= 0)
+        sdb_close(fd);
+    if(sfd >= 0)
+        sdb_close(sfd);
+    sdb_unlink(tmppath);
+    errno = err;
+    return -1;
+}
+
+void cas_insert(const char *path, long long size, const unsigned char *hash)
+{
+    char obj[PATH_MAX];
+    char tmppath[PATH_MAX];
+    char lnkpath[PATH_MAX + 2];
+    char *newpath = tmppath;
+    struct stat st;
+    int sfd, fd;
+
+    cas_path(obj, sizeof(obj), hash, "");
+    cas_path(tmppath, sizeof(tmppath), hash, ".XXXXXX");
+
+    sdb_mutex_lock(&cas_lock);
+    if(sdb_mkdir(SYNC_CAS_DIR, 0700) && errno != EEXIST) {
+        D("sync: cannot create " SYNC_CAS_DIR ": %s\n", strerror(errno));
+        sdb_mutex_unlock(&cas_lock);
+        return;
+    }
+    if(cas_bytes < 0)
+        cas_evict();
+    sdb_mutex_unlock(&cas_lock);
+
+        /* the object is set up without the lock, under a name of its
+        ** own, so that other pushes don't wait for it
+        */
+    sfd = sdb_open(path, O_RDONLY);
+    if(sfd < 0)
+        return;
+    if(fstat(sfd, &st) || st.st_size != size) {
+            /* changed since it was received */
+        sdb_close(sfd);
+        return;
+    }
+    fd = mkstemp(tmppath);
+    if(fd < 0) {
+        sdb_close(sfd);
+        return;
+    }
+
+    if(cas_clone(fd, sfd) == 0) {
+        if(fchmod(fd, st.st_mode & 0555)) {
+            sdb_close(fd);
+            sdb_close(sfd);
+            sdb_unlink(tmppath);
+            return;
+        }
+        sdb_close(fd);
+    } else {
+            /* no clones here: the file itself goes into the store,
+            ** read-only from now on, so that nothing but a replace
+            ** (which every push does) can change the object under it.
+            ** EXDEV means the store is on another filesystem.
+            */
+        sdb_close(fd);
+        snprintf(lnkpath, sizeof lnkpath, "%s.l", tmppath);
+        if(link(path, lnkpath) || fchmod(sfd, st.st_mode & 0555)) {
+            D("sync: cas cannot link '%s': %s\n", path, strerror(errno));
+            sdb_unlink(lnkpath);
+            sdb_close(sfd);
+            sdb_unlink(tmppath);
+            return;
+        }
+        sdb_unlink(tmppath);
+        newpath = lnkpath;
+    }
+    sdb_close(sfd);
+
+    sdb_mutex_lock(&cas_lock);
+    if(cas_bytes < 0)
+        cas_evict();
+    if(lstat(obj, &st) == 0)
+        cas_bytes -= st.st_size;
+    if(rename(newpath, obj)) {
+        sdb_unlink(newpath);
+        cas_bytes = -1;
+        goto done;
+    }
+        /* renaming onto another link to the same inode leaves both */
+    sdb_unlink(newpath);
+    cas_bytes += size;
+
+    if(cas_bytes > SYNC_CAS_MAX_BYTES)
+        cas_evict();
+
+done:
+    sdb_mutex_unlock(&cas_lock);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FILE_SYNC_CAS_H_
+#define _FILE_SYNC_CAS_H_
+
+#include <sys/types.h>
+
+/* sdbd keeps the files pushed with SYNC_FLAG_CAS in a content-addressed
+** store, each named by the hex sha-256 of its contents.  ID_CLNK asks
+** for a file by hash: on a hit the stored object is cloned into place
+** (FICLONE), or hard linked where the filesystem can't clone, and no
+** data has to cross the wire or be written again.
+**
+** objects are read-only.  where they can't be cloned the deployed file
+** is the object, so it is read-only too: every push replaces a file
+** rather than writing into it, and so leaves the object alone.  a hit
+** checks the object's size and mode, not its contents.
+**
+** objects are evicted oldest first, by inode change time (which a hit
+** bumps), preferring those nothing links to, once the store grows past
+** SYNC_CAS_MAX_BYTES.
+*/
+#define SYNC_CAS_DIR        "/opt/usr/.sdb-cas"
+#define SYNC_CAS_MAX_BYTES  (256LL * 1024 * 1024)
+
+/* put the store object for hash at path, with the given mode (less
+** its write bits, when linked) and mtime.  returns 0 on success and -1 on a miss (or any error).
+*/
+int cas_link(const char *path, mode_t mode, unsigned mtime, unsigned flags,
+             long long size, const unsigned char *hash);
+
+/* add the file just written at path to the store */
+void cas_insert(const char *path, long long size, const unsigned char *hash);
+
+/* create a file for writing next to path, under a name in tmppath that
+** no other push is using, with mode (less the umask) like any new file.
+*/
+int sync_open_temp(char *tmppath, size_t len, const char *path, mode_t mode);
+
+#endif
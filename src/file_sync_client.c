@@ -24,6 +24,10 @@
 #include <dirent.h>
 #include <limits.h>
 #include <sys/types.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
 #if 0 //eric
 #include <zipfile/zipfile.h>
 #endif
@@ -31,8 +35,13 @@
 #include "sdb.h"
 #include "sdb_client.h"
 #include "file_sync_service.h"
+#include "file_sync_archive.h"
+#include "file_sync_copylist.h"
+#include "file_sync_manifest.h"
+#include "sha256.h"
 
 static unsigned total_bytes;
+static unsigned cas_linked;
 static long long start_time;
 
 static long long NOW()
@@ -46,12 +55,17 @@ static long long NOW()
 static void BEGIN()
 {
     total_bytes = 0;
+    cas_linked = 0;
     start_time = NOW();
 }
 
 static void END()
 {
     long long t = NOW() - start_time;
+
+    if(cas_linked)
+        fprintf(stderr,"%u file%s already on the device, linked into place\n",
+                cas_linked, (cas_linked == 1) ? "" : "s");
     if(total_bytes == 0) return;
 
     if (t == 0)  /* prevent division by 0 :-) */
@@ -62,6 +76,53 @@ static void END()
             total_bytes, (t / 1000000LL), (t % 1000000LL) / 1000LL);
 }
 
+/* what the sdbd at the other end of each sync connection understands,
+** by descriptor: its SYNC_FEATURE_* bits with SYNC_FEATURES_KNOWN, or
+** 0 until the first request that needs one of them asks
+*/
+#define SYNC_FEATURE_FDS     64
+#define SYNC_FEATURES_KNOWN  0x80000000
+
+static unsigned sync_feature_cache[SYNC_FEATURE_FDS];
+
+static void sync_forget(int fd)
+{
+    if(fd >= 0 && fd < SYNC_FEATURE_FDS)
+        sync_feature_cache[fd] = 0;
+}
+
+static int sync_connect(void)
+{
+    int fd = sdb_connect("sync:");
+
+    sync_forget(fd);
+    return fd;
+}
+
+/* store the SYNC_FEATURE_* bits of the sdbd on fd in *features; an
+** older sdbd has none.  -1 if the connection failed.
+*/
+static int sync_features(int fd, unsigned *features)
+{
+    syncmsg msg;
+
+    if(fd >= 0 && fd < SYNC_FEATURE_FDS && sync_feature_cache[fd]) {
+        *features = sync_feature_cache[fd] & SYNC_FEATURES;
+        return 0;
+    }
+
+    msg.req.id = ID_STAT;
+    msg.req.namelen = 0;
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       readx(fd, &msg.stat, sizeof(msg.stat)) || msg.stat.id != ID_STAT) {
+        return -1;
+    }
+    *features = ltohl(msg.stat.size) & SYNC_FEATURES;
+    if(fd >= 0 && fd < SYNC_FEATURE_FDS)
+        sync_feature_cache[fd] = *features | SYNC_FEATURES_KNOWN;
+    return 0;
+}
+
 void sync_quit(int fd)
 {
     syncmsg msg;
@@ -70,6 +131,7 @@ void sync_quit(int fd)
     msg.req.namelen = 0;
 
     writex(fd, &msg.req, sizeof(msg.req));
+    sync_forget(fd);
 }
 
 typedef void (*sync_ls_cb)(unsigned mode, unsigned size, unsigned time, const char *name, void *cookie);
@@ -122,6 +184,9 @@ struct syncsendbuf {
 };
 
 static syncsendbuf send_buffer;
+#ifndef _WIN32
+static syncsendbuf readahead_buffer;
+#endif
 
 int sync_readtime(int fd, const char *path, unsigned *timestamp)
 {
@@ -207,16 +272,285 @@ int sync_readmode(int fd, const char *path, unsigned *mode)
     return 0;
 }
 
-static int write_data_file(int fd, const char *path, syncsendbuf *sbuf)
+#ifndef _WIN32
+/* the local file is mapped SYNC_MAP_WINDOW bytes at a time, so 32-bit
+** hosts can push files larger than their address space.  must be a
+** multiple of both the page size and SYNC_DATA_MAX.
+*/
+#define SYNC_MAP_WINDOW (32*1024*1024)
+
+static int writevx(int fd, struct iovec *iov, int cnt)
+{
+    while(cnt > 0) {
+        ssize_t r = writev(fd, iov, cnt);
+        if(r <= 0) {
+            if((r < 0) && (errno == EINTR)) continue;
+            return -1;
+        }
+        while(cnt > 0 && (size_t) r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if(cnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return 0;
+}
+
+/* send a regular file straight out of the page cache: each DATA message
+** is gathered from the header and the mapping, with no copy through
+** send_buffer.  returns 1 if the file can't be mapped at all, so that
+** the caller can fall back to reading it.
+**
+** the size is looked at again before each window, so a file that grows
+** is sent up to its end as a read() loop would.  one cut short under a
+** window already mapped can't be: the kernel fails the writev() with
+** EFAULT on the pages that are gone (nothing here touches the mapping,
+** so there is no SIGBUS), the DATA message in flight can't be finished,
+** and -1 tells the caller to drop the connection.
+*/
+static int write_data_mapped(int fd, int lfd, const char *path, long long start)
+{
+        /* windows start SYNC_DATA_MAX aligned, which is page aligned too */
+    long long offset = start & ~((long long) SYNC_DATA_MAX - 1);
+    size_t skip = start - offset;
+    int first = 1;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(lfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    for(;;) {
+        size_t window = SYNC_MAP_WINDOW;
+        size_t pos, count;
+        struct stat st;
+        char *map;
+
+        if(fstat(lfd, &st) || !S_ISREG(st.st_mode) || (first && st.st_size == 0))
+            return first ? 1 : -1;
+        if(offset + (long long) skip >= st.st_size) {
+            if(first && start > st.st_size) {
+                fprintf(stderr,"cannot read '%s': file is shorter than expected\n", path);
+                return -1;
+            }
+            break;
+        }
+        if(st.st_size - offset < (long long) window)
+            window = st.st_size - offset;
+
+        map = mmap(NULL, window, PROT_READ, MAP_SHARED, lfd, offset);
+        if(map == MAP_FAILED) {
+            if(first)
+                return 1;
+            fprintf(stderr,"cannot map '%s': %s\n", path, strerror(errno));
+            return -1;
+        }
+        madvise(map, window, MADV_SEQUENTIAL);
+
+        first = 0;
+
+        for(pos = skip; pos < window; pos += count) {
+            unsigned hdr[2];
+            struct iovec iov[2];
+
+            count = window - pos;
+            if(count > SYNC_DATA_MAX)
+                count = SYNC_DATA_MAX;
+
+            hdr[0] = ID_DATA;
+            hdr[1] = htoll(count);
+            iov[0].iov_base = hdr;
+            iov[0].iov_len = sizeof(hdr);
+            iov[1].iov_base = map + pos;
+            iov[1].iov_len = count;
+            if(writevx(fd, iov, 2)) {
+                if(errno == EFAULT)
+                    fprintf(stderr,"cannot read '%s': file shrank while being sent\n", path);
+                munmap(map, window);
+                return -1;
+            }
+            total_bytes += count;
+        }
+
+        munmap(map, window);
+        offset += window;
+        skip = 0;
+    }
+    return 0;
+}
+
+/* double-buffered reader for files that can't be mapped: a helper thread
+** fills one buffer from the file while the other one is on the wire.
+*/
+typedef struct sync_reader {
+    sdb_mutex_t lock;
+    sdb_cond_t cond;
+    int lfd;
+    syncsendbuf *buf[2];
+    int len[2];
+    int full[2];
+    int error;
+    int stop;
+    int exited;
+} sync_reader;
+
+static void *readahead_thread(void *x)
+{
+    sync_reader *ra = x;
+    int i = 0, stop;
+
+    for(;;) {
+        int n = 0, r = 0;
+
+        sdb_mutex_lock(&ra->lock);
+        while(ra->full[i] && !ra->stop)
+            sdb_cond_wait(&ra->cond, &ra->lock);
+        stop = ra->stop;
+        sdb_mutex_unlock(&ra->lock);
+        if(stop)
+            break;
+
+        while(n < SYNC_DATA_MAX) {
+            r = sdb_read(ra->lfd, ra->buf[i]->data + n, SYNC_DATA_MAX - n);
+            if(r > 0) {
+                n += r;
+                continue;
+            }
+            if((r < 0) && (errno == EINTR)) continue;
+            break;
+        }
+
+        sdb_mutex_lock(&ra->lock);
+        if(r < 0 && n == 0) {
+            ra->error = errno;
+            n = -1;
+        }
+        ra->len[i] = n;
+        ra->full[i] = 1;
+        sdb_cond_broadcast(&ra->cond);
+        sdb_mutex_unlock(&ra->lock);
+
+        if(n <= 0)
+            break;
+        i ^= 1;
+    }
+
+    sdb_mutex_lock(&ra->lock);
+    ra->exited = 1;
+    sdb_cond_broadcast(&ra->cond);
+    sdb_mutex_unlock(&ra->lock);
+    return 0;
+}
+
+static int write_data_readahead(int fd, int lfd, const char *path)
+{
+    sync_reader ra;
+    sdb_thread_t t;
+    int i = 0, err = 0;
+
+    memset(&ra, 0, sizeof(ra));
+    ra.lfd = lfd;
+    ra.buf[0] = &send_buffer;
+    ra.buf[1] = &readahead_buffer;
+    sdb_mutex_init(&ra.lock, NULL);
+    sdb_cond_init(&ra.cond, NULL);
+
+    if(sdb_thread_create(&t, readahead_thread, &ra)) {
+        fprintf(stderr,"cannot create reader thread for '%s'\n", path);
+        err = -1;
+        goto done;
+    }
+
+    for(;;) {
+        syncsendbuf *sbuf = ra.buf[i];
+        int n;
+
+        sdb_mutex_lock(&ra.lock);
+        while(!ra.full[i])
+            sdb_cond_wait(&ra.cond, &ra.lock);
+        n = ra.len[i];
+        sdb_mutex_unlock(&ra.lock);
+
+        if(n <= 0) {
+            if(n < 0)
+                fprintf(stderr,"cannot read '%s': %s\n", path, strerror(ra.error));
+            break;
+        }
+
+        sbuf->id = ID_DATA;
+        sbuf->size = htoll(n);
+        if(writex(fd, sbuf, sizeof(unsigned) * 2 + n)) {
+            err = -1;
+            break;
+        }
+        total_bytes += n;
+
+        sdb_mutex_lock(&ra.lock);
+        ra.full[i] = 0;
+        sdb_cond_broadcast(&ra.cond);
+        sdb_mutex_unlock(&ra.lock);
+        i ^= 1;
+    }
+
+    sdb_mutex_lock(&ra.lock);
+    ra.stop = 1;
+    sdb_cond_broadcast(&ra.cond);
+    while(!ra.exited)
+        sdb_cond_wait(&ra.cond, &ra.lock);
+    sdb_mutex_unlock(&ra.lock);
+
+done:
+    sdb_cond_destroy(&ra.cond);
+    sdb_mutex_destroy(&ra.lock);
+    return err;
+}
+#endif /* !_WIN32 */
+
+/* move past the first skip bytes of a file that couldn't be mapped */
+static int skip_data_file(int lfd, const char *path, long long skip, char *buf)
+{
+    while(skip > 0) {
+        int r = sdb_read(lfd, buf, skip > SYNC_DATA_MAX ? SYNC_DATA_MAX : skip);
+        if(r <= 0) {
+            if((r < 0) && (errno == EINTR)) continue;
+            fprintf(stderr,"cannot read '%s': %s\n", path,
+                    r ? strerror(errno) : "file is shorter than expected");
+            return -1;
+        }
+        skip -= r;
+    }
+    return 0;
+}
+
+/* send the contents of path from byte start on; -1 if the stream was
+** left mid-message and the connection can't be used any more
+*/
+static int write_data_file(int fd, const char *path, syncsendbuf *sbuf,
+                           long long start)
 {
     int lfd, err = 0;
 
     lfd = sdb_open(path, O_RDONLY);
     if(lfd < 0) {
         fprintf(stderr,"cannot open '%s': %s\n", path, strerror(errno));
-        return -1;
+        return 0;
     }
 
+#ifndef _WIN32
+    err = write_data_mapped(fd, lfd, path, start);
+    if(err == 1) {
+        err = skip_data_file(lfd, path, start, sbuf->data);
+        if(err == 0)
+            err = write_data_readahead(fd, lfd, path);
+    }
+#else
+    if(skip_data_file(lfd, path, start, sbuf->data)) {
+        sdb_close(lfd);
+        return -1;
+    }
     sbuf->id = ID_DATA;
     for(;;) {
         int ret;
@@ -239,6 +573,7 @@ static int write_data_file(int fd, const char *path, syncsendbuf *sbuf)
         }
         total_bytes += ret;
     }
+#endif
 
     sdb_close(lfd);
     return err;
@@ -294,14 +629,132 @@ static int write_data_link(int fd, const char *path, syncsendbuf *sbuf)
 }
 #endif
 
+static int hash_local_prefix(const char *lpath, long long size,
+                             unsigned char *hash)
+{
+    sha256_ctx ctx;
+    char *buf = send_buffer.data;
+    int lfd, r;
+
+    lfd = sdb_open(lpath, O_RDONLY);
+    if(lfd < 0)
+        return -1;
+
+    sha256_init(&ctx);
+    while(size > 0) {
+        r = sdb_read(lfd, buf, size > SYNC_DATA_MAX ? SYNC_DATA_MAX : size);
+        if(r <= 0) {
+            if((r < 0) && (errno == EINTR)) continue;
+            sdb_close(lfd);
+            return -1;
+        }
+        sha256_update(&ctx, buf, r);
+        size -= r;
+    }
+    sdb_close(lfd);
+    sha256_final(&ctx, hash);
+    return 0;
+}
+
+/* ask the device how much of rpath an earlier resumable push left
+** behind; if that prefix matches lpath we carry on from its end.
+*/
+static int sync_resume_offset(int fd, const char *lpath, const char *rpath,
+                              long long file_size, long long *offset)
+{
+    syncmsg msg;
+    unsigned char hash[SHA256_DIGEST_SIZE];
+    long long psize;
+    int len;
+
+    *offset = 0;
+
+    len = strlen(rpath);
+    msg.req.id = ID_PQRY;
+    msg.req.namelen = htoll(len);
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, rpath, len)) {
+        return -1;
+    }
+
+    if(readx(fd, &msg.status, sizeof(msg.status)))
+        return -1;
+    if(msg.part.id != ID_PART) {
+        if(msg.status.id != ID_FAIL)
+            return -1;
+        len = ltohl(msg.status.msglen);
+        if(len > 256) len = 256;
+        if(readx(fd, send_buffer.data, len))
+            return -1;
+        send_buffer.data[len] = 0;
+        fprintf(stderr,"cannot check partial '%s': %s\n", rpath, send_buffer.data);
+        return 0;
+    }
+    if(readx(fd, (char*) &msg.part + sizeof(msg.status),
+             sizeof(msg.part) - sizeof(msg.status)))
+        return -1;
+
+    psize = ((long long) ltohl(msg.part.size_hi) << 32) | ltohl(msg.part.size_lo);
+    if(psize == 0)
+        return 0;
+
+    if(psize <= file_size &&
+       hash_local_prefix(lpath, psize, hash) == 0 &&
+       memcmp(hash, msg.part.hash, sizeof(hash)) == 0) {
+        fprintf(stderr,"resuming '%s' at %lld bytes\n", rpath, psize);
+        *offset = psize;
+    } else {
+        fprintf(stderr,"partial '%s' does not match '%s', starting over\n", rpath, lpath);
+    }
+    return 0;
+}
+
+/* ask the device to put a copy it already has of lpath's contents at
+** rpath.  returns 1 if it did, 0 if the data has to be sent after all.
+*/
+static int sync_cas_link(int fd, const char *lpath, const char *rpath,
+                         unsigned mtime, mode_t mode, long long file_size,
+                         unsigned flags)
+{
+    syncmsg msg, hdr;
+    int len;
+
+    if(hash_local_prefix(lpath, file_size, hdr.cas.hash))
+        return 0;
+
+    len = strlen(rpath);
+    msg.req.id = ID_CLNK;
+    msg.req.namelen = htoll(len);
+    hdr.cas.id = ID_CLNK;
+    hdr.cas.mode = htoll(mode);
+    hdr.cas.flags = htoll(flags);
+    hdr.cas.time = htoll(mtime);
+    hdr.cas.size_lo = htoll((unsigned) file_size);
+    hdr.cas.size_hi = htoll((unsigned) (file_size >> 32));
+
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, rpath, len) || writex(fd, &hdr.cas, sizeof(hdr.cas)) ||
+       readx(fd, &msg.status, sizeof(msg.status))) {
+        return -1;
+    }
+    if(msg.status.id == ID_OKAY)
+        return 1;
+    if(msg.status.id != ID_MISS)
+        return -1;
+    return 0;
+}
+
 static int sync_send(int fd, const char *lpath, const char *rpath,
-                     unsigned mtime, mode_t mode, int verifyApk)
+                     unsigned mtime, mode_t mode, long long file_size,
+                     unsigned flags, int verifyApk)
 {
     syncmsg msg;
     int len, r;
     syncsendbuf *sbuf = &send_buffer;
     char* file_buffer = NULL;
     int size = 0;
+    long long offset = 0;
+    unsigned features = 0;
     char tmp[64];
 
     len = strlen(rpath);
@@ -369,20 +822,84 @@ static int sync_send(int fd, const char *lpath, const char *rpath,
 #endif
     }
 
-    msg.req.id = ID_SEND;
-    msg.req.namelen = htoll(len + r);
+    if(file_size < SYNC_CAS_MIN_SIZE)
+        flags &= ~SYNC_FLAG_CAS;
+    if (file_buffer == NULL && S_ISREG(mode)) {
+            /* asked once per connection, then cached */
+        if(sync_features(fd, &features))
+            goto fail;
+        if(!(features & SYNC_FEATURE_CAS))
+            flags &= ~SYNC_FLAG_CAS;
+        if(!(features & SYNC_FEATURE_SND2)) {
+            if(flags & (SYNC_FLAG_FDATASYNC | SYNC_FLAG_ATOMIC)) {
+                fprintf(stderr,"failed to copy '%s' to '%s': sdbd on the device does not "
+                        "support -fsync or -atomic\n", lpath, rpath);
+                return -1;
+            }
+            if(flags & SYNC_FLAG_RESUME)
+                fprintf(stderr,"sdbd on the device cannot resume, sending all of '%s'\n", lpath);
+            flags = 0;
+        }
+    }
 
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, rpath, len) || writex(fd, tmp, r)) {
-        free(file_buffer);
-        goto fail;
+    if (file_buffer == NULL && S_ISREG(mode) && (features & SYNC_FEATURE_SND2)) {
+            /* let the device preallocate and pick the durability it owes us */
+        syncmsg hdr, rhdr;
+
+        if(flags & SYNC_FLAG_CAS) {
+            int linked = sync_cas_link(fd, lpath, rpath, mtime, mode, file_size, flags);
+            if(linked < 0)
+                goto fail;
+            if(linked) {
+                cas_linked++;
+                return 0;
+            }
+        }
+
+        if((flags & SYNC_FLAG_RESUME) &&
+           sync_resume_offset(fd, lpath, rpath, file_size, &offset)) {
+            goto fail;
+        }
+
+        msg.req.id = ID_SND2;
+        msg.req.namelen = htoll(len);
+        hdr.send2.id = ID_SND2;
+        hdr.send2.mode = htoll(mode);
+        hdr.send2.flags = htoll(flags);
+        hdr.send2.size_lo = htoll((unsigned) file_size);
+        hdr.send2.size_hi = htoll((unsigned) (file_size >> 32));
+
+        if(writex(fd, &msg.req, sizeof(msg.req)) ||
+           writex(fd, rpath, len) || writex(fd, &hdr.send2, sizeof(hdr.send2))) {
+            goto fail;
+        }
+        if(flags & SYNC_FLAG_RESUME) {
+            rhdr.resume.id = ID_SND2;
+            rhdr.resume.offset_lo = htoll((unsigned) offset);
+            rhdr.resume.offset_hi = htoll((unsigned) (offset >> 32));
+            if(writex(fd, &rhdr.resume, sizeof(rhdr.resume)))
+                goto fail;
+        }
+    } else {
+        msg.req.id = ID_SEND;
+        msg.req.namelen = htoll(len + r);
+
+        if(writex(fd, &msg.req, sizeof(msg.req)) ||
+           writex(fd, rpath, len) || writex(fd, tmp, r)) {
+            free(file_buffer);
+            goto fail;
+        }
     }
 
     if (file_buffer) {
         write_data_buffer(fd, file_buffer, size, sbuf);
         free(file_buffer);
-    } else if (S_ISREG(mode))
-        write_data_file(fd, lpath, sbuf);
+    } else if (S_ISREG(mode)) {
+        if(write_data_file(fd, lpath, sbuf, offset) < 0) {
+            sdb_close(fd);
+            return -1;
+        }
+    }
 #ifdef HAVE_SYMLINKS
     else if (S_ISLNK(mode))
         write_data_link(fd, lpath, sbuf);
@@ -440,23 +957,19 @@ static int mkdirs(char *name)
     return 0;
 }
 
-int sync_recv(int fd, const char *rpath, const char *lpath)
+/* read the ID_DATA stream answering a RECV/RCV2 into lpath.  with
+** append set an existing lpath is extended instead of replaced, and
+** is kept if the device reports an error, less the last DATA message:
+** the device pads that one out if the file shrank under it.
+*/
+static int sync_recv_data(int fd, const char *rpath, const char *lpath, int append)
 {
     syncmsg msg;
     int len;
     int lfd = -1;
     char *buffer = send_buffer.data;
     unsigned id;
-
-    len = strlen(rpath);
-    if(len > 1024) return -1;
-
-    msg.req.id = ID_RECV;
-    msg.req.namelen = htoll(len);
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, rpath, len)) {
-        return -1;
-    }
+    long long pos = 0, last = -1;
 
     if(readx(fd, &msg.data, sizeof(msg.data))) {
         return -1;
@@ -464,9 +977,13 @@ int sync_recv(int fd, const char *rpath, const char *lpath)
     id = msg.data.id;
 
     if((id == ID_DATA) || (id == ID_DONE)) {
-        sdb_unlink(lpath);
-        mkdirs((char *)lpath);
-        lfd = sdb_creat(lpath, 0644);
+        if(append && (lfd = sdb_open(lpath, O_WRONLY)) >= 0) {
+            pos = sdb_lseek(lfd, 0, SEEK_END);
+        } else {
+            sdb_unlink(lpath);
+            mkdirs((char *)lpath);
+            lfd = sdb_creat(lpath, 0644);
+        }
         if(lfd < 0) {
             fprintf(stderr,"cannot create '%s': %s\n", lpath, strerror(errno));
             return -1;
@@ -504,14 +1021,19 @@ int sync_recv(int fd, const char *rpath, const char *lpath)
         }
 
         total_bytes += len;
+        last = pos;
+        pos += len;
     }
 
     sdb_close(lfd);
     return 0;
 
 remote_error:
+    if(append && lfd >= 0 && last >= 0)
+        ftruncate(lfd, last);
     sdb_close(lfd);
-    sdb_unlink(lpath);
+    if(!append)
+        sdb_unlink(lpath);
 
     if(id == ID_FAIL) {
         len = ltohl(msg.data.size);
@@ -529,6 +1051,53 @@ remote_error:
     return 0;
 }
 
+int sync_recv(int fd, const char *rpath, const char *lpath)
+{
+    syncmsg msg;
+    int len;
+
+    len = strlen(rpath);
+    if(len > 1024) return -1;
+
+    msg.req.id = ID_RECV;
+    msg.req.namelen = htoll(len);
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, rpath, len)) {
+        return -1;
+    }
+
+    return sync_recv_data(fd, rpath, lpath, 0);
+}
+
+/* fetch length bytes (< 0: up to the end) of rpath starting at offset,
+** or offset bytes back from the end with SYNC_RECV_TAIL.
+*/
+int sync_recv_range(int fd, const char *rpath, const char *lpath,
+                    long long offset, long long length, unsigned flags,
+                    int append)
+{
+    syncmsg msg, hdr;
+    int len;
+
+    len = strlen(rpath);
+    if(len > 1024) return -1;
+
+    msg.req.id = ID_RCV2;
+    msg.req.namelen = htoll(len);
+    hdr.recv2.id = ID_RCV2;
+    hdr.recv2.flags = htoll(flags);
+    hdr.recv2.offset_lo = htoll((unsigned) offset);
+    hdr.recv2.offset_hi = htoll((unsigned) (offset >> 32));
+    hdr.recv2.length_lo = htoll((unsigned) length);
+    hdr.recv2.length_hi = htoll((unsigned) (length >> 32));
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, rpath, len) || writex(fd, &hdr.recv2, sizeof(hdr.recv2))) {
+        return -1;
+    }
+
+    return sync_recv_data(fd, rpath, lpath, append);
+}
+
 
 
 /* --- */
@@ -542,7 +1111,7 @@ static void do_sync_ls_cb(unsigned mode, unsigned size, unsigned time,
 
 int do_sync_ls(const char *path)
 {
-    int fd = sdb_connect("sync:");
+    int fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", sdb_error());
         return 1;
@@ -556,160 +1125,176 @@ int do_sync_ls(const char *path)
     }
 }
 
-typedef struct copyinfo copyinfo;
+typedef struct {
+    sync_manifest *manifest;
+    copylist *list;
+    const char *lpath;
+    const char *rpath;
+    int root;
+    int count;
+} journal_args;
 
-struct copyinfo
+/* turn a path from the watcher's journal into copyinfos */
+static void journal_list_cb(const char *name, int isdir, void *cookie)
 {
-    copyinfo *next;
-    const char *src;
-    const char *dst;
-    unsigned int time;
-    unsigned int mode;
-    unsigned int size;
-    int flag;
-    //char data[0];
-};
+    journal_args *args = cookie;
+    copylist *l = args->list;
+    char lsub[PATH_MAX], rsub[PATH_MAX], prefix[PATH_MAX];
+    struct stat st;
+    copyinfo *ci;
+    unsigned n;
+    int llen = strlen(args->lpath);
+
+    args->count++;
+    snprintf(lsub, sizeof(lsub), "%s%s", args->lpath, name);
+    snprintf(prefix, sizeof(prefix), "%s/", name);
+
+    if(lstat(lsub, &st)) {
+            /* gone, along with anything below it */
+        manifest_remove(args->manifest, name);
+        manifest_clear_seen(args->manifest, prefix);
+        manifest_prune(args->manifest, prefix);
+        return;
+    }
 
-copyinfo *mkcopyinfo(const char *spath, const char *dpath,
-                     const char *name, int isdir)
-{
-    int slen = strlen(spath);
-    int dlen = strlen(dpath);
-    int nlen = strlen(name);
-    int ssize = slen + nlen + 2;
-    int dsize = dlen + nlen + 2;
-
-    copyinfo *ci = malloc(sizeof(copyinfo) + ssize + dsize);
-    if(ci == 0) {
-        fprintf(stderr,"out of memory\n");
-        abort();
+    if(S_ISDIR(st.st_mode)) {
+        unsigned first = l->count;
+
+        snprintf(lsub, sizeof(lsub), "%s%s/", args->lpath, name);
+        snprintf(rsub, sizeof(rsub), "%s%s/", args->rpath, name);
+
+        manifest_clear_seen(args->manifest, prefix);
+        if(local_build_list(l, lsub, rsub))
+            return;
+        for(n = first; n < l->count; n++) {
+            manifest_entry *e = manifest_lookup(args->manifest,
+                                                copyinfo_src(l, &l->files[n], lsub) + llen);
+            if(e) e->seen = 1;
+        }
+        manifest_prune(args->manifest, prefix);
+        return;
     }
 
-    ci->next = 0;
-    ci->time = 0;
-    ci->mode = 0;
-    ci->size = 0;
-    ci->flag = 0;
-    ci->src = (const char*)(ci + 1);
-    ci->dst = ci->src + ssize;
-    snprintf((char*) ci->src, ssize, isdir ? "%s%s/" : "%s%s", spath, name);
-    snprintf((char*) ci->dst, dsize, isdir ? "%s%s/" : "%s%s", dpath, name);
+    if(!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
+        return;
 
-//    fprintf(stderr,"mkcopyinfo('%s','%s')\n", ci->src, ci->dst);
-    return ci;
+    if(args->root < 0)
+        args->root = copylist_add_dir(l, args->lpath, args->rpath);
+    ci = copylist_add(l, args->root, name);
+    ci->time = st.st_mtime;
+    ci->mode = st.st_mode;
+    ci->size = st.st_size;
+    ci->ino = st.st_ino;
 }
 
-
-static int local_build_list(copyinfo **filelist,
-                            const char *lpath, const char *rpath)
+/* whether the file at src is still what the last sync pushed */
+static int manifest_unchanged(manifest_entry *e, copyinfo *ci, const char *src)
 {
-    DIR *d;
-    struct dirent *de;
-    struct stat st;
-    copyinfo *dirlist = 0;
-    copyinfo *ci, *next;
+    unsigned char hash[SHA256_DIGEST_SIZE];
 
-//    fprintf(stderr,"local_build_list('%s','%s')\n", lpath, rpath);
+    if(e->mode != ci->mode || e->size != ci->size)
+        return 0;
+    if(e->time == ci->time)
+        return 1;
 
-    d = opendir(lpath);
-    if(d == 0) {
-        fprintf(stderr,"cannot open '%s': %s\n", lpath, strerror(errno));
-        return -1;
+        /* rebuilt with the same contents: keep the copy on the device */
+    if(S_ISREG(ci->mode) && e->hashed &&
+       hash_local_prefix(src, ci->size, hash) == 0 &&
+       !memcmp(hash, e->hash, sizeof(hash))) {
+        e->time = ci->time;
+        return 1;
     }
+    return 0;
+}
 
-    while((de = readdir(d))) {
-        char stat_path[PATH_MAX];
-        char *name = de->d_name;
+static void manifest_record(sync_manifest *m, copyinfo *ci, const char *src,
+                            const char *name)
+{
+    unsigned char hash[SHA256_DIGEST_SIZE];
+    int hashed = 0;
 
-        if(name[0] == '.') {
-            if(name[1] == 0) continue;
-            if((name[1] == '.') && (name[2] == 0)) continue;
-        }
+    if(S_ISREG(ci->mode))
+        hashed = hash_local_prefix(src, ci->size, hash) == 0;
+    manifest_update(m, name, ci->mode, ci->size, ci->time, hashed ? hash : 0);
+}
 
-        /*
-         * We could use d_type if HAVE_DIRENT_D_TYPE is defined, but reiserfs
-         * always returns DT_UNKNOWN, so we just use stat() for all cases.
-         */
-        if (strlen(lpath) + strlen(de->d_name) + 1 > sizeof(stat_path))
-            continue;
-        strcpy(stat_path, lpath);
-        strcat(stat_path, de->d_name);
-        stat(stat_path, &st);
-
-        if (S_ISDIR(st.st_mode)) {
-            ci = mkcopyinfo(lpath, rpath, name, 1);
-            ci->next = dirlist;
-            dirlist = ci;
-        } else {
-            ci = mkcopyinfo(lpath, rpath, name, 0);
-            if(lstat(ci->src, &st)) {
-                closedir(d);
-                fprintf(stderr,"cannot stat '%s': %s\n", ci->src, strerror(errno));
-                return -1;
-            }
-            if(!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) {
-                fprintf(stderr, "skipping special file '%s'\n", ci->src);
-                free(ci);
-            } else {
-                ci->time = st.st_mtime;
-                ci->mode = st.st_mode;
-                ci->size = st.st_size;
-                ci->next = *filelist;
-                *filelist = ci;
-            }
-        }
-    }
-
-    closedir(d);
-
-    for(ci = dirlist; ci != 0; ci = next) {
-        next = ci->next;
-        local_build_list(filelist, ci->src, ci->dst);
-        free(ci);
-    }
-
-    return 0;
-}
-
-
-static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath, int checktimestamps, int listonly)
+static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath,
+                                 int checktimestamps, int listonly, unsigned flags,
+                                 sync_manifest *manifest)
 {
-    copyinfo *filelist = 0;
-    copyinfo *ci, *next;
+    char src[PATH_MAX], dst[PATH_MAX];
+    copylist list;
+    copyinfo *ci;
+    unsigned n;
     int pushed = 0;
     int skipped = 0;
+    int journaled = 0;
+    int llen, ret = 1;
 
     if((lpath[0] == 0) || (rpath[0] == 0)) return -1;
-    if(lpath[strlen(lpath) - 1] != '/') {
-        int  tmplen = strlen(lpath)+2;
-        char *tmp = malloc(tmplen);
-        if(tmp == 0) return -1;
-        snprintf(tmp, tmplen, "%s/",lpath);
-        lpath = tmp;
-    }
-    if(rpath[strlen(rpath) - 1] != '/') {
-        int tmplen = strlen(rpath)+2;
-        char *tmp = malloc(tmplen);
-        if(tmp == 0) return -1;
-        snprintf(tmp, tmplen, "%s/",rpath);
-        rpath = tmp;
+
+    copylist_init(&list);
+    if(lpath[strlen(lpath) - 1] != '/')
+        lpath = arena_strcat(&list.arena, lpath, "/", "");
+    if(rpath[strlen(rpath) - 1] != '/')
+        rpath = arena_strcat(&list.arena, rpath, "/", "");
+
+    llen = strlen(lpath);
+
+    if(manifest) {
+        journal_args args;
+
+        args.manifest = manifest;
+        args.list = &list;
+        args.lpath = lpath;
+        args.rpath = rpath;
+        args.root = -1;
+        args.count = 0;
+        if(manifest_journal_read(manifest, journal_list_cb, &args) == 0) {
+            fprintf(stderr,"sync: %d path%s changed since the last sync\n",
+                    args.count, (args.count == 1) ? "" : "s");
+            journaled = 1;
+        } else {
+            manifest_clear_seen(manifest, "");
+        }
     }
 
-    if(local_build_list(&filelist, lpath, rpath)) {
+    if(!journaled && local_build_list(&list, lpath, rpath)) {
+        copylist_free(&list);
         return -1;
     }
+    copylist_sort(&list);
+
+        /* flag 1: leave alone, 2: push without asking the device */
+    if(manifest) {
+        for(n = 0; n < list.count; n++) {
+            manifest_entry *e;
+
+            ci = &list.files[n];
+            copyinfo_src(&list, ci, src);
+            e = manifest_lookup(manifest, src + llen);
+            if(e) {
+                e->seen = 1;
+                ci->flag = manifest_unchanged(e, ci, src) ? 1 : 2;
+            }
+        }
+    }
 
     if(checktimestamps){
-        for(ci = filelist; ci != 0; ci = ci->next) {
-            if(sync_start_readtime(fd, ci->dst)) {
-                return 1;
+        for(n = 0; n < list.count; n++) {
+            ci = &list.files[n];
+            if(ci->flag) continue;
+            if(sync_start_readtime(fd, copyinfo_dst(&list, ci, dst))) {
+                goto done;
             }
         }
-        for(ci = filelist; ci != 0; ci = ci->next) {
+        for(n = 0; n < list.count; n++) {
             unsigned int timestamp, mode, size;
+            ci = &list.files[n];
+            if(ci->flag) continue;
             if(sync_finish_readtime(fd, &timestamp, &mode, &size))
-                return 1;
-            if(size == ci->size) {
+                goto done;
+            if(size == (unsigned) ci->size) {
                 /* for links, we cannot update the atime/mtime */
                 if((S_ISREG(ci->mode & mode) && timestamp == ci->time) ||
                     (S_ISLNK(ci->mode & mode) && timestamp >= ci->time))
@@ -717,36 +1302,57 @@ static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath, i
             }
         }
     }
-    for(ci = filelist; ci != 0; ci = next) {
-        next = ci->next;
-        if(ci->flag == 0) {
-            fprintf(stderr,"%spush: %s -> %s\n", listonly ? "would " : "", ci->src, ci->dst);
+    for(n = 0; n < list.count; n++) {
+        ci = &list.files[n];
+        copyinfo_src(&list, ci, src);
+        if(ci->flag != 1) {
+            copyinfo_dst(&list, ci, dst);
+            fprintf(stderr,"%spush: %s -> %s\n", listonly ? "would " : "", src, dst);
             if(!listonly &&
-               sync_send(fd, ci->src, ci->dst, ci->time, ci->mode, 0 /* no verify APK */)){
-                return 1;
+               sync_send(fd, src, dst, ci->time, ci->mode, ci->size,
+                         flags, 0 /* no verify APK */)){
+                    /* keep what did get across, but not the journal
+                    ** position: the rest is still to do next time
+                    */
+                if(manifest)
+                    manifest_save(manifest);
+                goto done;
             }
+            if(manifest && !listonly)
+                manifest_record(manifest, ci, src, src + llen);
             pushed++;
         } else {
+            if(manifest && !listonly && !manifest_lookup(manifest, src + llen))
+                manifest_update(manifest, src + llen, ci->mode, ci->size, ci->time, 0);
             skipped++;
         }
-        free(ci);
+    }
+
+    if(manifest && !listonly) {
+        if(!journaled)
+            manifest_prune(manifest, "");
+        manifest_journal_commit(manifest);
+        manifest_save(manifest);
     }
 
     fprintf(stderr,"%d file%s pushed. %d file%s skipped.\n",
             pushed, (pushed == 1) ? "" : "s",
             skipped, (skipped == 1) ? "" : "s");
+    ret = 0;
 
-    return 0;
+done:
+    copylist_free(&list);
+    return ret;
 }
 
 
-int do_sync_push(const char *lpath, const char *rpath, int verifyApk)
+int do_sync_push(const char *lpath, const char *rpath, int verifyApk, unsigned flags)
 {
     struct stat st;
     unsigned mode;
     int fd;
 
-    fd = sdb_connect("sync:");
+    fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", sdb_error());
         return 1;
@@ -760,7 +1366,7 @@ int do_sync_push(const char *lpath, const char *rpath, int verifyApk)
 
     if(S_ISDIR(st.st_mode)) {
         BEGIN();
-        if(copy_local_dir_remote(fd, lpath, rpath, 0, 0)) {
+        if(copy_local_dir_remote(fd, lpath, rpath, 0, 0, flags, 0)) {
             return 1;
         } else {
             END();
@@ -787,7 +1393,8 @@ int do_sync_push(const char *lpath, const char *rpath, int verifyApk)
             rpath = tmp;
         }
         BEGIN();
-        if(sync_send(fd, lpath, rpath, st.st_mtime, st.st_mode, verifyApk)) {
+        if(sync_send(fd, lpath, rpath, st.st_mtime, st.st_mode, st.st_size,
+                     flags, verifyApk)) {
             return 1;
         } else {
             END();
@@ -800,117 +1407,666 @@ int do_sync_push(const char *lpath, const char *rpath, int verifyApk)
 }
 
 
+#ifndef _WIN32
+/* push to several devices at once.  the main thread reads every file
+** once into a ring of shared buffers; one thread per device writes each
+** buffer to its own sync connection as it is, and the buffer is reused
+** once all of them have.  a device that fails keeps draining the ring,
+** so that it never holds the others up.
+*/
+#define FANOUT_SLOTS  16
+
+enum { FANOUT_START, FANOUT_DATA, FANOUT_DONE, FANOUT_ABORT, FANOUT_END };
+
 typedef struct {
-    copyinfo **filelist;
-    copyinfo **dirlist;
+    int kind;
+    unsigned file;
+    syncsendbuf buf;    /* ID_DATA, or ID_DONE with the mtime */
+} fanout_slot;
+
+typedef struct {
+    sdb_mutex_t lock;
+    sdb_cond_t cond;
+    fanout_slot *slots;
+    unsigned refs[FANOUT_SLOTS];
+    unsigned produced;
+    int running;
+
+    copylist *list;
     const char *rpath;
-    const char *lpath;
+    int single;         /* one file: where it goes depends on the device */
+} fanout_stream;
+
+typedef struct {
+    fanout_stream *s;
+    const char *serial;
+    unsigned flags;
+    unsigned features;  /* SYNC_FEATURE_* of its sdbd */
+    int fd;
+    unsigned consumed;
+    int failed;
+    int pending;        /* the file whose status is still to be read, or -1 */
+    unsigned files;
+    long long bytes;
+    long long start, end;
+    char dst[PATH_MAX];
+    char error[256];
+} fanout_device;
+
+static void fanout_fail(fanout_device *d, const char *fmt, ...)
+{
+    va_list ap;
+
+    if(d->failed) return;
+    va_start(ap, fmt);
+    vsnprintf(d->error, sizeof(d->error), fmt, ap);
+    va_end(ap);
+    d->failed = 1;
+}
+
+static void fanout_finish(fanout_device *d)
+{
+    char src[PATH_MAX];
+    syncmsg msg;
+    char reason[257];
+    unsigned len;
+
+    if(d->pending < 0 || d->failed)
+        return;
+
+    if(readx(d->fd, &msg.status, sizeof(msg.status))) {
+        fanout_fail(d, "protocol failure");
+    } else if(msg.status.id == ID_OKAY) {
+        d->files++;
+    } else {
+        strcpy(reason, "unknown reason");
+        if(msg.status.id == ID_FAIL) {
+            len = ltohl(msg.status.msglen);
+            if(len > 256) len = 256;
+            if(readx(d->fd, reason, len) == 0)
+                reason[len] = 0;
+        }
+        copyinfo_src(d->s->list, &d->s->list->files[d->pending], src);
+        fanout_fail(d, "failed to copy '%s': %s", src, reason);
+    }
+    d->pending = -1;
+}
+
+static void fanout_start(fanout_device *d, unsigned file)
+{
+    copylist *l = d->s->list;
+    copyinfo *ci = &l->files[file];
+    char dst[PATH_MAX];
+    const char *path;
+    syncmsg msg, hdr;
+    char tmp[64];
+    int len, r;
+
+    fanout_finish(d);
+    if(d->failed) return;
+
+    path = d->s->single ? d->dst : copyinfo_dst(l, ci, dst);
+    len = strlen(path);
+    if(len > 1024) {
+        fanout_fail(d, "path too long: '%s'", path);
+        return;
+    }
+
+    if(S_ISREG(ci->mode) && (d->features & SYNC_FEATURE_SND2)) {
+        msg.req.id = ID_SND2;
+        msg.req.namelen = htoll(len);
+        hdr.send2.id = ID_SND2;
+        hdr.send2.mode = htoll(ci->mode);
+        hdr.send2.flags = htoll(d->flags);
+        hdr.send2.size_lo = htoll((unsigned) ci->size);
+        hdr.send2.size_hi = htoll((unsigned) (ci->size >> 32));
+        if(writex(d->fd, &msg.req, sizeof(msg.req)) || writex(d->fd, path, len) ||
+           writex(d->fd, &hdr.send2, sizeof(hdr.send2)))
+            fanout_fail(d, "protocol failure");
+    } else {
+        snprintf(tmp, sizeof(tmp), ",%d", ci->mode);
+        r = strlen(tmp);
+        msg.req.id = ID_SEND;
+        msg.req.namelen = htoll(len + r);
+        if(writex(d->fd, &msg.req, sizeof(msg.req)) || writex(d->fd, path, len) ||
+           writex(d->fd, tmp, r))
+            fanout_fail(d, "protocol failure");
+    }
+}
+
+/* work out where a single file goes on this device */
+static int fanout_single_dst(fanout_device *d)
+{
+    fanout_stream *s = d->s;
+    const char *name;
+    unsigned mode;
+
+    if(sync_readmode(d->fd, s->rpath, &mode)) {
+        fanout_fail(d, "protocol failure");
+        return -1;
+    }
+    if(mode != 0 && S_ISDIR(mode)) {
+        name = sdb_dirstop(s->list->files[0].name);
+        name = name ? name + 1 : s->list->files[0].name;
+        snprintf(d->dst, sizeof(d->dst), "%s/%s", s->rpath, name);
+    } else {
+        snprintf(d->dst, sizeof(d->dst), "%s", s->rpath);
+    }
+    return 0;
+}
+
+static void *fanout_thread(void *x)
+{
+    fanout_device *d = x;
+    fanout_stream *s = d->s;
+    fanout_slot *slot;
+    char src[PATH_MAX];
+    int kind;
+
+    d->start = NOW();
+    if(!d->failed) {
+        if(sync_features(d->fd, &d->features))
+            fanout_fail(d, "protocol failure");
+        else if(d->flags && !(d->features & SYNC_FEATURE_SND2))
+            fanout_fail(d, "sdbd on the device does not support -fsync or -atomic");
+    }
+    if(s->single && !d->failed)
+        fanout_single_dst(d);
+
+    do {
+        sdb_mutex_lock(&s->lock);
+        while(d->consumed == s->produced)
+            sdb_cond_wait(&s->cond, &s->lock);
+        sdb_mutex_unlock(&s->lock);
+
+        slot = &s->slots[d->consumed % FANOUT_SLOTS];
+        kind = slot->kind;
+        if(!d->failed) {
+            switch(kind) {
+            case FANOUT_START:
+                fanout_start(d, slot->file);
+                break;
+            case FANOUT_DATA:
+                if(writex(d->fd, &slot->buf, sizeof(unsigned) * 2 + ltohl(slot->buf.size)))
+                    fanout_fail(d, "protocol failure");
+                else
+                    d->bytes += ltohl(slot->buf.size);
+                break;
+            case FANOUT_DONE:
+                if(writex(d->fd, &slot->buf, sizeof(unsigned) * 2))
+                    fanout_fail(d, "protocol failure");
+                else
+                    d->pending = slot->file;
+                break;
+            case FANOUT_ABORT:
+                    /* the host could not read the file it started: the
+                    ** device is left with half of it, so this one has
+                    ** failed everywhere, and dropping the connection
+                    ** makes sdbd throw the half away.
+                    */
+                copyinfo_src(s->list, &s->list->files[slot->file], src);
+                fanout_fail(d, "failed to copy '%s': read error on the host", src);
+                break;
+            case FANOUT_END:
+                fanout_finish(d);
+                break;
+            }
+        }
+
+        sdb_mutex_lock(&s->lock);
+        if(--s->refs[d->consumed % FANOUT_SLOTS] == 0)
+            sdb_cond_broadcast(&s->cond);
+        d->consumed++;
+        sdb_mutex_unlock(&s->lock);
+    } while(kind != FANOUT_END);
+
+    if(d->fd >= 0) {
+        if(!d->failed)
+            sync_quit(d->fd);
+        else
+            sdb_close(d->fd);
+    }
+    d->end = NOW();
+
+    sdb_mutex_lock(&s->lock);
+    s->running--;
+    sdb_cond_broadcast(&s->cond);
+    sdb_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/* wait until the next slot is free and return it */
+static fanout_slot *fanout_next(fanout_stream *s)
+{
+    unsigned n = s->produced % FANOUT_SLOTS;
+
+    sdb_mutex_lock(&s->lock);
+    while(s->refs[n])
+        sdb_cond_wait(&s->cond, &s->lock);
+    sdb_mutex_unlock(&s->lock);
+    return &s->slots[n];
+}
+
+static void fanout_publish(fanout_stream *s, int nworkers)
+{
+    sdb_mutex_lock(&s->lock);
+    s->refs[s->produced % FANOUT_SLOTS] = nworkers;
+    s->produced++;
+    sdb_cond_broadcast(&s->cond);
+    sdb_mutex_unlock(&s->lock);
+}
+
+/* tell every device that the file just started can't be finished */
+static void fanout_abort(fanout_stream *s, int nworkers, unsigned file)
+{
+    fanout_slot *slot = fanout_next(s);
+
+    slot->kind = FANOUT_ABORT;
+    slot->file = file;
+    fanout_publish(s, nworkers);
+}
+
+/* feed one file into the ring; -1 if it could not be read through */
+static int fanout_file(fanout_stream *s, int nworkers, unsigned file)
+{
+    copyinfo *ci = &s->list->files[file];
+    char src[PATH_MAX];
+    fanout_slot *slot;
+    int lfd = -1, n = 0, r, err = 0;
+
+    copyinfo_src(s->list, ci, src);
+#ifndef HAVE_SYMLINKS
+    if(S_ISLNK(ci->mode)) {
+        fprintf(stderr,"skipping symlink '%s'\n", src);
+        return 1;
+    }
+#endif
+    if(S_ISREG(ci->mode)) {
+        lfd = sdb_open(src, O_RDONLY);
+        if(lfd < 0) {
+            fprintf(stderr,"cannot open '%s': %s\n", src, strerror(errno));
+            return 1;
+        }
+    }
+
+    slot = fanout_next(s);
+    slot->kind = FANOUT_START;
+    slot->file = file;
+    fanout_publish(s, nworkers);
+
+#ifdef HAVE_SYMLINKS
+    if(S_ISLNK(ci->mode)) {
+        slot = fanout_next(s);
+        r = readlink(src, slot->buf.data, SYNC_DATA_MAX - 1);
+        if(r < 0) {
+            fprintf(stderr,"cannot read link '%s': %s\n", src, strerror(errno));
+            fanout_abort(s, nworkers, file);
+            return -1;
+        }
+        slot->buf.data[r] = 0;
+        slot->kind = FANOUT_DATA;
+        slot->buf.id = ID_DATA;
+        slot->buf.size = htoll(r + 1);
+        fanout_publish(s, nworkers);
+        total_bytes += r + 1;
+    }
+#endif
+
+    while(lfd >= 0) {
+        slot = fanout_next(s);
+        for(n = 0; n < SYNC_DATA_MAX; ) {
+            r = sdb_read(lfd, slot->buf.data + n, SYNC_DATA_MAX - n);
+            if(r > 0) {
+                n += r;
+                continue;
+            }
+            if(r < 0 && errno == EINTR) continue;
+            if(r < 0) err = errno;
+            break;
+        }
+        if(err) {
+            fprintf(stderr,"cannot read '%s': %s\n", src, strerror(err));
+            sdb_close(lfd);
+            fanout_abort(s, nworkers, file);
+            return -1;
+        }
+        if(n == 0)
+            break;
+        slot->kind = FANOUT_DATA;
+        slot->buf.id = ID_DATA;
+        slot->buf.size = htoll(n);
+        fanout_publish(s, nworkers);
+        total_bytes += n;
+    }
+    if(lfd >= 0)
+        sdb_close(lfd);
+
+    slot = fanout_next(s);
+    slot->kind = FANOUT_DONE;
+    slot->file = file;
+    slot->buf.id = ID_DONE;
+    slot->buf.size = htoll(ci->time);
+    fanout_publish(s, nworkers);
+    return 0;
+}
+
+int do_sync_push_fanout(int nserials, const char **serials,
+                        const char *lpath, const char *rpath, unsigned flags)
+{
+    fanout_stream s;
+    fanout_device *devs;
+    sdb_thread_t t;
+    copylist list;
+    copyinfo *ci;
+    struct stat st;
+    char src[PATH_MAX], dst[PATH_MAX];
+    unsigned n;
+    int i, r, ret = 0, failed = 0;
+
+    if(stat(lpath, &st)) {
+        fprintf(stderr,"cannot stat '%s': %s\n", lpath, strerror(errno));
+        return 1;
+    }
+
+    copylist_init(&list);
+    memset(&s, 0, sizeof(s));
+    s.list = &list;
+    s.rpath = rpath;
+    if(S_ISDIR(st.st_mode)) {
+        if(local_build_list(&list, arena_strcat(&list.arena, lpath, "/", ""),
+                            arena_strcat(&list.arena, rpath, "/", ""))) {
+            copylist_free(&list);
+            return 1;
+        }
+        copylist_sort(&list);
+    } else {
+        copylist_add_dir(&list, "", "");
+        ci = copylist_add(&list, 0, lpath);
+        ci->time = st.st_mtime;
+        ci->mode = st.st_mode;
+        ci->size = st.st_size;
+        s.single = 1;
+    }
+
+    s.slots = malloc(FANOUT_SLOTS * sizeof(fanout_slot));
+    devs = calloc(nserials, sizeof(fanout_device));
+    if(s.slots == 0 || devs == 0) {
+        fprintf(stderr,"out of memory\n");
+        abort();
+    }
+    sdb_mutex_init(&s.lock, NULL);
+    sdb_cond_init(&s.cond, NULL);
+
+    BEGIN();
+    for(i = 0; i < nserials; i++) {
+        fanout_device *d = &devs[i];
+
+        d->s = &s;
+        d->serial = serials[i];
+        d->flags = flags;
+        d->pending = -1;
+        d->fd = sdb_connect_to(d->serial, "sync:", d->error, sizeof(d->error));
+        sync_forget(d->fd);
+        if(d->fd < 0)
+            d->failed = 1;
+        if(sdb_thread_create(&t, fanout_thread, d)) {
+            fprintf(stderr,"cannot create thread for %s\n", d->serial);
+            abort();
+        }
+        s.running++;
+    }
+
+    for(n = 0; n < list.count; n++) {
+        ci = &list.files[n];
+        copyinfo_src(&list, ci, src);
+        if(s.single)
+            fprintf(stderr,"push: %s -> %s\n", src, rpath);
+        else
+            fprintf(stderr,"push: %s -> %s\n", src, copyinfo_dst(&list, ci, dst));
+        r = fanout_file(&s, nserials, n);
+        if(r < 0) {
+                /* the devices have half a file: stop here */
+            ret = 1;
+            break;
+        }
+        ret |= r;
+    }
+    fanout_next(&s)->kind = FANOUT_END;
+    fanout_publish(&s, nserials);
+
+    sdb_mutex_lock(&s.lock);
+    while(s.running)
+        sdb_cond_wait(&s.cond, &s.lock);
+    sdb_mutex_unlock(&s.lock);
+
+    fprintf(stderr,"read %u bytes once for %d device%s\n",
+            total_bytes, nserials, nserials == 1 ? "" : "s");
+    for(i = 0; i < nserials; i++) {
+        fanout_device *d = &devs[i];
+        long long elapsed = d->end - d->start;
+
+        if(d->failed) {
+            fprintf(stderr,"%s: error: %s (%u file%s pushed)\n", d->serial, d->error,
+                    d->files, d->files == 1 ? "" : "s");
+            failed++;
+        } else {
+            if(elapsed <= 0) elapsed = 1;
+            fprintf(stderr,"%s: %u file%s pushed, %lld KB/s (%lld bytes in %lld.%03llds)\n",
+                    d->serial, d->files, d->files == 1 ? "" : "s",
+                    (d->bytes * 1000000LL / elapsed) / 1024LL, d->bytes,
+                    elapsed / 1000000LL, (elapsed % 1000000LL) / 1000LL);
+        }
+    }
+    if(nserials > 1)
+        fprintf(stderr,"%d of %d devices ok\n", nserials - failed, nserials);
+
+    sdb_cond_destroy(&s.cond);
+    sdb_mutex_destroy(&s.lock);
+    free(devs);
+    free(s.slots);
+    copylist_free(&list);
+    return (ret || failed) ? 1 : 0;
+}
+#else
+int do_sync_push_fanout(int nserials, const char **serials,
+                        const char *lpath, const char *rpath, unsigned flags)
+{
+    fprintf(stderr,"error: pushing to several devices at once is not supported on this platform\n");
+    return 1;
+}
+#endif /* !_WIN32 */
+
+
+typedef void (*sync_rls_cb)(unsigned mode, long long size, unsigned time, const char *name, void *cookie);
+
+/* list the whole tree under path with a single ID_RLST; names handed to
+** func are relative to path.  returns 1, with the connection still
+** usable, if the device answered with ID_FAIL.
+*/
+int sync_rls(int fd, const char *path, sync_rls_cb func, void *cookie)
+{
+    syncmsg msg;
+    char *buf = send_buffer.data;
+    char name[PATH_MAX];
+    unsigned size, pos;
+    int len;
+
+    len = strlen(path);
+    if(len > 1024) goto fail;
+
+    msg.req.id = ID_RLST;
+    msg.req.namelen = htoll(len);
+
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, path, len)) {
+        goto fail;
+    }
+
+    for(;;) {
+        if(readx(fd, &msg.data, sizeof(msg.data))) break;
+        if(msg.data.id == ID_DONE) return 0;
+
+        size = ltohl(msg.data.size);
+        if(size > SYNC_DATA_MAX) break;
+        if(readx(fd, buf, size)) break;
+
+        if(msg.data.id == ID_FAIL)
+            return 1;
+        if(msg.data.id != ID_RDNT) break;
+
+        for(pos = 0; pos + sizeof(syncrdent) <= size; ) {
+            syncrdent ent;
+
+            memcpy(&ent, buf + pos, sizeof(ent));
+            pos += sizeof(ent);
+            len = ltohl(ent.namelen);
+            if(len >= PATH_MAX || pos + len > size) goto fail;
+            memcpy(name, buf + pos, len);
+            name[len] = 0;
+            pos += len;
+
+            func(ltohl(ent.mode),
+                 ((long long) ltohl(ent.size_hi) << 32) | ltohl(ent.size_lo),
+                 ltohl(ent.time),
+                 name, cookie);
+        }
+    }
+
+fail:
+    sdb_close(fd);
+    return -1;
+}
+
+typedef struct {
+    copylist *list;
+    unsigned dir;
 } sync_ls_build_list_cb_args;
 
 void
-sync_ls_build_list_cb(unsigned mode, unsigned size, unsigned time,
+sync_ls_build_list_cb(unsigned mode, long long size, unsigned time,
                       const char *name, void *cookie)
 {
     sync_ls_build_list_cb_args *args = (sync_ls_build_list_cb_args *)cookie;
     copyinfo *ci;
 
+        /* directories come with their contents, nothing to do for them */
     if (S_ISDIR(mode)) {
-        copyinfo **dirlist = args->dirlist;
+        return;
+    } else if (S_ISREG(mode) || S_ISLNK(mode)) {
+        ci = copylist_add(args->list, args->dir, name);
+        ci->time = time;
+        ci->mode = mode;
+        ci->size = size;
+    } else {
+        fprintf(stderr, "skipping special file '%s'\n", name);
+    }
+}
+
+static void
+sync_ls_walk_cb(unsigned mode, unsigned size, unsigned time,
+                const char *name, void *cookie)
+{
+    sync_ls_build_list_cb_args *args = (sync_ls_build_list_cb_args *)cookie;
+    copylist *list = args->list;
 
+    if (S_ISDIR(mode)) {
         /* Don't try recursing down "." or ".." */
         if (name[0] == '.') {
             if (name[1] == '\0') return;
             if ((name[1] == '.') && (name[2] == '\0')) return;
         }
-
-        ci = mkcopyinfo(args->rpath, args->lpath, name, 1);
-        ci->next = *dirlist;
-        *dirlist = ci;
-    } else if (S_ISREG(mode) || S_ISLNK(mode)) {
-        copyinfo **filelist = args->filelist;
-
-        ci = mkcopyinfo(args->rpath, args->lpath, name, 0);
-        ci->time = time;
-        ci->mode = mode;
-        ci->size = size;
-        ci->next = *filelist;
-        *filelist = ci;
+        copylist_add_dir(list,
+                         arena_strcat(&list->arena, list->dirs[args->dir].src, name, "/"),
+                         arena_strcat(&list->arena, list->dirs[args->dir].dst, name, "/"));
     } else {
-        fprintf(stderr, "skipping special file '%s'\n", name);
+        sync_ls_build_list_cb(mode, size, time, name, cookie);
     }
 }
 
-static int remote_build_list(int syncfd, copyinfo **filelist,
-                             const char *rpath, const char *lpath)
+static int remote_build_list(int syncfd, copylist *list,
+                             const char *rpath, const char *lpath,
+                             int filtered)
 {
-    copyinfo *dirlist = NULL;
     sync_ls_build_list_cb_args args;
+    unsigned features, root, count = list->count;
+    int r = 1;
+
+    args.list = list;
+    args.dir = root = copylist_add_dir(list, rpath, lpath);
+
+    if (sync_features(syncfd, &features)) {
+        fprintf(stderr, "protocol failure\n");
+        sdb_close(syncfd);
+        return 1;
+    }
 
-    args.filelist = filelist;
-    args.dirlist = &dirlist;
-    args.rpath = rpath;
-    args.lpath = lpath;
+    /* Put every file below rpath on the list in one request. */
+    if (features & SYNC_FEATURE_RLST) {
+        r = sync_rls(syncfd, rpath, sync_ls_build_list_cb, (void *)&args);
+        if (r < 0)
+            return 1;
+        if (r == 0)
+            return 0;
+        list->count = count;
+    }
 
-    /* Put the files/dirs in rpath on the lists. */
-    if (sync_ls(syncfd, rpath, sync_ls_build_list_cb, (void *)&args)) {
+    /* sdbd applies the filter to ID_RLST walks only: listing the tree
+    ** any other way would pull everything. */
+    if (filtered) {
+        fprintf(stderr, "sdbd could not list '%s' in one walk, so the filters cannot be applied\n", rpath);
         return 1;
     }
 
-    /* Recurse into each directory we found. */
-    while (dirlist != NULL) {
-        copyinfo *next = dirlist->next;
-        if (remote_build_list(syncfd, filelist, dirlist->src, dirlist->dst)) {
+    /* An older sdbd, or one that couldn't walk the whole tree: list it
+    ** one directory at a time, breadth first. */
+    for (args.dir = root; args.dir < list->ndirs; args.dir++) {
+        if (sync_ls(syncfd, list->dirs[args.dir].src, sync_ls_walk_cb, (void *)&args)) {
             return 1;
         }
-        free(dirlist);
-        dirlist = next;
     }
 
     return 0;
 }
 
 static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
-                                 int checktimestamps)
+                                 int checktimestamps, int filtered)
 {
-    copyinfo *filelist = 0;
-    copyinfo *ci, *next;
+    char src[PATH_MAX], dst[PATH_MAX];
+    copylist list;
+    copyinfo *ci;
+    unsigned n;
     int pulled = 0;
     int skipped = 0;
+    int ret = 1;
 
     /* Make sure that both directory paths end in a slash. */
     if (rpath[0] == 0 || lpath[0] == 0) return -1;
-    if (rpath[strlen(rpath) - 1] != '/') {
-        int  tmplen = strlen(rpath) + 2;
-        char *tmp = malloc(tmplen);
-        if (tmp == 0) return -1;
-        snprintf(tmp, tmplen, "%s/", rpath);
-        rpath = tmp;
-    }
-    if (lpath[strlen(lpath) - 1] != '/') {
-        int  tmplen = strlen(lpath) + 2;
-        char *tmp = malloc(tmplen);
-        if (tmp == 0) return -1;
-        snprintf(tmp, tmplen, "%s/", lpath);
-        lpath = tmp;
-    }
+    copylist_init(&list);
+    if (rpath[strlen(rpath) - 1] != '/')
+        rpath = arena_strcat(&list.arena, rpath, "/", "");
+    if (lpath[strlen(lpath) - 1] != '/')
+        lpath = arena_strcat(&list.arena, lpath, "/", "");
 
     fprintf(stderr, "pull: building file list...\n");
     /* Recursively build the list of files to copy. */
-    if (remote_build_list(fd, &filelist, rpath, lpath)) {
+    if (remote_build_list(fd, &list, rpath, lpath, filtered)) {
+        copylist_free(&list);
         return -1;
     }
 
 #if 0
     if (checktimestamps) {
-        for (ci = filelist; ci != 0; ci = ci->next) {
-            if (sync_start_readtime(fd, ci->dst)) {
-                return 1;
+        for (n = 0; n < list.count; n++) {
+            ci = &list.files[n];
+            if (sync_start_readtime(fd, copyinfo_dst(&list, ci, dst))) {
+                goto done;
             }
         }
-        for (ci = filelist; ci != 0; ci = ci->next) {
+        for (n = 0; n < list.count; n++) {
             unsigned int timestamp, mode, size;
+            ci = &list.files[n];
             if (sync_finish_readtime(fd, &timestamp, &mode, &size))
-                return 1;
+                goto done;
             if (size == ci->size) {
                 /* for links, we cannot update the atime/mtime */
                 if ((S_ISREG(ci->mode & mode) && timestamp == ci->time) ||
@@ -920,35 +2076,107 @@ static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
         }
     }
 #endif
-    for (ci = filelist; ci != 0; ci = next) {
-        next = ci->next;
+    for (n = 0; n < list.count; n++) {
+        ci = &list.files[n];
         if (ci->flag == 0) {
-            fprintf(stderr, "pull: %s -> %s\n", ci->src, ci->dst);
-            if (sync_recv(fd, ci->src, ci->dst)) {
-                return 1;
+            copyinfo_src(&list, ci, src);
+            copyinfo_dst(&list, ci, dst);
+            fprintf(stderr, "pull: %s -> %s\n", src, dst);
+            if (sync_recv(fd, src, dst)) {
+                goto done;
             }
             pulled++;
         } else {
             skipped++;
         }
-        free(ci);
     }
 
     fprintf(stderr, "%d file%s pulled. %d file%s skipped.\n",
             pulled, (pulled == 1) ? "" : "s",
             skipped, (skipped == 1) ? "" : "s");
+    ret = 0;
 
+done:
+    copylist_free(&list);
+    return ret;
+}
+
+/* install the device-side filter for the walks that follow on fd */
+static int sync_set_filter(int fd, const char *spec)
+{
+    syncmsg msg;
+    char buf[257];
+    unsigned features;
+    int len;
+
+    len = strlen(spec);
+    if(len > 1024) {
+        fprintf(stderr,"filter rules too long\n");
+        return -1;
+    }
+    if(sync_features(fd, &features)) {
+        fprintf(stderr,"protocol failure\n");
+        return -1;
+    }
+    if(!(features & SYNC_FEATURE_FILT)) {
+        fprintf(stderr,"sdbd on the device does not support filters\n");
+        return -1;
+    }
+
+    msg.req.id = ID_FILT;
+    msg.req.namelen = htoll(len);
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, spec, len) ||
+       readx(fd, &msg.status, sizeof(msg.status))) {
+        fprintf(stderr,"protocol failure\n");
+        return -1;
+    }
+
+    if(msg.status.id != ID_OKAY) {
+        if(msg.status.id != ID_FAIL) {
+            fprintf(stderr,"protocol failure\n");
+            return -1;
+        }
+        len = ltohl(msg.status.msglen);
+        if(len > 256) len = 256;
+        if(readx(fd, buf, len))
+            return -1;
+        buf[len] = 0;
+        fprintf(stderr,"bad filter: %s\n", buf);
+        return -1;
+    }
     return 0;
 }
 
-int do_sync_pull(const char *rpath, const char *lpath)
+/* if we're copying a remote file to a local directory,
+** we *really* want to copy to localdir + "/" + remotefilename
+*/
+static const char *local_file_target(const char *rpath, const char *lpath)
 {
-    unsigned mode;
     struct stat st;
 
+    if(stat(lpath, &st) == 0 && S_ISDIR(st.st_mode)) {
+        const char *name = sdb_dirstop(rpath);
+        if(name == 0) {
+            name = rpath;
+        } else {
+            name++;
+        }
+        int  tmplen = strlen(name) + strlen(lpath) + 2;
+        char *tmp = malloc(tmplen);
+        if(tmp == 0) return 0;
+        snprintf(tmp, tmplen, "%s/%s", lpath, name);
+        lpath = tmp;
+    }
+    return lpath;
+}
+
+int do_sync_pull(const char *rpath, const char *lpath, const char *filter)
+{
+    unsigned mode;
     int fd;
 
-    fd = sdb_connect("sync:");
+    fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", sdb_error());
         return 1;
@@ -963,24 +2191,13 @@ int do_sync_pull(const char *rpath, const char *lpath)
     }
 
     if(S_ISREG(mode) || S_ISLNK(mode) || S_ISCHR(mode) || S_ISBLK(mode)) {
-        if(stat(lpath, &st) == 0) {
-            if(S_ISDIR(st.st_mode)) {
-                    /* if we're copying a remote file to a local directory,
-                    ** we *really* want to copy to localdir + "/" + remotefilename
-                    */
-                const char *name = sdb_dirstop(rpath);
-                if(name == 0) {
-                    name = rpath;
-                } else {
-                    name++;
-                }
-                int  tmplen = strlen(name) + strlen(lpath) + 2;
-                char *tmp = malloc(tmplen);
-                if(tmp == 0) return 1;
-                snprintf(tmp, tmplen, "%s/%s", lpath, name);
-                lpath = tmp;
-            }
+        if(filter) {
+            fprintf(stderr,"filters apply to directories only, '%s' is not one\n", rpath);
+            sdb_close(fd);
+            return 1;
         }
+        lpath = local_file_target(rpath, lpath);
+        if(lpath == 0) return 1;
         BEGIN();
         if(sync_recv(fd, rpath, lpath)) {
             return 1;
@@ -990,8 +2207,12 @@ int do_sync_pull(const char *rpath, const char *lpath)
             return 0;
         }
     } else if(S_ISDIR(mode)) {
+        if(filter && sync_set_filter(fd, filter)) {
+            sdb_close(fd);
+            return 1;
+        }
         BEGIN();
-        if (copy_remote_dir_local(fd, rpath, lpath, 0)) {
+        if (copy_remote_dir_local(fd, rpath, lpath, 0, filter != 0)) {
             return 1;
         } else {
             END();
@@ -1004,18 +2225,231 @@ int do_sync_pull(const char *rpath, const char *lpath)
     }
 }
 
-int do_sync_sync(const char *lpath, const char *rpath, int listonly)
+/* pull part of a remote file: length bytes (< 0: to the end) from offset,
+** or from offset bytes before the end with SYNC_RECV_TAIL.  with resume
+** set the offset is the size of the local copy, which gets extended.
+*/
+int do_sync_pull_range(const char *rpath, const char *lpath, long long offset,
+                       long long length, unsigned flags, int resume)
+{
+    unsigned mode, features;
+    struct stat st;
+    int fd, r;
+
+    fd = sync_connect();
+    if(fd < 0) {
+        fprintf(stderr,"error: %s\n", sdb_error());
+        return 1;
+    }
+
+    if(sync_readmode(fd, rpath, &mode)) {
+        return 1;
+    }
+    if(mode == 0) {
+        fprintf(stderr,"remote object '%s' does not exist\n", rpath);
+        return 1;
+    }
+    if(!S_ISREG(mode) && !S_ISLNK(mode) && !S_ISCHR(mode) && !S_ISBLK(mode)) {
+        fprintf(stderr,"remote object '%s' not a file\n", rpath);
+        return 1;
+    }
+
+    lpath = local_file_target(rpath, lpath);
+    if(lpath == 0) return 1;
+    if(resume)
+        offset = (stat(lpath, &st) == 0) ? st.st_size : 0;
+
+    if(sync_features(fd, &features)) {
+        fprintf(stderr,"protocol failure\n");
+        return 1;
+    }
+    if(!(features & SYNC_FEATURE_RCV2) && (offset > 0 || length >= 0 || flags)) {
+        fprintf(stderr,"sdbd on the device does not support ranged pulls\n");
+        sync_quit(fd);
+        return 1;
+    }
+
+    BEGIN();
+    if(features & SYNC_FEATURE_RCV2)
+        r = sync_recv_range(fd, rpath, lpath, offset, length, flags, resume);
+    else
+        r = sync_recv(fd, rpath, lpath);
+    if(r) {
+        return 1;
+    }
+    END();
+    sync_quit(fd);
+    return 0;
+}
+
+static int sync_archive_request(int fd, unsigned id, const char *path)
 {
+    syncmsg msg;
+    int len;
+
+    len = strlen(path);
+    if(len > 1024) return -1;
+
+    msg.req.id = id;
+    msg.req.namelen = htoll(len);
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, path, len)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void sync_archive_report(const char *verb, archive_stats *stats)
+{
+    fprintf(stderr,"%u file%s, %u link%s and %u director%s %s. %u special file%s skipped.\n",
+            stats->files, (stats->files == 1) ? "" : "s",
+            stats->links, (stats->links == 1) ? "" : "s",
+            stats->dirs, (stats->dirs == 1) ? "y" : "ies", verb,
+            stats->skipped, (stats->skipped == 1) ? "" : "s");
+}
+
+/* push a local directory tree as one archive stream (ID_ASND), instead
+** of one SEND round trip per file.
+*/
+int do_sync_push_archive(const char *lpath, const char *rpath)
+{
+    archive_stats stats;
+    syncmsg msg;
+    char error[256];
+    struct stat st;
+    unsigned features;
+    int fd, r, len;
+
+    if(stat(lpath, &st)) {
+        fprintf(stderr,"cannot stat '%s': %s\n", lpath, strerror(errno));
+        return 1;
+    }
+    if(!S_ISDIR(st.st_mode))
+        return do_sync_push(lpath, rpath, 0 /* no verify APK */, 0);
+
+    fd = sync_connect();
+    if(fd < 0) {
+        fprintf(stderr,"error: %s\n", sdb_error());
+        return 1;
+    }
+    if(sync_features(fd, &features))
+        goto fail;
+    if(!(features & SYNC_FEATURE_ARCHIVE)) {
+        fprintf(stderr,"sdbd on the device does not take archives, copying file by file\n");
+        sync_quit(fd);
+        return do_sync_push(lpath, rpath, 0 /* no verify APK */, 0);
+    }
+
+    BEGIN();
+    if(sync_archive_request(fd, ID_ASND, rpath))
+        goto fail;
+    r = archive_send(fd, lpath, 0, 0, &stats, error, sizeof(error));
+    if(r < 0)
+        goto fail;
+
+        /* the device answers even when we gave up half way */
+    if(readx(fd, &msg.status, sizeof(msg.status)))
+        goto fail;
+    if(msg.status.id != ID_OKAY) {
+        if(msg.status.id != ID_FAIL)
+            goto fail;
+        len = ltohl(msg.status.msglen);
+        if(len > 255) len = 255;
+        if(readx(fd, error, len))
+            goto fail;
+        error[len] = 0;
+        r = 1;
+    }
+    if(r) {
+        fprintf(stderr,"failed to copy '%s' to '%s': %s\n", lpath, rpath, error);
+        sdb_close(fd);
+        return 1;
+    }
+
+    total_bytes = stats.bytes;
+    sync_archive_report("pushed", &stats);
+    END();
+    sync_quit(fd);
+    return 0;
+
+fail:
+    fprintf(stderr,"protocol failure\n");
+    sdb_close(fd);
+    return 1;
+}
+
+/* pull a remote directory tree as one archive stream (ID_ARCV) */
+int do_sync_pull_archive(const char *rpath, const char *lpath, const char *filter)
+{
+    archive_stats stats;
+    char error[256];
+    unsigned features;
+    int fd, r;
+
+    fd = sync_connect();
+    if(fd < 0) {
+        fprintf(stderr,"error: %s\n", sdb_error());
+        return 1;
+    }
+    if(sync_features(fd, &features)) {
+        fprintf(stderr,"protocol failure\n");
+        sdb_close(fd);
+        return 1;
+    }
+    if(!(features & SYNC_FEATURE_ARCHIVE)) {
+        fprintf(stderr,"sdbd on the device does not send archives, copying file by file\n");
+        sync_quit(fd);
+        return do_sync_pull(rpath, lpath, filter);
+    }
+
+    if(filter && sync_set_filter(fd, filter)) {
+        sdb_close(fd);
+        return 1;
+    }
+
+    BEGIN();
+    if(sync_archive_request(fd, ID_ARCV, rpath)) {
+        fprintf(stderr,"protocol failure\n");
+        sdb_close(fd);
+        return 1;
+    }
+    r = archive_receive(fd, lpath, &stats, error, sizeof(error));
+    if(r) {
+        if(r < 0 && error[0] == 0)
+            strcpy(error, "protocol failure");
+        fprintf(stderr,"failed to copy '%s' to '%s': %s\n", rpath, lpath, error);
+        sdb_close(fd);
+        return 1;
+    }
+
+    total_bytes = stats.bytes;
+    sync_archive_report("pulled", &stats);
+    END();
+    sync_quit(fd);
+    return 0;
+}
+
+int do_sync_sync(const char *lpath, const char *rpath, const char *serial,
+                 int listonly, unsigned flags)
+{
+    sync_manifest *manifest = 0;
+    int r;
+
     fprintf(stderr,"syncing %s...\n",rpath);
 
-    int fd = sdb_connect("sync:");
+    int fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", sdb_error());
         return 1;
     }
 
+    if(serial)
+        manifest = manifest_load(serial, lpath, rpath);
+
     BEGIN();
-    if(copy_local_dir_remote(fd, lpath, rpath, 1, listonly)){
+    r = copy_local_dir_remote(fd, lpath, rpath, 1, listonly, flags, manifest);
+    manifest_free(manifest);
+    if(r){
         return 1;
     } else {
         END();
@@ -1023,3 +2457,66 @@ int do_sync_sync(const char *lpath, const char *rpath, int listonly)
         return 0;
     }
 }
+
+/* copy sserial:spath to every tserials[n]:tpaths[n] through the server,
+** which streams it from one device to the others (host:relay)
+*/
+int do_sync_relay(const char *sserial, const char *spath,
+                  int ntargets, const char **tserials, const char **tpaths)
+{
+    char buf[4096 + 5];
+    char line[1024];
+    int fd, len, n, pos = 0, r = 1;
+
+    len = snprintf(buf + 4, sizeof(buf) - 4, "%s\n%s\n", sserial, spath);
+    for(n = 0; n < ntargets && len < (int) sizeof(buf) - 4; n++)
+        len += snprintf(buf + 4 + len, sizeof(buf) - 4 - len, "%s\n%s\n",
+                        tserials[n], tpaths[n]);
+    if(len > 4096) {
+        fprintf(stderr,"error: relay request too long\n");
+        return 1;
+    }
+    snprintf(line, sizeof(line), "%04x", len);
+    memcpy(buf, line, 4);
+
+    fd = sdb_connect("host:relay");
+    if(fd < 0) {
+        fprintf(stderr,"error: %s\n", sdb_error());
+        return 1;
+    }
+    if(writex(fd, buf, len + 4)) {
+        fprintf(stderr,"protocol failure\n");
+        sdb_close(fd);
+        return 1;
+    }
+
+    BEGIN();
+    for(;;) {
+        if(pos == (int) sizeof(line) - 1 || sdb_read(fd, line + pos, 1) != 1) {
+            if(pos == 0) break;
+            line[pos] = '\n';
+        }
+        if(line[pos] != '\n') {
+            pos++;
+            continue;
+        }
+        line[pos] = 0;
+        pos = 0;
+
+        if(!strncmp(line, "ok ", 3)) {
+            unsigned files = 0;
+            long long bytes = 0;
+            sscanf(line + 3, "%u %lld", &files, &bytes);
+            total_bytes = bytes;
+            fprintf(stderr,"%u file(s) relayed to %d target(s).\n", files, ntargets);
+            END();
+            r = 0;
+        } else if(!strncmp(line, "fail ", 5)) {
+            fprintf(stderr,"relay failed: %s\n", line + 5);
+        } else {
+            fprintf(stderr,"%s\n", line);
+        }
+    }
+    sdb_close(fd);
+    return r;
+}
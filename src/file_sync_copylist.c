@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "file_sync_copylist.h"
+
+#define ARENA_CHUNK (64*1024)
+
+struct arena_chunk
+{
+    arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[1];
+};
+
+static char *arena_alloc(arena_chunk **arena, size_t len)
+{
+    arena_chunk *c = *arena;
+    char *p;
+
+    if(c == 0 || c->size - c->used < len) {
+        size_t size = len > ARENA_CHUNK ? len : ARENA_CHUNK;
+        c = malloc(sizeof(arena_chunk) + size);
+        if(c == 0) {
+            fprintf(stderr,"out of memory\n");
+            abort();
+        }
+        c->next = *arena;
+        c->used = 0;
+        c->size = size;
+        *arena = c;
+    }
+    p = c->data + c->used;
+    c->used += len;
+    return p;
+}
+
+const char *arena_strcat(arena_chunk **arena, const char *a,
+                         const char *b, const char *c)
+{
+    size_t alen = strlen(a), blen = strlen(b), clen = strlen(c);
+    char *p = arena_alloc(arena, alen + blen + clen + 1);
+
+    memcpy(p, a, alen);
+    memcpy(p + alen, b, blen);
+    memcpy(p + alen + blen, c, clen + 1);
+    return p;
+}
+
+void copylist_init(copylist *l)
+{
+    memset(l, 0, sizeof(copylist));
+}
+
+void copylist_free(copylist *l)
+{
+    arena_chunk *c, *next;
+
+    for(c = l->arena; c != 0; c = next) {
+        next = c->next;
+        free(c);
+    }
+    free(l->dirs);
+    free(l->files);
+    copylist_init(l);
+}
+
+static void *copylist_grow(void *array, unsigned *max, size_t size)
+{
+    *max = *max ? *max * 2 : 1024;
+    array = realloc(array, *max * size);
+    if(array == 0) {
+        fprintf(stderr,"out of memory\n");
+        abort();
+    }
+    return array;
+}
+
+unsigned copylist_add_dir(copylist *l, const char *src, const char *dst)
+{
+    if(l->ndirs == l->maxdirs)
+        l->dirs = copylist_grow(l->dirs, &l->maxdirs, sizeof(copydir));
+    l->dirs[l->ndirs].src = arena_strcat(&l->arena, src, "", "");
+    l->dirs[l->ndirs].dst = arena_strcat(&l->arena, dst, "", "");
+    return l->ndirs++;
+}
+
+copyinfo *copylist_add(copylist *l, unsigned dir, const char *name)
+{
+    copyinfo *ci;
+
+    if(l->count == l->max)
+        l->files = copylist_grow(l->files, &l->max, sizeof(copyinfo));
+    ci = &l->files[l->count++];
+    memset(ci, 0, sizeof(copyinfo));
+    ci->dir = dir;
+    ci->name = arena_strcat(&l->arena, name, "", "");
+    return ci;
+}
+
+const char *copyinfo_src(copylist *l, copyinfo *ci, char *buf)
+{
+    snprintf(buf, PATH_MAX, "%s%s", l->dirs[ci->dir].src, ci->name);
+    return buf;
+}
+
+const char *copyinfo_dst(copylist *l, copyinfo *ci, char *buf)
+{
+    snprintf(buf, PATH_MAX, "%s%s", l->dirs[ci->dir].dst, ci->name);
+    return buf;
+}
+
+static int copyinfo_ino_cmp(const void *a, const void *b)
+{
+    const copyinfo *ca = a, *cb = b;
+
+    if(ca->ino != cb->ino)
+        return ca->ino < cb->ino ? -1 : 1;
+    return 0;
+}
+
+void copylist_sort(copylist *l)
+{
+    qsort(l->files, l->count, sizeof(copyinfo), copyinfo_ino_cmp);
+}
+
+static int is_dir_link(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* add everything below lpath, breadth first; the directory table
+** doubles as the queue of directories still to read.
+*/
+int local_build_list(copylist *l, const char *lpath, const char *rpath)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    copyinfo *ci;
+    unsigned root, dir;
+
+//    fprintf(stderr,"local_build_list('%s','%s')\n", lpath, rpath);
+
+    root = copylist_add_dir(l, lpath, rpath);
+    for(dir = root; dir < l->ndirs; dir++) {
+        const char *src = l->dirs[dir].src;
+        const char *dst = l->dirs[dir].dst;
+        size_t slen = strlen(src);
+
+        d = opendir(src);
+        if(d == 0) {
+            fprintf(stderr,"cannot open '%s': %s\n", src, strerror(errno));
+            if(dir == root)
+                return -1;
+            continue;
+        }
+
+        while((de = readdir(d))) {
+            char stat_path[PATH_MAX];
+            char *name = de->d_name;
+
+            if(name[0] == '.') {
+                if(name[1] == 0) continue;
+                if((name[1] == '.') && (name[2] == 0)) continue;
+            }
+
+            /*
+             * We could use d_type if HAVE_DIRENT_D_TYPE is defined, but reiserfs
+             * always returns DT_UNKNOWN, so we just use stat() for all cases.
+             */
+            if (slen + strlen(de->d_name) + 1 > sizeof(stat_path))
+                continue;
+            memcpy(stat_path, src, slen);
+            strcpy(stat_path + slen, de->d_name);
+            if(lstat(stat_path, &st)) {
+                closedir(d);
+                fprintf(stderr,"cannot stat '%s': %s\n", stat_path, strerror(errno));
+                return -1;
+            }
+
+                /* a link to a directory is followed, as it always was */
+            if(S_ISDIR(st.st_mode) ||
+               (S_ISLNK(st.st_mode) && is_dir_link(stat_path))) {
+                copylist_add_dir(l, arena_strcat(&l->arena, src, name, "/"),
+                                 arena_strcat(&l->arena, dst, name, "/"));
+            } else if(!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) {
+                fprintf(stderr, "skipping special file '%s'\n", stat_path);
+            } else {
+                ci = copylist_add(l, dir, name);
+                ci->time = st.st_mtime;
+                ci->mode = st.st_mode;
+                ci->size = st.st_size;
+                ci->ino = st.st_ino;
+            }
+        }
+
+        closedir(d);
+    }
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FILE_SYNC_COPYLIST_H_
+#define _FILE_SYNC_COPYLIST_H_
+
+/* file lists for whole trees.  the entries sit in one array that can be
+** sorted, and their names, along with the directory prefixes they
+** share, in an arena that is released in one go.
+**
+** this is host code that needs nothing else from sdb, so that
+** bench/copylist_bench.c can measure it on its own.
+*/
+#include <limits.h>
+
+typedef struct arena_chunk arena_chunk;
+
+typedef struct {
+    const char *src;    /* both end in '/' */
+    const char *dst;
+} copydir;
+
+typedef struct {
+    unsigned dir;
+    unsigned time;
+    unsigned mode;
+    int flag;
+    long long size;
+    unsigned long long ino;
+    const char *name;
+} copyinfo;
+
+typedef struct {
+    arena_chunk *arena;
+    copydir *dirs;
+    unsigned ndirs;
+    unsigned maxdirs;
+    copyinfo *files;
+    unsigned count;
+    unsigned max;
+} copylist;
+
+/* a copy of a, b and c run together, which lives as long as the arena */
+const char *arena_strcat(arena_chunk **arena, const char *a,
+                         const char *b, const char *c);
+
+void copylist_init(copylist *l);
+void copylist_free(copylist *l);
+
+/* src and dst must already end in '/'.  returns the new directory's index */
+unsigned copylist_add_dir(copylist *l, const char *src, const char *dst);
+copyinfo *copylist_add(copylist *l, unsigned dir, const char *name);
+
+/* the full local and remote paths of an entry, built in buf[PATH_MAX] */
+const char *copyinfo_src(copylist *l, copyinfo *ci, char *buf);
+const char *copyinfo_dst(copylist *l, copyinfo *ci, char *buf);
+
+/* read the files in inode order, which on most filesystems is close to
+** the order they sit on disk in.
+*/
+void copylist_sort(copylist *l);
+
+/* add everything below lpath (to go to rpath), breadth first; both must
+** end in '/'.  returns -1 if lpath itself can't be read.
+*/
+int local_build_list(copylist *l, const char *lpath, const char *rpath);
+
+#endif
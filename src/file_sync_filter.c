@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "file_sync_filter.h"
+
+#define RULE_INCLUDE  0x01
+#define RULE_REGEX    0x02
+
+typedef struct filter_rule filter_rule;
+
+struct filter_rule {
+    filter_rule *next;
+    unsigned flags;
+    int pathname;       /* glob has a '/': match the whole relative path */
+    regex_t re;
+    char pattern[1];
+};
+
+struct sync_filter {
+    filter_rule *rules;
+    int includes;
+    long long min_size;
+    long long max_size;
+    long long min_age;
+    long long max_age;
+};
+
+static int parse_number(const char *arg, long long *out)
+{
+    char *end;
+
+    *out = strtoll(arg, &end, 0);
+    return (end == arg || *end || *out < 0) ? -1 : 0;
+}
+
+static int add_rule(sync_filter *f, unsigned flags, const char *pattern,
+                    char *error, int errlen)
+{
+    filter_rule *r;
+    int len = strlen(pattern);
+
+    if(len == 0) {
+        snprintf(error, errlen, "empty pattern");
+        return -1;
+    }
+
+    r = calloc(1, sizeof(filter_rule) + len);
+    if(r == 0) {
+        snprintf(error, errlen, "out of memory");
+        return -1;
+    }
+    r->flags = flags;
+    memcpy(r->pattern, pattern, len + 1);
+
+    if(flags & RULE_REGEX) {
+        int err = regcomp(&r->re, pattern, REG_EXTENDED | REG_NOSUB);
+        if(err) {
+            char msg[128];
+            regerror(err, &r->re, msg, sizeof(msg));
+            snprintf(error, errlen, "bad regex '%s': %s", pattern, msg);
+            free(r);
+            return -1;
+        }
+    } else {
+        r->pathname = strchr(pattern, '/') != 0;
+    }
+
+    if(flags & RULE_INCLUDE)
+        f->includes++;
+    r->next = f->rules;
+    f->rules = r;
+    return 0;
+}
+
+sync_filter *sync_filter_parse(const char *spec, char *error, int errlen)
+{
+    sync_filter *f;
+    char *copy, *line, *next;
+    int r = 0;
+
+    error[0] = 0;
+    f = calloc(1, sizeof(sync_filter));
+    copy = strdup(spec);
+    if(f == 0 || copy == 0) {
+        snprintf(error, errlen, "out of memory");
+        free(f);
+        free(copy);
+        return 0;
+    }
+    f->max_size = -1;
+    f->max_age = -1;
+
+    for(line = copy; r == 0 && line; line = next) {
+        char *arg;
+
+        next = strchr(line, '\n');
+        if(next)
+            *next++ = 0;
+        if(*line == 0)
+            continue;
+
+        arg = strchr(line, ' ');
+        if(arg == 0) {
+            snprintf(error, errlen, "bad filter rule '%s'", line);
+            r = -1;
+            break;
+        }
+        *arg++ = 0;
+
+        if(!strcmp(line, "include")) {
+            r = add_rule(f, RULE_INCLUDE, arg, error, errlen);
+        } else if(!strcmp(line, "exclude")) {
+            r = add_rule(f, 0, arg, error, errlen);
+        } else if(!strcmp(line, "include-re")) {
+            r = add_rule(f, RULE_INCLUDE | RULE_REGEX, arg, error, errlen);
+        } else if(!strcmp(line, "exclude-re")) {
+            r = add_rule(f, RULE_REGEX, arg, error, errlen);
+        } else if(!strcmp(line, "min-size")) {
+            r = parse_number(arg, &f->min_size);
+        } else if(!strcmp(line, "max-size")) {
+            r = parse_number(arg, &f->max_size);
+        } else if(!strcmp(line, "min-age")) {
+            r = parse_number(arg, &f->min_age);
+        } else if(!strcmp(line, "max-age")) {
+            r = parse_number(arg, &f->max_age);
+        } else {
+            snprintf(error, errlen, "unknown filter rule '%s'", line);
+            r = -1;
+            break;
+        }
+        if(r && error[0] == 0)
+            snprintf(error, errlen, "bad number for '%s': '%s'", line, arg);
+    }
+
+    free(copy);
+    if(r) {
+        sync_filter_free(f);
+        return 0;
+    }
+    return f;
+}
+
+void sync_filter_free(sync_filter *f)
+{
+    filter_rule *r, *next;
+
+    if(f == 0)
+        return;
+    for(r = f->rules; r != 0; r = next) {
+        next = r->next;
+        if(r->flags & RULE_REGEX)
+            regfree(&r->re);
+        free(r);
+    }
+    free(f);
+}
+
+static int rule_matches(const filter_rule *r, const char *relpath)
+{
+    const char *base;
+
+    if(r->flags & RULE_REGEX)
+        return regexec(&r->re, relpath, 0, 0, 0) == 0;
+
+    if(r->pathname)
+        return fnmatch(r->pattern, relpath, FNM_PATHNAME) == 0;
+
+    base = strrchr(relpath, '/');
+    return fnmatch(r->pattern, base ? base + 1 : relpath, 0) == 0;
+}
+
+int sync_filter_accept(const sync_filter *f, const char *relpath,
+                       unsigned mode, long long size, unsigned mtime)
+{
+    const filter_rule *r;
+    int included;
+
+    if(f == 0)
+        return 1;
+
+    for(r = f->rules; r != 0; r = r->next) {
+        if(!(r->flags & RULE_INCLUDE) && rule_matches(r, relpath))
+            return 0;
+    }
+
+        /* only files are held to the include, size and age rules */
+    if(S_ISDIR(mode))
+        return 1;
+
+    if(f->includes) {
+        included = 0;
+        for(r = f->rules; r != 0 && !included; r = r->next) {
+            if((r->flags & RULE_INCLUDE) && rule_matches(r, relpath))
+                included = 1;
+        }
+        if(!included)
+            return 0;
+    }
+
+    if(size < f->min_size)
+        return 0;
+    if(f->max_size >= 0 && size > f->max_size)
+        return 0;
+
+    if(f->min_age > 0 || f->max_age >= 0) {
+        long long age = (long long) time(0) - mtime;
+
+        if(age < f->min_age)
+            return 0;
+        if(f->max_age >= 0 && age > f->max_age)
+            return 0;
+    }
+
+    return 1;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FILE_SYNC_FILTER_H_
+#define _FILE_SYNC_FILTER_H_
+
+/* ID_FILT <spec> sets the filter that later ID_RLST and ID_ARCV walks on
+** the same connection apply; an empty spec clears it.  the spec is one
+** rule per line:
+**
+**   include <glob>       exclude <glob>
+**   include-re <regex>   exclude-re <regex>
+**   min-size <bytes>     max-size <bytes>
+**   min-age <seconds>    max-age <seconds>
+**
+** a glob containing '/' is matched against the path below the listed
+** directory, any other glob against the last component; regexes (POSIX
+** extended) always see the whole relative path.  excluded directories
+** are not walked at all.  when there are include rules a file has to
+** match one of them, and it has to pass every size and age test.
+*/
+
+typedef struct sync_filter sync_filter;
+
+sync_filter *sync_filter_parse(const char *spec, char *error, int errlen);
+void sync_filter_free(sync_filter *f);
+
+/* returns 1 if the entry at relpath should be listed (and, for a
+** directory, walked), 0 if it should be left out.
+*/
+int sync_filter_accept(const sync_filter *f, const char *relpath,
+                       unsigned mode, long long size, unsigned mtime);
+
+#endif
@@ -0,0 +1,780 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/file.h>
+#include <sys/inotify.h>
+#endif
+
+#include "sysdeps.h"
+#include "file_sync_manifest.h"
+
+#define MANIFEST_MAGIC "sdb-manifest 1"
+#define JOURNAL_MAGIC  "sdb-journal"
+
+struct sync_manifest {
+    manifest_entry **table;
+    unsigned buckets;
+    unsigned count;
+
+    char path[PATH_MAX];
+    char journal[PATH_MAX];
+
+        /* the journal position this manifest is up to date with, and
+        ** the one it will be once the running sync succeeds
+        */
+    char journal_id[64];
+    long long journal_off;
+    char next_id[64];
+    long long next_off;
+};
+
+static unsigned name_hash(const char *name)
+{
+    unsigned h = 2166136261u;
+
+    while(*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void absolute_path(const char *path, char *out, size_t len)
+{
+    size_t n;
+#ifdef _WIN32
+    if(_fullpath(out, path, len) == 0)
+        snprintf(out, len, "%s", path);
+#else
+    char tmp[PATH_MAX];
+
+    if(realpath(path, tmp) == 0)
+        snprintf(out, len, "%s", path);
+    else
+        snprintf(out, len, "%s", tmp);
+#endif
+    n = strlen(out);
+    while(n > 1 && (out[n - 1] == '/' || out[n - 1] == '\\'))
+        out[--n] = 0;
+}
+
+/* ~/.sdb/sync/<first half of sha-256 of key><suffix> */
+static int sync_state_path(char *out, size_t len, const char *key, const char *suffix)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    char name[SHA256_DIGEST_SIZE + 1];
+    const char *home;
+    sha256_ctx ctx;
+    int n;
+
+#ifdef _WIN32
+    home = getenv("USERPROFILE");
+#else
+    home = getenv("HOME");
+#endif
+    if(home == 0)
+        home = "/tmp";
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, key, strlen(key));
+    sha256_final(&ctx, digest);
+    for(n = 0; n < SHA256_DIGEST_SIZE / 2; n++) {
+        name[n * 2] = hex[digest[n] >> 4];
+        name[n * 2 + 1] = hex[digest[n] & 15];
+    }
+    name[SHA256_DIGEST_SIZE] = 0;
+
+    snprintf(out, len, "%s/.sdb", home);
+    sdb_mkdir(out, 0775);
+    snprintf(out, len, "%s/.sdb/sync", home);
+    sdb_mkdir(out, 0775);
+
+    n = snprintf(out, len, "%s/.sdb/sync/%s%s", home, name, suffix);
+    return (n < 0 || (size_t) n >= len) ? -1 : 0;
+}
+
+static void journal_path(char *out, size_t len, const char *abs)
+{
+    char key[PATH_MAX + 16];
+
+    snprintf(key, sizeof(key), "journal\n%s", abs);
+    sync_state_path(out, len, key, ".journal");
+}
+
+manifest_entry *manifest_lookup(sync_manifest *m, const char *name)
+{
+    manifest_entry *e;
+
+    for(e = m->table[name_hash(name) & (m->buckets - 1)]; e; e = e->next) {
+        if(!strcmp(e->name, name))
+            return e;
+    }
+    return 0;
+}
+
+static void manifest_grow(sync_manifest *m)
+{
+    unsigned buckets = m->buckets * 2;
+    manifest_entry **table = calloc(buckets, sizeof(manifest_entry*));
+    manifest_entry *e, *next;
+    unsigned n;
+
+    if(table == 0)
+        return;
+
+    for(n = 0; n < m->buckets; n++) {
+        for(e = m->table[n]; e; e = next) {
+            next = e->next;
+            e->next = table[name_hash(e->name) & (buckets - 1)];
+            table[name_hash(e->name) & (buckets - 1)] = e;
+        }
+    }
+    free(m->table);
+    m->table = table;
+    m->buckets = buckets;
+}
+
+void manifest_update(sync_manifest *m, const char *name, unsigned mode,
+                     long long size, unsigned time, const unsigned char *hash)
+{
+    manifest_entry *e = manifest_lookup(m, name);
+
+    if(e == 0) {
+        int len = strlen(name);
+        unsigned slot;
+
+        e = malloc(sizeof(manifest_entry) + len);
+        if(e == 0) {
+            fprintf(stderr,"out of memory\n");
+            abort();
+        }
+        memcpy(e->name, name, len + 1);
+
+        if(m->count >= m->buckets)
+            manifest_grow(m);
+        slot = name_hash(name) & (m->buckets - 1);
+        e->next = m->table[slot];
+        m->table[slot] = e;
+        m->count++;
+    }
+
+    e->mode = mode;
+    e->size = size;
+    e->time = time;
+    e->seen = 1;
+    e->hashed = hash != 0;
+    if(hash)
+        memcpy(e->hash, hash, SHA256_DIGEST_SIZE);
+}
+
+void manifest_remove(sync_manifest *m, const char *name)
+{
+    manifest_entry **pe = &m->table[name_hash(name) & (m->buckets - 1)];
+    manifest_entry *e;
+
+    for(; (e = *pe); pe = &e->next) {
+        if(!strcmp(e->name, name)) {
+            *pe = e->next;
+            free(e);
+            m->count--;
+            return;
+        }
+    }
+}
+
+void manifest_clear_seen(sync_manifest *m, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    manifest_entry *e;
+    unsigned n;
+
+    for(n = 0; n < m->buckets; n++) {
+        for(e = m->table[n]; e; e = e->next) {
+            if(!strncmp(e->name, prefix, len))
+                e->seen = 0;
+        }
+    }
+}
+
+void manifest_prune(sync_manifest *m, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    manifest_entry **pe, *e;
+    unsigned n;
+
+    for(n = 0; n < m->buckets; n++) {
+        pe = &m->table[n];
+        while((e = *pe)) {
+            if(!e->seen && !strncmp(e->name, prefix, len)) {
+                *pe = e->next;
+                free(e);
+                m->count--;
+            } else {
+                pe = &e->next;
+            }
+        }
+    }
+}
+
+static int parse_hash(const char *s, unsigned char *hash)
+{
+    unsigned n, v;
+
+    if(strlen(s) != SHA256_DIGEST_SIZE * 2)
+        return -1;
+    for(n = 0; n < SHA256_DIGEST_SIZE; n++) {
+        if(sscanf(s + n * 2, "%2x", &v) != 1)
+            return -1;
+        hash[n] = v;
+    }
+    return 0;
+}
+
+sync_manifest *manifest_load(const char *serial, const char *lpath, const char *rpath)
+{
+    char abs[PATH_MAX];
+    char key[PATH_MAX * 2 + 128];
+    char line[PATH_MAX + 128];
+    sync_manifest *m;
+    FILE *f;
+    size_t n;
+
+    m = calloc(1, sizeof(sync_manifest));
+    if(m == 0)
+        return 0;
+    m->buckets = 1024;
+    m->table = calloc(m->buckets, sizeof(manifest_entry*));
+    if(m->table == 0) {
+        free(m);
+        return 0;
+    }
+
+    absolute_path(lpath, abs, sizeof(abs));
+    snprintf(key, sizeof(key), "%s\n%s\n%s", serial, abs, rpath);
+    n = strlen(key);
+    while(n > 1 && key[n - 1] == '/')
+        key[--n] = 0;
+    sync_state_path(m->path, sizeof(m->path), key, ".manifest");
+    journal_path(m->journal, sizeof(m->journal), abs);
+
+    f = fopen(m->path, "r");
+    if(f == 0)
+        return m;
+
+    if(fgets(line, sizeof(line), f) == 0 || strncmp(line, MANIFEST_MAGIC "\n", sizeof(line))) {
+        fprintf(stderr,"ignoring unknown manifest '%s'\n", m->path);
+        fclose(f);
+        return m;
+    }
+    if(fgets(line, sizeof(line), f) &&
+       sscanf(line, "journal %63s %lld", m->journal_id, &m->journal_off) == 2 &&
+       !strcmp(m->journal_id, "-")) {
+        m->journal_id[0] = 0;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        char hash[SHA256_DIGEST_SIZE * 2 + 2];
+        unsigned char digest[SHA256_DIGEST_SIZE];
+        unsigned mode, time;
+        long long size;
+        int skip = 0;
+
+        n = strlen(line);
+        if(n == 0 || line[n - 1] != '\n')
+            break;
+        line[n - 1] = 0;
+
+        if(sscanf(line, "%o %lld %u %66s %n", &mode, &size, &time, hash, &skip) != 4 ||
+           skip == 0 || line[skip] == 0)
+            continue;
+        manifest_update(m, line + skip, mode, size, time,
+                        parse_hash(hash, digest) ? 0 : digest);
+    }
+    fclose(f);
+
+    manifest_clear_seen(m, "");
+    return m;
+}
+
+int manifest_save(sync_manifest *m)
+{
+    static const char hex[] = "0123456789abcdef";
+    char tmp[PATH_MAX + 8];
+    manifest_entry *e;
+    unsigned n, k;
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m->path);
+    f = fopen(tmp, "w");
+    if(f == 0) {
+        fprintf(stderr,"cannot write manifest '%s': %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, MANIFEST_MAGIC "\njournal %s %lld\n",
+            m->journal_id[0] ? m->journal_id : "-", m->journal_off);
+    for(n = 0; n < m->buckets; n++) {
+        for(e = m->table[n]; e; e = e->next) {
+            char hash[SHA256_DIGEST_SIZE * 2 + 1];
+
+            if(strchr(e->name, '\n'))
+                continue;
+            if(e->hashed) {
+                for(k = 0; k < SHA256_DIGEST_SIZE; k++) {
+                    hash[k * 2] = hex[e->hash[k] >> 4];
+                    hash[k * 2 + 1] = hex[e->hash[k] & 15];
+                }
+                hash[SHA256_DIGEST_SIZE * 2] = 0;
+            } else {
+                strcpy(hash, "-");
+            }
+            fprintf(f, "%o %lld %u %s %s\n", e->mode, e->size, e->time, hash, e->name);
+        }
+    }
+
+    if(fclose(f)) {
+        fprintf(stderr,"cannot write manifest '%s': %s\n", tmp, strerror(errno));
+        sdb_unlink(tmp);
+        return -1;
+    }
+#ifdef _WIN32
+    sdb_unlink(m->path);
+#endif
+    if(rename(tmp, m->path)) {
+        fprintf(stderr,"cannot write manifest '%s': %s\n", m->path, strerror(errno));
+        sdb_unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void manifest_free(sync_manifest *m)
+{
+    manifest_entry *e, *next;
+    unsigned n;
+
+    if(m == 0)
+        return;
+    for(n = 0; n < m->buckets; n++) {
+        for(e = m->table[n]; e; e = next) {
+            next = e->next;
+            free(e);
+        }
+    }
+    free(m->table);
+    free(m);
+}
+
+void manifest_journal_commit(sync_manifest *m)
+{
+    strcpy(m->journal_id, m->next_id);
+    m->journal_off = m->next_off;
+}
+
+#ifdef __linux__
+
+typedef struct {
+    int isdir;
+    char *name;
+} journal_line;
+
+static int journal_line_cmp(const void *a, const void *b)
+{
+    const journal_line *la = a, *lb = b;
+    int r = strcmp(la->name, lb->name);
+
+        /* a directory sorts before a file of the same name, and wins */
+    return r ? r : lb->isdir - la->isdir;
+}
+
+int manifest_journal_read(sync_manifest *m, journal_cb func, void *cookie)
+{
+    char line[PATH_MAX + 8];
+    journal_line *lines = 0;
+    int count = 0, max = 0, lost = 0;
+    const char *dir = 0;
+    size_t dirlen = 0;
+    long long pos, end;
+    struct stat st;
+    FILE *f;
+    int n;
+
+    m->next_id[0] = 0;
+    m->next_off = 0;
+
+    f = fopen(m->journal, "r");
+    if(f == 0)
+        return -1;
+
+        /* the watcher holds an exclusive lock for as long as it runs;
+        ** a journal nobody is writing says nothing about what changed.
+        */
+    if(flock(fileno(f), LOCK_SH | LOCK_NB) == 0 ||
+       errno != EWOULDBLOCK ||
+       fstat(fileno(f), &st) ||
+       fgets(line, sizeof(line), f) == 0 ||
+       sscanf(line, JOURNAL_MAGIC " %63s", m->next_id) != 1) {
+        m->next_id[0] = 0;
+        fclose(f);
+        return -1;
+    }
+
+    end = st.st_size;
+    m->next_off = end;
+    if(strcmp(m->next_id, m->journal_id) || m->journal_off > end ||
+       fseeko(f, m->journal_off, SEEK_SET)) {
+        fclose(f);
+        return -1;
+    }
+
+    pos = m->journal_off;
+    while(pos < end && fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+
+        if(len == 0 || line[len - 1] != '\n') {
+                /* the watcher is still writing this one */
+            break;
+        }
+        pos += len;
+        line[--len] = 0;
+
+        if(line[0] == '*') {
+            lost = 1;
+            continue;
+        }
+        if(len < 3 || line[1] != ' ' || (line[0] != 'F' && line[0] != 'D'))
+            continue;
+
+        if(count == max) {
+            journal_line *tmp;
+            max = max ? max * 2 : 256;
+            tmp = realloc(lines, max * sizeof(journal_line));
+            if(tmp == 0) {
+                lost = 1;
+                break;
+            }
+            lines = tmp;
+        }
+        lines[count].isdir = line[0] == 'D';
+        lines[count].name = strdup(line + 2);
+        if(lines[count].name == 0) {
+            lost = 1;
+            break;
+        }
+        count++;
+    }
+    m->next_off = pos;
+    fclose(f);
+
+    if(!lost) {
+        qsort(lines, count, sizeof(journal_line), journal_line_cmp);
+        for(n = 0; n < count; n++) {
+            if(n > 0 && !strcmp(lines[n].name, lines[n - 1].name))
+                continue;
+            if(dir && !strncmp(lines[n].name, dir, dirlen) &&
+               lines[n].name[dirlen] == '/')
+                continue;
+            if(lines[n].isdir) {
+                dir = lines[n].name;
+                dirlen = strlen(dir);
+            }
+            func(lines[n].name, lines[n].isdir, cookie);
+        }
+    }
+
+    for(n = 0; n < count; n++)
+        free(lines[n].name);
+    free(lines);
+
+    return lost ? -1 : 0;
+}
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                    IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR | \
+                    IN_DONT_FOLLOW)
+
+typedef struct {
+    int ifd;
+    int jfd;
+    char root[PATH_MAX];
+    char **dirs;        /* path below root, indexed by watch descriptor */
+    int max;
+    int count;
+} watcher;
+
+static int journal_append(watcher *w, int type, const char *name)
+{
+    char line[PATH_MAX + 8];
+    int len;
+
+    if(type == '*' || strchr(name, '\n'))
+        len = snprintf(line, sizeof(line), "*\n");
+    else
+        len = snprintf(line, sizeof(line), "%c %s\n", type, name);
+    if(len < 0 || len >= (int) sizeof(line))
+        len = snprintf(line, sizeof(line), "*\n");
+
+        /* one write per line, so a reader never sees half of one */
+    if(unix_write(w->jfd, line, len) != len) {
+        fprintf(stderr,"cannot write journal: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int watch_dir(watcher *w, const char *rel)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+    int wd;
+
+    snprintf(path, sizeof(path), rel[0] ? "%s/%s" : "%s", w->root, rel);
+    wd = inotify_add_watch(w->ifd, path, WATCH_MASK);
+    if(wd < 0) {
+        if(errno == ENOENT || errno == ENOTDIR)
+            return 0;
+        if(errno == ENOSPC)
+            fprintf(stderr,"cannot watch '%s': out of inotify watches "
+                    "(see /proc/sys/fs/inotify/max_user_watches)\n", path);
+        else
+            fprintf(stderr,"cannot watch '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if(wd >= w->max) {
+        int max = wd + 1024;
+        char **dirs = realloc(w->dirs, max * sizeof(char*));
+        if(dirs == 0)
+            return -1;
+        memset(dirs + w->max, 0, (max - w->max) * sizeof(char*));
+        w->dirs = dirs;
+        w->max = max;
+    }
+    if(w->dirs[wd] == 0)
+        w->count++;
+    free(w->dirs[wd]);
+    w->dirs[wd] = strdup(rel);
+    if(w->dirs[wd] == 0)
+        return -1;
+
+    d = opendir(path);
+    if(d == 0)
+        return 0;
+    while((de = readdir(d))) {
+        char sub[PATH_MAX];
+        int isdir;
+
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if(snprintf(sub, sizeof(sub), rel[0] ? "%s/%s" : "%s%s",
+                    rel, de->d_name) >= (int) sizeof(sub))
+            goto toolong;
+
+        if(de->d_type == DT_UNKNOWN) {
+            char full[PATH_MAX];
+            if(snprintf(full, sizeof(full), "%s/%s", w->root, sub) >= (int) sizeof(full))
+                goto toolong;
+            isdir = lstat(full, &st) == 0 && S_ISDIR(st.st_mode);
+        } else {
+            isdir = de->d_type == DT_DIR;
+        }
+        if(isdir && watch_dir(w, sub)) {
+            closedir(d);
+            return -1;
+        }
+    }
+    closedir(d);
+    return 0;
+
+        /* a directory we cannot name goes unwatched, and then the
+        ** journal would miss what changes below it.
+        */
+toolong:
+    fprintf(stderr,"cannot watch below '%s': path too long\n", path);
+    closedir(d);
+    return -1;
+}
+
+/* drop the watches on a directory that moved away and everything below */
+static void unwatch_dir(watcher *w, const char *rel)
+{
+    size_t len = strlen(rel);
+    int wd;
+
+    for(wd = 0; wd < w->max; wd++) {
+        if(w->dirs[wd] && !strncmp(w->dirs[wd], rel, len) &&
+           (w->dirs[wd][len] == 0 || w->dirs[wd][len] == '/')) {
+            inotify_rm_watch(w->ifd, wd);
+            free(w->dirs[wd]);
+            w->dirs[wd] = 0;
+            w->count--;
+        }
+    }
+}
+
+static int watch_event(watcher *w, struct inotify_event *ev)
+{
+    char rel[PATH_MAX];
+    const char *dir;
+
+    if(ev->mask & IN_Q_OVERFLOW)
+        return journal_append(w, '*', "");
+
+    if(ev->wd < 0 || ev->wd >= w->max || (dir = w->dirs[ev->wd]) == 0)
+        return 0;
+
+    if(ev->mask & IN_IGNORED) {
+        free(w->dirs[ev->wd]);
+        w->dirs[ev->wd] = 0;
+        w->count--;
+        if(w->count == 0) {
+            fprintf(stderr,"'%s' is gone\n", w->root);
+            return -1;
+        }
+        return 0;
+    }
+    if(ev->len == 0)
+        return 0;
+
+    snprintf(rel, sizeof(rel), dir[0] ? "%s/%s" : "%s%s", dir, ev->name);
+
+    if(ev->mask & IN_ISDIR) {
+        if(ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                /* anything created in there before the watch was
+                ** added is covered by walking the whole directory.
+                */
+            if(watch_dir(w, rel))
+                return -1;
+        } else if(ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            unwatch_dir(w, rel);
+        } else {
+            return 0;
+        }
+        return journal_append(w, 'D', rel);
+    }
+    return journal_append(w, 'F', rel);
+}
+
+int do_sync_watch(const char *lpath)
+{
+    char path[PATH_MAX];
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    watcher w;
+    int len, r;
+
+    memset(&w, 0, sizeof(w));
+    absolute_path(lpath, w.root, sizeof(w.root));
+    journal_path(path, sizeof(path), w.root);
+
+    w.jfd = unix_open(path, O_RDWR | O_CREAT | O_APPEND, 0640);
+    if(w.jfd < 0) {
+        fprintf(stderr,"cannot open journal '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    if(flock(w.jfd, LOCK_EX | LOCK_NB)) {
+        fprintf(stderr,"'%s' is already being watched\n", w.root);
+        unix_close(w.jfd);
+        return 1;
+    }
+    if(ftruncate(w.jfd, 0)) {
+        fprintf(stderr,"cannot reset journal '%s': %s\n", path, strerror(errno));
+        unix_close(w.jfd);
+        return 1;
+    }
+
+    w.ifd = inotify_init();
+    if(w.ifd < 0) {
+        fprintf(stderr,"cannot start watching: %s\n", strerror(errno));
+        unix_close(w.jfd);
+        return 1;
+    }
+    close_on_exec(w.ifd);
+
+    if(watch_dir(&w, "") || w.count == 0) {
+        if(w.count == 0)
+            fprintf(stderr,"cannot watch '%s'\n", w.root);
+        unix_close(w.ifd);
+        unix_close(w.jfd);
+        return 1;
+    }
+
+        /* only now that every directory is watched can a sync trust
+        ** the journal; the header is what tells it so.
+        */
+    len = snprintf(buf, sizeof(buf), JOURNAL_MAGIC " %d.%lld\n",
+                   (int) getpid(), (long long) time(0));
+    if(unix_write(w.jfd, buf, len) != len) {
+        fprintf(stderr,"cannot write journal: %s\n", strerror(errno));
+        return 1;
+    }
+    fprintf(stderr,"watching %d director%s under %s\n",
+            w.count, w.count == 1 ? "y" : "ies", w.root);
+
+    for(;;) {
+        char *p;
+
+        len = unix_read(w.ifd, buf, sizeof(buf));
+        if(len < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr,"cannot read events: %s\n", strerror(errno));
+            break;
+        }
+
+        for(p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+            r = watch_event(&w, (struct inotify_event*) p);
+            if(r) {
+                journal_append(&w, '*', "");
+                unix_close(w.ifd);
+                unix_close(w.jfd);
+                return 1;
+            }
+        }
+    }
+
+    unix_close(w.ifd);
+    unix_close(w.jfd);
+    return 1;
+}
+
+#else
+
+int manifest_journal_read(sync_manifest *m, journal_cb func, void *cookie)
+{
+    m->next_id[0] = 0;
+    m->next_off = 0;
+    return -1;
+}
+
+int do_sync_watch(const char *lpath)
+{
+    fprintf(stderr,"error: 'watch' is not supported on this platform\n");
+    return 1;
+}
+
+#endif
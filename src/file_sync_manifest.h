@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FILE_SYNC_MANIFEST_H_
+#define _FILE_SYNC_MANIFEST_H_
+
+#include "sha256.h"
+
+/* 'sdb sync' remembers what it last put on a device in a manifest kept
+** under ~/.sdb/sync, one per (device serial, local dir, remote dir).
+** an entry holds the path below the local dir and the mode, size, mtime
+** and (for regular files) sha-256 the file had when it was pushed.
+** files that still match their entry are not pushed, and not STATed on
+** the device either.
+**
+** 'sdb watch <dir>' keeps an inotify journal of the paths that change
+** under dir.  while the same watcher keeps running, a sync reads only
+** the journal lines added since the previous one instead of walking the
+** local tree.  lines are "F <path>" for a file, "D <path>" for a whole
+** directory and "*" when events were lost, which forces a full walk.
+*/
+
+typedef struct manifest_entry manifest_entry;
+
+struct manifest_entry {
+    manifest_entry *next;
+    unsigned mode;
+    unsigned time;
+    long long size;
+    int hashed;
+    int seen;
+    unsigned char hash[SHA256_DIGEST_SIZE];
+    char name[1];
+};
+
+typedef struct sync_manifest sync_manifest;
+
+/* load the manifest for serial/lpath/rpath; a missing or unreadable
+** manifest gives an empty one.
+*/
+sync_manifest *manifest_load(const char *serial, const char *lpath, const char *rpath);
+int manifest_save(sync_manifest *m);
+void manifest_free(sync_manifest *m);
+
+manifest_entry *manifest_lookup(sync_manifest *m, const char *name);
+
+/* add or replace name, marking it seen; hash may be null. */
+void manifest_update(sync_manifest *m, const char *name, unsigned mode,
+                     long long size, unsigned time, const unsigned char *hash);
+
+void manifest_remove(sync_manifest *m, const char *name);
+
+/* clear the seen mark of, or drop the unseen entries among, every entry
+** whose name starts with prefix ("" for all of them).
+*/
+void manifest_clear_seen(sync_manifest *m, const char *prefix);
+void manifest_prune(sync_manifest *m, const char *prefix);
+
+typedef void (*journal_cb)(const char *name, int isdir, void *cookie);
+
+/* hand the paths the watcher of lpath journaled since the last sync to
+** func, once each, skipping anything inside a directory that is itself
+** listed.  returns 0 if that is all that changed, or -1 if the caller
+** has to walk the whole tree (no watcher, a different watcher, or lost
+** events).  either way manifest_journal_commit() marks what was read
+** as consumed, once the sync has succeeded.
+*/
+int manifest_journal_read(sync_manifest *m, journal_cb func, void *cookie);
+void manifest_journal_commit(sync_manifest *m);
+
+/* journal changes under lpath until killed */
+int do_sync_watch(const char *lpath);
+
+#endif
@@ -0,0 +1,521 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* host:relay copies a file or a tree from one device to one or more
+** others inside the server, without a stop on the host's disk: the
+** ID_DATA messages of an ID_RECV on the source are handed on as they
+** come to an ID_SEND on every target.  a tree is listed with ID_RLST
+** where the source's sdbd has it, and one ID_LIST at a time where not.
+**
+** once the service is open the client sends one request, a 4 digit
+** hex length and then newline separated fields:
+**
+**   <source serial> <source path> <target serial> <target path> ...
+**
+** and reads back progress lines until the service closes the
+** connection.  the last line is "ok <files> <bytes>" or "fail <reason>".
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sysdeps.h"
+
+#define TRACE_TAG  TRACE_SYNC
+#include "sdb.h"
+#include "sdb_client.h"
+#include "file_sync_service.h"
+
+#define RELAY_MAX_TARGETS 16
+
+typedef struct {
+    unsigned mode;
+    unsigned time;
+    long long size;
+    char *name;         /* below the source path; "" for a single file */
+} relay_file;
+
+typedef struct {
+    const char *serial;
+    const char *path;
+    int fd;
+    int pending;        /* an ID_SEND whose status hasn't been read yet */
+    int failed;
+} relay_target;
+
+typedef struct {
+    int out;
+    int sfd;
+    const char *serial;
+    const char *path;
+
+    relay_file *files;
+    int count;
+    int max;
+
+    relay_target targets[RELAY_MAX_TARGETS];
+    int ntargets;
+
+    char *buffer;
+} relay;
+
+static void relay_report(relay *r, const char *fmt, ...)
+{
+    char line[1024];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if(len < 0) return;
+    if(len > (int) sizeof(line) - 2) len = sizeof(line) - 2;
+    line[len++] = '\n';
+    writex(r->out, line, len);
+}
+
+static void relay_quit(int fd)
+{
+    syncmsg msg;
+
+    msg.req.id = ID_QUIT;
+    msg.req.namelen = 0;
+    writex(fd, &msg.req, sizeof(msg.req));
+}
+
+static int relay_request(int fd, unsigned id, const char *path)
+{
+    syncmsg msg;
+    int len = strlen(path);
+
+    if(len > 1024) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    msg.req.id = id;
+    msg.req.namelen = htoll(len);
+    return (writex(fd, &msg.req, sizeof(msg.req)) || writex(fd, path, len)) ? -1 : 0;
+}
+
+static void relay_add(relay *r, unsigned mode, unsigned time, long long size,
+                      const char *name)
+{
+    relay_file *f;
+
+    if(r->count == r->max) {
+        r->max = r->max ? r->max * 2 : 256;
+        r->files = realloc(r->files, r->max * sizeof(relay_file));
+        if(r->files == 0) fatal("cannot allocate relay list");
+    }
+    f = &r->files[r->count++];
+    f->mode = mode;
+    f->time = time;
+    f->size = size;
+    f->name = strdup(name);
+    if(f->name == 0) fatal("cannot allocate relay list");
+}
+
+/* the SYNC_FEATURE_* bits of the source's sdbd; 0 from one that
+** predates them
+*/
+static int relay_features(relay *r, unsigned *features)
+{
+    syncmsg msg;
+
+    if(relay_request(r->sfd, ID_STAT, "") ||
+       readx(r->sfd, &msg.stat, sizeof(msg.stat)) || msg.stat.id != ID_STAT)
+        return -1;
+    *features = ltohl(msg.stat.size);
+    return 0;
+}
+
+static void relay_path(char *out, const char *dir, const char *name)
+{
+    if(name[0] == 0)
+        snprintf(out, 1025, "%s", dir);
+    else if(dir[0] == 0)
+        snprintf(out, 1025, "%s", name);
+    else if(dir[strlen(dir) - 1] == '/')
+        snprintf(out, 1025, "%s%s", dir, name);
+    else
+        snprintf(out, 1025, "%s/%s", dir, name);
+}
+
+/* list the tree below the source directory with ID_LIST, breadth first */
+static int relay_walk(relay *r)
+{
+    syncmsg msg;
+    char **dirs;
+    char path[1025], name[257], sub[1025];
+    unsigned mode;
+    int ndirs = 1, maxdirs = 64, n, len, ret = -1;
+
+    dirs = malloc(maxdirs * sizeof(char*));
+    if(dirs == 0 || (dirs[0] = strdup("")) == 0)
+        fatal("cannot allocate relay list");
+
+    for(n = 0; n < ndirs; n++) {
+        relay_path(path, r->path, dirs[n]);
+        if(relay_request(r->sfd, ID_LIST, path))
+            goto done;
+        for(;;) {
+            if(readx(r->sfd, &msg.dent, sizeof(msg.dent)))
+                goto done;
+            if(msg.dent.id == ID_DONE)
+                break;
+            len = ltohl(msg.dent.namelen);
+            if(msg.dent.id != ID_DENT || len > 256 || readx(r->sfd, name, len))
+                goto done;
+            name[len] = 0;
+            if(!strcmp(name, ".") || !strcmp(name, ".."))
+                continue;
+            relay_path(sub, dirs[n], name);
+
+            mode = ltohl(msg.dent.mode);
+            if(S_ISDIR(mode)) {
+                if(ndirs == maxdirs) {
+                    maxdirs *= 2;
+                    dirs = realloc(dirs, maxdirs * sizeof(char*));
+                    if(dirs == 0) fatal("cannot allocate relay list");
+                }
+                dirs[ndirs] = strdup(sub);
+                if(dirs[ndirs++] == 0) fatal("cannot allocate relay list");
+            } else if(S_ISREG(mode) || S_ISLNK(mode)) {
+                relay_add(r, mode, ltohl(msg.dent.time), ltohl(msg.dent.size), sub);
+            }
+        }
+    }
+    ret = 0;
+
+done:
+    for(n = 0; n < ndirs; n++)
+        free(dirs[n]);
+    free(dirs);
+    if(ret)
+        relay_report(r, "fail protocol failure listing %s:%s", r->serial, r->path);
+    return ret;
+}
+
+/* list the source: the file itself, or every file below the directory */
+static int relay_list(relay *r)
+{
+    syncmsg msg;
+    unsigned size, pos, mode, features;
+    char name[1025];
+    int len;
+
+    if(relay_request(r->sfd, ID_STAT, r->path) ||
+       readx(r->sfd, &msg.stat, sizeof(msg.stat)) || msg.stat.id != ID_STAT) {
+        relay_report(r, "fail cannot stat %s:%s", r->serial, r->path);
+        return -1;
+    }
+    mode = ltohl(msg.stat.mode);
+    if(mode == 0) {
+        relay_report(r, "fail %s:%s does not exist", r->serial, r->path);
+        return -1;
+    }
+    if(!S_ISDIR(mode)) {
+        relay_add(r, mode, ltohl(msg.stat.time), ltohl(msg.stat.size), "");
+        return 0;
+    }
+
+    if(relay_features(r, &features))
+        goto fail;
+    if(!(features & SYNC_FEATURE_RLST))
+        return relay_walk(r);
+    if(relay_request(r->sfd, ID_RLST, r->path))
+        goto fail;
+    for(;;) {
+        if(readx(r->sfd, &msg.data, sizeof(msg.data)))
+            goto fail;
+        if(msg.data.id == ID_DONE)
+            return 0;
+        size = ltohl(msg.data.size);
+        if(size > SYNC_DATA_MAX || readx(r->sfd, r->buffer, size))
+            goto fail;
+        if(msg.data.id == ID_FAIL) {
+            r->buffer[size < 256 ? size : 256] = 0;
+            relay_report(r, "fail cannot list %s:%s: %s", r->serial, r->path, r->buffer);
+            return -1;
+        }
+        if(msg.data.id != ID_RDNT)
+            goto fail;
+
+        for(pos = 0; pos + sizeof(syncrdent) <= size; ) {
+            syncrdent ent;
+
+            memcpy(&ent, r->buffer + pos, sizeof(ent));
+            pos += sizeof(ent);
+            len = ltohl(ent.namelen);
+            if(len > 1024 || pos + len > size)
+                goto fail;
+            memcpy(name, r->buffer + pos, len);
+            name[len] = 0;
+            pos += len;
+
+            mode = ltohl(ent.mode);
+            if(S_ISREG(mode) || S_ISLNK(mode))
+                relay_add(r, mode, ltohl(ent.time),
+                          ((long long) ltohl(ent.size_hi) << 32) | ltohl(ent.size_lo),
+                          name);
+        }
+    }
+
+fail:
+    relay_report(r, "fail protocol failure listing %s:%s", r->serial, r->path);
+    return -1;
+}
+
+/* read the status of the last file sent to t, if it's still owed */
+static void relay_finish(relay *r, relay_target *t)
+{
+    syncmsg msg;
+    char reason[257];
+    unsigned len;
+
+    if(!t->pending || t->failed)
+        return;
+    t->pending = 0;
+
+    if(readx(t->fd, &msg.status, sizeof(msg.status))) {
+        strcpy(reason, "connection lost");
+    } else if(msg.status.id == ID_OKAY) {
+        return;
+    } else if(msg.status.id == ID_FAIL) {
+        len = ltohl(msg.status.msglen);
+        if(len > 256) len = 256;
+        if(readx(t->fd, reason, len))
+            len = 0;
+        reason[len] = 0;
+    } else {
+        strcpy(reason, "protocol failure");
+    }
+    relay_report(r, "target %s:%s failed: %s", t->serial, t->path, reason);
+    t->failed = 1;
+}
+
+static void relay_fail_target(relay *r, relay_target *t)
+{
+    relay_report(r, "target %s:%s failed: %s", t->serial, t->path, strerror(errno));
+    t->failed = 1;
+}
+
+/* stream one file from the source to every live target */
+static int relay_file_copy(relay *r, relay_file *f, long long *bytes)
+{
+    syncmsg msg, req;
+    char path[1025], tmp[64];
+    relay_target *t;
+    unsigned len;
+    int n, started = 0;
+
+    relay_path(path, r->path, f->name);
+    if(relay_request(r->sfd, ID_RECV, path))
+        return -1;
+
+    for(;;) {
+        if(readx(r->sfd, &msg.data, sizeof(msg.data)))
+            return -1;
+
+        if(msg.data.id == ID_FAIL) {
+            len = ltohl(msg.data.size);
+            if(len > 256) len = 256;
+            if(readx(r->sfd, r->buffer, len))
+                return -1;
+            r->buffer[len] = 0;
+            if(started) {
+                    /* the targets are half way through: there is no
+                    ** way to call that off but to drop them
+                    */
+                relay_report(r, "fail cannot read %s:%s: %s", r->serial, path, r->buffer);
+                return -1;
+            }
+            relay_report(r, "skipping %s:%s: %s", r->serial, path, r->buffer);
+            return 0;
+        }
+        if(msg.data.id != ID_DATA && msg.data.id != ID_DONE)
+            return -1;
+
+            /* only start the targets once the source has something */
+        if(!started) {
+            started = 1;
+            relay_report(r, "relay: %s:%s", r->serial, path);
+            for(n = 0; n < r->ntargets; n++) {
+                t = &r->targets[n];
+                if(t->failed) continue;
+                relay_finish(r, t);
+                if(t->failed) continue;
+
+                    /* plain ID_SEND, "<path>,<mode>", which any sdbd takes */
+                relay_path(path, t->path, f->name);
+                snprintf(tmp, sizeof(tmp), ",%u", S_ISLNK(f->mode) ? (S_IFREG | 0644) : f->mode);
+                len = strlen(path);
+                req.req.id = ID_SEND;
+                req.req.namelen = htoll(len + strlen(tmp));
+                if(len + strlen(tmp) > 1024) {
+                    errno = ENAMETOOLONG;
+                    relay_fail_target(r, t);
+                    continue;
+                }
+                if(writex(t->fd, &req.req, sizeof(req.req)) ||
+                   writex(t->fd, path, len) || writex(t->fd, tmp, strlen(tmp))) {
+                    relay_fail_target(r, t);
+                    continue;
+                }
+                t->pending = 1;
+            }
+            relay_path(path, r->path, f->name);
+        }
+
+        if(msg.data.id == ID_DONE) {
+            msg.data.size = htoll(f->time);
+            for(n = 0; n < r->ntargets; n++) {
+                t = &r->targets[n];
+                if(!t->failed && writex(t->fd, &msg.data, sizeof(msg.data)))
+                    relay_fail_target(r, t);
+            }
+            return 0;
+        }
+
+        len = ltohl(msg.data.size);
+        if(len > SYNC_DATA_MAX || readx(r->sfd, r->buffer, len))
+            return -1;
+        *bytes += len;
+
+        for(n = 0; n < r->ntargets; n++) {
+            t = &r->targets[n];
+            if(t->failed) continue;
+            if(writex(t->fd, &msg.data, sizeof(msg.data)) ||
+               writex(t->fd, r->buffer, len))
+                relay_fail_target(r, t);
+        }
+    }
+}
+
+static int relay_parse(relay *r, char *req)
+{
+    char *fields[2 + 2 * RELAY_MAX_TARGETS];
+    int n = 0;
+
+    while(*req && n < (int) (sizeof(fields) / sizeof(fields[0]))) {
+        char *end = strchr(req, '\n');
+        if(end == 0) break;
+        *end = 0;
+        fields[n++] = req;
+        req = end + 1;
+    }
+    if(n < 4 || (n & 1))
+        return -1;
+
+    r->serial = fields[0];
+    r->path = fields[1];
+    for(n -= 2; n > 0; n -= 2) {
+        relay_target *t = &r->targets[r->ntargets++];
+        t->serial = fields[2 * r->ntargets];
+        t->path = fields[2 * r->ntargets + 1];
+        t->fd = -1;
+    }
+    return 0;
+}
+
+void file_sync_relay_service(int fd, void *cookie)
+{
+    char req[4097];
+    char error[256];
+    long long bytes = 0;
+    unsigned len;
+    relay r;
+    int n, failed = 0, copied = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.out = fd;
+    r.sfd = -1;
+
+    if(readx(fd, req, 4))
+        goto done;
+    req[4] = 0;
+    len = strtoul(req, 0, 16);
+    if(len > sizeof(req) - 1 || readx(fd, req, len))
+        goto done;
+    req[len] = 0;
+
+    if(relay_parse(&r, req)) {
+        relay_report(&r, "fail bad relay request");
+        goto done;
+    }
+
+    r.buffer = malloc(SYNC_DATA_MAX + 1);
+    if(r.buffer == 0) {
+        relay_report(&r, "fail out of memory");
+        goto done;
+    }
+
+    r.sfd = sdb_connect_to(r.serial, "sync:", error, sizeof(error));
+    if(r.sfd < 0) {
+        relay_report(&r, "fail %s: %s", r.serial, error);
+        goto done;
+    }
+    for(n = 0; n < r.ntargets; n++) {
+        relay_target *t = &r.targets[n];
+        t->fd = sdb_connect_to(t->serial, "sync:", error, sizeof(error));
+        if(t->fd < 0) {
+            relay_report(&r, "fail %s: %s", t->serial, error);
+            goto done;
+        }
+    }
+
+    if(relay_list(&r))
+        goto done;
+
+    for(n = 0; n < r.count; n++) {
+        if(relay_file_copy(&r, &r.files[n], &bytes)) {
+            relay_report(&r, "fail protocol failure reading %s:%s", r.serial, r.path);
+            goto done;
+        }
+        copied++;
+    }
+    for(n = 0; n < r.ntargets; n++) {
+        relay_finish(&r, &r.targets[n]);
+        failed |= r.targets[n].failed;
+    }
+
+    if(failed)
+        relay_report(&r, "fail not every target got everything");
+    else
+        relay_report(&r, "ok %d %lld", copied, bytes);
+
+done:
+    if(r.sfd >= 0) {
+        relay_quit(r.sfd);
+        sdb_close(r.sfd);
+    }
+    for(n = 0; n < r.ntargets; n++) {
+        if(r.targets[n].fd >= 0) {
+            relay_quit(r.targets[n].fd);
+            sdb_close(r.targets[n].fd);
+        }
+    }
+    for(n = 0; n < r.count; n++)
+        free(r.files[n].name);
+    free(r.files);
+    free(r.buffer);
+    sdb_close(fd);
+}
@@ -22,6 +22,11 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <utime.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
 
 #include <errno.h>
 
@@ -30,6 +35,10 @@
 #define TRACE_TAG  TRACE_SYNC
 #include "sdb.h"
 #include "file_sync_service.h"
+#include "file_sync_archive.h"
+#include "sha256.h"
+#include "file_sync_filter.h"
+#include "file_sync_cas.h"
 
 static int mkdirs(char *name)
 {
@@ -60,7 +69,11 @@ static int do_stat(int s, const char *path)
 
     msg.stat.id = ID_STAT;
 
-    if(lstat(path, &st)) {
+    if(path[0] == 0) {
+        msg.stat.mode = 0;
+        msg.stat.size = htoll(SYNC_FEATURES);
+        msg.stat.time = 0;
+    } else if(lstat(path, &st)) {
         msg.stat.mode = 0;
         msg.stat.size = 0;
         msg.stat.time = 0;
@@ -148,19 +161,468 @@ static int fail_errno(int s)
     return fail_message(s, strerror(errno));
 }
 
-static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
+/* recursive listing for ID_RLST: the tree is walked with getdents64()
+** and statx() relative to each directory fd, and the entries go out
+** packed into ID_RDNT messages as soon as one fills up.
+**
+** the walk is breadth first, off a queue of the directories still to
+** read kept on the heap, with one of them open at a time: a deep tree
+** costs neither stack nor file descriptors.
+*/
+#define RLIST_DENTS_SIZE (32*1024)
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct rlist {
+    int s;
+    unsigned len;
+    char *buffer;
+    char *dents;
+    const sync_filter *filter;
+        /* paths below the root of the directories still to read, each
+        ** ending in a NUL; the next one starts at dirs + next
+        */
+    char *dirs;
+    size_t next;
+    size_t dirslen;
+    size_t dirsmax;
+    char name[PATH_MAX];
+} rlist;
+
+static int rlist_flush(rlist *rl)
 {
     syncmsg msg;
-    unsigned int timestamp = 0;
+
+    if(rl->len == 0)
+        return 0;
+
+    msg.data.id = ID_RDNT;
+    msg.data.size = htoll(rl->len);
+    if(writex(rl->s, &msg.data, sizeof(msg.data)) ||
+       writex(rl->s, rl->buffer, rl->len))
+        return -1;
+    rl->len = 0;
+    return 0;
+}
+
+static int rlist_stat(int dfd, const char *name, unsigned *mode,
+                      long long *size, unsigned *time)
+{
+    struct stat st;
+
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+
+    if(statx(dfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+             STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) == 0) {
+        *mode = stx.stx_mode;
+        *size = stx.stx_size;
+        *time = stx.stx_mtime.tv_sec;
+        return 0;
+    }
+    if(errno != ENOSYS)
+        return -1;
+#endif
+    if(fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW))
+        return -1;
+    *mode = st.st_mode;
+    *size = st.st_size;
+    *time = st.st_mtime;
+    return 0;
+}
+
+/* queue the directory whose path below the root is name */
+static int rlist_push(rlist *rl, const char *name, int len)
+{
+    if(rl->next > 0 && rl->next * 2 > rl->dirslen) {
+            /* most of the queue has been read: drop that part */
+        memmove(rl->dirs, rl->dirs + rl->next, rl->dirslen - rl->next);
+        rl->dirslen -= rl->next;
+        rl->next = 0;
+    }
+    if(rl->dirslen + len + 1 > rl->dirsmax) {
+        size_t max = rl->dirsmax ? rl->dirsmax * 2 : 4096;
+        char *dirs;
+
+        while(max < rl->dirslen + len + 1)
+            max *= 2;
+        dirs = realloc(rl->dirs, max);
+        if(dirs == 0)
+            return -1;
+        rl->dirs = dirs;
+        rl->dirsmax = max;
+    }
+    memcpy(rl->dirs + rl->dirslen, name, len);
+    rl->dirs[rl->dirslen + len] = 0;
+    rl->dirslen += len + 1;
+    return 0;
+}
+
+    /* list dfd, which rl->name (plen chars long) names, and close it */
+static int rlist_dir(rlist *rl, int dfd, int plen)
+{
+    int n, r = 0;
+
+    while(r == 0 && (n = syscall(SYS_getdents64, dfd, rl->dents, RLIST_DENTS_SIZE)) > 0) {
+        int pos;
+
+        for(pos = 0; pos < n; ) {
+            struct linux_dirent64 *de = (struct linux_dirent64*) (rl->dents + pos);
+            const char *name = de->d_name;
+            int nlen = strlen(name);
+            int len = plen ? plen + 1 + nlen : nlen;
+            syncrdent ent;
+            unsigned mode, time;
+            long long size;
+
+            pos += de->d_reclen;
+
+            if(name[0] == '.') {
+                if(name[1] == 0) continue;
+                if((name[1] == '.') && (name[2] == 0)) continue;
+            }
+            if(len >= PATH_MAX) continue;
+            if(rlist_stat(dfd, name, &mode, &size, &time)) continue;
+
+            if(plen)
+                rl->name[plen] = '/';
+            memcpy(rl->name + len - nlen, name, nlen + 1);
+            if(!sync_filter_accept(rl->filter, rl->name, mode, size, time))
+                continue;
+
+            if(rl->len + sizeof(ent) + len > SYNC_DATA_MAX && rlist_flush(rl)) {
+                r = -1;
+                break;
+            }
+            ent.mode = htoll(mode);
+            ent.size_lo = htoll((unsigned) size);
+            ent.size_hi = htoll((unsigned) (size >> 32));
+            ent.time = htoll(time);
+            ent.namelen = htoll(len);
+            memcpy(rl->buffer + rl->len, &ent, sizeof(ent));
+            memcpy(rl->buffer + rl->len + sizeof(ent), rl->name, len);
+            rl->len += sizeof(ent) + len;
+
+            if(S_ISDIR(mode) && rlist_push(rl, rl->name, len)) {
+                r = fail_message(rl->s, "out of memory") ? -1 : 1;
+                break;
+            }
+        }
+    }
+
+    sdb_close(dfd);
+    return r;
+}
+
+static int do_rlist(int s, const char *path, char *buffer,
+                    const sync_filter *filter)
+{
+    syncmsg msg;
+    rlist *rl;
+    int root, dfd, plen, r = 0;
+
+    root = sdb_open(path, O_RDONLY | O_DIRECTORY);
+    if(root < 0)
+        return fail_errno(s);
+
+    rl = calloc(1, sizeof(rlist));
+    if(rl == 0 || (rl->dents = malloc(RLIST_DENTS_SIZE)) == 0 ||
+       rlist_push(rl, "", 0)) {
+        r = fail_message(s, "out of memory") ? -1 : 1;
+        goto done;
+    }
+    rl->s = s;
+    rl->buffer = buffer;
+    rl->filter = filter;
+
+    while(r == 0 && rl->next < rl->dirslen) {
+        plen = strlen(rl->dirs + rl->next);
+        memcpy(rl->name, rl->dirs + rl->next, plen + 1);
+        rl->next += plen + 1;
+
+        dfd = openat(root, plen ? rl->name : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if(dfd < 0) {
+                /* an unreadable subdirectory is listed but left empty,
+                ** like ID_LIST does; running out of descriptors would
+                ** leave holes nobody is told about, so that fails.
+                */
+            if(errno == EMFILE || errno == ENFILE || errno == ENOMEM)
+                r = fail_errno(s) ? -1 : 1;
+            continue;
+        }
+        r = rlist_dir(rl, dfd, plen);
+    }
+    if(r == 0)
+        r = rlist_flush(rl);
+
+done:
+    if(rl) {
+        free(rl->dents);
+        free(rl->dirs);
+        free(rl);
+    }
+    sdb_close(root);
+    if(r)
+        return r < 0 ? -1 : 0;
+
+    msg.data.id = ID_DONE;
+    msg.data.size = 0;
+    return writex(s, &msg.data, sizeof(msg.data));
+}
+
+
+/* write-behind stage used while receiving large files: the sync thread
+** fills SYNC_WB_BLOCK_SIZE blocks straight from the socket and hands them
+** to a writer thread, so socket reads and storage writes overlap and the
+** file system sees a few large, block-aligned writes instead of many
+** SYNC_DATA_MAX ones.  one writer is started lazily per sync session.
+*/
+typedef struct wbblock wbblock;
+
+struct wbblock {
+    wbblock *next;
+    unsigned len;
+    char *data;
+};
+
+typedef struct writebehind {
+    sdb_mutex_t lock;
+    sdb_cond_t cond;
+    wbblock *free_list;
+    wbblock *queue_first;
+    wbblock *queue_last;
+    int busy;
+    int quit;
+    int exited;
     int fd;
+    int error;
+    wbblock blocks[SYNC_WB_BLOCKS];
+} writebehind;
 
-    fd = sdb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL, mode);
-    if(fd < 0 && errno == ENOENT) {
-        mkdirs(path);
-        fd = sdb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL, mode);
+static void *wb_thread(void *x)
+{
+    writebehind *wb = x;
+    wbblock *b;
+    int skip, err;
+
+    sdb_mutex_lock(&wb->lock);
+    for(;;) {
+        while(wb->queue_first == 0 && !wb->quit)
+            sdb_cond_wait(&wb->cond, &wb->lock);
+        if(wb->queue_first == 0)
+            break;
+
+        b = wb->queue_first;
+        wb->queue_first = b->next;
+        if(wb->queue_first == 0)
+            wb->queue_last = 0;
+        wb->busy = 1;
+        skip = wb->error;
+        sdb_mutex_unlock(&wb->lock);
+
+        err = 0;
+        if(!skip && writex(wb->fd, b->data, b->len))
+            err = errno ? errno : EIO;
+
+        sdb_mutex_lock(&wb->lock);
+        if(err && !wb->error)
+            wb->error = err;
+        b->next = wb->free_list;
+        wb->free_list = b;
+        wb->busy = 0;
+        sdb_cond_broadcast(&wb->cond);
     }
-    if(fd < 0 && errno == EEXIST) {
-        fd = sdb_open_mode(path, O_WRONLY, mode);
+    wb->exited = 1;
+    sdb_cond_broadcast(&wb->cond);
+    sdb_mutex_unlock(&wb->lock);
+    return 0;
+}
+
+static void wb_free_blocks(writebehind *wb)
+{
+    int n;
+
+    for(n = 0; n < SYNC_WB_BLOCKS; n++)
+        free(wb->blocks[n].data);
+}
+
+static writebehind *wb_create(void)
+{
+    writebehind *wb;
+    sdb_thread_t t;
+    int n;
+
+    wb = calloc(1, sizeof(writebehind));
+    if(wb == 0)
+        return 0;
+
+    for(n = 0; n < SYNC_WB_BLOCKS; n++) {
+        void *data;
+        if(posix_memalign(&data, 4096, SYNC_WB_BLOCK_SIZE)) {
+            wb_free_blocks(wb);
+            free(wb);
+            return 0;
+        }
+        wb->blocks[n].data = data;
+        wb->blocks[n].next = wb->free_list;
+        wb->free_list = &wb->blocks[n];
+    }
+
+    sdb_mutex_init(&wb->lock, NULL);
+    sdb_cond_init(&wb->cond, NULL);
+
+    if(sdb_thread_create(&t, wb_thread, wb)) {
+        D("sync: cannot create write-behind thread\n");
+        sdb_cond_destroy(&wb->cond);
+        sdb_mutex_destroy(&wb->lock);
+        wb_free_blocks(wb);
+        free(wb);
+        return 0;
+    }
+    return wb;
+}
+
+static void wb_destroy(writebehind *wb)
+{
+    sdb_mutex_lock(&wb->lock);
+    wb->quit = 1;
+    sdb_cond_broadcast(&wb->cond);
+    while(!wb->exited)
+        sdb_cond_wait(&wb->cond, &wb->lock);
+    sdb_mutex_unlock(&wb->lock);
+
+    sdb_cond_destroy(&wb->cond);
+    sdb_mutex_destroy(&wb->lock);
+    wb_free_blocks(wb);
+    free(wb);
+}
+
+/* get an empty block, waiting for the writer if all of them are queued */
+static wbblock *wb_get(writebehind *wb)
+{
+    wbblock *b;
+
+    sdb_mutex_lock(&wb->lock);
+    while(wb->free_list == 0)
+        sdb_cond_wait(&wb->cond, &wb->lock);
+    b = wb->free_list;
+    wb->free_list = b->next;
+    sdb_mutex_unlock(&wb->lock);
+
+    b->next = 0;
+    b->len = 0;
+    return b;
+}
+
+static void wb_release(writebehind *wb, wbblock *b)
+{
+    sdb_mutex_lock(&wb->lock);
+    b->next = wb->free_list;
+    wb->free_list = b;
+    sdb_cond_broadcast(&wb->cond);
+    sdb_mutex_unlock(&wb->lock);
+}
+
+/* queue a filled block for writing; returns the writer's errno, if any */
+static int wb_put(writebehind *wb, wbblock *b)
+{
+    int err;
+
+    sdb_mutex_lock(&wb->lock);
+    b->next = 0;
+    if(wb->queue_last)
+        wb->queue_last->next = b;
+    else
+        wb->queue_first = b;
+    wb->queue_last = b;
+    err = wb->error;
+    sdb_cond_broadcast(&wb->cond);
+    sdb_mutex_unlock(&wb->lock);
+    return err;
+}
+
+/* wait until everything queued has hit the file */
+static int wb_drain(writebehind *wb)
+{
+    int err;
+
+    sdb_mutex_lock(&wb->lock);
+    while(wb->queue_first || wb->busy)
+        sdb_cond_wait(&wb->cond, &wb->lock);
+    err = wb->error;
+    sdb_mutex_unlock(&wb->lock);
+    return err;
+}
+
+static void wb_begin(writebehind *wb, int fd)
+{
+    sdb_mutex_lock(&wb->lock);
+    wb->fd = fd;
+    wb->error = 0;
+    sdb_mutex_unlock(&wb->lock);
+}
+
+static void preallocate(int fd, long long size)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+    /* best effort only: reserve the extents up front so the file
+    ** doesn't end up fragmented, without changing its size.
+    */
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size))
+        D("sync: fallocate(%lld) failed: %s\n", size, strerror(errno));
+#endif
+}
+
+static int handle_send_file(int s, char *path, mode_t mode, char *buffer,
+                            writebehind **pwb, long long size, unsigned flags,
+                            long long offset)
+{
+    syncmsg msg;
+    unsigned int timestamp = 0;
+    char tmppath[1025 + 32];
+    char *wpath = path;
+    writebehind *wb = 0;
+    wbblock *b = 0;
+    sha256_ctx ctx;
+    long long received = 0;
+    int fd, err;
+
+        /* a resumed file's prefix never passes through here */
+    if(flags & SYNC_FLAG_RESUME)
+        flags &= ~SYNC_FLAG_CAS;
+    if(flags & SYNC_FLAG_CAS)
+        sha256_init(&ctx);
+
+    if(flags & SYNC_FLAG_RESUME) {
+        snprintf(tmppath, sizeof tmppath, "%s" SYNC_PART_SUFFIX, path);
+        wpath = tmppath;
+    } else if(flags & SYNC_FLAG_ATOMIC) {
+        wpath = tmppath;
+    }
+
+    if(wpath == tmppath && !(flags & SYNC_FLAG_RESUME)) {
+            /* a name of its own, so that two pushes to one path don't
+            ** remove each other's */
+        fd = sync_open_temp(tmppath, sizeof tmppath, path, mode);
+        if(fd < 0 && errno == ENOENT) {
+            mkdirs(tmppath);
+            fd = sync_open_temp(tmppath, sizeof tmppath, path, mode);
+        }
+    } else {
+        fd = sdb_open_mode(wpath, O_WRONLY | O_CREAT | O_EXCL, mode);
+        if(fd < 0 && errno == ENOENT) {
+            mkdirs(wpath);
+            fd = sdb_open_mode(wpath, O_WRONLY | O_CREAT | O_EXCL, mode);
+        }
+        if(fd < 0 && errno == EEXIST) {
+            fd = sdb_open_mode(wpath, O_WRONLY, mode);
+        }
     }
     if(fd < 0) {
         if(fail_errno(s))
@@ -168,6 +630,39 @@ static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
         fd = -1;
     }
 
+        /* pick up after the prefix the host has checked, dropping the rest */
+    if(fd >= 0 && (flags & SYNC_FLAG_RESUME)) {
+        struct stat st;
+
+        if(fstat(fd, &st) || st.st_size < offset) {
+            sdb_close(fd);
+            fd = -1;
+            if(fail_message(s, "partial file is shorter than the resume offset"))
+                return -1;
+        } else if(ftruncate64(fd, offset) || lseek64(fd, offset, SEEK_SET) < 0) {
+            err = errno;
+            sdb_close(fd);
+            fd = -1;
+            errno = err;
+            if(fail_errno(s))
+                return -1;
+        }
+    }
+
+    if(fd >= 0 && size > 0)
+        preallocate(fd, size);
+
+        /* small files of known size aren't worth a hand-off */
+    if(fd >= 0 && (size < 0 || size > SYNC_WB_BLOCK_SIZE)) {
+        if(*pwb == 0)
+            *pwb = wb_create();
+        wb = *pwb;
+        if(wb) {
+            wb_begin(wb, fd);
+            b = wb_get(wb);
+        }
+    }
+
     for(;;) {
         unsigned int len;
 
@@ -187,25 +682,96 @@ static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
             fail_message(s, "oversize data message");
             goto fail;
         }
-        if(readx(s, buffer, len))
-            goto fail;
+        received += len;
+
+        if(b) {
+            err = 0;
+            while(len > 0) {
+                unsigned n = SYNC_WB_BLOCK_SIZE - b->len;
+                if(n > len)
+                    n = len;
+                if(readx(s, b->data + b->len, n))
+                    goto fail;
+                if(flags & SYNC_FLAG_CAS)
+                    sha256_update(&ctx, b->data + b->len, n);
+                b->len += n;
+                len -= n;
+                if(b->len == SYNC_WB_BLOCK_SIZE) {
+                    err = wb_put(wb, b);
+                    b = wb_get(wb);
+                }
+            }
+            if(err == 0)
+                continue;
+
+            wb_release(wb, b);
+            b = 0;
+            wb_drain(wb);
+            errno = err;
+        } else {
+            if(readx(s, buffer, len))
+                goto fail;
+            if(flags & SYNC_FLAG_CAS)
+                sha256_update(&ctx, buffer, len);
+
+            if(fd < 0)
+                continue;
+            if(writex(fd, buffer, len) == 0)
+                continue;
+        }
 
-        if(fd < 0)
-            continue;
-        if(writex(fd, buffer, len)) {
+        err = errno;
+        sdb_close(fd);
+        sdb_unlink(wpath);
+        fd = -1;
+        errno = err;
+        if(fail_errno(s)) return -1;
+    }
+
+    if(b) {
+        if(b->len > 0)
+            wb_put(wb, b);
+        else
+            wb_release(wb, b);
+        b = 0;
+        err = wb_drain(wb);
+        if(err) {
             sdb_close(fd);
-            sdb_unlink(path);
+            sdb_unlink(wpath);
             fd = -1;
+            errno = err;
             if(fail_errno(s)) return -1;
         }
     }
 
+    if(fd >= 0 && (flags & SYNC_FLAG_FDATASYNC) && fdatasync(fd)) {
+        err = errno;
+        sdb_close(fd);
+        sdb_unlink(wpath);
+        fd = -1;
+        errno = err;
+        if(fail_errno(s)) return -1;
+    }
+
     if(fd >= 0) {
         struct utimbuf u;
         sdb_close(fd);
         u.actime = timestamp;
         u.modtime = timestamp;
-        utime(path, &u);
+        utime(wpath, &u);
+
+        if(wpath != path && rename(wpath, path)) {
+            err = errno;
+            sdb_unlink(wpath);
+            errno = err;
+            return fail_errno(s);
+        }
+
+        if(flags & SYNC_FLAG_CAS) {
+            unsigned char hash[SHA256_DIGEST_SIZE];
+            sha256_final(&ctx, hash);
+            cas_insert(path, received, hash);
+        }
 
         msg.status.id = ID_OKAY;
         msg.status.msglen = 0;
@@ -215,9 +781,18 @@ static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
     return 0;
 
 fail:
+        /* a resumable send keeps everything that made it across */
+    if(b) {
+        if((flags & SYNC_FLAG_RESUME) && b->len > 0)
+            wb_put(wb, b);
+        else
+            wb_release(wb, b);
+        wb_drain(wb);
+    }
     if(fd >= 0)
         sdb_close(fd);
-    sdb_unlink(path);
+    if(!(flags & SYNC_FLAG_RESUME))
+        sdb_unlink(wpath);
     return -1;
 }
 
@@ -271,7 +846,7 @@ static int handle_send_link(int s, char *path, char *buffer)
 }
 #endif /* HAVE_SYMLINKS */
 
-static int do_send(int s, char *path, char *buffer)
+static int do_send(int s, char *path, char *buffer, writebehind **pwb)
 {
     char *tmp;
     mode_t mode;
@@ -308,57 +883,357 @@ static int do_send(int s, char *path, char *buffer)
         mode |= ((mode >> 3) & 0070);
         mode |= ((mode >> 3) & 0007);
 
-        ret = handle_send_file(s, path, mode, buffer);
+        ret = handle_send_file(s, path, mode, buffer, pwb, -1, 0, 0);
     }
 
     return ret;
 }
 
+/* ID_SND2 carries the mode, the durability flags and the size of the
+** file in a fixed header after the path, instead of the ",mode" suffix.
+*/
+static int do_send2(int s, char *path, char *buffer, writebehind **pwb)
+{
+    syncmsg msg;
+    mode_t mode;
+    unsigned flags;
+    long long size, offset = 0;
+
+    if(readx(s, &msg.send2, sizeof(msg.send2)))
+        return -1;
+    if(msg.send2.id != ID_SND2) {
+        fail_message(s, "invalid send2 message");
+        return -1;
+    }
+    mode = ltohl(msg.send2.mode);
+    flags = ltohl(msg.send2.flags);
+    size = ((long long) ltohl(msg.send2.size_hi) << 32) | ltohl(msg.send2.size_lo);
+
+    if(flags & SYNC_FLAG_RESUME) {
+        if(readx(s, &msg.resume, sizeof(msg.resume)))
+            return -1;
+        if(msg.resume.id != ID_SND2) {
+            fail_message(s, "invalid resume message");
+            return -1;
+        }
+        offset = ((long long) ltohl(msg.resume.offset_hi) << 32) | ltohl(msg.resume.offset_lo);
+    }
+
+#ifdef HAVE_SYMLINKS
+    if(S_ISLNK(mode)) {
+        sdb_unlink(path);
+        return handle_send_link(s, path, buffer);
+    }
+#endif
+
+    mode &= 0777;
+    mode |= ((mode >> 3) & 0070);
+    mode |= ((mode >> 3) & 0007);
+
+        /* an atomic replace must leave the old file alone until the rename */
+    if(!(flags & (SYNC_FLAG_ATOMIC | SYNC_FLAG_RESUME)))
+        sdb_unlink(path);
+
+    return handle_send_file(s, path, mode, buffer, pwb, size, flags, offset);
+}
+
+/* ID_CLNK: link a file the content store already has into place */
+static int do_cas_link(int s, char *path)
+{
+    syncmsg msg;
+    mode_t mode;
+    long long size;
+    unsigned flags;
+    int r;
+
+    if(readx(s, &msg.cas, sizeof(msg.cas)))
+        return -1;
+    if(msg.cas.id != ID_CLNK) {
+        fail_message(s, "invalid cas message");
+        return -1;
+    }
+    mode = ltohl(msg.cas.mode) & 0777;
+    mode |= ((mode >> 3) & 0070);
+    mode |= ((mode >> 3) & 0007);
+    flags = ltohl(msg.cas.flags);
+    size = ((long long) ltohl(msg.cas.size_hi) << 32) | ltohl(msg.cas.size_lo);
+
+    r = cas_link(path, mode, ltohl(msg.cas.time), flags, size, msg.cas.hash);
+    if(r && errno == ENOENT) {
+        mkdirs(path);
+        r = cas_link(path, mode, ltohl(msg.cas.time), flags, size, msg.cas.hash);
+    }
+    D("sync: cas %s for '%s'\n", r ? "miss" : "hit", path);
+
+    msg.status.id = r ? ID_MISS : ID_OKAY;
+    msg.status.msglen = 0;
+    return writex(s, &msg.status, sizeof(msg.status));
+}
+
+/* send length bytes of fd from offset (length < 0: up to the end) as
+** ID_DATA messages, then ID_DONE.  regular files go out with sendfile()
+** where the kernel allows it; anything else, including files that claim
+** to be empty like those in /proc, is read into buffer.
+**
+** the end is where the file ends when the send gets there, so a log
+** that grows meanwhile is sent to its new end.  one cut short under a
+** DATA message whose header is already out can't be: the message is
+** filled up with zeros, to keep the stream in step, and the answer is
+** ID_FAIL instead of ID_DONE.
+*/
+static int send_file_range(int s, int fd, long long offset, long long length,
+                           char *buffer)
+{
+    syncmsg msg;
+    struct stat st;
+    int r;
+
+    msg.data.id = ID_DATA;
+
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        off64_t pos = offset;
+        long long size = st.st_size;
+        long long end = (length < 0 || length > LLONG_MAX - offset) ? -1 : offset + length;
+        int use_sendfile = 1;
+
+        for(;;) {
+            long long avail;
+            int n, err = 0;
+
+            if(pos >= size && fstat(fd, &st) == 0)
+                size = st.st_size;
+            avail = (end >= 0 && end < size ? end : size) - pos;
+            if(avail <= 0)
+                break;
+            n = avail > SYNC_DATA_MAX ? SYNC_DATA_MAX : avail;
+
+            msg.data.size = htoll(n);
+            if(writex(s, &msg.data, sizeof(msg.data)))
+                return -1;
+
+            while(n > 0) {
+                if(use_sendfile) {
+                    r = sendfile64(s, fd, &pos, n);
+                    if(r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                        use_sendfile = 0;
+                        continue;
+                    }
+                } else {
+                    r = pread64(fd, buffer, n, pos);
+                    if(r > 0) {
+                        if(writex(s, buffer, r))
+                            return -1;
+                        pos += r;
+                    }
+                }
+                if(r < 0 && errno == EINTR) continue;
+                if(r <= 0) {
+                    err = r < 0 ? errno : 0;
+                    break;
+                }
+                n -= r;
+            }
+            if(n > 0) {
+                memset(buffer, 0, n);
+                if(writex(s, buffer, n))
+                    return -1;
+                return fail_message(s, err ? strerror(err) : "file shrank while being read");
+            }
+        }
+    } else {
+        if(offset > 0 && lseek64(fd, offset, SEEK_SET) < 0)
+            return fail_errno(s);
+
+        while(length != 0) {
+            int n = (length < 0 || length > SYNC_DATA_MAX) ? SYNC_DATA_MAX : length;
+
+            r = sdb_read(fd, buffer, n);
+            if(r <= 0) {
+                if(r == 0) break;
+                if(errno == EINTR) continue;
+                return fail_errno(s);
+            }
+            msg.data.size = htoll(r);
+            if(writex(s, &msg.data, sizeof(msg.data)) ||
+               writex(s, buffer, r)) {
+                return -1;
+            }
+            if(length > 0)
+                length -= r;
+        }
+    }
+
+    msg.data.id = ID_DONE;
+    msg.data.size = 0;
+    if(writex(s, &msg.data, sizeof(msg.data))) {
+        return -1;
+    }
+
+    return 0;
+}
+
 static int do_recv(int s, const char *path, char *buffer)
+{
+    int fd, r;
+
+    fd = sdb_open(path, O_RDONLY);
+    if(fd < 0) {
+        if(fail_errno(s)) return -1;
+        return 0;
+    }
+
+    r = send_file_range(s, fd, 0, -1, buffer);
+    sdb_close(fd);
+    return r;
+}
+
+/* ID_RCV2 names a byte range: from offset, or offset bytes back from the
+** end with SYNC_RECV_TAIL, for length bytes (all ones: to the end).
+*/
+static int do_recv2(int s, const char *path, char *buffer)
 {
     syncmsg msg;
+    struct stat st;
+    long long offset, length;
+    unsigned flags;
     int fd, r;
 
+    if(readx(s, &msg.recv2, sizeof(msg.recv2)))
+        return -1;
+    if(msg.recv2.id != ID_RCV2) {
+        fail_message(s, "invalid recv2 message");
+        return -1;
+    }
+    flags = ltohl(msg.recv2.flags);
+    offset = ((long long) ltohl(msg.recv2.offset_hi) << 32) | ltohl(msg.recv2.offset_lo);
+    length = ((long long) ltohl(msg.recv2.length_hi) << 32) | ltohl(msg.recv2.length_lo);
+    if(offset < 0)
+        return fail_message(s, "invalid offset");
+
     fd = sdb_open(path, O_RDONLY);
     if(fd < 0) {
         if(fail_errno(s)) return -1;
         return 0;
     }
 
-    msg.data.id = ID_DATA;
-    for(;;) {
-        r = sdb_read(fd, buffer, SYNC_DATA_MAX);
-        if(r <= 0) {
-            if(r == 0) break;
-            if(errno == EINTR) continue;
-            r = fail_errno(s);
+    if(flags & SYNC_RECV_TAIL) {
+        if(fstat(fd, &st) || !S_ISREG(st.st_mode)) {
             sdb_close(fd);
-            return r;
-        }
-        msg.data.size = htoll(r);
-        if(writex(s, &msg.data, sizeof(msg.data)) ||
-           writex(s, buffer, r)) {
-            sdb_close(fd);
-            return -1;
+            return fail_message(s, "can only tail regular files");
         }
+        offset = offset < st.st_size ? st.st_size - offset : 0;
     }
 
+    r = send_file_range(s, fd, offset, length, buffer);
     sdb_close(fd);
+    return r;
+}
 
-    msg.data.id = ID_DONE;
-    msg.data.size = 0;
-    if(writex(s, &msg.data, sizeof(msg.data))) {
-        return -1;
+/* ID_PQRY: report how much of a resumable send is already here */
+static int do_query_partial(int s, const char *path, char *buffer)
+{
+    syncmsg msg;
+    sha256_ctx ctx;
+    char tmppath[1025 + 8];
+    long long size = 0;
+    int fd, r;
+
+    snprintf(tmppath, sizeof tmppath, "%s" SYNC_PART_SUFFIX, path);
+    sha256_init(&ctx);
+
+    fd = sdb_open(tmppath, O_RDONLY);
+    if(fd < 0 && errno != ENOENT)
+        return fail_errno(s);
+    if(fd >= 0) {
+        for(;;) {
+            r = sdb_read(fd, buffer, SYNC_DATA_MAX);
+            if(r <= 0) {
+                if(r == 0) break;
+                if(errno == EINTR) continue;
+                sdb_close(fd);
+                return fail_errno(s);
+            }
+            sha256_update(&ctx, buffer, r);
+            size += r;
+        }
+        sdb_close(fd);
     }
 
+    msg.part.id = ID_PART;
+    msg.part.size_lo = htoll((unsigned) size);
+    msg.part.size_hi = htoll((unsigned) (size >> 32));
+    sha256_final(&ctx, msg.part.hash);
+    return writex(s, &msg.part, sizeof(msg.part));
+}
+
+/* ID_ASND: the host streams a whole tree, which is unpacked under path */
+static int do_archive_send(int s, const char *path)
+{
+    archive_stats stats;
+    char error[256];
+    syncmsg msg;
+    int r;
+
+    r = archive_receive(s, path, &stats, error, sizeof(error));
+    D("sync: archive into '%s': %u files, %u dirs, %u links, %lld bytes\n",
+      path, stats.files, stats.dirs, stats.links, stats.bytes);
+    if(r < 0)
+        return -1;
+    if(r > 0)
+        return fail_message(s, error);
+
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    if(writex(s, &msg.status, sizeof(msg.status)))
+        return -1;
     return 0;
 }
 
+static int archive_filter(void *cookie, const char *name, unsigned mode,
+                          long long size, unsigned mtime)
+{
+    return sync_filter_accept(cookie, name, mode, size, mtime);
+}
+
+/* ID_ARCV: stream the tree under path back to the host */
+static int do_archive_recv(int s, const char *path, sync_filter *filter)
+{
+    archive_stats stats;
+    char error[256];
+
+    if(archive_send(s, path, filter ? archive_filter : 0, filter,
+                    &stats, error, sizeof(error)) < 0)
+        return -1;
+    return 0;
+}
+
+/* ID_FILT: replace the filter used by the walks that follow */
+static int do_filter(int s, const char *spec, sync_filter **pfilter)
+{
+    syncmsg msg;
+    char error[256];
+
+    sync_filter_free(*pfilter);
+    *pfilter = 0;
+
+    if(spec[0]) {
+        *pfilter = sync_filter_parse(spec, error, sizeof(error));
+        if(*pfilter == 0)
+            return fail_message(s, error);
+    }
+
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    return writex(s, &msg.status, sizeof(msg.status));
+}
+
 void file_sync_service(int fd, void *cookie)
 {
     syncmsg msg;
     char name[1025];
     unsigned namelen;
+    writebehind *wb = 0;
+    sync_filter *filter = 0;
 
     char *buffer = malloc(SYNC_DATA_MAX);
     if(buffer == 0) goto fail;
@@ -391,12 +1266,36 @@ void file_sync_service(int fd, void *cookie)
         case ID_LIST:
             if(do_list(fd, name)) goto fail;
             break;
+        case ID_RLST:
+            if(do_rlist(fd, name, buffer, filter)) goto fail;
+            break;
         case ID_SEND:
-            if(do_send(fd, name, buffer)) goto fail;
+            if(do_send(fd, name, buffer, &wb)) goto fail;
+            break;
+        case ID_SND2:
+            if(do_send2(fd, name, buffer, &wb)) goto fail;
             break;
         case ID_RECV:
             if(do_recv(fd, name, buffer)) goto fail;
             break;
+        case ID_RCV2:
+            if(do_recv2(fd, name, buffer)) goto fail;
+            break;
+        case ID_CLNK:
+            if(do_cas_link(fd, name)) goto fail;
+            break;
+        case ID_PQRY:
+            if(do_query_partial(fd, name, buffer)) goto fail;
+            break;
+        case ID_FILT:
+            if(do_filter(fd, name, &filter)) goto fail;
+            break;
+        case ID_ASND:
+            if(do_archive_send(fd, name)) goto fail;
+            break;
+        case ID_ARCV:
+            if(do_archive_recv(fd, name, filter)) goto fail;
+            break;
         case ID_QUIT:
             goto fail;
         default:
@@ -406,6 +1305,8 @@ void file_sync_service(int fd, void *cookie)
     }
 
 fail:
+    sync_filter_free(filter);
+    if(wb != 0) wb_destroy(wb);
     if(buffer != 0) free(buffer);
     D("sync: done\n");
     sdb_close(fd);
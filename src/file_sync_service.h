@@ -45,6 +45,17 @@ static inline unsigned __swap_uint32(unsigned x)
 #define ID_OKAY MKID('O','K','A','Y')
 #define ID_FAIL MKID('F','A','I','L')
 #define ID_QUIT MKID('Q','U','I','T')
+#define ID_SND2 MKID('S','N','D','2')
+#define ID_ASND MKID('A','S','N','D')
+#define ID_ARCV MKID('A','R','C','V')
+#define ID_RLST MKID('R','L','S','T')
+#define ID_RDNT MKID('R','D','N','T')
+#define ID_RCV2 MKID('R','C','V','2')
+#define ID_PQRY MKID('P','Q','R','Y')
+#define ID_PART MKID('P','A','R','T')
+#define ID_FILT MKID('F','I','L','T')
+#define ID_CLNK MKID('C','L','N','K')
+#define ID_MISS MKID('M','I','S','S')
 
 typedef union {
     unsigned id;
@@ -65,6 +76,41 @@ typedef union {
         unsigned time;
         unsigned namelen;
     } dent;
+    struct {
+        unsigned id;
+        unsigned mode;
+        unsigned flags;
+        unsigned size_lo;
+        unsigned size_hi;
+    } send2;
+    struct {
+        unsigned id;
+        unsigned offset_lo;
+        unsigned offset_hi;
+    } resume;
+    struct {
+        unsigned id;
+        unsigned size_lo;
+        unsigned size_hi;
+        unsigned char hash[32];
+    } part;
+    struct {
+        unsigned id;
+        unsigned mode;
+        unsigned flags;
+        unsigned time;
+        unsigned size_lo;
+        unsigned size_hi;
+        unsigned char hash[32];
+    } cas;
+    struct {
+        unsigned id;
+        unsigned flags;
+        unsigned offset_lo;
+        unsigned offset_hi;
+        unsigned length_lo;
+        unsigned length_hi;
+    } recv2;
     struct {
         unsigned id;
         unsigned size;
@@ -76,12 +122,79 @@ typedef union {
 } syncmsg;
 
 
+/* ID_RLST answers with ID_RDNT messages (sized like ID_DATA) until
+** ID_DONE.  each one packs as many of these as fit, each followed by
+** namelen bytes of path relative to the listed directory.  a
+** directory always comes before its contents.
+*/
+typedef struct {
+    unsigned mode;
+    unsigned size_lo;
+    unsigned size_hi;
+    unsigned time;
+    unsigned namelen;
+} syncrdent;
+
 void file_sync_service(int fd, void *cookie);
+void file_sync_relay_service(int fd, void *cookie);
 int do_sync_ls(const char *path);
-int do_sync_push(const char *lpath, const char *rpath, int verifyApk);
-int do_sync_sync(const char *lpath, const char *rpath, int listonly);
-int do_sync_pull(const char *rpath, const char *lpath);
+int do_sync_push(const char *lpath, const char *rpath, int verifyApk, unsigned flags);
+int do_sync_push_fanout(int nserials, const char **serials,
+                        const char *lpath, const char *rpath, unsigned flags);
+int do_sync_sync(const char *lpath, const char *rpath, const char *serial,
+                 int listonly, unsigned flags);
+int do_sync_pull(const char *rpath, const char *lpath, const char *filter);
+int do_sync_pull_range(const char *rpath, const char *lpath, long long offset,
+                       long long length, unsigned flags, int resume);
+int do_sync_push_archive(const char *lpath, const char *rpath);
+int do_sync_pull_archive(const char *rpath, const char *lpath, const char *filter);
+int do_sync_relay(const char *sserial, const char *spath,
+                  int ntargets, const char **tserials, const char **tpaths);
 
 #define SYNC_DATA_MAX (64*1024)
 
+/* ID_SND2 flags: how durable the file must be before the OKAY is sent.
+** with neither flag the data is left to the page cache, as with ID_SEND.
+*/
+#define SYNC_FLAG_FDATASYNC  0x0001  /* fdatasync() before acknowledging */
+#define SYNC_FLAG_ATOMIC     0x0002  /* receive into a temp file, rename() into place */
+#define SYNC_FLAG_RESUME     0x0004  /* continue <path>.sdbpart from the offset in the
+                                        resume header that follows send2 */
+#define SYNC_FLAG_CAS        0x0008  /* add the file to the device's content store */
+
+/* ID_STAT of the empty path, which no file can have, answers with the
+** SYNC_FEATURE_* bits this sdbd understands in place of the size.  an
+** older one reports it missing, all zeros, and only knows STAT, LIST,
+** SEND, RECV and QUIT: anything else makes it drop the connection.
+*/
+#define SYNC_FEATURE_SND2    0x0001  /* ID_SND2 with any SYNC_FLAG_*, ID_PQRY */
+#define SYNC_FEATURE_RLST    0x0002
+#define SYNC_FEATURE_RCV2    0x0004
+#define SYNC_FEATURE_CAS     0x0008  /* ID_CLNK */
+#define SYNC_FEATURE_FILT    0x0010
+#define SYNC_FEATURE_ARCHIVE 0x0020  /* ID_ASND, ID_ARCV */
+#define SYNC_FEATURES        0x003f
+
+/* ID_CLNK <path> + cas header: put the stored file with that hash at
+** path.  the answer is ID_OKAY, or ID_MISS (no message) when the host
+** has to send it after all.  files smaller than this aren't worth the
+** extra round trip.
+*/
+#define SYNC_CAS_MIN_SIZE    (16*1024)
+
+/* a resumable send collects the file here, and keeps it if the transport
+** goes away.  ID_PQRY <path> answers with an ID_PART message giving its
+** size and the SHA-256 of its contents.
+*/
+#define SYNC_PART_SUFFIX     ".sdbpart"
+
+/* ID_RCV2 flags */
+#define SYNC_RECV_TAIL       0x0001  /* the offset counts back from the end of the file */
+
+/* write-behind buffers used by sdbd to overlap socket reads with
+** storage writes when receiving large files.
+*/
+#define SYNC_WB_BLOCK_SIZE   (256*1024)
+#define SYNC_WB_BLOCKS       4
+
 #endif
@@ -6,8 +6,10 @@
 SDB_MUTEX(dns_lock)
 SDB_MUTEX(socket_list_lock)
 SDB_MUTEX(transport_lock)
+SDB_MUTEX(transport_tx_lock)
 #if SDB_HOST
 SDB_MUTEX(local_transports_lock)
+SDB_MUTEX(server_ready_lock)
 #endif
 SDB_MUTEX(usb_lock)
 
@@ -202,10 +202,11 @@ void print_packet(const char *label, apacket *p)
 }
 #endif
 
-static void send_ready(unsigned local, unsigned remote, atransport *t)
+static void send_ready(unsigned local, unsigned remote, int stream_class, atransport *t)
 {
     D("Calling send_ready \n");
     apacket *p = get_apacket();
+    p->stream_class = stream_class;
     p->msg.command = A_OKAY;
     p->msg.arg0 = local;
     p->msg.arg1 = remote;
@@ -233,11 +234,6 @@ static void send_connect(atransport *t)
             HOST ? "host" : sdb_device_banner);
     cp->msg.data_length = strlen((char*) cp->data) + 1;
     send_packet(cp, t);
-#if SDB_HOST
-        /* XXX why sleep here? */
-    // allow the device some time to respond to the connect message
-    sdb_sleep_ms(1000);
-#endif
 }
 
 static char *connection_state_name(atransport *t)
@@ -348,7 +344,8 @@ void handle_packet(apacket *p, atransport *t)
             } else {
                 s->peer = create_remote_socket(p->msg.arg0, t);
                 s->peer->peer = s;
-                send_ready(s->id, s->peer->id, t);
+                s->stream_class = s->peer->stream_class = stream_class_of(name);
+                send_ready(s->id, s->peer->id, s->stream_class, t);
                 s->ready(s);
             }
         }
@@ -360,6 +357,7 @@ void handle_packet(apacket *p, atransport *t)
                 if(s->peer == 0) {
                     s->peer = create_remote_socket(p->msg.arg0, t);
                     s->peer->peer = s;
+                    s->peer->stream_class = s->stream_class;
                 }
                 s->ready(s);
             }
@@ -382,7 +380,7 @@ void handle_packet(apacket *p, atransport *t)
 
                 if(s->enqueue(s, p) == 0) {
                     D("Enqueue the socket\n");
-                    send_ready(s->id, rid, t);
+                    send_ready(s->id, rid, s->stream_class, t);
                 }
                 return;
             }
@@ -403,6 +401,7 @@ alistener listener_list = {
 
 static void ss_listener_event_func(int _fd, unsigned ev, void *_l)
 {
+    alistener *l = _l;
     asocket *s;
 
     if(ev & FDE_READ) {
@@ -414,7 +413,26 @@ static void ss_listener_event_func(int _fd, unsigned ev, void *_l)
         fd = sdb_socket_accept(_fd, &addr, &alen);
         if(fd < 0) return;
 
-        sdb_socket_setbufsize(fd, CHUNK_SIZE);
+#ifndef HAVE_WIN32_IPC
+        if(!strncmp(l->local_name, "local", 5)) {
+                /* a Unix-domain socket: only our own user (or root)
+                ** gets to talk to us through it
+                */
+            int uid = socket_local_peer_uid(fd);
+            if(uid != 0 && uid != (int) getuid()) {
+                D("refusing smartsocket client with uid %d\n", uid);
+                sdb_close(fd);
+                return;
+            }
+        } else
+#endif
+        {
+            sdb_socket_setbufsize(fd, CHUNK_SIZE);
+                /* replies are relayed as they arrive from the device; with
+                ** Nagle, a second small one waits out the client's delayed ack
+                */
+            disable_tcp_nagle(fd);
+        }
 
         s = create_local_socket(fd);
         if(s) {
@@ -823,6 +841,47 @@ int launch_server(int server_port)
 }
 #endif
 
+#if SDB_HOST
+/* "OK" goes down the launcher's pipe once the server has had its first
+** look for devices, so that the client can go ahead the moment it has;
+** a device that never finishes its handshake holds it up this long at most
+*/
+#define SERVER_READY_WAIT_MAX  3000
+
+#ifdef HAVE_WIN32_PROC
+static HANDLE ready_pipe = INVALID_HANDLE_VALUE;
+#else
+static int ready_pipe = -1;
+#endif
+SDB_MUTEX_DEFINE( server_ready_lock );
+
+void server_ready(void)
+{
+    sdb_mutex_lock(&server_ready_lock);
+#ifdef HAVE_WIN32_PROC
+    if(ready_pipe != INVALID_HANDLE_VALUE) {
+        DWORD  count;
+        WriteFile( ready_pipe, "OK\n", 3, &count, NULL );
+        ready_pipe = INVALID_HANDLE_VALUE;
+    }
+#else
+    if(ready_pipe >= 0) {
+        writex(ready_pipe, "OK\n", 3);
+        sdb_close(ready_pipe);
+        ready_pipe = -1;
+    }
+#endif
+    sdb_mutex_unlock(&server_ready_lock);
+}
+
+static void *server_ready_timeout(void *x)
+{
+    sdb_sleep_ms(SERVER_READY_WAIT_MAX);
+    server_ready();
+    return 0;
+}
+#endif
+
 /* Constructs a local name of form tcp:port.
  * target_str points to the target string, it's content will be overwritten.
  * target_size is the capacity of the target string.
@@ -858,11 +917,21 @@ int sdb_main(int is_daemon, int server_port)
     usb_init();
     local_init(DEFAULT_SDB_LOCAL_TRANSPORT_PORT);
 
-    char local_name[30];
+    char local_name[64];
     build_local_name(local_name, sizeof(local_name), server_port);
     if(install_listener(local_name, "*smartsocket*", NULL)) {
         exit(1);
     }
+#ifndef HAVE_WIN32_IPC
+        /* local clients skip TCP through this one; the port stays for
+        ** everything else, so not getting it is no reason to give up
+        */
+    if(getenv("SDB_NO_LOCAL_SOCKET") == NULL) {
+        snprintf(local_name, sizeof(local_name), "localabstract:" SDB_SERVER_SOCKET_NAME,
+                 server_port);
+        install_listener(local_name, "*smartsocket*", NULL);
+    }
+#endif
 #else
     /* run sdbd in secure mode if ro.secure is set and
     ** we are not in the emulator
@@ -965,12 +1034,27 @@ int sdb_main(int is_daemon, int server_port)
 
     if (is_daemon)
     {
+#if SDB_HOST
+        // inform our parent that we are up and running, once we are:
+        // keep its pipe past start_logging() for server_ready().
+        sdb_thread_t  tid;
+#ifdef HAVE_WIN32_PROC
+        ready_pipe = GetStdHandle( STD_OUTPUT_HANDLE );
+#elif defined(HAVE_FORKEXEC)
+        ready_pipe = dup(STDERR_FILENO);
+        close_on_exec(ready_pipe);
+#endif
+        if(sdb_thread_create(&tid, server_ready_timeout, NULL)) {
+            server_ready();
+        }
+#else
         // inform our parent that we are up and running.
 #ifdef HAVE_WIN32_PROC
         DWORD  count;
         WriteFile( GetStdHandle( STD_OUTPUT_HANDLE ), "OK\n", 3, &count, NULL );
 #elif defined(HAVE_FORKEXEC)
         fprintf(stderr, "OK\n");
+#endif
 #endif
         start_logging();
     }
@@ -1061,14 +1145,6 @@ void connect_emulator(char* port_spec, char* buffer, int buffer_size)
         return;
     }
 
-    /* Check if more emulators can be registered. Similar unproblematic
-     * race condition as above. */
-    int candidate_slot = get_available_local_transport_index();
-    if (candidate_slot < 0) {
-        snprintf(buffer, buffer_size, "Cannot accept more emulators.");
-        return;
-    }
-
     /* Preconditions met, try to connect to the emulator. */
     if (!local_connect_arbitrary_ports(console_port, sdb_port, NULL)) {
         snprintf(buffer, buffer_size,
@@ -1091,6 +1167,9 @@ int handle_host_request(char *service, transport_type ttype, char* serial, int r
         fflush(stdout);
         sdb_write(reply_fd, "OKAY", 4);
         usb_cleanup();
+#if SDB_HOST
+        flush_devicename();
+#endif
         exit(0);
     }
 
@@ -1127,14 +1206,17 @@ int handle_host_request(char *service, transport_type ttype, char* serial, int r
 
     // return a list of all connected devices
     if (!strcmp(service, "devices")) {
-        char buffer[4096];
-        memset(buf, 0, sizeof(buf));
-        memset(buffer, 0, sizeof(buffer));
+        char *msg;
+        int len;
         D("Getting device list \n");
-        list_transports(buffer, sizeof(buffer));
-        snprintf(buf, sizeof(buf), "OKAY%04x%s",(unsigned)strlen(buffer),buffer);
+        msg = list_transports_msg("OKAY", &len);
+        if (msg == NULL) {
+            sendfailmsg(reply_fd, "out of memory");
+            return 0;
+        }
+        writex(reply_fd, msg, len);
+        free(msg);
         D("Wrote device list \n");
-        writex(reply_fd, buf, strlen(buf));
         return 0;
     }
 
@@ -1273,6 +1355,28 @@ int handle_host_request(char *service, transport_type ttype, char* serial, int r
         writex(reply_fd, buf, strlen(buf));
         return 0;
     }
+
+    if(!strcmp(service, "get-transport-stats")) {
+        char *err;
+        char stats[sizeof(buf) - 8];    /* room for OKAY and the length */
+        int len;
+
+        transport = acquire_one_transport(CS_ANY, ttype, serial, &err);
+        if (!transport) {
+            sendfailmsg(reply_fd, err);
+            return 0;
+        }
+        len = transport_tx_stats(transport, stats, sizeof stats);
+        if (len < 0) {
+            sendfailmsg(reply_fd, "device not connected");
+            return 0;
+        }
+        if (len > 0xffff)
+            len = 0xffff;
+        snprintf(buf, sizeof buf, "OKAY%04x%s", (unsigned)len, stats);
+        writex(reply_fd, buf, strlen(buf));
+        return 0;
+    }
     return -1;
 }
 
@@ -53,6 +53,15 @@ struct amessage {
     unsigned magic;         /* command ^ 0xffffffff             */
 };
 
+/* how the packets of a stream share its transport with the other
+** streams' (see send_packet()): the classes get the transport in
+** proportion to their weights, the streams of a class in turn
+*/
+#define STREAM_NORMAL       0
+#define STREAM_INTERACTIVE  1
+#define STREAM_BULK         2
+#define STREAM_CLASSES      3
+
 struct apacket
 {
     apacket *next;
@@ -60,6 +69,12 @@ struct apacket
     unsigned len;
     unsigned char *ptr;
 
+        /* the class of the stream it belongs to, and when send_packet()
+        ** queued it (microseconds)
+        */
+    int stream_class;
+    long long queued;
+
     amessage msg;
     unsigned char data[MAX_PAYLOAD];
 };
@@ -123,6 +138,9 @@ struct asocket {
         /* socket-type-specific extradata */
     void *extra;
 
+        /* STREAM_*, given to the packets sent for this socket */
+    int stream_class;
+
     	/* A socket is bound to atransport */
     atransport *transport;
 };
@@ -171,7 +189,10 @@ struct atransport
     int fd;
     int transport_socket;
     fdevent transport_fde;
-    int ref_count;
+
+        /* the packets send_packet() queued for the input thread */
+    struct tx_sched *tx;
+    volatile int ref_count;
     unsigned sync_token;
     int connection_state;
     transport_type type;
@@ -186,6 +207,12 @@ struct atransport
     int sdb_port; // Use for emulators (local transport)
     char *device_name; // for connection explorer
 
+        /* the next one in the same bucket of the indexes by serial
+        ** (transport.c) and by emulator port (transport_local.c)
+        */
+    atransport *serial_next;
+    atransport *port_next;
+
         /* a list of adisconnect callbacks called when the transport is kicked */
     int          kicked;
     adisconnect  disconnects;
@@ -230,6 +257,8 @@ asocket *create_local_service_socket(const char *destination);
 
 asocket *create_remote_socket(unsigned id, atransport *t);
 void connect_to_remote(asocket *s, const char *destination);
+/* the STREAM_* class of a connection to service */
+int stream_class_of(const char *service);
 void connect_to_smartsocket(asocket *s);
 
 void fatal(const char *fmt, ...);
@@ -237,25 +266,54 @@ void fatal_errno(const char *fmt, ...);
 
 void handle_packet(apacket *p, atransport *t);
 void send_packet(apacket *p, atransport *t);
+/* t's per-class queue counters as text (those of every transport when
+** t is NULL): the length, or -1 when buf is too small
+*/
+int transport_tx_stats(atransport *t, char *buf, int size);
 
 void get_my_path(char *s, size_t maxLen);
 int launch_server(int server_port);
 int sdb_main(int is_daemon, int server_port);
+#if SDB_HOST
+void server_ready(void);
+#endif
 
 
 /* transports are ref-counted
 ** get_device_transport does an acquire on your behalf before returning
 */
 void init_transport_registration(void);
-int  list_transports(char *buf, size_t  bufsize);
+/* the device list, as 'sdb devices' prints it, after prefix and its
+** length in 4 hex digits: malloc'd, with the whole length in *msglen
+*/
+char *list_transports_msg(const char *prefix, int *msglen);
 void update_transports(void);
 
+#if SDB_HOST
+/* the server's first look for devices: a scan calls startup_scan_begin()
+** before it starts and startup_scan_done() once it has registered all it
+** found; server_ready() follows when the last is done and none of the
+** transports is still waiting for its device's banner
+*/
+void startup_scan_begin(void);
+void startup_scan_done(void);
+#endif
+
 asocket*  create_device_tracker(void);
 
+#if SDB_HOST
+/* answer OKAY once a transport matching ttype and serial is in state,
+** or FAIL when timeout_ms (unless negative) runs out first
+*/
+asocket*  create_state_waiter(int state, transport_type ttype, const char* serial,
+                              int timeout_ms);
+#endif
+
 /* Obtain a transport from the available transports.
 ** If state is != CS_ANY, only transports in that state are considered.
 ** If serial is non-NULL then only the device with that serial will be chosen.
-** If no suitable transport is found, error is set.
+** If no suitable transport is found, error is set; this doesn't wait
+** for one to show up, create_state_waiter() does.
 */
 atransport *acquire_one_transport(int state, transport_type ttype, const char* serial, char **error_out);
 void   add_transport_disconnect( atransport*  t, adisconnect*  dis );
@@ -264,9 +322,6 @@ void   run_transport_disconnects( atransport*  t );
 void   kick_transport( atransport*  t );
 
 /* initialize a transport object's func pointers and state */
-#if SDB_HOST
-int get_available_local_transport_index();
-#endif
 int  init_socket_transport(atransport *t, int s, int port, int local);
 void init_usb_transport(atransport *t, usb_handle *usb, int state);
 
@@ -304,6 +359,8 @@ int       create_jdwp_connection_fd(int  jdwp_pid);
 
 #if !SDB_HOST
 void framebuffer_service(int fd, void *cookie);
+void exec_session_service(int fd, void *cookie);
+pid_t spawn_subprocess(char *const argv[], const char *pts, const int *fds, int nfds);
 #if 0 //eric
 void log_service(int fd, void *cookie);
 void remount_service(int fd, void *cookie);
@@ -374,6 +431,10 @@ typedef enum {
 #endif
 
 #define DEFAULT_SDB_PORT 26099
+/* the host server also listens on this Unix-domain socket, in the
+** abstract namespace where there is one, after the port it serves
+*/
+#define SDB_SERVER_SOCKET_NAME "sdb-server.%d"
 #define DEFAULT_SDB_LOCAL_TRANSPORT_PORT 26101
 
 #define SDB_CLASS              0xFF
@@ -400,6 +461,9 @@ int is_sdb_interface(int vid, int pid, int usb_class, int usb_subclass, int usb_
 
 unsigned host_to_le32(unsigned n);
 int sdb_commandline(int argc, char **argv);
+#if SDB_HOST
+int do_batch(const char *path, int jobs, transport_type ttype, const char *serial);
+#endif
 
 int connection_state(atransport *t);
 
@@ -426,6 +490,9 @@ int handle_host_request(char *service, transport_type ttype, char* serial, int r
 #define DEFAULT_DEVICENAME "<unknown>"
 void register_device_name(const char *device_type, const char *device_name, int port);
 int get_devicename_from_shdmem(int port, char *device_name);
-int read_line(const int fd, char* ptr, const size_t maxlen);
+/* DEVICEMAP_FILENAME is saved a little after the changes; this saves
+** what is still to be saved right now
+*/
+void flush_devicename(void);
 #endif
 #endif
@@ -20,6 +20,12 @@ static const char* __sdb_serial = NULL;
 
 static int __sdb_server_port = DEFAULT_SDB_PORT;
 
+/* set once the server has been found to speak our version, so that the
+** rest of this process (and, with sdb batch, the children it forks)
+** connects straight to the service instead of asking again
+*/
+static int __sdb_version_ok = 0;
+
 void sdb_set_transport(transport_type type, const char* serial)
 {
     __sdb_transport = type;
@@ -133,13 +139,14 @@ static int switch_socket_transport(int fd)
     return 0;
 }
 
-int sdb_status(int fd)
+/* read an OKAY/FAIL status, leaving the reason for a FAIL in error */
+static int read_status(int fd, char *error, int errlen)
 {
     unsigned char buf[5];
     unsigned len;
 
     if(readx(fd, buf, 4)) {
-        strcpy(__sdb_error, "protocol fault (no status)");
+        snprintf(error, errlen, "protocol fault (no status)");
         return -1;
     }
 
@@ -148,27 +155,89 @@ int sdb_status(int fd)
     }
 
     if(memcmp(buf, "FAIL", 4)) {
-        sprintf(__sdb_error,
-                "protocol fault (status %02x %02x %02x %02x?!)",
-                buf[0], buf[1], buf[2], buf[3]);
+        snprintf(error, errlen,
+                 "protocol fault (status %02x %02x %02x %02x?!)",
+                 buf[0], buf[1], buf[2], buf[3]);
         return -1;
     }
 
     if(readx(fd, buf, 4)) {
-        strcpy(__sdb_error, "protocol fault (status len)");
+        snprintf(error, errlen, "protocol fault (status len)");
         return -1;
     }
     buf[4] = 0;
     len = strtoul((char*)buf, 0, 16);
-    if(len > 255) len = 255;
-    if(readx(fd, __sdb_error, len)) {
-        strcpy(__sdb_error, "protocol fault (status read)");
+    if(len > (unsigned) errlen - 1) len = errlen - 1;
+    if(readx(fd, error, len)) {
+        snprintf(error, errlen, "protocol fault (status read)");
         return -1;
     }
-    __sdb_error[len] = 0;
+    error[len] = 0;
     return -1;
 }
 
+int sdb_status(int fd)
+{
+    return read_status(fd, __sdb_error, sizeof(__sdb_error));
+}
+
+/* the server's Unix-domain socket is quicker to get through than its
+** port, when it has one and runs as us
+*/
+static int connect_to_server(void)
+{
+#ifndef HAVE_WIN32_IPC
+    char name[32];
+    int fd;
+
+    if(getenv("SDB_NO_LOCAL_SOCKET") == NULL) {
+        snprintf(name, sizeof name, SDB_SERVER_SOCKET_NAME, __sdb_server_port);
+        fd = socket_local_client_same_user(name, ANDROID_SOCKET_NAMESPACE_ABSTRACT,
+                                           SOCK_STREAM);
+        if(fd >= 0)
+            return fd;
+    }
+#endif
+    return socket_loopback_client(__sdb_server_port, SOCK_STREAM);
+}
+
+static int send_request(int fd, const char *service)
+{
+    char tmp[5];
+    int len = strlen(service);
+
+    snprintf(tmp, sizeof tmp, "%04x", len);
+    return writex(fd, tmp, 4) || writex(fd, service, len);
+}
+
+int sdb_connect_to(const char *serial, const char *service, char *error, int errlen)
+{
+    char transport[128];
+    int fd;
+
+    error[0] = 0;
+    if(strlen(service) > 1024 || strlen(serial) > sizeof(transport) - 16) {
+        snprintf(error, errlen, "service name too long");
+        return -1;
+    }
+
+    fd = connect_to_server();
+    if(fd < 0) {
+        snprintf(error, errlen, "cannot connect to daemon");
+        return -1;
+    }
+
+    snprintf(transport, sizeof transport, "host:transport:%s", serial);
+    if(send_request(fd, transport) || read_status(fd, error, errlen) ||
+       send_request(fd, service) || read_status(fd, error, errlen)) {
+        if(error[0] == 0)
+            snprintf(error, errlen, "write failure during connection");
+        sdb_close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 int _sdb_connect(const char *service)
 {
     char tmp[5];
@@ -183,7 +252,7 @@ int _sdb_connect(const char *service)
     }
     snprintf(tmp, sizeof tmp, "%04x", len);
 
-    fd = socket_loopback_client(__sdb_server_port, SOCK_STREAM);
+    fd = connect_to_server();
     if(fd < 0) {
         strcpy(__sdb_error, "cannot connect to daemon");
         return -2;
@@ -209,8 +278,20 @@ int _sdb_connect(const char *service)
 
 int sdb_connect(const char *service)
 {
+    int fd;
+
+    if(__sdb_version_ok) {
+        if (!strcmp(service, "host:start-server"))
+            return 0;
+        fd = _sdb_connect(service);
+        if(fd != -2)
+            return fd;
+        // the server has gone away since; start over
+        __sdb_version_ok = 0;
+    }
+
     // first query the sdb server's version
-    int fd = _sdb_connect("host:version");
+    fd = _sdb_connect("host:version");
 
     if(fd == -2) {
         fprintf(stdout,"* daemon not running. starting it now on port %d *\n",
@@ -222,8 +303,9 @@ int sdb_connect(const char *service)
         } else {
             fprintf(stdout,"* daemon started successfully *\n");
         }
-        /* give the server some time to start properly and detect devices */
-        sdb_sleep_ms(3000);
+        /* no need to wait: the server only says it's up once it has
+        ** looked for devices and they have come online
+        */
         // fall through to _sdb_connect
     } else {
         // if server was running, check its version to make sure it is not out of date
@@ -260,6 +342,8 @@ int sdb_connect(const char *service)
         }
     }
 
+    __sdb_version_ok = 1;
+
     // if the command is start-server, we are done.
     if (!strcmp(service, "host:start-server"))
         return 0;
@@ -308,7 +392,6 @@ char *sdb_query(const char *service)
 
     buf[4] = 0;
     n = strtoul(buf, 0, 16);
-    if(n > 1024) goto oops;
 
     tmp = malloc(n + 1);
     if(tmp == 0) goto oops;
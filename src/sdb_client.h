@@ -21,6 +21,13 @@ int sdb_command(const char *service);
 */
 char *sdb_query(const char *service);
 
+/* connect to service on the device with the given serial, leaving the
+** transport picked with sdb_set_transport() alone, and return the fd or
+** -1 with the reason in error.  unlike sdb_connect() this never starts
+** the server and keeps no global state, so any thread may call it.
+*/
+int sdb_connect_to(const char *serial, const char *service, char *error, int errlen);
+
 /* Set the preferred transport to connect to.
 */
 void sdb_set_transport(transport_type type, const char* serial);
@@ -0,0 +1,711 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sysdeps.h"
+#include "sdb.h"
+#include "exec_session.h"
+#include "sdb_lib.h"
+
+/* the library stands alone: nothing here may touch the globals of the
+** sdb client (or its trace flags), so it has its own copies of the few
+** helpers it needs
+*/
+
+#define OP_STACK_SIZE   (128*1024)
+#define OP_BUFFER_SIZE  (sizeof(syncmsg) + SYNC_DATA_MAX)
+
+enum {
+    OP_SHELL,
+    OP_PUSH,
+    OP_PULL,
+    OP_TRACK,
+};
+
+struct sdb_ctx {
+    int port;
+    sdb_mutex_t lock;
+    sdb_cond_t cond;    /* signalled when an operation finishes */
+    sdb_op *ops;        /* the ones still running */
+    int running;
+};
+
+struct sdb_op {
+    sdb_ctx *ctx;
+    sdb_op *next;
+    sdb_op *prev;
+    int kind;
+    char *serial;
+    char *src;
+    char *dst;
+    sdb_callbacks cb;
+    void *opaque;
+
+        /* under ctx->lock */
+    int fd;             /* the connection, once there is one */
+    int cancelled;
+    int finished;
+    int refs;           /* the thread's and the caller's */
+
+    int status;
+    char error[256];
+    char *buf;          /* OP_BUFFER_SIZE */
+};
+
+static int lib_readx(int fd, void *ptr, size_t len)
+{
+    char *p = ptr;
+    int r;
+
+    while(len > 0) {
+        r = sdb_read(fd, p, len);
+        if(r > 0) {
+            len -= r;
+            p += r;
+        } else if(r < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if(r == 0) errno = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int lib_writex(int fd, const void *ptr, size_t len)
+{
+    const char *p = ptr;
+    int r;
+
+    while(len > 0) {
+        r = sdb_write(fd, p, len);
+        if(r > 0) {
+            len -= r;
+            p += r;
+        } else if(r < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* the request goes in one write, which spares a round trip with Nagle */
+static int lib_send_request(int fd, const char *service)
+{
+    char buf[1024 + 5];
+    int len = strlen(service);
+
+    snprintf(buf, sizeof buf, "%04x%s", len, service);
+    return lib_writex(fd, buf, len + 4);
+}
+
+static int lib_read_status(int fd, char *error, int errlen)
+{
+    char buf[256];
+    unsigned len;
+
+    if(lib_readx(fd, buf, 4)) {
+        snprintf(error, errlen, "protocol fault (no status)");
+        return -1;
+    }
+    if(!memcmp(buf, "OKAY", 4))
+        return 0;
+    if(memcmp(buf, "FAIL", 4) || lib_readx(fd, buf, 4)) {
+        snprintf(error, errlen, "protocol fault (bad status)");
+        return -1;
+    }
+    buf[4] = 0;
+    len = strtoul(buf, 0, 16);
+    if(len > sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    if(lib_readx(fd, buf, len)) {
+        snprintf(error, errlen, "protocol fault (status read)");
+        return -1;
+    }
+    buf[len] = 0;
+    snprintf(error, errlen, "%s", buf);
+    return -1;
+}
+
+sdb_ctx *sdb_ctx_new(int server_port)
+{
+    sdb_ctx *ctx = calloc(1, sizeof(sdb_ctx));
+
+    if(ctx == 0)
+        return 0;
+    ctx->port = server_port ? server_port : DEFAULT_SDB_PORT;
+    sdb_mutex_init(&ctx->lock, NULL);
+    sdb_cond_init(&ctx->cond, NULL);
+    return ctx;
+}
+
+void sdb_ctx_free(sdb_ctx *ctx)
+{
+    sdb_op *op;
+
+    sdb_mutex_lock(&ctx->lock);
+    for(op = ctx->ops; op; op = op->next) {
+        op->cancelled = 1;
+        if(op->fd >= 0)
+            sdb_shutdown(op->fd);
+    }
+    while(ctx->running)
+        sdb_cond_wait(&ctx->cond, &ctx->lock);
+    sdb_mutex_unlock(&ctx->lock);
+
+    sdb_cond_destroy(&ctx->cond);
+    sdb_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+/* by the server's Unix-domain socket if we may, as sdb itself does */
+static int lib_connect_server(int port)
+{
+    char name[32];
+    int fd;
+
+    if(getenv("SDB_NO_LOCAL_SOCKET") == NULL) {
+        snprintf(name, sizeof name, SDB_SERVER_SOCKET_NAME, port);
+        fd = socket_local_client_same_user(name, ANDROID_SOCKET_NAMESPACE_ABSTRACT,
+                                           SOCK_STREAM);
+        if(fd >= 0)
+            return fd;
+    }
+    return socket_loopback_client(port, SOCK_STREAM);
+}
+
+int sdb_ctx_connect(sdb_ctx *ctx, const char *serial, const char *service,
+                    char *error, int errlen)
+{
+    char transport[128];
+    int fd;
+
+    if(strlen(service) > 1024 || (serial && strlen(serial) > sizeof(transport) - 16)) {
+        snprintf(error, errlen, "service name too long");
+        return -1;
+    }
+
+    fd = lib_connect_server(ctx->port);
+    if(fd < 0) {
+        snprintf(error, errlen, "cannot connect to the sdb server on port %d", ctx->port);
+        return -1;
+    }
+
+    if(memcmp(service, "host", 4)) {
+        if(serial)
+            snprintf(transport, sizeof transport, "host:transport:%s", serial);
+        else
+            snprintf(transport, sizeof transport, "host:transport-any");
+        if(lib_send_request(fd, transport) || lib_read_status(fd, error, errlen))
+            goto fail;
+    }
+    if(lib_send_request(fd, service) || lib_read_status(fd, error, errlen))
+        goto fail;
+    return fd;
+
+fail:
+    sdb_close(fd);
+    return -1;
+}
+
+/* a host service's answer: four hex digits of length, then that much */
+static char *lib_read_answer(int fd, char *error, int errlen)
+{
+    char buf[5];
+    char *answer;
+    unsigned len;
+
+    if(lib_readx(fd, buf, 4)) {
+        snprintf(error, errlen, "connection to the server lost");
+        return 0;
+    }
+    buf[4] = 0;
+    len = strtoul(buf, 0, 16);
+    answer = malloc(len + 1);
+    if(answer == 0) {
+        snprintf(error, errlen, "out of memory");
+        return 0;
+    }
+    if(lib_readx(fd, answer, len)) {
+        snprintf(error, errlen, "connection to the server lost");
+        free(answer);
+        return 0;
+    }
+    answer[len] = 0;
+    return answer;
+}
+
+char *sdb_ctx_query(sdb_ctx *ctx, const char *service, char *error, int errlen)
+{
+    char *answer;
+    int fd;
+
+    fd = sdb_ctx_connect(ctx, 0, service, error, errlen);
+    if(fd < 0)
+        return 0;
+    answer = lib_read_answer(fd, error, errlen);
+    sdb_close(fd);
+    return answer;
+}
+
+
+/* connect op to service, unless it has been cancelled meanwhile */
+static int op_connect(sdb_op *op, const char *service)
+{
+    int fd = sdb_ctx_connect(op->ctx, op->serial, service, op->error, sizeof(op->error));
+
+    if(fd < 0)
+        return -1;
+    sdb_mutex_lock(&op->ctx->lock);
+    if(op->cancelled) {
+        sdb_mutex_unlock(&op->ctx->lock);
+        sdb_close(fd);
+        return -1;
+    }
+    op->fd = fd;
+    sdb_mutex_unlock(&op->ctx->lock);
+    return fd;
+}
+
+static int op_fail(sdb_op *op, const char *what)
+{
+    if(op->error[0] == 0)
+        snprintf(op->error, sizeof(op->error), "%s", what);
+    return -1;
+}
+
+static int op_shell(sdb_op *op)
+{
+    sessionmsg msg;
+    char *buf = op->buf;
+    unsigned len;
+    int fd;
+
+    len = strlen(op->src);
+    if(len > EXEC_SESSION_MAX_COMMAND)
+        return op_fail(op, "command too long");
+    fd = op_connect(op, "session:");
+    if(fd < 0)
+        return -1;
+
+        /* the command and the end of the session, in one write */
+    msg.data.id = ID_XRUN;
+    msg.data.reqid = htoll(0);
+    msg.data.len = htoll(len);
+    memcpy(buf, &msg.data, sizeof(msg.data));
+    memcpy(buf + sizeof(msg.data), op->src, len);
+    msg.id = ID_QUIT;
+    memcpy(buf + sizeof(msg.data) + len, &msg.id, sizeof(msg.id));
+    if(lib_writex(fd, buf, sizeof(msg.data) + len + sizeof(msg.id)))
+        return op_fail(op, "connection lost");
+
+    for(;;) {
+        if(lib_readx(fd, &msg.data, sizeof(msg.data)))
+            return op_fail(op, "connection lost");
+        if(msg.id == ID_XEXT) {
+            op->status = (int) ltohl(msg.exit.status);
+            if(op->status == -1)
+                return op_fail(op, "the command could not be run");
+            return op->status;
+        }
+        len = ltohl(msg.data.len);
+        if((msg.id != ID_XOUT && msg.id != ID_XERR) || len > SYNC_DATA_MAX)
+            return op_fail(op, "protocol fault");
+        if(lib_readx(fd, buf, len))
+            return op_fail(op, "connection lost");
+        if(op->cb.output)
+            op->cb.output(op->opaque, msg.id == ID_XOUT ? 1 : 2, buf, len);
+    }
+}
+
+/* the OKAY or FAIL that ends a sync request */
+static int op_sync_status(sdb_op *op, int fd)
+{
+    syncmsg msg;
+    unsigned len;
+
+    if(lib_readx(fd, &msg.status, sizeof(msg.status)))
+        return op_fail(op, "connection lost");
+    if(msg.status.id == ID_OKAY)
+        return 0;
+    if(msg.status.id != ID_FAIL)
+        return op_fail(op, "protocol fault");
+    len = ltohl(msg.status.msglen);
+    if(len > sizeof(op->error) - 1)
+        len = sizeof(op->error) - 1;
+    if(lib_readx(fd, op->error, len))
+        return op_fail(op, "connection lost");
+    op->error[len] = 0;
+    return -1;
+}
+
+static void op_sync_quit(int fd)
+{
+    syncmsg msg;
+
+    msg.req.id = ID_QUIT;
+    msg.req.namelen = 0;
+    lib_writex(fd, &msg.req, sizeof(msg.req));
+}
+
+static int op_push(sdb_op *op)
+{
+    syncmsg msg;
+    struct stat st;
+    char *buf = op->buf;
+    long long copied = 0;
+    int lfd, fd, len, r;
+
+    if(stat(op->src, &st) || !S_ISREG(st.st_mode)) {
+        snprintf(op->error, sizeof(op->error), "cannot push '%s': %s", op->src,
+                 errno ? strerror(errno) : "not a regular file");
+        return -1;
+    }
+    lfd = sdb_open(op->src, O_RDONLY);
+    if(lfd < 0) {
+        snprintf(op->error, sizeof(op->error), "cannot open '%s': %s", op->src, strerror(errno));
+        return -1;
+    }
+    fd = op_connect(op, "sync:");
+    if(fd < 0) {
+        sdb_close(lfd);
+        return -1;
+    }
+
+    len = snprintf(buf + sizeof(msg.req), SYNC_DATA_MAX, "%s,%d", op->dst, (int) st.st_mode);
+    if(len > 1024 + 16) {
+        sdb_close(lfd);
+        return op_fail(op, "remote path too long");
+    }
+    msg.req.id = ID_SEND;
+    msg.req.namelen = htoll(len);
+    memcpy(buf, &msg.req, sizeof(msg.req));
+    if(lib_writex(fd, buf, sizeof(msg.req) + len)) {
+        sdb_close(lfd);
+        return op_fail(op, "connection lost");
+    }
+
+    if(op->cb.progress)
+        op->cb.progress(op->opaque, 0, st.st_size);
+    for(;;) {
+        r = sdb_read(lfd, buf + sizeof(msg.data), SYNC_DATA_MAX);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r < 0) {
+            snprintf(op->error, sizeof(op->error), "cannot read '%s': %s", op->src, strerror(errno));
+            sdb_close(lfd);
+            return -1;
+        }
+        if(r == 0)
+            break;
+        msg.data.id = ID_DATA;
+        msg.data.size = htoll(r);
+        memcpy(buf, &msg.data, sizeof(msg.data));
+        if(lib_writex(fd, buf, sizeof(msg.data) + r)) {
+            sdb_close(lfd);
+            return op_fail(op, "connection lost");
+        }
+        copied += r;
+        if(op->cb.progress)
+            op->cb.progress(op->opaque, copied, st.st_size);
+    }
+    sdb_close(lfd);
+
+    msg.data.id = ID_DONE;
+    msg.data.size = htoll((unsigned) st.st_mtime);
+    if(lib_writex(fd, &msg.data, sizeof(msg.data)))
+        return op_fail(op, "connection lost");
+    if(op_sync_status(op, fd))
+        return -1;
+    op_sync_quit(fd);
+    return 0;
+}
+
+static int op_pull(sdb_op *op)
+{
+    syncmsg msg;
+    char *buf = op->buf;
+    long long copied = 0, total;
+    unsigned len;
+    int lfd, fd;
+
+    len = strlen(op->src);
+    if(len > 1024)
+        return op_fail(op, "remote path too long");
+    fd = op_connect(op, "sync:");
+    if(fd < 0)
+        return -1;
+
+    msg.req.id = ID_STAT;
+    msg.req.namelen = htoll(len);
+    memcpy(buf, &msg.req, sizeof(msg.req));
+    memcpy(buf + sizeof(msg.req), op->src, len);
+    if(lib_writex(fd, buf, sizeof(msg.req) + len) ||
+       lib_readx(fd, &msg.stat, sizeof(msg.stat)) || msg.stat.id != ID_STAT)
+        return op_fail(op, "connection lost");
+    if(msg.stat.mode == 0) {
+        snprintf(op->error, sizeof(op->error), "remote object '%s' does not exist", op->src);
+        return -1;
+    }
+    total = ltohl(msg.stat.size);
+
+    msg.req.id = ID_RECV;
+    msg.req.namelen = htoll(len);
+    memcpy(buf, &msg.req, sizeof(msg.req));
+    if(lib_writex(fd, buf, sizeof(msg.req) + len))
+        return op_fail(op, "connection lost");
+
+    lfd = sdb_creat(op->dst, 0644);
+    if(lfd < 0) {
+        snprintf(op->error, sizeof(op->error), "cannot create '%s': %s", op->dst, strerror(errno));
+        return -1;
+    }
+    if(op->cb.progress)
+        op->cb.progress(op->opaque, 0, total);
+
+    for(;;) {
+        if(lib_readx(fd, &msg.data, sizeof(msg.data))) {
+            op_fail(op, "connection lost");
+            goto fail;
+        }
+        if(msg.data.id == ID_DONE)
+            break;
+        len = ltohl(msg.data.size);
+        if(msg.data.id == ID_FAIL) {
+            if(len > sizeof(op->error) - 1)
+                len = sizeof(op->error) - 1;
+            if(lib_readx(fd, op->error, len))
+                len = 0;
+            op->error[len] = 0;
+            op_fail(op, "remote read failed");
+            goto fail;
+        }
+        if(msg.data.id != ID_DATA || len > SYNC_DATA_MAX) {
+            op_fail(op, "protocol fault");
+            goto fail;
+        }
+        if(lib_readx(fd, buf, len)) {
+            op_fail(op, "connection lost");
+            goto fail;
+        }
+        if(lib_writex(lfd, buf, len)) {
+            snprintf(op->error, sizeof(op->error), "cannot write '%s': %s", op->dst, strerror(errno));
+            goto fail;
+        }
+        copied += len;
+        if(op->cb.progress)
+            op->cb.progress(op->opaque, copied, total > copied ? total : copied);
+    }
+    sdb_close(lfd);
+    op_sync_quit(fd);
+    return 0;
+
+fail:
+    sdb_close(lfd);
+    sdb_unlink(op->dst);
+    return -1;
+}
+
+static int op_track(sdb_op *op)
+{
+    char *list;
+    int fd;
+
+    fd = op_connect(op, "host:track-devices");
+    if(fd < 0)
+        return -1;
+    for(;;) {
+        list = lib_read_answer(fd, op->error, sizeof(op->error));
+        if(list == 0)
+            return -1;
+        if(op->cb.devices)
+            op->cb.devices(op->opaque, list);
+        free(list);
+    }
+}
+
+static void op_free(sdb_op *op)
+{
+    free(op->serial);
+    free(op->src);
+    free(op->dst);
+    free(op->buf);
+    free(op);
+}
+
+static void *op_thread(void *x)
+{
+    sdb_op *op = x;
+    sdb_ctx *ctx = op->ctx;
+    int status, refs;
+
+    switch(op->kind) {
+    case OP_SHELL: status = op_shell(op); break;
+    case OP_PUSH:  status = op_push(op); break;
+    case OP_PULL:  status = op_pull(op); break;
+    default:       status = op_track(op); break;
+    }
+
+    sdb_mutex_lock(&ctx->lock);
+    if(op->fd >= 0) {
+        sdb_close(op->fd);
+        op->fd = -1;
+    }
+    if(op->cancelled && status < 0)
+        snprintf(op->error, sizeof(op->error), "cancelled");
+    sdb_mutex_unlock(&ctx->lock);
+
+    op->status = status;
+    if(op->cb.done)
+        op->cb.done(op->opaque, status, status < 0 ? op->error : 0);
+
+    sdb_mutex_lock(&ctx->lock);
+    op->finished = 1;
+    if(op->prev)
+        op->prev->next = op->next;
+    else
+        ctx->ops = op->next;
+    if(op->next)
+        op->next->prev = op->prev;
+    ctx->running--;
+    refs = --op->refs;
+    sdb_cond_broadcast(&ctx->cond);
+    sdb_mutex_unlock(&ctx->lock);
+
+        /* ctx may be gone by now, if that was the last operation */
+    if(refs == 0)
+        op_free(op);
+    return 0;
+}
+
+static char *lib_strdup(const char *s, int *failed)
+{
+    char *copy;
+
+    if(s == 0)
+        return 0;
+    copy = strdup(s);
+    if(copy == 0)
+        *failed = 1;
+    return copy;
+}
+
+static sdb_op *op_start(sdb_ctx *ctx, int kind, const char *serial, const char *src,
+                        const char *dst, const sdb_callbacks *cb, void *opaque)
+{
+    sdb_thread_t t;
+    sdb_op *op;
+    int failed = 0;
+
+    op = calloc(1, sizeof(sdb_op));
+    if(op == 0)
+        return 0;
+    op->ctx = ctx;
+    op->kind = kind;
+    op->serial = lib_strdup(serial, &failed);
+    op->src = lib_strdup(src, &failed);
+    op->dst = lib_strdup(dst, &failed);
+    op->buf = malloc(OP_BUFFER_SIZE);
+    if(cb)
+        op->cb = *cb;
+    op->opaque = opaque;
+    op->fd = -1;
+    op->refs = 2;
+    if(failed || op->buf == 0) {
+        op_free(op);
+        return 0;
+    }
+
+    sdb_mutex_lock(&ctx->lock);
+    op->next = ctx->ops;
+    if(ctx->ops)
+        ctx->ops->prev = op;
+    ctx->ops = op;
+    ctx->running++;
+    if(sdb_thread_create_stack(&t, op_thread, op, OP_STACK_SIZE)) {
+        ctx->ops = op->next;
+        if(ctx->ops)
+            ctx->ops->prev = 0;
+        ctx->running--;
+        sdb_mutex_unlock(&ctx->lock);
+        op_free(op);
+        return 0;
+    }
+    sdb_mutex_unlock(&ctx->lock);
+    return op;
+}
+
+sdb_op *sdb_ctx_shell(sdb_ctx *ctx, const char *serial, const char *command,
+                      const sdb_callbacks *cb, void *opaque)
+{
+    return op_start(ctx, OP_SHELL, serial, command, 0, cb, opaque);
+}
+
+sdb_op *sdb_ctx_push(sdb_ctx *ctx, const char *serial, const char *lpath,
+                     const char *rpath, const sdb_callbacks *cb, void *opaque)
+{
+    return op_start(ctx, OP_PUSH, serial, lpath, rpath, cb, opaque);
+}
+
+sdb_op *sdb_ctx_pull(sdb_ctx *ctx, const char *serial, const char *rpath,
+                     const char *lpath, const sdb_callbacks *cb, void *opaque)
+{
+    return op_start(ctx, OP_PULL, serial, rpath, lpath, cb, opaque);
+}
+
+sdb_op *sdb_ctx_track_devices(sdb_ctx *ctx, const sdb_callbacks *cb, void *opaque)
+{
+    return op_start(ctx, OP_TRACK, 0, 0, 0, cb, opaque);
+}
+
+int sdb_op_wait(sdb_op *op)
+{
+    sdb_ctx *ctx = op->ctx;
+
+    sdb_mutex_lock(&ctx->lock);
+    while(!op->finished)
+        sdb_cond_wait(&ctx->cond, &ctx->lock);
+    sdb_mutex_unlock(&ctx->lock);
+    return op->status;
+}
+
+void sdb_op_cancel(sdb_op *op)
+{
+    sdb_mutex_lock(&op->ctx->lock);
+    op->cancelled = 1;
+    if(op->fd >= 0)
+        sdb_shutdown(op->fd);
+    sdb_mutex_unlock(&op->ctx->lock);
+}
+
+void sdb_op_release(sdb_op *op)
+{
+    int refs;
+
+    sdb_mutex_lock(&op->ctx->lock);
+    refs = --op->refs;
+    sdb_mutex_unlock(&op->ctx->lock);
+    if(refs == 0)
+        op_free(op);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SDB_LIB_H_
+#define _SDB_LIB_H_
+
+/* libsdb: the client side of sdb as a library, for programs that would
+** otherwise run the sdb binary for every operation.
+**
+** everything hangs off an sdb_ctx, which holds the server port; there
+** is no other state, so any number of contexts and operations may be
+** used from any number of threads.  the library talks to a running sdb
+** server and never starts one.
+**
+** the operations below return at once with an sdb_op and run on a
+** thread of their own, reporting through the callbacks given to them:
+** those are called from that thread, so they must not block for long.
+** every operation ends with exactly one call to done().
+*/
+
+typedef struct sdb_ctx sdb_ctx;
+typedef struct sdb_op sdb_op;
+
+typedef struct {
+        /* shell: stream is 1 for stdout, 2 for stderr */
+    void (*output)(void *opaque, int stream, const char *data, int len);
+        /* push and pull: bytes copied so far, of total */
+    void (*progress)(void *opaque, long long copied, long long total);
+        /* track-devices: the whole list, as 'sdb devices' prints it */
+    void (*devices)(void *opaque, const char *list);
+        /* status is the exit code for shell, else 0; -1 with a reason
+        ** in error when the operation failed or was cancelled
+        */
+    void (*done)(void *opaque, int status, const char *error);
+} sdb_callbacks;
+
+/* port 0 means the default one */
+sdb_ctx *sdb_ctx_new(int server_port);
+
+/* cancel whatever is still running, wait for it, and free ctx */
+void sdb_ctx_free(sdb_ctx *ctx);
+
+/* connect to service on the device with the given serial (NULL for the
+** only one there is) and return the fd, or -1 with the reason in error.
+** host services ("host:...") go to the server itself.
+*/
+int sdb_ctx_connect(sdb_ctx *ctx, const char *serial, const char *service,
+                    char *error, int errlen);
+
+/* ask the server a host service ("host:devices", ...) and return its
+** malloc'd answer, or 0 with the reason in error
+*/
+char *sdb_ctx_query(sdb_ctx *ctx, const char *service, char *error, int errlen);
+
+/* run command with /bin/sh -c on the device, without a pty */
+sdb_op *sdb_ctx_shell(sdb_ctx *ctx, const char *serial, const char *command,
+                      const sdb_callbacks *cb, void *opaque);
+
+/* copy a regular file to or from the device */
+sdb_op *sdb_ctx_push(sdb_ctx *ctx, const char *serial, const char *lpath,
+                     const char *rpath, const sdb_callbacks *cb, void *opaque);
+sdb_op *sdb_ctx_pull(sdb_ctx *ctx, const char *serial, const char *rpath,
+                     const char *lpath, const sdb_callbacks *cb, void *opaque);
+
+/* report the device list now and each time it changes, until cancelled */
+sdb_op *sdb_ctx_track_devices(sdb_ctx *ctx, const sdb_callbacks *cb, void *opaque);
+
+/* wait for op to finish and return its status (as given to done()) */
+int sdb_op_wait(sdb_op *op);
+
+/* make op finish as soon as it can; done() still gets called */
+void sdb_op_cancel(sdb_op *op);
+
+/* let go of op; it runs to the end all the same */
+void sdb_op_release(sdb_op *op);
+
+#endif
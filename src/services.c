@@ -19,6 +19,12 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#ifndef _WIN32
+#include <spawn.h>
+#endif
 
 #include "sysdeps.h"
 
@@ -43,6 +49,10 @@ struct stinfo {
     void (*func)(int fd, void *cookie);
     int fd;
     void *cookie;
+#if !SDB_HOST
+    stinfo *next;
+    long long queued;   /* when it was queued, in microseconds */
+#endif
 };
 
 
@@ -242,6 +252,7 @@ done:
 }
 #endif
 
+#if SDB_HOST
 static int create_service_thread(void (*func)(int, void *), void *cookie)
 {
     stinfo *sti;
@@ -270,6 +281,417 @@ static int create_service_thread(void (*func)(int, void *), void *cookie)
     D("service thread started, %d:%d\n",s[0], s[1]);
     return s[0];
 }
+#else /* !SDB_HOST */
+
+/* device services run on a pool of worker threads rather than a thread
+** apiece, so that a burst of requests can't grow sdbd without bound.
+** workers are started as they are needed, up to SDBD_SERVICE_THREADS of
+** them, each with a stack of SDBD_SERVICE_STACK kilobytes.  once they are
+** all busy requests wait in a queue -- the client already has its end of
+** the socket, and the service starts when a worker frees up -- and with
+** SDBD_SERVICE_QUEUE of them waiting, new ones are refused.
+**
+** sync: and session: last for as long as the client keeps them open, so
+** a worker given to one would be lost to the pool for that long, and
+** with every worker held so, whatever queued behind them would wait
+** forever.  those get a thread of their own instead, outside the pool,
+** up to SDBD_STREAM_THREADS at once; past that they are refused.
+*/
+#define SERVICE_POOL_THREADS  16
+#define SERVICE_POOL_QUEUE    64
+#define SERVICE_POOL_STACK    256
+#define SERVICE_STREAM_THREADS  64
+
+SDB_MUTEX_DEFINE( service_pool_lock );
+
+static struct {
+    int ready;
+    sdb_cond_t cond;
+    stinfo *head;
+    stinfo *tail;
+
+    int max_threads;
+    int max_queued;
+    int max_streams;
+    size_t stack;
+
+    int threads;
+    int active;
+    int peak_active;
+    int queued;
+    int peak_queued;
+    int streams;
+    int peak_streams;
+    unsigned long long served;
+    unsigned long long refused;
+    unsigned long long wait_total;  /* microseconds */
+    unsigned long long wait_max;
+} pool;
+
+static long long service_pool_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int service_pool_setting(const char *name, int def, int min)
+{
+    const char *p = getenv(name);
+    int n;
+
+    if(p == 0 || *p == 0)
+        return def;
+    n = atoi(p);
+    return (n < min) ? min : n;
+}
+
+/* called with service_pool_lock held */
+static void service_pool_init(void)
+{
+    sdb_cond_init(&pool.cond, NULL);
+    pool.max_threads = service_pool_setting("SDBD_SERVICE_THREADS", SERVICE_POOL_THREADS, 1);
+    pool.max_queued = service_pool_setting("SDBD_SERVICE_QUEUE", SERVICE_POOL_QUEUE, 0);
+    pool.max_streams = service_pool_setting("SDBD_STREAM_THREADS", SERVICE_STREAM_THREADS, 1);
+    pool.stack = (size_t) service_pool_setting("SDBD_SERVICE_STACK", SERVICE_POOL_STACK, 0) * 1024;
+    if(pool.stack && pool.stack < PTHREAD_STACK_MIN)
+        pool.stack = PTHREAD_STACK_MIN;
+    pool.ready = 1;
+    D("service pool: %d threads, %d queued, %zu byte stacks\n",
+      pool.max_threads, pool.max_queued, pool.stack);
+}
+
+static void *service_pool_worker(void *x)
+{
+    stinfo *sti;
+    unsigned long long waited;
+
+    sdb_mutex_lock(&service_pool_lock);
+    for(;;) {
+        while(pool.head == 0)
+            sdb_cond_wait(&pool.cond, &service_pool_lock);
+        sti = pool.head;
+        pool.head = sti->next;
+        if(pool.head == 0)
+            pool.tail = 0;
+        pool.queued--;
+        if(++pool.active > pool.peak_active)
+            pool.peak_active = pool.active;
+        waited = service_pool_now() - sti->queued;
+        pool.wait_total += waited;
+        if(waited > pool.wait_max)
+            pool.wait_max = waited;
+        sdb_mutex_unlock(&service_pool_lock);
+
+        service_bootstrap_func(sti);
+
+        sdb_mutex_lock(&service_pool_lock);
+        pool.active--;
+        pool.served++;
+    }
+    return 0;
+}
+
+static int create_service_thread(void (*func)(int, void *), void *cookie)
+{
+    stinfo *sti;
+    sdb_thread_t t;
+    int s[2];
+
+    sti = malloc(sizeof(stinfo));
+    if(sti == 0) fatal("cannot allocate stinfo");
+    sti->func = func;
+    sti->cookie = cookie;
+    sti->next = 0;
+
+    sdb_mutex_lock(&service_pool_lock);
+    if(!pool.ready)
+        service_pool_init();
+    if(pool.queued >= pool.max_queued && pool.active + pool.queued >= pool.threads &&
+       pool.threads >= pool.max_threads) {
+        pool.refused++;
+        sdb_mutex_unlock(&service_pool_lock);
+        free(sti);
+        D("service pool full, request refused\n");
+        return -1;
+    }
+        /* start another worker unless an idle one will take it */
+    if(pool.active + pool.queued >= pool.threads && pool.threads < pool.max_threads) {
+        if(sdb_thread_create_stack(&t, service_pool_worker, 0, pool.stack) == 0) {
+            pool.threads++;
+        } else if(pool.threads == 0) {
+            sdb_mutex_unlock(&service_pool_lock);
+            free(sti);
+            printf("cannot create service thread\n");
+            return -1;
+        }
+    }
+
+    if(sdb_socketpair(s)) {
+        sdb_mutex_unlock(&service_pool_lock);
+        free(sti);
+        printf("cannot create service socket pair\n");
+        return -1;
+    }
+    sti->fd = s[1];
+    sti->queued = service_pool_now();
+    if(pool.tail)
+        pool.tail->next = sti;
+    else
+        pool.head = sti;
+    pool.tail = sti;
+    if(++pool.queued > pool.peak_queued)
+        pool.peak_queued = pool.queued;
+    sdb_cond_signal(&pool.cond);
+    sdb_mutex_unlock(&service_pool_lock);
+
+    D("service queued, %d:%d\n",s[0], s[1]);
+    return s[0];
+}
+
+static void *service_stream_func(void *x)
+{
+    service_bootstrap_func(x);
+
+    sdb_mutex_lock(&service_pool_lock);
+    pool.streams--;
+    sdb_mutex_unlock(&service_pool_lock);
+    return 0;
+}
+
+/* like create_service_thread, for the long-lived services, which start
+** at once on a thread of their own or not at all
+*/
+static int create_stream_thread(void (*func)(int, void *), void *cookie)
+{
+    stinfo *sti;
+    sdb_thread_t t;
+    int s[2];
+
+    sdb_mutex_lock(&service_pool_lock);
+    if(!pool.ready)
+        service_pool_init();
+    if(pool.streams >= pool.max_streams) {
+        pool.refused++;
+        sdb_mutex_unlock(&service_pool_lock);
+        D("too many stream services, request refused\n");
+        return -1;
+    }
+    pool.streams++;
+    sdb_mutex_unlock(&service_pool_lock);
+
+    sti = malloc(sizeof(stinfo));
+    if(sti == 0) fatal("cannot allocate stinfo");
+    sti->func = func;
+    sti->cookie = cookie;
+    sti->next = 0;
+
+    if(sdb_socketpair(s)) {
+        free(sti);
+        printf("cannot create service socket pair\n");
+        goto fail;
+    }
+    sti->fd = s[1];
+
+    if(sdb_thread_create_stack(&t, service_stream_func, sti, pool.stack)) {
+        free(sti);
+        sdb_close(s[0]);
+        sdb_close(s[1]);
+        printf("cannot create service thread\n");
+        goto fail;
+    }
+
+    sdb_mutex_lock(&service_pool_lock);
+    if(pool.streams > pool.peak_streams)
+        pool.peak_streams = pool.streams;
+    sdb_mutex_unlock(&service_pool_lock);
+
+    D("stream service started, %d:%d\n",s[0], s[1]);
+    return s[0];
+
+fail:
+    sdb_mutex_lock(&service_pool_lock);
+    pool.streams--;
+    sdb_mutex_unlock(&service_pool_lock);
+    return -1;
+}
+
+/* the pool's counters, answered here rather than by a worker so that they
+** can still be had while the pool is saturated
+*/
+static int service_pool_stats(void)
+{
+    char buf[512];
+    int s[2], len;
+
+    if(sdb_socketpair(s))
+        return -1;
+
+    sdb_mutex_lock(&service_pool_lock);
+    if(!pool.ready)
+        service_pool_init();
+    len = snprintf(buf, sizeof buf,
+                   "workers:       %d of %d (%zu KiB stacks)\n"
+                   "active:        %d (peak %d)\n"
+                   "queued:        %d of %d (peak %d)\n"
+                   "streams:       %d of %d (peak %d)\n"
+                   "served:        %llu\n"
+                   "refused:       %llu\n"
+                   "queue wait:    %llu us average, %llu us max\n",
+                   pool.threads, pool.max_threads, pool.stack / 1024,
+                   pool.active, pool.peak_active,
+                   pool.queued, pool.max_queued, pool.peak_queued,
+                   pool.streams, pool.max_streams, pool.peak_streams,
+                   pool.served, pool.refused,
+                   pool.served + pool.active ?
+                       pool.wait_total / (pool.served + pool.active) : 0,
+                   pool.wait_max);
+    sdb_mutex_unlock(&service_pool_lock);
+
+    writex(s[1], buf, len);
+    sdb_close(s[1]);
+    return s[0];
+}
+#endif
+
+#if !SDB_HOST
+/* the per-class counters of the device's sending side; like the pool's,
+** answered right here
+*/
+static int transport_stats(void)
+{
+    char buf[4096];
+    int s[2], len;
+
+    len = transport_tx_stats(NULL, buf, sizeof buf);
+    if(len < 0 || sdb_socketpair(s))
+        return -1;
+
+    writex(s[1], buf, len);
+    sdb_close(s[1]);
+    return s[0];
+}
+#endif
+
+#ifndef HAVE_WIN32_PROC
+#if defined(POSIX_SPAWN_SETSID) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_POSIX_SPAWN_SETSID 1
+#endif
+
+/* start argv[0] in a session of its own, in PROCESS_WORKING_DIRECTORY,
+** with either the pty slave pts as its stdin, stdout and stderr, or
+** fds[n] as its descriptor n for each n below nfds (-1 for /dev/null).
+** anything else the child should see must not be close-on-exec, and
+** anything it shouldn't must be.  sdbd itself is never copied:
+** posix_spawn() and vfork() share its memory until the exec, where
+** fork() would have to duplicate the page tables of the whole daemon
+** for every command.  returns the pid, or -1 with errno set.
+*/
+pid_t spawn_subprocess(char *const argv[], const char *pts, const int *fds, int nfds)
+{
+    pid_t pid;
+    int n;
+
+#ifdef HAVE_POSIX_SPAWN_SETSID
+    {
+        posix_spawn_file_actions_t fa;
+        posix_spawnattr_t attr;
+        sigset_t mask;
+        int r;
+
+        posix_spawn_file_actions_init(&fa);
+        posix_spawnattr_init(&attr);
+
+            /* the session comes first, so that opening pts makes it
+            ** the controlling terminal
+            */
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGPIPE);
+        posix_spawnattr_setsigdefault(&attr, &mask);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGDEF);
+
+        posix_spawn_file_actions_addchdir_np(&fa, PROCESS_WORKING_DIRECTORY);
+        if(pts) {
+            posix_spawn_file_actions_addopen(&fa, 0, pts, O_RDWR, 0);
+            posix_spawn_file_actions_adddup2(&fa, 0, 1);
+            posix_spawn_file_actions_adddup2(&fa, 0, 2);
+        } else {
+            for(n = 0; n < nfds; n++) {
+                if(fds[n] < 0)
+                    posix_spawn_file_actions_addopen(&fa, n, "/dev/null", O_RDWR, 0);
+                else
+                    posix_spawn_file_actions_adddup2(&fa, fds[n], n);
+            }
+        }
+
+        r = posix_spawn(&pid, argv[0], &fa, &attr, argv, environ);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&fa);
+        if(r) {
+            errno = r;
+            return -1;
+        }
+        return pid;
+    }
+#else
+        /* between vfork() and the exec the child runs on our stack and
+        ** must stick to plain system calls
+        */
+    pid = vfork();
+    if(pid == 0) {
+        int fd;
+
+        setsid();
+        chdir(PROCESS_WORKING_DIRECTORY);
+        signal(SIGPIPE, SIG_DFL);
+        if(pts) {
+            fd = unix_open(pts, O_RDWR);
+            if(fd < 0) _exit(127);
+            dup2(fd, 0);
+            dup2(fd, 1);
+            dup2(fd, 2);
+            if(fd > 2) sdb_close(fd);
+        } else {
+            for(n = 0; n < nfds; n++) {
+                if(fds[n] >= 0) {
+                    dup2(fds[n], n);
+                } else if((fd = unix_open("/dev/null", O_RDWR)) >= 0) {
+                    dup2(fd, n);
+                    if(fd != n) sdb_close(fd);
+                }
+                    /* dup2() onto itself would keep close-on-exec */
+                if(fds[n] == n)
+                    fcntl(n, F_SETFD, 0);
+            }
+        }
+
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+#endif
+}
+
+static void subprocess_started(pid_t pid)
+{
+#if !SDB_HOST
+    // set child's OOM adjustment to zero
+    char text[64];
+    int fd;
+
+    snprintf(text, sizeof text, "/proc/%d/oom_adj", pid);
+    fd = sdb_open(text, O_WRONLY);
+    if (fd >= 0) {
+        sdb_write(fd, "0", 1);
+        sdb_close(fd);
+    } else {
+       D("sdb: unable to open %s\n", text);
+    }
+#endif
+}
+#endif /* !HAVE_WIN32_PROC */
 
 static int create_subprocess(const char *cmd, const char *arg0, const char *arg1)
 {
@@ -277,6 +699,7 @@ static int create_subprocess(const char *cmd, const char *arg0, const char *arg1
 	fprintf(stderr, "error: create_subprocess not implemented on Win32 (%s %s %s)\n", cmd, arg0, arg1);
 	return -1;
 #else /* !HAVE_WIN32_PROC */
+    char *argv[] = { (char*) cmd, (char*) arg0, (char*) arg1, 0 };
     char *devname;
     int ptm;
     pid_t pid;
@@ -291,49 +714,58 @@ static int create_subprocess(const char *cmd, const char *arg0, const char *arg1
     if(grantpt(ptm) || unlockpt(ptm) ||
        ((devname = (char*) ptsname(ptm)) == 0)){
         printf("[ trouble with /dev/ptmx - %s ]\n", strerror(errno));
+        sdb_close(ptm);
         return -1;
     }
 
-    pid = fork();
+    pid = spawn_subprocess(argv, devname, 0, 0);
     if(pid < 0) {
-        printf("- fork failed: %s -\n", strerror(errno));
+        printf("- exec '%s' failed: %s -\n", cmd, strerror(errno));
+        sdb_close(ptm);
         return -1;
     }
+    subprocess_started(pid);
+    return ptm;
+#endif /* !HAVE_WIN32_PROC */
+}
 
-    if(pid == 0){
-        int pts;
-
-        setsid();
-        chdir(PROCESS_WORKING_DIRECTORY);
-
-        pts = unix_open(devname, O_RDWR);
-        if(pts < 0) exit(-1);
-
-        dup2(pts, 0);
-        dup2(pts, 1);
-        dup2(pts, 2);
-
-        sdb_close(ptm);
+/* like create_subprocess(), but the command gets one end of a socket
+** pair as its stdin and stdout instead of a pty: no line discipline
+** stands between it and the client, so binary output arrives byte for
+** byte, and at whatever rate the transport takes it.  stderr goes to
+** /dev/null so that it can't get mixed in; "2>&1" brings it back.
+*/
+static int create_subprocess_raw(const char *cmd, const char *arg0, const char *arg1)
+{
+#ifdef HAVE_WIN32_PROC
+	fprintf(stderr, "error: create_subprocess_raw not implemented on Win32 (%s %s %s)\n", cmd, arg0, arg1);
+	return -1;
+#else /* !HAVE_WIN32_PROC */
+    char *argv[] = { (char*) cmd, (char*) arg0, (char*) arg1, 0 };
+    int s[2], fds[3];
+    pid_t pid;
 
-        execl(cmd, cmd, arg0, arg1, NULL);
-        fprintf(stderr, "- exec '%s' failed: %s (%d) -\n",
-                cmd, strerror(errno), errno);
-        exit(-1);
-    } else {
-#if !SDB_HOST
-        // set child's OOM adjustment to zero
-        char text[64];
-        snprintf(text, sizeof text, "/proc/%d/oom_adj", pid);
-        int fd = sdb_open(text, O_WRONLY);
-        if (fd >= 0) {
-            sdb_write(fd, "0", 1);
-            sdb_close(fd);
-        } else {
-           D("sdb: unable to open %s\n", text);
-        }
-#endif
-        return ptm;
+    if(sdb_socketpair(s)) {
+        printf("[ cannot create socket pair - %s ]\n", strerror(errno));
+        return -1;
+    }
+    fcntl(s[0], F_SETFD, FD_CLOEXEC);
+    fcntl(s[1], F_SETFD, FD_CLOEXEC);
+    sdb_socket_setbufsize(s[0], 256 * 1024);
+
+    fds[0] = s[1];
+    fds[1] = s[1];
+    fds[2] = -1;
+    pid = spawn_subprocess(argv, 0, fds, 3);
+        /* the child holds the other end: its exit is our end of file */
+    sdb_close(s[1]);
+    if(pid < 0) {
+        printf("- exec '%s' failed: %s -\n", cmd, strerror(errno));
+        sdb_close(s[0]);
+        return -1;
     }
+    subprocess_started(pid);
+    return s[0];
 #endif /* !HAVE_WIN32_PROC */
 }
 
@@ -402,9 +834,17 @@ int service_to_fd(const char *name)
         } else {
             ret = create_subprocess(SHELL_COMMAND, "-", 0);
         }
+    } else if(!HOST && !strncmp(name, "exec:", 5)) {
+        ret = create_subprocess_raw(SHELL_COMMAND, "-c", name + 5);
 #if !SDB_HOST
     } else if(!strncmp(name, "sync:", 5)) {
-        ret = create_service_thread(file_sync_service, NULL);
+        ret = create_stream_thread(file_sync_service, NULL);
+    } else if(!strncmp(name, "session:", 8)) {
+        ret = create_stream_thread(exec_session_service, NULL);
+    } else if(!strncmp(name, "service-stats:", 14)) {
+        ret = service_pool_stats();
+    } else if(!strncmp(name, "transport-stats:", 16)) {
+        ret = transport_stats();
 #if 0 //eric
     } else if(!strncmp(name, "remount:", 8)) {
         ret = create_service_thread(remount_service, NULL);
@@ -437,65 +877,37 @@ int service_to_fd(const char *name)
     return ret;
 }
 
-#if SDB_HOST
-struct state_info {
-    transport_type transport;
-    char* serial;
-    int state;
-};
-
-static void wait_for_state(int fd, void* cookie)
-{
-    struct state_info* sinfo = cookie;
-    char* err = "unknown error";
-
-    D("wait_for_state %d\n", sinfo->state);
-
-    atransport *t = acquire_one_transport(sinfo->state, sinfo->transport, sinfo->serial, &err);
-    if(t != 0) {
-        writex(fd, "OKAY", 4);
-    } else {
-        sendfailmsg(fd, err);
-    }
-
-    if (sinfo->serial)
-        free(sinfo->serial);
-    free(sinfo);
-    sdb_close(fd);
-    D("wait_for_state is done\n");
-}
-#endif
-
 #if SDB_HOST
 asocket*  host_service_to_socket(const char*  name, const char *serial)
 {
     if (!strcmp(name,"track-devices")) {
         return create_device_tracker();
     } else if (!strncmp(name, "wait-for-", strlen("wait-for-"))) {
-        struct state_info* sinfo = malloc(sizeof(struct state_info));
-
-        if (serial)
-            sinfo->serial = strdup(serial);
-        else
-            sinfo->serial = NULL;
+        transport_type ttype;
+        int timeout_ms = -1;
 
         name += strlen("wait-for-");
 
         if (!strncmp(name, "local", strlen("local"))) {
-            sinfo->transport = kTransportLocal;
-            sinfo->state = CS_DEVICE;
+            ttype = kTransportLocal;
+            name += strlen("local");
         } else if (!strncmp(name, "usb", strlen("usb"))) {
-            sinfo->transport = kTransportUsb;
-            sinfo->state = CS_DEVICE;
+            ttype = kTransportUsb;
+            name += strlen("usb");
         } else if (!strncmp(name, "any", strlen("any"))) {
-            sinfo->transport = kTransportAny;
-            sinfo->state = CS_DEVICE;
+            ttype = kTransportAny;
+            name += strlen("any");
         } else {
-            free(sinfo);
             return NULL;
         }
 
-        int fd = create_service_thread(wait_for_state, sinfo);
+            /* "wait-for-<transport>:<ms>" gives up after that long */
+        if (*name == ':')
+            timeout_ms = atoi(name + 1);
+
+        return create_state_waiter(CS_DEVICE, ttype, serial, timeout_ms);
+    } else if (!strcmp(name, "relay")) {
+        int fd = create_service_thread(file_sync_relay_service, NULL);
         return create_local_socket(fd);
     }
     return NULL;
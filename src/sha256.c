@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <string.h>
+#include "sha256.h"
+
+static const unsigned int  K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x,n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(sha256_ctx*  ctx, const unsigned char*  p)
+{
+    unsigned int  w[64];
+    unsigned int  a, b, c, d, e, f, g, h;
+    int           i;
+
+    for (i = 0; i < 16; i++, p += 4)
+        w[i] = ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+               ((unsigned int)p[2] << 8)  |  (unsigned int)p[3];
+
+    for (i = 16; i < 64; i++) {
+        unsigned int  s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+        unsigned int  s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19)  ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+    for (i = 0; i < 64; i++) {
+        unsigned int  t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+                           ((e & f) ^ (~e & g)) + K[i] + w[i];
+        unsigned int  t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+                           ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void
+sha256_init(sha256_ctx*  ctx)
+{
+    static const unsigned int  init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->count = 0;
+}
+
+void
+sha256_update(sha256_ctx*  ctx, const void*  data, size_t  len)
+{
+    const unsigned char*  p    = data;
+    unsigned              used = (unsigned)(ctx->count & 63);
+
+    ctx->count += len;
+
+    if (used) {
+        unsigned  n = 64 - used;
+        if (n > len) n = len;
+        memcpy(ctx->buf + used, p, n);
+        p   += n;
+        len -= n;
+        if (used + n < 64)
+            return;
+        sha256_block(ctx, ctx->buf);
+    }
+
+    for ( ; len >= 64; p += 64, len -= 64)
+        sha256_block(ctx, p);
+
+    memcpy(ctx->buf, p, len);
+}
+
+void
+sha256_final(sha256_ctx*  ctx, unsigned char  digest[SHA256_DIGEST_SIZE])
+{
+    unsigned long long  bits = ctx->count << 3;
+    unsigned            used = (unsigned)(ctx->count & 63);
+    int                 i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        sha256_block(ctx, ctx->buf);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, 56 - used);
+    for (i = 0; i < 8; i++)
+        ctx->buf[56 + i] = (unsigned char)(bits >> (56 - 8*i));
+    sha256_block(ctx, ctx->buf);
+
+    for (i = 0; i < 8; i++) {
+        digest[4*i]   = (unsigned char)(ctx->state[i] >> 24);
+        digest[4*i+1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[4*i+2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[4*i+3] = (unsigned char)(ctx->state[i]);
+    }
+}
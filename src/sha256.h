@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _SDB_SHA256_H
+#define _SDB_SHA256_H
+
+#include <stddef.h>
+
+/* SHA-256 (FIPS 180-4), shared by sdb and sdbd so that both ends can
+ * check file contents without moving them.
+ */
+#define SHA256_DIGEST_SIZE  32
+
+typedef struct {
+    unsigned int        state[8];
+    unsigned long long  count;
+    unsigned char       buf[64];
+} sha256_ctx;
+
+void  sha256_init(sha256_ctx*  ctx);
+void  sha256_update(sha256_ctx*  ctx, const void*  data, size_t  len);
+void  sha256_final(sha256_ctx*  ctx, unsigned char  digest[SHA256_DIGEST_SIZE]);
+
+#endif /* _SDB_SHA256_H */
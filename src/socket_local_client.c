@@ -30,6 +30,17 @@ int socket_local_client(const char *name, int namespaceId, int type)
     return -1;
 }
 
+int socket_local_client_same_user(const char *name, int namespaceId, int type)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int socket_local_peer_uid(int fd)
+{
+    return -1;
+}
+
 #else /* !HAVE_WINSOCK */
 
 #include <sys/socket.h>
@@ -163,4 +174,52 @@ int socket_local_client(const char *name, int namespaceId, int type)
     return s;
 }
 
+/**
+ * uid of the process at the other end of the connected local socket fd,
+ * or -1 if it can't be told
+ */
+int socket_local_peer_uid(int fd)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cr;
+    socklen_t len = sizeof(cr);
+
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cr, &len) < 0)
+        return -1;
+    return cr.uid;
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+    uid_t uid;
+    gid_t gid;
+
+    if(getpeereid(fd, &uid, &gid) < 0)
+        return -1;
+    return uid;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * connect to peer named "name", but only if it runs as the same user as
+ * we do (any peer will do for root): anyone may bind a name in the
+ * abstract namespace first
+ * returns fd or -1 on error
+ */
+int socket_local_client_same_user(const char *name, int namespaceId, int type)
+{
+    uid_t uid = getuid();
+    int s;
+
+    s = socket_local_client(name, namespaceId, type);
+    if(s < 0) return -1;
+
+    if(uid != 0 && socket_local_peer_uid(s) != (int) uid) {
+        close(s);
+        errno = EACCES;
+        return -1;
+    }
+
+    return s;
+}
+
 #endif /* !HAVE_WINSOCK */
@@ -41,7 +41,8 @@ int socket_local_server(const char *name, int namespaceId, int type)
 
 #include "socket_local.h"
 
-#define LISTEN_BACKLOG 4
+/* same as socket_loopback_server(): the sdb server's clients connect in bursts */
+#define LISTEN_BACKLOG 128
 
 
 /**
@@ -24,7 +24,10 @@
 #include <errno.h>
 #include <stddef.h>
 
-#define LISTEN_BACKLOG 4
+/* the server's clients connect in bursts: with a short queue the ones
+** that don't fit sit out SYN retransmits, a second or more each
+*/
+#define LISTEN_BACKLOG 128
 #define LOOPBACK_UP 1
 #define LOOPBACK_DOWN 0
 
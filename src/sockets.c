@@ -428,6 +428,7 @@ typedef struct aremotesocket {
 static int remote_socket_enqueue(asocket *s, apacket *p)
 {
     D("Calling remote_socket_enqueue\n");
+    p->stream_class = s->stream_class;
     p->msg.command = A_WRTE;
     p->msg.arg0 = s->peer->id;
     p->msg.arg1 = s->id;
@@ -440,6 +441,7 @@ static void remote_socket_ready(asocket *s)
 {
     D("Calling remote_socket_ready\n");
     apacket *p = get_apacket();
+    p->stream_class = s->stream_class;
     p->msg.command = A_OKAY;
     p->msg.arg0 = s->peer->id;
     p->msg.arg1 = s->id;
@@ -450,6 +452,7 @@ static void remote_socket_close(asocket *s)
 {
     D("Calling remote_socket_close\n");
     apacket *p = get_apacket();
+    p->stream_class = s->stream_class;
     p->msg.command = A_CLSE;
     if(s->peer) {
         p->msg.arg0 = s->peer->id;
@@ -496,6 +499,18 @@ asocket *create_remote_socket(unsigned id, atransport *t)
     return s;
 }
 
+/* an interactive shell's keystrokes and echo shouldn't wait behind file
+** transfers; everything else, forwards included, is normal
+*/
+int stream_class_of(const char *service)
+{
+    if(!strcmp(service, "shell:"))
+        return STREAM_INTERACTIVE;
+    if(!strncmp(service, "sync:", 5))
+        return STREAM_BULK;
+    return STREAM_NORMAL;
+}
+
 void connect_to_remote(asocket *s, const char *destination)
 {
     D("Connect_to_remote call \n");
@@ -507,6 +522,7 @@ void connect_to_remote(asocket *s, const char *destination)
     }
 
     D("LS(%d): connect('%s')\n", s->id, destination);
+    s->stream_class = p->stream_class = stream_class_of(destination);
     p->msg.command = A_OPEN;
     p->msg.arg0 = s->id;
     p->msg.data_length = len;
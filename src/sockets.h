@@ -91,6 +91,8 @@ extern int socket_local_server_bind(int s, const char *name, int namespaceId);
 extern int socket_local_client_connect(int fd, 
         const char *name, int namespaceId, int type);
 extern int socket_local_client(const char *name, int namespaceId, int type);
+extern int socket_local_client_same_user(const char *name, int namespaceId, int type);
+extern int socket_local_peer_uid(int fd);
 extern int socket_inaddr_any_server(int port, int type);
     
 #ifdef __cplusplus
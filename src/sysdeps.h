@@ -74,6 +74,26 @@ static __inline__ int  sdb_thread_create( sdb_thread_t  *thread, sdb_thread_func
     return 0;
 }
 
+static __inline__ int  sdb_thread_create_stack( sdb_thread_t  *thread, sdb_thread_func_t  func, void*  arg, size_t  stack)
+{
+    thread->tid = _beginthread( (win_thread_func_t)func, (unsigned)stack, arg );
+    if (thread->tid == (unsigned)-1L) {
+        return -1;
+    }
+    return 0;
+}
+
+/* both return the new value */
+static __inline__ int  sdb_atomic_inc( volatile int*  p )
+{
+    return InterlockedIncrement( (volatile LONG*) p );
+}
+
+static __inline__ int  sdb_atomic_dec( volatile int*  p )
+{
+    return InterlockedDecrement( (volatile LONG*) p );
+}
+
 static __inline__ void  close_on_exec(int  fd)
 {
     /* nothing really */
@@ -409,6 +429,35 @@ static __inline__ int  sdb_thread_create( sdb_thread_t  *pthread, sdb_thread_fun
     return pthread_create( pthread, &attr, start, arg );
 }
 
+/* the same, with a stack of the given size; 0 for the default */
+static __inline__ int  sdb_thread_create_stack( sdb_thread_t  *pthread, sdb_thread_func_t  start, void*  arg, size_t  stack )
+{
+    pthread_attr_t   attr;
+    int              ret;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if (stack && pthread_attr_setstacksize (&attr, stack) != 0) {
+        pthread_attr_destroy (&attr);
+        return -1;
+    }
+
+    ret = pthread_create( pthread, &attr, start, arg );
+    pthread_attr_destroy (&attr);
+    return ret;
+}
+
+/* both return the new value */
+static __inline__ int  sdb_atomic_inc( volatile int*  p )
+{
+    return __sync_add_and_fetch( p, 1 );
+}
+
+static __inline__ int  sdb_atomic_dec( volatile int*  p )
+{
+    return __sync_sub_and_fetch( p, 1 );
+}
+
 static __inline__  int  sdb_socket_setbufsize( int   fd, int  bufsize )
 {
     int opt = bufsize;
@@ -611,7 +611,10 @@ int socket_loopback_client(int port, int type)
     return _fh_to_int(f);
 }
 
-#define LISTEN_BACKLOG 4
+/* the server's clients connect in bursts: with a short queue the ones
+** that don't fit sit out SYN retransmits, a second or more each
+*/
+#define LISTEN_BACKLOG 128
 
 int socket_loopback_server(int port, int type)
 {
@@ -1266,6 +1269,8 @@ static void dump_fde(fdevent *fde, const char *info)
 static void fdevent_plist_enqueue(fdevent *node);
 static void fdevent_plist_remove(fdevent *node);
 static fdevent *fdevent_plist_dequeue(void);
+static int fdevent_timer_wait(void);
+static void fdevent_timer_expire(void);
 
 static fdevent list_pending = {
     .next = &list_pending,
@@ -1515,21 +1520,33 @@ static void fdevent_process()
         }
 
         if (looper->htab_count == 0) {
-            D( "fdevent_process: nothing to wait for !!\n" );
+            int  wait = fdevent_timer_wait();
+
+            if (wait < 0) {
+                D( "fdevent_process: nothing to wait for !!\n" );
+                return;
+            }
+            Sleep( wait );
+            fdevent_timer_expire();
             return;
         }
 
         do
         {
             int   wait_ret;
+            int   wait = fdevent_timer_wait();
 
             D( "sdb_win32: waiting for %d events\n", looper->htab_count );
             if (looper->htab_count > MAXIMUM_WAIT_OBJECTS) {
                 D("handle count %d exceeds MAXIMUM_WAIT_OBJECTS, aborting!\n", looper->htab_count);
                 abort();
             }
-            wait_ret = WaitForMultipleObjects( looper->htab_count, looper->htab, FALSE, INFINITE );
-            if (wait_ret == (int)WAIT_FAILED) {
+            wait_ret = WaitForMultipleObjects( looper->htab_count, looper->htab, FALSE,
+                                               wait < 0 ? INFINITE : (DWORD)wait );
+            if (wait_ret == (int)WAIT_TIMEOUT) {
+                /* a timer is due: fdevent_timer_expire() below signals it */
+                gotone = 1;
+            } else if (wait_ret == (int)WAIT_FAILED) {
                 D( "sdb_win32: wait failed, error %ld\n", GetLastError() );
             } else {
                 D( "sdb_win32: got one (index %d)\n", wait_ret );
@@ -1565,6 +1582,8 @@ static void fdevent_process()
         if (hook->peek && hook->peek(hook))
                 event_hook_signal( hook );
     }
+
+    fdevent_timer_expire();
 }
 
 
@@ -1651,6 +1670,82 @@ static fdevent *fdevent_plist_dequeue(void)
     return node;
 }
 
+/* the fdes with a deadline, in no particular order: there are few */
+static fdevent *timer_list = 0;
+
+static int64_t fdevent_now_ms(void)
+{
+    FILETIME  ft;
+
+    GetSystemTimeAsFileTime( &ft );
+    return ((((int64_t) ft.dwHighDateTime) << 32) | ft.dwLowDateTime) / 10000;
+}
+
+static void fdevent_timer_remove(fdevent *fde)
+{
+    fdevent **pnode;
+
+    if(fde->deadline == 0) return;
+    for(pnode = &timer_list; *pnode; pnode = &(*pnode)->timer_next) {
+        if(*pnode == fde) {
+            *pnode = fde->timer_next;
+            break;
+        }
+    }
+    fde->timer_next = 0;
+    fde->deadline = 0;
+}
+
+/* how long the wait for events may last: until the first deadline */
+static int fdevent_timer_wait(void)
+{
+    fdevent *fde;
+    int64_t first = 0, wait;
+
+    for(fde = timer_list; fde; fde = fde->timer_next) {
+        if(first == 0 || fde->deadline < first) first = fde->deadline;
+    }
+    if(first == 0) return -1;
+    wait = first - fdevent_now_ms();
+    if(wait < 0) return 0;
+    return wait > 0x7ffffffe ? 0x7ffffffe : (int) wait;
+}
+
+static void fdevent_timer_expire(void)
+{
+    fdevent **pnode = &timer_list;
+    fdevent *fde;
+    int64_t now;
+
+    if(timer_list == 0) return;
+    now = fdevent_now_ms();
+    while((fde = *pnode) != 0) {
+        if(fde->deadline > now) {
+            pnode = &fde->timer_next;
+            continue;
+        }
+        *pnode = fde->timer_next;
+        fde->timer_next = 0;
+        fde->deadline = 0;
+
+        fde->events |= FDE_TIMEOUT;
+        if(fde->state & FDE_PENDING) continue;
+        fde->state |= FDE_PENDING;
+        fdevent_plist_enqueue(fde);
+    }
+}
+
+void fdevent_set_timeout(fdevent *fde, int64_t timeout_ms)
+{
+    fdevent_timer_remove(fde);
+    if(timeout_ms < 0) return;
+
+    fde->deadline = fdevent_now_ms() + timeout_ms;
+    if(fde->deadline == 0) fde->deadline = 1;
+    fde->timer_next = timer_list;
+    timer_list = fde;
+}
+
 fdevent *fdevent_create(int fd, fd_func func, void *arg)
 {
     fdevent *fde = (fdevent*) malloc(sizeof(fdevent));
@@ -1677,6 +1772,12 @@ void fdevent_install(fdevent *fde, int fd, fd_func func, void *arg)
     fde->func = func;
     fde->arg = arg;
 
+        /* a timer has nothing to watch, and so is never active */
+    if(fd == FD_TIMER) {
+        fde->state = 0;
+        return;
+    }
+
     fdevent_register(fde);
     dump_fde(fde, "connect");
     fdevent_connect(fde);
@@ -1685,6 +1786,8 @@ void fdevent_install(fdevent *fde, int fd, fd_func func, void *arg)
 
 void fdevent_remove(fdevent *fde)
 {
+    fdevent_timer_remove(fde);
+
     if(fde->state & FDE_PENDING) {
         fdevent_plist_remove(fde);
     }
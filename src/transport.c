@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/time.h>
 
 #include "sysdeps.h"
 
@@ -33,6 +34,74 @@ static atransport transport_list = {
 };
 
 SDB_MUTEX_DEFINE( transport_lock );
+SDB_MUTEX_DEFINE( transport_tx_lock );
+
+/* transport_list is also hashed by serial, so that finding a device by
+** its serial stays cheap with hundreds attached.  both change together,
+** under transport_lock, through transport_list_add/remove_locked()
+*/
+#define TRANSPORT_HASH_SIZE  256
+
+static atransport *transport_by_serial[TRANSPORT_HASH_SIZE];
+
+static unsigned serial_hash(const char *serial)
+{
+    unsigned h = 0;
+
+    while (*serial)
+        h = h * 31 + (unsigned char) *serial++;
+    return h % TRANSPORT_HASH_SIZE;
+}
+
+static void transport_list_add_locked(atransport *t)
+{
+    atransport **pp;
+
+    t->next = &transport_list;
+    t->prev = transport_list.prev;
+    t->next->prev = t;
+    t->prev->next = t;
+
+    t->serial_next = NULL;
+    if (t->serial) {
+            /* at the end of the chain, so that of two with the same
+            ** serial the older one is found, as on the list
+            */
+        for (pp = &transport_by_serial[serial_hash(t->serial)]; *pp; pp = &(*pp)->serial_next)
+            ;
+        *pp = t;
+    }
+}
+
+/* taking a transport off more than once is harmless */
+static void transport_list_remove_locked(atransport *t)
+{
+    atransport **pp;
+
+    t->next->prev = t->prev;
+    t->prev->next = t->next;
+    t->next = t->prev = t;
+
+    if (t->serial) {
+        for (pp = &transport_by_serial[serial_hash(t->serial)]; *pp; pp = &(*pp)->serial_next) {
+            if (*pp == t) {
+                *pp = t->serial_next;
+                break;
+            }
+        }
+    }
+}
+
+static atransport *find_transport_locked(const char *serial)
+{
+    atransport *t;
+
+    for (t = transport_by_serial[serial_hash(serial)]; t; t = t->serial_next) {
+        if (!strcmp(serial, t->serial))
+            return t;
+    }
+    return NULL;
+}
 
 #if SDB_TRACE
 static void  dump_hex( const unsigned char*  ptr, size_t  len )
@@ -185,6 +254,247 @@ static void transport_socket_events(int fd, unsigned events, void *_t)
     }
 }
 
+/* what send_packet() gives the input thread waits in per-stream queues
+** rather than in the transport socket, so that a shell's keystrokes don't
+** wait behind the sync packets queued before them.  the classes take
+** turns by deficit round robin: on its turn a class may send as many
+** bytes as it has been given quanta, so that over time each gets its
+** weight's share of the transport while it has something to send; its
+** streams (each with its packets in order) go one packet at a time.
+** SYNC and CNXN go before anything.  the transport socket only carries
+** one byte per packet queued, to wake the input thread.
+*/
+#define TX_QUANTUM      (sizeof(amessage) + MAX_PAYLOAD)
+#define TX_STREAM_HASH  64
+
+static const int tx_weight[STREAM_CLASSES] = { 4, 16, 1 };
+static const char *tx_class_name[STREAM_CLASSES] = { "normal", "interactive", "bulk" };
+
+typedef struct tx_stream tx_stream;
+struct tx_stream {
+    unsigned    id;
+    int         cls;
+    apacket*    first;
+    apacket*    last;
+    tx_stream*  next;       /* the next in its class's turn */
+    tx_stream*  hash_next;
+};
+
+typedef struct {
+    tx_stream*  first;
+    tx_stream*  last;
+    int         deficit;
+    int         visited;    /* got its quantum this turn */
+
+    int                 depth;
+    int                 peak_depth;
+    unsigned long long  packets;
+    unsigned long long  bytes;
+    unsigned long long  wait_total;  /* microseconds */
+    unsigned long long  wait_max;
+} tx_class;
+
+struct tx_sched {
+    apacket*    ctl_first;
+    apacket*    ctl_last;
+    tx_stream*  streams[TX_STREAM_HASH];
+    tx_class    classes[STREAM_CLASSES];
+    int         turn;
+};
+
+static long long tx_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return ((long long) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void tx_enqueue(struct tx_sched *q, apacket *p)
+{
+    tx_stream **ps, *s;
+    tx_class *c;
+
+    p->next = NULL;
+    p->queued = tx_now();
+
+    if (p->msg.command == A_SYNC || p->msg.command == A_CNXN) {
+        if (q->ctl_last)
+            q->ctl_last->next = p;
+        else
+            q->ctl_first = p;
+        q->ctl_last = p;
+        return;
+    }
+
+        /* a stream's packets all carry its local id in arg0 */
+    ps = &q->streams[p->msg.arg0 % TX_STREAM_HASH];
+    for (s = *ps; s && s->id != p->msg.arg0; s = s->hash_next)
+        ;
+    if (s == NULL) {
+        s = calloc(1, sizeof(*s));
+        if (s == NULL) fatal("cannot allocate tx stream");
+        s->id = p->msg.arg0;
+        s->cls = (unsigned) p->stream_class < STREAM_CLASSES ? p->stream_class : STREAM_NORMAL;
+        s->hash_next = *ps;
+        *ps = s;
+
+        c = &q->classes[s->cls];
+        if (c->last)
+            c->last->next = s;
+        else
+            c->first = s;
+        c->last = s;
+    }
+
+    if (s->last)
+        s->last->next = p;
+    else
+        s->first = p;
+    s->last = p;
+
+    c = &q->classes[s->cls];
+    if (++c->depth > c->peak_depth)
+        c->peak_depth = c->depth;
+}
+
+static apacket *tx_dequeue(struct tx_sched *q)
+{
+    tx_stream **ps, *s;
+    tx_class *c;
+    apacket *p;
+    int size, n;
+    long long wait;
+
+    if ((p = q->ctl_first) != NULL) {
+        q->ctl_first = p->next;
+        if (q->ctl_first == NULL)
+            q->ctl_last = NULL;
+        return p;
+    }
+
+        /* every class's quantum is more than the largest packet, so a
+        ** class with packets sends one on its turn at the latest
+        */
+    for (n = 0; n < 2 * STREAM_CLASSES; n++) {
+        c = &q->classes[q->turn];
+        if (c->first != NULL) {
+            if (!c->visited) {
+                c->deficit += tx_weight[q->turn] * TX_QUANTUM;
+                c->visited = 1;
+            }
+            s = c->first;
+            size = sizeof(amessage) + s->first->msg.data_length;
+            if (size <= c->deficit)
+                break;
+        } else {
+            c->deficit = 0;
+        }
+        c->visited = 0;
+        q->turn = (q->turn + 1) % STREAM_CLASSES;
+    }
+    if (n == 2 * STREAM_CLASSES)
+        return NULL;
+
+    p = s->first;
+    s->first = p->next;
+    c->deficit -= size;
+    c->depth--;
+    c->packets++;
+    c->bytes += size;
+    wait = tx_now() - p->queued;
+    if (wait > 0) {
+        c->wait_total += wait;
+        if ((unsigned long long) wait > c->wait_max)
+            c->wait_max = wait;
+    }
+
+        /* the stream's turn is over: to the back, or gone if it's empty */
+    c->first = s->next;
+    if (c->first == NULL)
+        c->last = NULL;
+    s->next = NULL;
+    if (s->first != NULL) {
+        if (c->last)
+            c->last->next = s;
+        else
+            c->first = s;
+        c->last = s;
+    } else {
+        for (ps = &q->streams[s->id % TX_STREAM_HASH]; *ps != s; ps = &(*ps)->hash_next)
+            ;
+        *ps = s->hash_next;
+        free(s);
+    }
+    return p;
+}
+
+static void tx_sched_free(struct tx_sched *q)
+{
+    apacket *p;
+
+    if (q == NULL)
+        return;
+    while ((p = tx_dequeue(q)) != NULL)
+        put_apacket(p);
+    free(q);
+}
+
+static int tx_stats(struct tx_sched *q, char *buf, int size)
+{
+    int len, n, k;
+
+    len = snprintf(buf, size, "%-12s %6s %6s %10s %12s %12s %12s\n", "class", "queued",
+                   "peak", "packets", "bytes", "wait avg us", "wait max us");
+    if (len >= size)
+        return -1;
+
+    sdb_mutex_lock(&transport_tx_lock);
+    for (k = 0; k < STREAM_CLASSES; k++) {
+        static const int order[STREAM_CLASSES] = { STREAM_INTERACTIVE, STREAM_NORMAL, STREAM_BULK };
+        tx_class *c = &q->classes[order[k]];
+
+        n = snprintf(buf + len, size - len, "%-12s %6d %6d %10llu %12llu %12llu %12llu\n",
+                     tx_class_name[order[k]], c->depth, c->peak_depth, c->packets, c->bytes,
+                     c->packets ? c->wait_total / c->packets : 0, c->wait_max);
+        if (n >= size - len) {
+            len = -1;
+            break;
+        }
+        len += n;
+    }
+    sdb_mutex_unlock(&transport_tx_lock);
+    return len;
+}
+
+int transport_tx_stats(atransport *t, char *buf, int size)
+{
+    int len = 0, n;
+
+    if (t != NULL)
+        return t->tx ? tx_stats(t->tx, buf, size) : -1;
+
+    sdb_mutex_lock(&transport_lock);
+    for (t = transport_list.next; t != &transport_list; t = t->next) {
+        if (t->tx == NULL)
+            continue;
+        n = snprintf(buf + len, size - len, "%s%s transport %s:\n", len ? "\n" : "",
+                     t->type == kTransportUsb ? "usb" : "local", t->serial ? t->serial : "");
+        if (n >= size - len) {
+            len = -1;
+            break;
+        }
+        len += n;
+        n = tx_stats(t->tx, buf + len, size - len);
+        if (n < 0) {
+            len = -1;
+            break;
+        }
+        len += n;
+    }
+    sdb_mutex_unlock(&transport_lock);
+    return len;
+}
+
 void send_packet(apacket *p, atransport *t)
 {
     unsigned char *x;
@@ -208,7 +518,12 @@ void send_packet(apacket *p, atransport *t)
         D("Transport is null \n");
     }
 
-    if(write_packet(t->transport_socket, &p)){
+    sdb_mutex_lock(&transport_tx_lock);
+    tx_enqueue(t->tx, p);
+    sdb_mutex_unlock(&transport_tx_lock);
+
+        /* p may be sent and gone already */
+    if(writex(t->transport_socket, "", 1)){
         fatal_errno("cannot enqueue packet on transport socket");
     }
 }
@@ -292,11 +607,18 @@ static void *input_thread(void *_t)
        t, t->fd);
 
     for(;;){
-        if(read_packet(t->fd, &p)) {
+        char token;
+
+        if(readx(t->fd, &token, 1)) {
             D("to_remote: failed to read apacket from transport %p on fd %d\n", 
                t, t->fd );
             break;
         }
+        sdb_mutex_lock(&transport_tx_lock);
+        p = tx_dequeue(t->tx);
+        sdb_mutex_unlock(&transport_tx_lock);
+        if(p == NULL)
+            continue;
         if(p->msg.command == A_SYNC){
             if(p->msg.arg0 == 0) {
                 D("to_remote: transport %p SYNC offline\n", t);
@@ -340,17 +662,6 @@ static fdevent transport_registration_fde;
 
 
 #if SDB_HOST
-static int list_transports_msg(char*  buffer, size_t  bufferlen)
-{
-    char  head[5];
-    int   len;
-
-    len = list_transports(buffer+4, bufferlen-4);
-    snprintf(head, sizeof(head), "%04x", len);
-    memcpy(buffer, head, 4);
-    len += 4;
-    return len;
-}
 
 /* this adds support required by the 'track-devices' service.
  * this is used to send the content of "list_transport" to any
@@ -367,6 +678,10 @@ struct device_tracker {
 /* linked list of all device trackers */
 static device_tracker*   device_tracker_list;
 
+/* the list they last got, see tracker_update_func() */
+static char*             tracker_last;
+static int               tracker_last_len;
+
 static void
 device_tracker_remove( device_tracker*  tracker )
 {
@@ -414,12 +729,21 @@ device_tracker_send( device_tracker*  tracker,
                      const char*      buffer,
                      int              len )
 {
-    apacket*  p = get_apacket();
     asocket*  peer = tracker->socket.peer;
 
-    memcpy(p->data, buffer, len);
-    p->len = len;
-    return peer->enqueue( peer, p );
+        /* with many devices, the list takes more than one packet */
+    while (len > 0) {
+        apacket*  p = get_apacket();
+        int       n = (len < MAX_PAYLOAD) ? len : MAX_PAYLOAD;
+
+        memcpy(p->data, buffer, n);
+        p->len = n;
+        buffer += n;
+        len    -= n;
+        if (peer->enqueue( peer, p ) < 0)
+            return -1;
+    }
+    return 0;
 }
 
 
@@ -431,13 +755,16 @@ device_tracker_ready( asocket*  socket )
     /* we want to send the device list when the tracker connects
     * for the first time, even if no update occured */
     if (tracker->update_needed > 0) {
-        char  buffer[1024];
-        int   len;
+        char*  msg;
+        int    len;
 
         tracker->update_needed = 0;
 
-        len = list_transports_msg(buffer, sizeof(buffer));
-        device_tracker_send(tracker, buffer, len);
+        msg = list_transports_msg("", &len);
+        if (msg) {
+            device_tracker_send(tracker, msg, len);
+            free(msg);
+        }
     }
 }
 
@@ -459,51 +786,334 @@ create_device_tracker(void)
     tracker->next       = device_tracker_list;
     device_tracker_list = tracker;
 
+        /* it gets the list as it is now; make sure the next update,
+         * whatever it says, reaches it too */
+    free(tracker_last);
+    tracker_last = NULL;
+
     return &tracker->socket;
 }
 
-void save_devicename(void)
+/* this adds support for the 'wait-for-*' services: a state waiter
+ * answers as soon as a transport reaches the state it waits for,
+ * which update_transports() tells it, or when its timeout runs out.
+ * like the trackers, waiters are only touched from the fdevent thread.
+ */
+static atransport *find_one_transport(int state, transport_type ttype, const char* serial,
+                                      char** error_out, int *ambiguous);
+
+typedef struct state_waiter  state_waiter;
+struct state_waiter {
+    asocket          socket;
+    int              state;
+    transport_type   ttype;
+    char*            serial;
+    fdevent          timer;
+    state_waiter*    next;
+};
+
+static state_waiter*     state_waiter_list;
+
+static void
+state_waiter_close( asocket*  socket )
 {
-    int fd;
-    char buffer[MAX_PAYLOAD];
-    atransport *t;
+    state_waiter*   waiter = (state_waiter*) socket;
+    state_waiter**  pnode  = &state_waiter_list;
+    asocket*        peer   = socket->peer;
 
-    sdb_mutex_lock(&transport_lock);
-    if (access(DEVICEMAP_FILENAME, F_OK) == 0) // if exist
-        sdb_unlink(DEVICEMAP_FILENAME);
-    fd = unix_open(DEVICEMAP_FILENAME, O_WRONLY | O_CREAT, 0640);
+    D( "state waiter %p removed\n", waiter);
+    if (peer) {
+        peer->peer = NULL;
+        peer->close(peer);
+    }
+    while (*pnode) {
+        if (*pnode == waiter) {
+            *pnode = waiter->next;
+            break;
+        }
+        pnode = &(*pnode)->next;
+    }
+    fdevent_remove(&waiter->timer);
+    free(waiter->serial);
+    free(waiter);
+}
 
-    if (fd <0 ) {
-        D("failed to save devicename to %s\n",DEVICEMAP_FILENAME);
-        sdb_mutex_unlock(&transport_lock);
-        return;
+static int
+state_waiter_enqueue( asocket*  socket, apacket*  p )
+{
+    /* nothing is to be said to a waiter, close immediately */
+    put_apacket(p);
+    state_waiter_close(socket);
+    return -1;
+}
+
+/* give the answer and close; reason is NULL for OKAY */
+static void
+state_waiter_reply( state_waiter*  waiter, const char*  reason )
+{
+    asocket*  peer = waiter->socket.peer;
+    apacket*  p    = get_apacket();
+
+    if (reason == NULL) {
+        memcpy(p->data, "OKAY", 4);
+        p->len = 4;
+    } else {
+        p->len = snprintf((char*) p->data, MAX_PAYLOAD, "FAIL%04x%s",
+                          (unsigned) strlen(reason), reason);
     }
+    D( "state waiter %p: %.*s\n", waiter, (int) p->len, p->data);
+    if (peer->enqueue( peer, p ) < 0)
+        return;
+    state_waiter_close(&waiter->socket);
+}
 
-    for(t = transport_list.next; t != &transport_list; t = t->next) {
-        sprintf(buffer,"%s%s%d\n", t->device_name, DEVICEMAP_SEPARATOR, t->sdb_port);
-        sdb_write(fd, buffer, strlen(buffer));
+/* answer if the wait is over: 1 when it was and waiter is gone */
+static int
+state_waiter_check( state_waiter*  waiter )
+{
+    char*  error;
+    int    ambiguous;
+
+    if (find_one_transport(waiter->state, waiter->ttype, waiter->serial,
+                           &error, &ambiguous)) {
+        state_waiter_reply(waiter, NULL);
+        return 1;
     }
-    sdb_mutex_unlock(&transport_lock);
-    sdb_close(fd);
+        /* no amount of waiting makes it clear which one was meant */
+    if (ambiguous && waiter->serial == NULL) {
+        state_waiter_reply(waiter, error);
+        return 1;
+    }
+    return 0;
 }
 
-/* call this function each time the transport list has changed */
-void  update_transports(void)
+static void
+state_waiter_ready( asocket*  socket )
+{
+    state_waiter_check((state_waiter*) socket);
+}
+
+static void
+state_waiter_timeout( int  fd, unsigned  events, void*  arg )
+{
+    state_waiter*  waiter = arg;
+    char*          error;
+    int            ambiguous;
+    char           reason[64];
+
+    if (state_waiter_check(waiter))
+        return;
+    find_one_transport(waiter->state, waiter->ttype, waiter->serial,
+                       &error, &ambiguous);
+    snprintf(reason, sizeof reason, "timeout (%s)", error);
+    state_waiter_reply(waiter, reason);
+}
+
+asocket*
+create_state_waiter(int state, transport_type ttype, const char* serial,
+                    int timeout_ms)
+{
+    state_waiter*  waiter = calloc(1,sizeof(*waiter));
+
+    if(waiter == 0) fatal("cannot allocate state waiter");
+
+    D( "state waiter %p created\n", waiter);
+
+    waiter->socket.enqueue = state_waiter_enqueue;
+    waiter->socket.ready   = state_waiter_ready;
+    waiter->socket.close   = state_waiter_close;
+    waiter->state          = state;
+    waiter->ttype          = ttype;
+    waiter->serial         = serial ? strdup(serial) : NULL;
+
+    fdevent_install(&waiter->timer, FD_TIMER, state_waiter_timeout, waiter);
+    if (timeout_ms >= 0)
+        fdevent_set_timeout(&waiter->timer, timeout_ms);
+
+    waiter->next      = state_waiter_list;
+    state_waiter_list = waiter;
+
+    return &waiter->socket;
+}
+
+/* a burst of changes (a reconnect storm, a scan registering hundreds
+ * of emulators) is told to the trackers and saved to DEVICEMAP_FILENAME
+ * once, when it is over, and only when it changed what they have.
+ */
+#define TRACKER_UPDATE_DELAY   10   /* ms */
+#define DEVICEMAP_SAVE_DELAY   200  /* ms */
+
+static fdevent  tracker_update_fde;
+static int      tracker_update_pending;
+
+static fdevent  devicemap_save_fde;
+static int      devicemap_save_pending;
+static char*    devicemap_last;      /* what DEVICEMAP_FILENAME holds */
+static int      devicemap_last_len = -1;
+
+static void
+tracker_update_func( int  fd, unsigned  events, void*  arg )
 {
-    char             buffer[1024];
+    char*            msg;
     int              len;
     device_tracker*  tracker;
 
-    len = list_transports_msg(buffer, sizeof(buffer));
+    tracker_update_pending = 0;
+
+    msg = list_transports_msg("", &len);
+    if (msg == NULL)
+        return;
+    if (tracker_last && len == tracker_last_len && !memcmp(msg, tracker_last, len)) {
+        free(msg);
+        return;
+    }
 
     tracker = device_tracker_list;
     while (tracker != NULL) {
         device_tracker*  next = tracker->next;
         /* note: this may destroy the tracker if the connection is closed */
-        device_tracker_send(tracker, buffer, len);
+        device_tracker_send(tracker, msg, len);
         tracker = next;
     }
+    free(tracker_last);
+    tracker_last     = msg;
+    tracker_last_len = len;
+}
+
+static void
+devicemap_save_func( int  fd, unsigned  events, void*  arg )
+{
+    char*       buf;
+    int         size = 1024;
+    int         len  = 0;
+    int         n;
+    atransport* t;
+    char        tmp[sizeof(DEVICEMAP_FILENAME) + 4];
+
+    devicemap_save_pending = 0;
+
+    buf = malloc(size);
+    if (buf == NULL)
+        return;
+
+        /* only the snapshot is taken under the lock, not the file I/O */
+    sdb_mutex_lock(&transport_lock);
+    for(t = transport_list.next; t != &transport_list; t = t->next) {
+        const char* name = t->device_name ? t->device_name : DEFAULT_DEVICENAME;
+
+        while ((n = snprintf(buf + len, size - len, "%s%s%d\n", name,
+                             DEVICEMAP_SEPARATOR, t->sdb_port)) >= size - len) {
+            char*  grown = realloc(buf, size * 2);
+            if (grown == NULL) {
+                sdb_mutex_unlock(&transport_lock);
+                free(buf);
+                return;
+            }
+            buf   = grown;
+            size *= 2;
+        }
+        len += n;
+    }
+    sdb_mutex_unlock(&transport_lock);
+
+    if (len == devicemap_last_len && !memcmp(buf, devicemap_last, len)) {
+        free(buf);
+        return;
+    }
+
+        /* readers see the old map or the new one, never half of it */
+    snprintf(tmp, sizeof tmp, "%s.tmp", DEVICEMAP_FILENAME);
+    fd = unix_open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0 || writex(fd, buf, len) < 0) {
+        D("failed to save devicename to %s\n", DEVICEMAP_FILENAME);
+        if (fd >= 0) {
+            sdb_close(fd);
+            sdb_unlink(tmp);
+        }
+        free(buf);
+        return;
+    }
+    sdb_close(fd);
+#ifdef _WIN32
+    sdb_unlink(DEVICEMAP_FILENAME);
+#endif
+    if (rename(tmp, DEVICEMAP_FILENAME)) {
+        D("failed to save devicename to %s\n", DEVICEMAP_FILENAME);
+        sdb_unlink(tmp);
+        free(buf);
+        return;
+    }
+    free(devicemap_last);
+    devicemap_last     = buf;
+    devicemap_last_len = len;
+}
+
+void save_devicename(void)
+{
+    if (devicemap_save_pending)
+        return;
+    devicemap_save_pending = 1;
+    fdevent_set_timeout(&devicemap_save_fde, DEVICEMAP_SAVE_DELAY);
+}
+
+void flush_devicename(void)
+{
+    if (devicemap_save_pending) {
+        fdevent_set_timeout(&devicemap_save_fde, -1);
+        devicemap_save_func(FD_TIMER, FDE_TIMEOUT, NULL);
+    }
+}
+
+static int startup_scans = 0;
+static int startup_over = 0;
+
+void startup_scan_begin(void)
+{
+    startup_scans++;
+}
+
+/* runs on the fdevent thread, like everything that changes a transport's state */
+static void startup_check(void)
+{
+    atransport *t;
+
+    if(startup_over || startup_scans > 0)
+        return;
+
+    sdb_mutex_lock(&transport_lock);
+    for(t = transport_list.next; t != &transport_list; t = t->next) {
+        if(t->connection_state == CS_OFFLINE) {
+            sdb_mutex_unlock(&transport_lock);
+            return;
+        }
+    }
+    sdb_mutex_unlock(&transport_lock);
+
+    startup_over = 1;
+    server_ready();
+}
+
+/* call this function each time the transport list has changed */
+void  update_transports(void)
+{
+    state_waiter*    waiter;
+
+    if (!tracker_update_pending && device_tracker_list != NULL) {
+        tracker_update_pending = 1;
+        fdevent_set_timeout(&tracker_update_fde, TRACKER_UPDATE_DELAY);
+    }
+
+    waiter = state_waiter_list;
+    while (waiter != NULL) {
+        state_waiter*  next = waiter->next;
+        /* note: this destroys the waiter once it is answered */
+        if (waiter->socket.peer)
+            state_waiter_check(waiter);
+        waiter = next;
+    }
+
     save_devicename();
+    startup_check();
 }
 #else
 void  update_transports(void)
@@ -579,6 +1189,17 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
         fatal_errno("cannot read transport registration socket");
     }
 
+#if SDB_HOST
+    if(m.action == 2) {
+            /* a startup scan is over; the registrations it made came
+            ** down this pipe before this, so they are all in by now
+            */
+        startup_scans--;
+        startup_check();
+        return;
+    }
+#endif
+
     t = m.transport;
 
     if(m.action == 0){
@@ -591,8 +1212,7 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
         sdb_close(t->fd);
 
         sdb_mutex_lock(&transport_lock);
-        t->next->prev = t->prev;
-        t->prev->next = t->next;
+        transport_list_remove_locked(t);
         sdb_mutex_unlock(&transport_lock);
 
         run_transport_disconnects(t);
@@ -603,6 +1223,7 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
             free(t->serial);
         if (t->device_name)
             free(t->device_name);
+        tx_sched_free(t->tx);
         memset(t,0xee,sizeof(atransport));
         free(t);
 
@@ -621,6 +1242,11 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
 
         D("transport: %p (%d,%d) starting\n", t, s[0], s[1]);
 
+        t->tx = calloc(1, sizeof(struct tx_sched));
+        if(t->tx == NULL) {
+            fatal("cannot allocate transport queues");
+        }
+
         t->transport_socket = s[0];
         t->fd = s[1];
 
@@ -643,10 +1269,7 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
 
         /* put us on the master device list */
     sdb_mutex_lock(&transport_lock);
-    t->next = &transport_list;
-    t->prev = transport_list.prev;
-    t->next->prev = t;
-    t->prev->next = t;
+    transport_list_add_locked(t);
     sdb_mutex_unlock(&transport_lock);
 
     t->disconnects.next = t->disconnects.prev = &t->disconnects;
@@ -671,6 +1294,11 @@ void init_transport_registration(void)
                     0);
 
     fdevent_set(&transport_registration_fde, FDE_READ);
+
+#if SDB_HOST
+    fdevent_install(&tracker_update_fde, FD_TIMER, tracker_update_func, 0);
+    fdevent_install(&devicemap_save_fde, FD_TIMER, devicemap_save_func, 0);
+#endif
 }
 
 /* the fdevent select pump is single threaded */
@@ -696,28 +1324,56 @@ static void remove_transport(atransport *transport)
     }
 }
 
+#if SDB_HOST
+void startup_scan_done(void)
+{
+    tmsg m;
+    m.transport = NULL;
+    m.action = 2;
+    D("transport: startup scan done\n");
+    if(transport_write_action(transport_registration_send, &m)) {
+        fatal_errno("cannot write transport registration socket\n");
+    }
+}
+#endif
+
 
-static void transport_unref_locked(atransport *t)
+/* the last reference is gone */
+static void transport_release_locked(atransport *t)
 {
-    t->ref_count--;
-    D("transport: %p R- (ref=%d)\n", t, t->ref_count);
-    if (t->ref_count == 0) {
-        D("transport: %p kicking and closing\n", t);
-        if (!t->kicked) {
-            t->kicked = 1;
-            t->kick(t);
-        }
-        t->close(t);
-        remove_transport(t);
+    D("transport: %p kicking and closing\n", t);
+    if (!t->kicked) {
+        t->kicked = 1;
+        t->kick(t);
     }
+    t->close(t);
+    remove_transport(t);
 }
 
+#if SDB_HOST
+static void transport_unref_locked(atransport *t)
+{
+    int refs = sdb_atomic_dec(&t->ref_count);
+
+    D("transport: %p R- (ref=%d)\n", t, refs);
+    if (refs == 0)
+        transport_release_locked(t);
+}
+#endif
+
+/* only the one dropping the last reference needs transport_lock */
 static void transport_unref(atransport *t)
 {
+    int refs;
+
     if (t) {
-        sdb_mutex_lock(&transport_lock);
-        transport_unref_locked(t);
-        sdb_mutex_unlock(&transport_lock);
+        refs = sdb_atomic_dec(&t->ref_count);
+        D("transport: %p R- (ref=%d)\n", t, refs);
+        if (refs == 0) {
+            sdb_mutex_lock(&transport_lock);
+            transport_release_locked(t);
+            sdb_mutex_unlock(&transport_lock);
+        }
     }
 }
 
@@ -739,36 +1395,40 @@ void remove_transport_disconnect(atransport*  t, adisconnect*  dis)
 }
 
 
-atransport *acquire_one_transport(int state, transport_type ttype, const char* serial, char** error_out)
+/* as acquire_one_transport(); *ambiguous is set when more than one
+** transport would do and no serial says which
+*/
+static atransport *find_one_transport(int state, transport_type ttype, const char* serial,
+                                      char** error_out, int *ambiguous)
 {
     atransport *t;
     atransport *result = NULL;
-    int ambiguous = 0;
 
-retry:
+    *ambiguous = 0;
     if (error_out)
         *error_out = "device not found";
 
     sdb_mutex_lock(&transport_lock);
-    for (t = transport_list.next; t != &transport_list; t = t->next) {
-        if (t->connection_state == CS_NOPERM) {
-        if (error_out)
-            *error_out = "insufficient permissions for device";
-            continue;
+    if (serial) {
+        result = find_transport_locked(serial);
+        if (result && result->connection_state == CS_NOPERM) {
+            if (error_out)
+                *error_out = "insufficient permissions for device";
+            result = NULL;
         }
-
-        /* check for matching serial number */
-        if (serial) {
-            if (t->serial && !strcmp(serial, t->serial)) {
-                result = t;
-                break;
+    } else {
+        for (t = transport_list.next; t != &transport_list; t = t->next) {
+            if (t->connection_state == CS_NOPERM) {
+            if (error_out)
+                *error_out = "insufficient permissions for device";
+                continue;
             }
-        } else {
+
             if (ttype == kTransportUsb && t->type == kTransportUsb) {
                 if (result) {
                     if (error_out)
                         *error_out = "more than one device";
-                    ambiguous = 1;
+                    *ambiguous = 1;
                     result = NULL;
                     break;
                 }
@@ -777,7 +1437,7 @@ retry:
                 if (result) {
                     if (error_out)
                         *error_out = "more than one emulator";
-                    ambiguous = 1;
+                    *ambiguous = 1;
                     result = NULL;
                     break;
                 }
@@ -786,7 +1446,7 @@ retry:
                 if (result) {
                     if (error_out)
                         *error_out = "more than one device and emulator";
-                    ambiguous = 1;
+                    *ambiguous = 1;
                     result = NULL;
                     break;
                 }
@@ -815,14 +1475,18 @@ retry:
         /* found one that we can take */
         if (error_out)
             *error_out = NULL;
-    } else if (state != CS_ANY && (serial || !ambiguous)) {
-        sdb_sleep_ms(1000);
-        goto retry;
     }
 
     return result;
 }
 
+atransport *acquire_one_transport(int state, transport_type ttype, const char* serial, char** error_out)
+{
+    int ambiguous;
+
+    return find_one_transport(state, ttype, serial, error_out, &ambiguous);
+}
+
 #if SDB_HOST
 static const char *statename(atransport *t)
 {
@@ -837,31 +1501,49 @@ static const char *statename(atransport *t)
     }
 }
 
-int list_transports(char *buf, size_t  bufsize)
+char *list_transports_msg(const char *prefix, int *msglen)
 {
-    char*       p   = buf;
-    char*       end = buf + bufsize;
-    int         len;
+    int         head = strlen(prefix) + 4;
+    int         size = head + 1024;
+    int         len  = head;
+    int         n;
+    char*       buf;
+    char*       grown;
     atransport *t;
+    char        hex[5];
+
+    buf = malloc(size);
+    if (buf == NULL)
+        return NULL;
 
-        /* XXX OVERRUN PROBLEMS XXX */
     sdb_mutex_lock(&transport_lock);
     for(t = transport_list.next; t != &transport_list; t = t->next) {
         const char* serial = t->serial;
         const char* devicename = (t->device_name == NULL) ? DEFAULT_DEVICENAME : t->device_name; /* tizen specific */
         if (!serial || !serial[0])
             serial = "????????????";
-        len = snprintf(p, end - p, "%s\t%s\t%s\n", serial, statename(t), devicename);
 
-        if (p + len >= end) {
-            /* discard last line if buffer is too short */
-            break;
+        while ((n = snprintf(buf + len, size - len, "%s\t%s\t%s\n",
+                             serial, statename(t), devicename)) >= size - len) {
+            grown = realloc(buf, size * 2);
+            if (grown == NULL)
+                break;
+            buf = grown;
+            size *= 2;
         }
-        p += len;
+            /* the length has 4 hex digits: leave out what won't fit */
+        if (n >= size - len || len + n - head > 0xffff)
+            break;
+        len += n;
     }
-    p[0] = 0;
     sdb_mutex_unlock(&transport_lock);
-    return p - buf;
+    buf[len] = 0;
+
+    memcpy(buf, prefix, head - 4);
+    snprintf(hex, sizeof hex, "%04x", len - head);
+    memcpy(buf + head - 4, hex, 4);
+    *msglen = len;
+    return buf;
 }
 
 
@@ -919,24 +1601,16 @@ atransport *find_transport(const char *serial)
     atransport *t;
 
     sdb_mutex_lock(&transport_lock);
-    for(t = transport_list.next; t != &transport_list; t = t->next) {
-        if (t->serial && !strcmp(serial, t->serial)) {
-            break;
-        }
-     }
+    t = find_transport_locked(serial);
     sdb_mutex_unlock(&transport_lock);
 
-    if (t != &transport_list)
-        return t;
-    else
-        return 0;
+    return t;
 }
 
 void unregister_transport(atransport *t)
 {
     sdb_mutex_lock(&transport_lock);
-    t->next->prev = t->prev;
-    t->prev->next = t->next;
+    transport_list_remove_locked(t);
     sdb_mutex_unlock(&transport_lock);
 
     kick_transport(t);
@@ -951,8 +1625,7 @@ void unregister_all_tcp_transports()
     for (t = transport_list.next; t != &transport_list; t = next) {
         next = t->next;
         if (t->type == kTransportLocal && t->sdb_port == 0) {
-            t->next->prev = t->prev;
-            t->prev->next = next;
+            transport_list_remove_locked(t);
             // we cannot call kick_transport when holding transport_lock
             if (!t->kicked)
             {
@@ -1005,8 +1678,7 @@ void unregister_usb_transport(usb_handle *usb)
     sdb_mutex_lock(&transport_lock);
     for(t = transport_list.next; t != &transport_list; t = t->next) {
         if (t->usb == usb && t->connection_state == CS_NOPERM) {
-            t->next->prev = t->prev;
-            t->prev->next = t->next;
+            transport_list_remove_locked(t);
             break;
         }
      }
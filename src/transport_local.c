@@ -26,6 +26,10 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <netinet/in.h>
 #endif
 
 #define  TRACE_TAG  TRACE_TRANSPORT
@@ -50,12 +54,22 @@ static inline void fix_endians(apacket *p)
 /* we keep a list of opened transports. The atransport struct knows to which
  * local transport it is connected. The list is used to detect when we're
  * trying to connect twice to a given local transport.
+ * it is hashed by sdb port, chained through port_next, so that a host can
+ * run as many emulators as it likes.
  */
-#define  SDB_LOCAL_TRANSPORT_MAX  16
+#define  LOCAL_TRANSPORT_HASH_SIZE  256
 
 SDB_MUTEX_DEFINE( local_transports_lock );
 
-static atransport*  local_transports[ SDB_LOCAL_TRANSPORT_MAX ];
+static atransport*  local_transports[ LOCAL_TRANSPORT_HASH_SIZE ];
+
+/* the emulators looked for at startup, unless SDB_EMULATOR_PORTS says
+** otherwise: this many, sdb ports 10 apart from the default one
+*/
+#define  SDB_LOCAL_TRANSPORT_SCAN  16
+
+/* how long the startup scan waits for emulators to accept, in ms */
+#define  EMULATOR_SCAN_TIMEOUT     500
 #endif /* SDB_HOST */
 
 static int remote_read(apacket *p, atransport *t)
@@ -112,9 +126,19 @@ int local_connect(int port, const char *device_name) {
     return local_connect_arbitrary_ports(port-1, port, device_name);
 }
 
-int local_connect_arbitrary_ports(int console_port, int sdb_port, const char *device_name)
+static void register_emulator(int fd, int console_port, int sdb_port, const char *device_name)
 {
     char buf[64];
+
+    D("client: connected on remote on fd %d\n", fd);
+    close_on_exec(fd);
+    disable_tcp_nagle(fd);
+    snprintf(buf, sizeof buf, "%s%d", LOCAL_CLIENT_PREFIX, console_port);
+    register_socket_transport(fd, buf, sdb_port, 1, device_name);
+}
+
+int local_connect_arbitrary_ports(int console_port, int sdb_port, const char *device_name)
+{
     int  fd = -1;
 
 #if SDB_HOST
@@ -128,50 +152,13 @@ int local_connect_arbitrary_ports(int console_port, int sdb_port, const char *de
     }
 
     if (fd >= 0) {
-        D("client: connected on remote on fd %d\n", fd);
-        close_on_exec(fd);
-        disable_tcp_nagle(fd);
-        snprintf(buf, sizeof buf, "%s%d", LOCAL_CLIENT_PREFIX, console_port);
-        register_socket_transport(fd, buf, sdb_port, 1, device_name);
+        register_emulator(fd, console_port, sdb_port, device_name);
         return 0;
     }
     return -1;
 }
 
 #if SDB_HOST /* tizen specific */
-int get_devicename(int port, char *device_name)
-{
-    int fd;
-    char buffer[MAX_PAYLOAD];
-    char *tok = NULL;
-    int found = 0;
-
-    fd = unix_open(DEVICEMAP_FILENAME, O_RDONLY);
-    if (fd > 0) {
-        for(;;) {
-            if(read_line(fd, buffer, MAX_PAYLOAD) < 0)
-                break;
-            tok = strtok(buffer, DEVICEMAP_SEPARATOR);
-            if (tok != NULL) {
-                strncpy(device_name, tok, DEVICENAME_MAX);
-                tok = strtok(NULL, DEVICEMAP_SEPARATOR);
-                if (tok != NULL) {
-                    if (port == atoi(tok)) {
-                        found = 1;
-                        break;
-                    }
-                }
-            }
-        }
-        sdb_close(fd);
-    }
-    if (found != 1)
-        strncpy(device_name, DEFAULT_DEVICENAME, DEVICENAME_MAX);
-    D("init device name %s on port %d\n", device_name, port);
-
-    return found;
-}
-
 int get_devicename_from_shdmem(int port, char *device_name)
 {
     char *vms = NULL;
@@ -196,10 +183,12 @@ int get_devicename_from_shdmem(int port, char *device_name)
         strncpy(device_name, vms+strlen(VMS_PATH), DEVICENAME_MAX);
     else
         strncpy(device_name, DEFAULT_DEVICENAME, DEVICENAME_MAX);
+    device_name[DEVICENAME_MAX - 1] = 0;
+    shmdt(shared_memory);
 
 #else /* _WIN32*/
     HANDLE hMapFile;
-    char s_port[5];
+    char s_port[8];
     char* pBuf;
 
     sprintf(s_port, "%d", port-1);
@@ -225,6 +214,8 @@ int get_devicename_from_shdmem(int port, char *device_name)
         strncpy(device_name, vms+strlen(VMS_PATH), DEVICENAME_MAX);
     else
         strncpy(device_name, DEFAULT_DEVICENAME, DEVICENAME_MAX);
+    device_name[DEVICENAME_MAX - 1] = 0;
+    UnmapViewOfFile(pBuf);
     CloseHandle(hMapFile);
 #endif
     D("init device name %s on port %d\n", device_name, port);
@@ -232,44 +223,182 @@ int get_devicename_from_shdmem(int port, char *device_name)
     return 0;
 }
 
-int read_line(const int fd, char* ptr, size_t maxlen)
+#endif
+
+#if SDB_HOST
+/* the sdb ports to look for emulators on at startup, from
+** SDB_EMULATOR_PORTS: a comma-separated list of ports and lo-hi ranges,
+** a range taking every 10th port from lo ("26101-26731" is 64
+** emulators in the usual layout) unless it says otherwise with
+** lo-hi/step.  returns how many it put in the malloc'd *ports.
+*/
+static int emulator_scan_ports(int **ports)
+{
+    const char *spec = getenv("SDB_EMULATOR_PORTS");
+    const char *p;
+    int *list = NULL;
+    int count = 0, size = 0;
+    int lo, hi, step, port;
+    char *end;
+
+    if (spec == NULL || *spec == 0) {
+        list = malloc(SDB_LOCAL_TRANSPORT_SCAN * sizeof(int));
+        if (list == NULL)
+            return 0;
+        for (; count < SDB_LOCAL_TRANSPORT_SCAN; count++)
+            list[count] = DEFAULT_SDB_LOCAL_TRANSPORT_PORT + 10 * count;
+        *ports = list;
+        return count;
+    }
+
+    for (p = spec; *p; p = (*end == ',') ? end + 1 : end) {
+        lo = hi = strtol(p, &end, 10);
+        step = 10;
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        if (*end == '/')
+            step = strtol(end + 1, &end, 10);
+        if ((*end != ',' && *end != 0) || end == p || lo <= 0 || hi > 65535 || step <= 0) {
+            D("ignoring bad SDB_EMULATOR_PORTS '%s'\n", spec);
+            break;
+        }
+        for (port = lo; port <= hi; port += step) {
+            if (count == size) {
+                int *n = realloc(list, (size ? size * 2 : 64) * sizeof(int));
+                if (n == NULL)
+                    goto done;
+                list = n;
+                size = size ? size * 2 : 64;
+            }
+            list[count++] = port;
+        }
+    }
+done:
+    *ports = list;
+    return count;
+}
+
+#ifndef HAVE_WIN32_IPC
+static long long scan_now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return ((long long) tv.tv_usec) / 1000 + 1000LL * ((long long) tv.tv_sec);
+}
+
+/* connect to all the ports at once and take whatever answers within
+** EMULATOR_SCAN_TIMEOUT: on loopback a missing emulator refuses at once,
+** but one behind SDBHOST may not answer at all, and one by one that
+** adds up.  what answered is registered afterwards, so that the time
+** that takes isn't held against the ones still connecting.
+*/
+static void scan_emulators(const int *ports, int count)
 {
-    unsigned int n = 0;
-    char c[2];
-    int rc;
+    struct pollfd *pfd;
+    int *found;
+    struct sockaddr_in addr;
+    const char *host = getenv("SDBHOST");
+    int pending = 0, i, fd, err;
+    socklen_t len;
+    long long deadline;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (host) {
+        struct hostent *hp = gethostbyname(host);
+        if (hp && hp->h_addrtype == AF_INET)
+            memcpy(&addr.sin_addr, hp->h_addr, hp->h_length);
+    }
 
-    while(n != maxlen) {
-        if((rc = sdb_read(fd, c, 1)) != 1)
-            return -1; // eof or read err
+    pfd = calloc(count, sizeof(*pfd));
+    found = calloc(count, sizeof(*found));
+    if (pfd == NULL || found == NULL) {
+        free(pfd);
+        free(found);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        pfd[i].fd = -1;
+        found[i] = -1;
+        if (find_emulator_transport_by_sdb_port(ports[i]))
+            continue;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            continue;
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        addr.sin_port = htons(ports[i]);
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 &&
+            errno != EINPROGRESS) {
+            sdb_close(fd);
+            continue;
+        }
+        pfd[i].fd = fd;
+        pfd[i].events = POLLOUT;
+        pending++;
+    }
+
+    deadline = scan_now_ms() + EMULATOR_SCAN_TIMEOUT;
+    while (pending > 0) {
+        long long wait = deadline - scan_now_ms();
+        if (wait <= 0 || poll(pfd, count, wait) < 0) {
+            if (wait > 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            if (pfd[i].fd < 0 || !pfd[i].revents)
+                continue;
+            fd = pfd[i].fd;
+            pfd[i].fd = -1;
+            pending--;
 
-        if(*c == '\n') {
-            ptr[n] = 0;
-            return n;
+            len = sizeof(err);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+                sdb_close(fd);
+                continue;
+            }
+            fcntl(fd, F_SETFL, 0);
+            found[i] = fd;
         }
-        ptr[n++] = *c;
     }
-    return -1; // no space
+
+    for (i = 0; i < count; i++) {
+        if (pfd[i].fd >= 0)
+            sdb_close(pfd[i].fd);
+        if (found[i] >= 0)
+            register_emulator(found[i], ports[i] - 1, ports[i], NULL);
+    }
+    free(pfd);
+    free(found);
+}
+#else
+static void scan_emulators(const int *ports, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        (void) local_connect(ports[i], NULL);
 }
 #endif
+#endif
 
 static void *client_socket_thread(void *x)
 {
 #if SDB_HOST
-//	for (;;){
-    int port = DEFAULT_SDB_LOCAL_TRANSPORT_PORT;
-    int count = SDB_LOCAL_TRANSPORT_MAX;
+    int *ports = NULL;
+    int count;
 
     D("transport: client_socket_thread() starting\n");
 
     /* try to connect to any number of running emulator instances     */
     /* this is only done when SDB starts up. later, each new emulator */
     /* will send a message to SDB to indicate that is is starting up  */
-    for (; count > 0; count--, port += 10 ) {
-        (void) local_connect(port, NULL);
-    }
-
-//		sdb_sleep_ms(1000);
-//	}
+    count = emulator_scan_ports(&ports);
+    scan_emulators(ports, count);
+    free(ports);
+    startup_scan_done();
 #endif
     return 0;
 }
@@ -315,6 +444,9 @@ void local_init(int port)
 
     if(HOST) {
         func = client_socket_thread;
+#if SDB_HOST
+        startup_scan_begin();
+#endif
     } else {
         func = server_socket_thread;
     }
@@ -336,11 +468,12 @@ static void remote_kick(atransport *t)
 
 #if SDB_HOST
     if(HOST) {
-        int  nn;
+        atransport**  pp;
         sdb_mutex_lock( &local_transports_lock );
-        for (nn = 0; nn < SDB_LOCAL_TRANSPORT_MAX; nn++) {
-            if (local_transports[nn] == t) {
-                local_transports[nn] = NULL;
+        pp = &local_transports[t->sdb_port % LOCAL_TRANSPORT_HASH_SIZE];
+        for (; *pp; pp = &(*pp)->port_next) {
+            if (*pp == t) {
+                *pp = t->port_next;
                 break;
             }
         }
@@ -359,10 +492,10 @@ static void remote_close(atransport *t)
 /* Only call this function if you already hold local_transports_lock. */
 atransport* find_emulator_transport_by_sdb_port_locked(int sdb_port)
 {
-    int i;
-    for (i = 0; i < SDB_LOCAL_TRANSPORT_MAX; i++) {
-        if (local_transports[i] && local_transports[i]->sdb_port == sdb_port) {
-            return local_transports[i];
+    atransport* t;
+    for (t = local_transports[sdb_port % LOCAL_TRANSPORT_HASH_SIZE]; t; t = t->port_next) {
+        if (t->sdb_port == sdb_port) {
+            return t;
         }
     }
     return NULL;
@@ -375,26 +508,6 @@ atransport* find_emulator_transport_by_sdb_port(int sdb_port)
     sdb_mutex_unlock( &local_transports_lock );
     return result;
 }
-
-/* Only call this function if you already hold local_transports_lock. */
-int get_available_local_transport_index_locked()
-{
-    int i;
-    for (i = 0; i < SDB_LOCAL_TRANSPORT_MAX; i++) {
-        if (local_transports[i] == NULL) {
-            return i;
-        }
-    }
-    return -1;
-}
-
-int get_available_local_transport_index()
-{
-    sdb_mutex_lock( &local_transports_lock );
-    int result = get_available_local_transport_index_locked();
-    sdb_mutex_unlock( &local_transports_lock );
-    return result;
-}
 #endif
 
 int init_socket_transport(atransport *t, int s, int sdb_port, int local)
@@ -418,18 +531,15 @@ int init_socket_transport(atransport *t, int s, int sdb_port, int local)
             t->sdb_port = sdb_port;
             atransport* existing_transport =
                     find_emulator_transport_by_sdb_port_locked(sdb_port);
-            int index = get_available_local_transport_index_locked();
             if (existing_transport != NULL) {
                 D("local transport for port %d already registered (%p)?\n",
                 sdb_port, existing_transport);
                 fail = -1;
-            } else if (index < 0) {
-                // Too many emulators.
-                D("cannot register more emulators. Maximum is %d\n",
-                        SDB_LOCAL_TRANSPORT_MAX);
-                fail = -1;
             } else {
-                local_transports[index] = t;
+                atransport** bucket =
+                        &local_transports[sdb_port % LOCAL_TRANSPORT_HASH_SIZE];
+                t->port_next = *bucket;
+                *bucket = t;
             }
        }
        sdb_mutex_unlock( &local_transports_lock );
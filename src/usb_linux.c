@@ -667,11 +667,17 @@ fail:
 
 void* device_poll_thread(void* unused)
 {
+    int first = 1;
+
     D("Created device thread\n");
     for(;;) {
             /* XXX use inotify */
         find_usb_device("/dev/bus/usb", register_device);
         kick_disconnected_devices();
+        if(first) {
+            startup_scan_done();
+            first = 0;
+        }
         sleep(1);
     }
     return NULL;
@@ -693,6 +699,7 @@ void usb_init()
     actions.sa_handler = sigalrm_handler;
     sigaction(SIGALRM,& actions, NULL);
 
+    startup_scan_begin();
     if(sdb_thread_create(&tid, device_poll_thread, NULL)){
         fatal_errno("cannot create input thread");
     }